@@ -23,9 +23,17 @@
 
 #include <sys/fsuid.h>
 #include <sys/types.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/time.h>
 #include <pthread.h>
+#include <elf.h>
 #include <limits.h>
+#include <stdint.h>
+#include <ctype.h>
 #include <string.h>
 #include <stdarg.h>
 #include <stdlib.h>
@@ -33,8 +41,10 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
-#include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <pwd.h>
+#include <netdb.h>
+#include <sqlite3.h>
 #include <tcl.h>
 
 /*
@@ -92,6 +102,12 @@ int Sha1_Init(Tcl_Interp *interp);
  */
 static pthread_key_t interpKey;
 
+/*
+ * Thread Specific Data (TSD) for SQLite3 handles used by the native path
+ * resolver for the current thread
+ */
+static pthread_key_t sqliteKey;
+
 /*
  * Global variables, needed for all threads but only initialized before any
  * FUSE threads are created
@@ -100,13 +116,61 @@ const char *appfs_cachedir;
 time_t appfs_boottime;
 int appfs_fuse_started = 0;
 int appfs_threaded_tcl;
+struct fuse_session *appfs_fuse_session = NULL;
+struct fuse_chan *appfs_fuse_chan = NULL;
+
+/*
+ * Timeouts for the kernel to cache entries and attributes we return.
+ * Packaged paths are immutable (until the site or the user's overlay
+ * changes, at which point they are explicitly invalidated) so they may be
+ * cached for much longer, but only when a single user can use the mount
+ * since the kernel shares its cache between users.  If not set, this is
+ * decided once the options have been parsed.
+ */
+double appfs_entry_timeout = 0.0;
+double appfs_attr_timeout = 0.0;
+double appfs_packaged_timeout = -1.0;
+
+/*
+ * Whether or not to let the kernel keep its page cache across opens of
+ * files from the content-addressed cache, which can never change
+ */
+int appfs_keep_cache = 1;
+
+/*
+ * Credentials of the FUSE request currently being serviced by this thread
+ */
+static __thread uid_t appfs_fuse_uid = 1;
+static __thread gid_t appfs_fuse_gid = 1;
 
 /*
  * Global variables for AppFS caching
+ *         The path info cache is split into shards (by path hash), each of
+ *         which is a hash table of entries which are also on a list ordered
+ *         by how recently they were used, with its own lock.  The least
+ *         recently used entries of a shard are evicted once the shard's
+ *         memory use exceeds its share of the budget
+ *         (appfs_path_info_cache_mem, in bytes)
+ *
+ *         Packaged paths look the same to every user who has not modified
+ *         the package they are in, so they are cached once under the uid
+ *         APPFS_PATH_INFO_CACHE_UID_SHARED along with the name of the
+ *         overlay ("package@hostname") which would override them.  Whether
+ *         or not each user has that overlay is cached per-user.
+ */
+#define APPFS_PATH_INFO_CACHE_SHARDS 64
+#define APPFS_PATH_INFO_CACHE_UID_SHARED ((uid_t) -1)
+struct appfs_path_info_cache_shard;
+struct appfs_path_info_cache_shard *appfs_path_info_cache_shards = NULL;
+size_t appfs_path_info_cache_mem = 32 * 1024 * 1024;
+
+/*
+ * Global variables for the native path resolver, which answers lookups of
+ * packaged files directly from the cache database.  This is only enabled
+ * when the Tcl configuration has not replaced any hooks which would alter
+ * the result.
  */
-pthread_mutex_t appfs_path_info_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
-int appfs_path_info_cache_size = 8209;
-struct appfs_pathinfo *appfs_path_info_cache = NULL;
+int appfs_native_resolver = 0;
 
 #if !defined(TCL_THREADS) || TCL_THREADS != 1
 /*
@@ -171,12 +235,132 @@ struct appfs_pathinfo {
 	uid_t _cache_uid;
 };
 
+/*
+ * AppFS Path Info Cache Entry:
+ *         An entry in the path info cache, on both a hash chain and the
+ *         least-recently-used list
+ */
+struct appfs_path_info_cache_entry {
+	struct appfs_pathinfo pathinfo;
+	char *overlay;
+	unsigned int hash;
+	size_t mem;
+
+	struct appfs_path_info_cache_entry *_next_in_bucket;
+	struct appfs_path_info_cache_entry *_lru_prev;
+	struct appfs_path_info_cache_entry *_lru_next;
+};
+
+/*
+ * AppFS Path Info Cache Shard:
+ *         An independently locked part of the path info cache
+ */
+struct appfs_path_info_cache_shard {
+	pthread_mutex_t mutex;
+
+	unsigned int buckets_count;
+	struct appfs_path_info_cache_entry **buckets;
+	struct appfs_path_info_cache_entry *lru_head;
+	struct appfs_path_info_cache_entry *lru_tail;
+
+	size_t mem;
+	size_t mem_used;
+	unsigned long long entries;
+	unsigned long long hits;
+	unsigned long long misses;
+	unsigned long long evictions;
+};
+
+/*
+ * AppFS Package Context:
+ *         The package a path within a package was resolved to.  It is kept
+ *         with the inode of the path and shared with the inodes of every
+ *         path below it, so that their children can be looked up by name
+ *         within the package rather than resolving the whole path again.
+ */
+struct appfs_package_context {
+	char *hostname;
+	char *package;
+	char *package_sha1;
+	int refs;
+};
+
+/*
+ * The package context of a path, along with where in the path the file
+ * within the package starts (the end of the path for the package itself)
+ */
+struct appfs_path_context {
+	struct appfs_package_context *package;
+	size_t file_offset;
+};
+
+/*
+ * AppFS Inode:
+ *         Associates an inode number handed to the kernel with the path it
+ *         refers to, for as long as the kernel holds a reference to it
+ */
+struct appfs_inode {
+	fuse_ino_t ino;
+	fuse_ino_t parent;
+	char *path;
+	char *name; /* The last component of "path" */
+	struct appfs_path_context context;
+	unsigned long long nlookup;
+
+	/*
+	 * Set once a file has been opened from somewhere other than the
+	 * content-addressed cache (such as a user's home directory), in
+	 * which case the kernel's page cache for it is not trustworthy
+	 */
+	int page_cache_tainted;
+
+	/* Hash chains, by inode number and by parent inode number and name */
+	struct appfs_inode *_next_by_ino;
+	struct appfs_inode *_next_by_name;
+};
+
+/*
+ * Global variables for the AppFS inode table.  Most requests only need to
+ * find an inode, so the table is locked for reading by them and only
+ * locked for writing when inodes are added or removed.  Reference counts
+ * and page cache taints are updated atomically while it is locked for
+ * reading.
+ */
+#define APPFS_INODE_TABLE_SIZE 65521
+pthread_rwlock_t appfs_inode_table_lock = PTHREAD_RWLOCK_INITIALIZER;
+struct appfs_inode *appfs_inode_table_by_ino[APPFS_INODE_TABLE_SIZE];
+struct appfs_inode *appfs_inode_table_by_name[APPFS_INODE_TABLE_SIZE];
+
+/*
+ * AppFS Kernel Invalidation:
+ *         A request for the kernel to drop a cached entry (if "name" is
+ *         set) or the cached attributes and data of an inode
+ */
+struct appfs_kernel_inval {
+	fuse_ino_t parent;
+	fuse_ino_t ino;
+	char *name;
+
+	struct appfs_kernel_inval *_next;
+};
+
+/*
+ * Global variables for the queue of pending kernel invalidations
+ */
+pthread_mutex_t appfs_kernel_inval_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t appfs_kernel_inval_cond = PTHREAD_COND_INITIALIZER;
+struct appfs_kernel_inval *appfs_kernel_inval_head = NULL;
+struct appfs_kernel_inval *appfs_kernel_inval_tail = NULL;
+int appfs_kernel_inval_started = 0;
+
 /*
  * Create a new Tcl interpreter and completely initialize it
  */
 static Tcl_Interp *appfs_create_TclInterp(char **error_string) {
 	Tcl_Interp *interp;
+	Tcl_Obj *tcl_getvar_ret;
 	int tcl_ret;
+	int native_resolver;
 	const char *tcl_setvar_ret;
 
 	APPFS_DEBUG("Creating new Tcl interpreter for TID = 0x%llx", (unsigned long long) pthread_self());
@@ -268,35 +452,6 @@ static Tcl_Interp *appfs_create_TclInterp(char **error_string) {
 		return(NULL);
 	}
 
-	/*
-	 * Load "pki.tcl" in the same way as appfsd.tcl (see below)
-	 */
-	appfs_call_libtcl_enter
-		tcl_ret = Tcl_Eval(interp, ""
-#include "pki.tcl.h"
-		"");
-	appfs_call_libtcl_exit
-	if (tcl_ret != TCL_OK) {
-		APPFS_ERROR("Unable to initialize Tcl PKI.  Aborting.");
-		appfs_call_libtcl(
-			APPFS_ERROR("Tcl Error is: %s", Tcl_GetStringResult(interp));
-		)
-
-		if (error_string) {
-			appfs_call_libtcl(
-				*error_string = strdup(Tcl_GetStringResult(interp));
-			)
-		}
-
-		appfs_call_libtcl(Tcl_Release(interp);)
-
-		APPFS_DEBUG("Terminating Tcl interpreter.");
-
-		appfs_call_libtcl(Tcl_DeleteInterp(interp);)
-
-		return(NULL);
-	}
-
 	/*
 	 * Load the "appfsd.tcl" script, which is "compiled" into a C header
 	 * so that it does not need to exist on the filesystem and can be
@@ -380,6 +535,19 @@ static Tcl_Interp *appfs_create_TclInterp(char **error_string) {
 		return(NULL);
 	}
 
+	/*
+	 * Determine if the configuration loaded by "::appfs::init" permits
+	 * lookups to be answered without consulting Tcl
+	 */
+	appfs_call_libtcl(
+		tcl_getvar_ret = Tcl_GetVar2Ex(interp, "::appfs::native_resolver", NULL, TCL_GLOBAL_ONLY);
+		if (tcl_getvar_ret == NULL || Tcl_GetBooleanFromObj(NULL, tcl_getvar_ret, &native_resolver) != TCL_OK) {
+			native_resolver = 0;
+		}
+	)
+
+	__sync_lock_test_and_set(&appfs_native_resolver, native_resolver);
+
 	/*
 	 * Hide some Tcl commands that we do not care to use and which may
 	 * slow down run-time operations.
@@ -527,1520 +695,9164 @@ static void appfs_tcl_ResetInterps(void) {
  * locally modified files.
  */
 static uid_t appfs_get_fsuid(void) {
-	struct fuse_context *ctx;
-
 	if (!appfs_fuse_started) {
 		return(getuid());
 	}
 
-	ctx = fuse_get_context();
-	if (ctx == NULL) {
-		/* Unable to lookup user for some reason */
-		/* Return an unprivileged user ID */
-		APPFS_DEBUG("Unable to lookup user for some reason, returninng user ID of 1");
-
-		return(1);
-	}
-
-	return(ctx->uid);
+	return(appfs_fuse_uid);
 }
 
 /*
  * Determine the GID for the user making the current FUSE filesystem request.
  */
 static gid_t appfs_get_fsgid(void) {
-	struct fuse_context *ctx;
-
 	if (!appfs_fuse_started) {
 		return(getgid());
 	}
 
-	ctx = fuse_get_context();
-	if (ctx == NULL) {
-		/* Unable to lookup user for some reason */
-		/* Return an unprivileged user ID */
-		APPFS_DEBUG("Unable to lookup group for some reason, returninng group ID of 1");
-
-		return(1);
-	}
-
-	return(ctx->gid);
-}
-
-static void appfs_simulate_user_fs_enter(void) {
-	setfsuid(appfs_get_fsuid());
-	setfsgid(appfs_get_fsgid());
-}
-
-static void appfs_simulate_user_fs_leave(void) {
-	setfsuid(0);
-	setfsgid(0);
+	return(appfs_fuse_gid);
 }
 
-#ifdef APPFS_NO_GETPWUID
-static char *appfs_get_homedir(uid_t fsuid) {
-	return(NULL);
-}
-#else
 /*
- * Look up the home directory for a given UID
- *        Returns a C string containing the user's home directory or NULL if
- *        the user's home directory does not exist or is not correctly
- *        configured
+ * Tcl worker pool:
+ *         Rather than every FUSE thread creating its own Tcl interpreter
+ *         (which is expensive, and libfuse may create many threads at
+ *         once), work which requires Tcl is queued for a fixed number of
+ *         worker threads, each with an interpreter created ahead of time.
+ *         The FUSE thread waits for the work to complete.
+ *
+ *         Work is a function which is called with the worker's
+ *         interpreter (which may be NULL if it could not be created) as
+ *         the user making the request.
  */
-static char *appfs_get_homedir(uid_t fsuid) {
-	struct passwd entry, *result;
-	struct stat stbuf;
-	char buf[1024], *retval;
-	int gpu_ret, stat_ret;
+typedef int (*appfs_tcl_func_t)(Tcl_Interp *interp, void *data);
 
-	gpu_ret = getpwuid_r(fsuid, &entry, buf, sizeof(buf), &result);
-	if (gpu_ret != 0) {
-		APPFS_DEBUG("getpwuid_r(%llu, ...) returned in failure", (unsigned long long) fsuid);
+struct appfs_tcl_job {
+	appfs_tcl_func_t func;
+	void *data;
+	uid_t uid;
+	gid_t gid;
+	int retval;
+	int done;
+	pthread_cond_t cond;
 
-		return(NULL);
-	}
+	struct appfs_tcl_job *_next;
+};
 
-	if (result == NULL) {
-		APPFS_DEBUG("getpwuid_r(%llu, ...) returned NULL result", (unsigned long long) fsuid);
+static int appfs_tcl_workers = 8;
+static int appfs_tcl_workers_started = 0;
+static __thread int appfs_tcl_worker_thread = 0;
+static pthread_mutex_t appfs_tcl_jobs_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t appfs_tcl_jobs_cond = PTHREAD_COND_INITIALIZER;
+static struct appfs_tcl_job *appfs_tcl_jobs_head = NULL, *appfs_tcl_jobs_tail = NULL;
 
-		return(NULL);
+static int appfs_tcl_call(appfs_tcl_func_t func, void *data) {
+	struct appfs_tcl_job job;
+
+	/*
+	 * Without a worker pool (or from within a worker), just do the work
+	 * in this thread
+	 */
+	if (appfs_tcl_worker_thread || !__sync_fetch_and_add(&appfs_tcl_workers_started, 0)) {
+		return(func(appfs_TclInterp(), data));
 	}
 
-	if (result->pw_dir == NULL) {
-		APPFS_DEBUG("getpwuid_r(%llu, ...) returned NULL home directory", (unsigned long long) fsuid);
+	job.func = func;
+	job.data = data;
+	job.uid = appfs_get_fsuid();
+	job.gid = appfs_get_fsgid();
+	job.retval = -1;
+	job.done = 0;
+	job._next = NULL;
 
-		return(NULL);
-	}
+	pthread_cond_init(&job.cond, NULL);
 
-	stat_ret = stat(result->pw_dir, &stbuf);
-	if (stat_ret != 0) {
-		APPFS_DEBUG("stat(%s) returned in failure", result->pw_dir);
+	pthread_mutex_lock(&appfs_tcl_jobs_mutex);
 
-		return(NULL);
+	if (appfs_tcl_jobs_tail == NULL) {
+		appfs_tcl_jobs_head = &job;
+	} else {
+		appfs_tcl_jobs_tail->_next = &job;
 	}
+	appfs_tcl_jobs_tail = &job;
 
-	if (stbuf.st_uid != fsuid) {
-		APPFS_DEBUG("UID mis-match on user %llu's home directory (%s).  It's owned by %llu.",
-		    (unsigned long long) fsuid,
-		    result->pw_dir,
-		    (unsigned long long) stbuf.st_uid
-		);
+	pthread_cond_signal(&appfs_tcl_jobs_cond);
 
-		return(NULL);
+	while (!job.done) {
+		pthread_cond_wait(&job.cond, &appfs_tcl_jobs_mutex);
 	}
 
-	retval = strdup(result->pw_dir);
+	pthread_mutex_unlock(&appfs_tcl_jobs_mutex);
 
-	return(retval);
-}
-#endif
+	pthread_cond_destroy(&job.cond);
 
-/*
- * Generate an inode for a given path.  The inode should be computed in such
- * a way that it is unlikely to be duplicated and remains the same for a given
- * file
- *
- * Current implementation is an FNV-1a 32-bit
- */
-#if UINT_MAX < 4294967295
-#error Integer size is too small 
-#endif
-static unsigned long long appfs_get_path_inode(const char *path, int uid) {
-	unsigned int retval;
-	const unsigned char *p;
+	return(job.retval);
+}
 
-	retval = 2166136261U; /* FNV-1a 32-bit offset_basis */
+static void *appfs_tcl_worker(void *data) {
+	struct appfs_tcl_job *job;
+	Tcl_Interp *interp;
 
-	for (p = (unsigned char *) path; *p; p++) {
-		retval ^= (int) *p;
-#if 0
-		retval *= 16777619; /* FNV-1a 32-bit prime */
-#else
-		/* GCC Optimized replacement */
-		retval += (retval << 1) + (retval << 4) + (retval << 7) + (retval << 8) + (retval << 24);
-#endif
-	}
+	appfs_tcl_worker_thread = 1;
 
-	if (uid >= 0) {
-		retval += uid;
-		retval++;
+	/* Create our interpreter before there is any work for it */
+	interp = appfs_TclInterp();
+	if (interp == NULL) {
+		APPFS_DEBUG("Unable to pre-create Tcl interpreter for worker");
 	}
 
-	APPFS_DEBUG("Looked up inode number for path=%s,uid=%i: %u", path, uid, retval);
-
-	return(retval);
-}
-
-/*
- * Cache Get Path Info lookups for speed
- */
-static int appfs_get_path_info_cache_get(const char *path, uid_t uid, struct appfs_pathinfo *pathinfo) {
-	unsigned int hash_idx;
-	int pthread_ret;
-	int retval;
+	while (1) {
+		pthread_mutex_lock(&appfs_tcl_jobs_mutex);
 
-	retval = 1;
+		while (appfs_tcl_jobs_head == NULL) {
+			pthread_cond_wait(&appfs_tcl_jobs_cond, &appfs_tcl_jobs_mutex);
+		}
 
-	pthread_ret = pthread_mutex_lock(&appfs_path_info_cache_mutex);
-	if (pthread_ret != 0) {
-		APPFS_DEBUG("Unable to lock path_info cache mutex !");
+		job = appfs_tcl_jobs_head;
 
-		return(-1);
-	}
+		appfs_tcl_jobs_head = job->_next;
+		if (appfs_tcl_jobs_head == NULL) {
+			appfs_tcl_jobs_tail = NULL;
+		}
 
-	APPFS_DEBUG("Looking up cache entry for path=%s,uid=%lli...", path, (long long) uid);
+		pthread_mutex_unlock(&appfs_tcl_jobs_mutex);
 
-	if (appfs_path_info_cache != NULL) {
-		hash_idx = (appfs_get_path_inode(path, uid)) % appfs_path_info_cache_size;
+		/* Do the work as the user who made the request */
+		appfs_fuse_uid = job->uid;
+		appfs_fuse_gid = job->gid;
 
-		if (appfs_path_info_cache[hash_idx]._cache_path != NULL) {
-			if (strcmp(appfs_path_info_cache[hash_idx]._cache_path, path) == 0 && appfs_path_info_cache[hash_idx]._cache_uid == uid) {
-				retval = 0;
+		job->retval = job->func(appfs_TclInterp(), job->data);
 
-				memcpy(pathinfo, &appfs_path_info_cache[hash_idx], sizeof(*pathinfo));
-				pathinfo->_cache_path = NULL;
-			}
-		}
-	}
+		pthread_mutex_lock(&appfs_tcl_jobs_mutex);
 
-	pthread_ret = pthread_mutex_unlock(&appfs_path_info_cache_mutex);
-	if (pthread_ret != 0) {
-		APPFS_DEBUG("Unable to unlock path_info cache mutex !");
+		job->done = 1;
 
-		return(-1);
-	}
+		pthread_cond_signal(&job->cond);
 
-	if (retval == 0) {
-		APPFS_DEBUG("Cache hit on path=%s,uid=%lli", path, (long long) uid);
-	} else {
-		APPFS_DEBUG("Cache miss on path=%s,uid=%lli", path, (long long) uid);
+		pthread_mutex_unlock(&appfs_tcl_jobs_mutex);
 	}
 
-	return(retval);
+	return(NULL);
 }
 
-static void appfs_get_path_info_cache_add(const char *path, uid_t uid, struct appfs_pathinfo *pathinfo) {
-	unsigned int hash_idx;
+static void appfs_tcl_workers_start(void) {
+	pthread_t thread;
 	int pthread_ret;
+	int idx, started;
 
-	pthread_ret = pthread_mutex_lock(&appfs_path_info_cache_mutex);
-	if (pthread_ret != 0) {
-		APPFS_DEBUG("Unable to lock path_info cache mutex !");
-
+	if (!appfs_threaded_tcl) {
 		return;
 	}
 
-	if (appfs_path_info_cache == NULL) {
-		appfs_path_info_cache = calloc(appfs_path_info_cache_size, sizeof(*appfs_path_info_cache));
-	}
-
-	hash_idx = (appfs_get_path_inode(path, uid)) % appfs_path_info_cache_size;
+	started = 0;
+	for (idx = 0; idx < appfs_tcl_workers; idx++) {
+		pthread_ret = pthread_create(&thread, NULL, appfs_tcl_worker, NULL);
+		if (pthread_ret != 0) {
+			APPFS_ERROR("Unable to start Tcl worker thread");
 
-	if (appfs_path_info_cache[hash_idx]._cache_path != NULL) {
-		free(appfs_path_info_cache[hash_idx]._cache_path);
-	}
+			break;
+		}
 
-	memcpy(&appfs_path_info_cache[hash_idx], pathinfo, sizeof(*pathinfo));
+		pthread_detach(thread);
 
-	appfs_path_info_cache[hash_idx]._cache_path = strdup(path);
-	appfs_path_info_cache[hash_idx]._cache_uid  = uid;
+		started++;
+	}
 
-	pthread_ret = pthread_mutex_unlock(&appfs_path_info_cache_mutex);
-	if (pthread_ret != 0) {
-		APPFS_DEBUG("Unable to unlock path_info cache mutex !");
+	APPFS_DEBUG("Started %i Tcl worker threads", started);
 
-		return;
+	if (started > 0) {
+		__sync_lock_test_and_set(&appfs_tcl_workers_started, 1);
 	}
 
 	return;
 }
 
-static void appfs_get_path_info_cache_rm(const char *path, uid_t uid) {
-	unsigned int hash_idx;
-	int pthread_ret;
-
-	pthread_ret = pthread_mutex_lock(&appfs_path_info_cache_mutex);
-	if (pthread_ret != 0) {
-		APPFS_DEBUG("Unable to lock path_info cache mutex !");
+/*
+ * Call a Tcl procedure with one or two string arguments and return a copy
+ * of its result, or NULL if it failed
+ */
+struct appfs_tcl_call_string_data {
+	const char *proc;
+	const char *arg1;
+	const char *arg2;
+	char *result;
+};
 
-		return;
-	}
+static int appfs_tcl_call_string_func(Tcl_Interp *interp, void *_data) {
+	struct appfs_tcl_call_string_data *data;
+	const char *result;
+	int tcl_ret;
 
-	if (appfs_path_info_cache != NULL) {
-		hash_idx = (appfs_get_path_inode(path, uid)) % appfs_path_info_cache_size;
+	data = _data;
 
-		if (appfs_path_info_cache[hash_idx]._cache_path != NULL) {
-			free(appfs_path_info_cache[hash_idx]._cache_path);
+	if (interp == NULL) {
+		APPFS_DEBUG("error: Unable to get an interpreter");
 
-			appfs_path_info_cache[hash_idx]._cache_path = NULL;
-		}
+		return(-1);
 	}
 
-	pthread_ret = pthread_mutex_unlock(&appfs_path_info_cache_mutex);
-	if (pthread_ret != 0) {
-		APPFS_DEBUG("Unable to unlock path_info cache mutex !");
+	appfs_call_libtcl(Tcl_Preserve(interp);)
 
-		return;
+	if (data->arg2 == NULL) {
+		tcl_ret = appfs_Tcl_Eval(interp, 2, data->proc, data->arg1);
+	} else {
+		tcl_ret = appfs_Tcl_Eval(interp, 3, data->proc, data->arg1, data->arg2);
 	}
 
-	return;
+	if (tcl_ret != TCL_OK) {
+		APPFS_DEBUG("%s(%s, %s) failed.", data->proc, data->arg1, data->arg2 ? data->arg2 : "");
+		appfs_call_libtcl(
+			APPFS_DEBUG("Tcl Error is: %s", Tcl_GetStringResult(interp));
+		)
+
+		appfs_call_libtcl(Tcl_Release(interp);)
+
+		return(-1);
+	}
+
+	appfs_call_libtcl(
+		result = Tcl_GetStringResult(interp);
+	)
+
+	if (result != NULL) {
+		data->result = strdup(result);
+	}
+
+	appfs_call_libtcl(Tcl_Release(interp);)
+
+	if (data->result == NULL) {
+		return(-1);
+	}
+
+	return(0);
 }
 
-static void appfs_get_path_info_cache_flush(uid_t uid, int new_size) {
-	unsigned int idx;
+static char *appfs_tcl_call_string(const char *proc, const char *arg1, const char *arg2) {
+	struct appfs_tcl_call_string_data data;
+
+	data.proc = proc;
+	data.arg1 = arg1;
+	data.arg2 = arg2;
+	data.result = NULL;
+
+	appfs_tcl_call(appfs_tcl_call_string_func, &data);
+
+	return(data.result);
+}
+
+/*
+ * Download workers:
+ *         Downloads which no request waits on directly, such as those of
+ *         files being streamed and of files fetched ahead of time, are
+ *         queued for a fixed number of worker threads, each with an
+ *         interpreter created ahead of time, rather than tying up the Tcl
+ *         workers or starting a thread and interpreter for each.
+ *
+ *         Foreground work (for files which are being read) is done before
+ *         background work (files fetched ahead of time), and one worker is
+ *         always left for foreground work since background work may wait
+ *         on it.
+ */
+typedef void (*appfs_download_func_t)(Tcl_Interp *interp, void *data);
+
+struct appfs_download_job {
+	appfs_download_func_t func;
+	void *data;
+	int background;
+
+	struct appfs_download_job *_next;
+};
+
+static int appfs_download_workers = 8;
+static int appfs_download_workers_started = 0;
+static int appfs_download_background_running = 0;
+static __thread int appfs_download_worker_thread = 0;
+static pthread_mutex_t appfs_download_jobs_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t appfs_download_jobs_cond = PTHREAD_COND_INITIALIZER;
+static struct appfs_download_job *appfs_download_jobs_head[2], *appfs_download_jobs_tail[2];
+
+/*
+ * Queue work for a download worker, returning 0 if it was queued.  The
+ * work is done as the user appfsd runs as, and is passed the worker's
+ * interpreter (which may be NULL if it could not be created).
+ */
+static int appfs_download_queue(appfs_download_func_t func, void *data, int background) {
+	struct appfs_download_job *job;
+
+	if (!__sync_fetch_and_add(&appfs_download_workers_started, 0)) {
+		return(-1);
+	}
+
+	job = malloc(sizeof(*job));
+	if (job == NULL) {
+		return(-1);
+	}
+
+	background = !!background;
+
+	job->func = func;
+	job->data = data;
+	job->background = background;
+	job->_next = NULL;
+
+	pthread_mutex_lock(&appfs_download_jobs_mutex);
+
+	if (appfs_download_jobs_tail[background] == NULL) {
+		appfs_download_jobs_head[background] = job;
+	} else {
+		appfs_download_jobs_tail[background]->_next = job;
+	}
+	appfs_download_jobs_tail[background] = job;
+
+	pthread_cond_signal(&appfs_download_jobs_cond);
+
+	pthread_mutex_unlock(&appfs_download_jobs_mutex);
+
+	return(0);
+}
+
+/*
+ * Must be called with the download jobs mutex held
+ */
+static struct appfs_download_job *appfs_download_next(void) {
+	struct appfs_download_job *job;
+	int background;
+
+	if (appfs_download_jobs_head[0] != NULL) {
+		background = 0;
+	} else if (appfs_download_jobs_head[1] != NULL && appfs_download_background_running < appfs_download_workers - 1) {
+		background = 1;
+	} else {
+		return(NULL);
+	}
+
+	job = appfs_download_jobs_head[background];
+
+	appfs_download_jobs_head[background] = job->_next;
+	if (appfs_download_jobs_head[background] == NULL) {
+		appfs_download_jobs_tail[background] = NULL;
+	}
+
+	if (background) {
+		appfs_download_background_running++;
+	}
+
+	return(job);
+}
+
+static void *appfs_download_worker(void *data) {
+	struct appfs_download_job *job;
+	Tcl_Interp *interp;
+
+	/* Anything we need Tcl for is done with our own interpreter */
+	appfs_tcl_worker_thread = 1;
+	appfs_download_worker_thread = 1;
+
+	/* Create our interpreter before there is any work for it */
+	interp = appfs_TclInterp();
+	if (interp == NULL) {
+		APPFS_DEBUG("Unable to pre-create Tcl interpreter for download worker");
+	}
+
+	while (1) {
+		pthread_mutex_lock(&appfs_download_jobs_mutex);
+
+		while ((job = appfs_download_next()) == NULL) {
+			pthread_cond_wait(&appfs_download_jobs_cond, &appfs_download_jobs_mutex);
+		}
+
+		pthread_mutex_unlock(&appfs_download_jobs_mutex);
+
+		appfs_fuse_uid = getuid();
+		appfs_fuse_gid = getgid();
+
+		job->func(appfs_TclInterp(), job->data);
+
+		if (job->background) {
+			pthread_mutex_lock(&appfs_download_jobs_mutex);
+
+			appfs_download_background_running--;
+
+			pthread_cond_signal(&appfs_download_jobs_cond);
+
+			pthread_mutex_unlock(&appfs_download_jobs_mutex);
+		}
+
+		free(job);
+	}
+
+	return(NULL);
+}
+
+/*
+ * Do work which needs Tcl with a download worker, as foreground work, and
+ * wait for it.  This is for work which may take too long to tie up a Tcl
+ * worker with, such as fetching part of a file.
+ */
+struct appfs_download_call_data {
+	appfs_tcl_func_t func;
+	void *data;
+	int retval;
+	int done;
+	pthread_cond_t cond;
+};
+
+static void appfs_download_call_job(Tcl_Interp *interp, void *_data) {
+	struct appfs_download_call_data *call;
+	int retval;
+
+	call = _data;
+
+	retval = call->func(interp, call->data);
+
+	pthread_mutex_lock(&appfs_download_jobs_mutex);
+
+	call->retval = retval;
+	call->done = 1;
+
+	pthread_cond_signal(&call->cond);
+
+	pthread_mutex_unlock(&appfs_download_jobs_mutex);
+
+	return;
+}
+
+static int appfs_download_call(appfs_tcl_func_t func, void *data) {
+	struct appfs_download_call_data call;
+
+	/* From within a download worker, just do the work in this thread */
+	if (appfs_download_worker_thread) {
+		return(func(appfs_TclInterp(), data));
+	}
+
+	call.func = func;
+	call.data = data;
+	call.retval = -1;
+	call.done = 0;
+
+	pthread_cond_init(&call.cond, NULL);
+
+	if (appfs_download_queue(appfs_download_call_job, &call, 0) != 0) {
+		pthread_cond_destroy(&call.cond);
+
+		return(appfs_tcl_call(func, data));
+	}
+
+	pthread_mutex_lock(&appfs_download_jobs_mutex);
+
+	while (!call.done) {
+		pthread_cond_wait(&call.cond, &appfs_download_jobs_mutex);
+	}
+
+	pthread_mutex_unlock(&appfs_download_jobs_mutex);
+
+	pthread_cond_destroy(&call.cond);
+
+	return(call.retval);
+}
+
+static void appfs_download_workers_start(void) {
+	pthread_t thread;
 	int pthread_ret;
+	int idx, started;
+
+	if (!appfs_threaded_tcl) {
+		return;
+	}
 
-	APPFS_DEBUG("Flushing AppFS cache (uid = %lli, new_size = %i)", (long long) uid, new_size);
+	/* One for foreground work, and at least one more for background work */
+	if (appfs_download_workers < 2) {
+		appfs_download_workers = 2;
+	}
 
-	pthread_ret = pthread_mutex_lock(&appfs_path_info_cache_mutex);
-	if (pthread_ret != 0) {
-		APPFS_DEBUG("Unable to lock path_info cache mutex !");
+	started = 0;
+	for (idx = 0; idx < appfs_download_workers; idx++) {
+		pthread_ret = pthread_create(&thread, NULL, appfs_download_worker, NULL);
+		if (pthread_ret != 0) {
+			APPFS_ERROR("Unable to start download worker thread");
+
+			break;
+		}
+
+		pthread_detach(thread);
+
+		started++;
+	}
+
+	APPFS_DEBUG("Started %i download worker threads", started);
+
+	if (started < 2) {
+		APPFS_ERROR("Too few download workers started, downloads will not be done in the background");
 
 		return;
 	}
 
-	if (appfs_path_info_cache != NULL) {
-		for (idx = 0; idx < appfs_path_info_cache_size; idx++) {
-			if (appfs_path_info_cache[idx]._cache_path != NULL) {
-				if (uid != ((uid_t) -1)) {
-					if (appfs_path_info_cache[idx]._cache_uid != uid) {
-						continue;
-					}
-				}
+	pthread_mutex_lock(&appfs_download_jobs_mutex);
 
-				free(appfs_path_info_cache[idx]._cache_path);
+	appfs_download_workers = started;
 
-				appfs_path_info_cache[idx]._cache_path = NULL;
-			}
+	pthread_mutex_unlock(&appfs_download_jobs_mutex);
+
+	__sync_lock_test_and_set(&appfs_download_workers_started, 1);
+
+	return;
+}
+
+/*
+ * Background index refresher:
+ *         When a site's index has expired, the request which noticed it is
+ *         answered from the index already in the cache while this thread
+ *         fetches the new one, rather than making that request (and
+ *         everything waiting on the database behind it) wait for the
+ *         download.  Each site is only queued once, no matter how many
+ *         requests notice that it is stale.
+ */
+struct appfs_index_refresh {
+	char *hostname;
+
+	struct appfs_index_refresh *_next;
+};
+
+static int appfs_index_refresh_started = 0;
+static pthread_mutex_t appfs_index_refresh_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t appfs_index_refresh_cond = PTHREAD_COND_INITIALIZER;
+static struct appfs_index_refresh *appfs_index_refresh_queue = NULL;
+
+/*
+ * Queue a site to have its index refreshed in the background.  Returns 1 if
+ * the refresh was queued (or already was), or 0 if there is no background
+ * refresher and the caller must refresh it itself.
+ */
+static int appfs_index_refresh_schedule(const char *hostname) {
+	struct appfs_index_refresh *refresh, **refresh_p;
+
+	if (!__sync_fetch_and_add(&appfs_index_refresh_started, 0)) {
+		return(0);
+	}
+
+	pthread_mutex_lock(&appfs_index_refresh_mutex);
+
+	for (refresh_p = &appfs_index_refresh_queue; *refresh_p != NULL; refresh_p = &(*refresh_p)->_next) {
+		if (strcmp((*refresh_p)->hostname, hostname) == 0) {
+			pthread_mutex_unlock(&appfs_index_refresh_mutex);
+
+			return(1);
+		}
+	}
+
+	refresh = malloc(sizeof(*refresh));
+	if (refresh != NULL) {
+		refresh->hostname = strdup(hostname);
+		if (refresh->hostname == NULL) {
+			free(refresh);
+
+			refresh = NULL;
 		}
 	}
 
-	if (uid == ((uid_t) -1)) {
-		free(appfs_path_info_cache);
+	if (refresh == NULL) {
+		pthread_mutex_unlock(&appfs_index_refresh_mutex);
+
+		return(0);
+	}
+
+	APPFS_DEBUG("Queueing background refresh of the index for %s", hostname);
+
+	refresh->_next = NULL;
+
+	*refresh_p = refresh;
+
+	pthread_cond_signal(&appfs_index_refresh_cond);
+
+	pthread_mutex_unlock(&appfs_index_refresh_mutex);
+
+	return(1);
+}
+
+static void *appfs_index_refresh_thread(void *data) {
+	struct appfs_index_refresh *refresh, **refresh_p;
+	Tcl_Interp *interp;
+	int tcl_ret;
+
+	/* Any Tcl work done on behalf of the refresh is done here, as us */
+	appfs_tcl_worker_thread = 1;
+	appfs_fuse_uid = getuid();
+	appfs_fuse_gid = getgid();
+
+	while (1) {
+		pthread_mutex_lock(&appfs_index_refresh_mutex);
+
+		while (appfs_index_refresh_queue == NULL) {
+			pthread_cond_wait(&appfs_index_refresh_cond, &appfs_index_refresh_mutex);
+		}
+
+		/* Stays queued until it is done, so it is not queued twice */
+		refresh = appfs_index_refresh_queue;
+
+		pthread_mutex_unlock(&appfs_index_refresh_mutex);
+
+		APPFS_DEBUG("Refreshing the index for %s in the background", refresh->hostname);
+
+		interp = appfs_TclInterp();
+		if (interp == NULL) {
+			APPFS_DEBUG("error: Unable to get an interpreter");
+		} else {
+			appfs_call_libtcl(Tcl_Preserve(interp);)
+
+			tcl_ret = appfs_Tcl_Eval(interp, 3, "::appfs::getindex", refresh->hostname, "1");
+			if (tcl_ret != TCL_OK) {
+				APPFS_DEBUG("::appfs::getindex(%s, 1) failed.", refresh->hostname);
+				appfs_call_libtcl(
+					APPFS_DEBUG("Tcl Error is: %s", Tcl_GetStringResult(interp));
+				)
+			}
+
+			appfs_call_libtcl(Tcl_Release(interp);)
+		}
+
+		pthread_mutex_lock(&appfs_index_refresh_mutex);
 
-		appfs_path_info_cache = NULL;
+		for (refresh_p = &appfs_index_refresh_queue; *refresh_p != NULL; refresh_p = &(*refresh_p)->_next) {
+			if (*refresh_p == refresh) {
+				*refresh_p = refresh->_next;
 
-		if (new_size != -1) {
-			appfs_path_info_cache_size = new_size;
+				break;
+			}
 		}
+
+		pthread_mutex_unlock(&appfs_index_refresh_mutex);
+
+		free(refresh->hostname);
+		free(refresh);
+	}
+
+	return(NULL);
+}
+
+static void appfs_index_refresh_start(void) {
+	pthread_t thread;
+	int pthread_ret;
+
+	/* The refresher needs an interpreter of its own */
+	if (!appfs_threaded_tcl) {
+		return;
 	}
 
-	pthread_ret = pthread_mutex_unlock(&appfs_path_info_cache_mutex);
+	pthread_ret = pthread_create(&thread, NULL, appfs_index_refresh_thread, NULL);
 	if (pthread_ret != 0) {
-		APPFS_DEBUG("Unable to unlock path_info cache mutex !");
+		APPFS_ERROR("Unable to start background index refresh thread");
 
 		return;
 	}
 
+	pthread_detach(thread);
+
+	__sync_lock_test_and_set(&appfs_index_refresh_started, 1);
+
 	return;
 }
 
-/* Get information about a path, and optionally list children */
-static int appfs_get_path_info(const char *path, struct appfs_pathinfo *pathinfo) {
-	Tcl_Interp *interp;
-	Tcl_Obj *attrs_dict, *attr_value;
-	const char *attr_value_str, *attr_value_str_i;
-	Tcl_WideInt attr_value_wide;
-	int attr_value_int;
-	static __thread Tcl_Obj *attr_key_type = NULL, *attr_key_perms = NULL, *attr_key_size = NULL, *attr_key_time = NULL, *attr_key_source = NULL, *attr_key_childcount = NULL, *attr_key_packaged = NULL;
-	int cache_ret;
-	int tcl_ret;
-	int retval;
-	uid_t fsuid;
+/*
+ * HTTP download engine:
+ *         Files are fetched over HTTP/1.1 connections which are kept open
+ *         after each request and reused for the next request to the same
+ *         host, rather than making a new connection for every file.  No
+ *         more than a set number of requests are made to any one host at
+ *         the same time, anyone else waits for one of them to finish.  This
+ *         is shared by every thread and interpreter.  Only "http" URLs are
+ *         handled here, anything else is left to Tcl.
+ */
+#define APPFS_HTTP_BUFFER_SIZE  65536
+#define APPFS_HTTP_IDLE_TIMEOUT 30
+#define APPFS_HTTP_IO_TIMEOUT   60
+
+typedef int (*appfs_http_sink_t)(void *data, const char *buf, size_t len);
+
+struct appfs_http_request {
+	/* Filled in by the caller */
+	const char *url;
+	const char *headers;
+	int expect;
+	appfs_http_sink_t sink;
+	void *sink_data;
+
+	/* Filled in by appfs_http_get() */
+	int code;
+	char *response_headers;
+	size_t response_headers_len;
+	const char *error;
+};
 
-	retval = 0;
+struct appfs_http_conn {
+	int fd;
+	time_t last_used;
 
-	fsuid = appfs_get_fsuid();
+	struct appfs_http_conn *_next;
+};
 
-	cache_ret = appfs_get_path_info_cache_get(path, fsuid, pathinfo);
-	if (cache_ret == 0) {
-		if (pathinfo->type == APPFS_PATHTYPE_DOES_NOT_EXIST) {
-			APPFS_DEBUG("Returning from cache: does not exist \"%s\"", path);
+struct appfs_http_host {
+	char *host;
+	char *port;
+	int active;
+	struct appfs_http_conn *idle;
 
-			return(-ENOENT);
+	struct appfs_http_host *_next;
+};
+
+struct appfs_http_reader {
+	int fd;
+	size_t pos;
+	size_t len;
+	int got_data;
+	char buf[APPFS_HTTP_BUFFER_SIZE];
+};
+
+static int appfs_http_connections = 4;
+static pthread_mutex_t appfs_http_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t appfs_http_cond = PTHREAD_COND_INITIALIZER;
+static struct appfs_http_host *appfs_http_hosts = NULL;
+
+/*
+ * Split an "http" URL into its host, port, and path.  Returns -1 for URLs
+ * this engine cannot fetch.
+ */
+static int appfs_http_parse_url(const char *url, char *host, size_t host_size, char *port, size_t port_size, const char **path_p) {
+	const char *host_start, *host_end, *port_start, *path;
+	size_t len;
+
+	if (strncasecmp(url, "http://", 7) != 0) {
+		return(-1);
+	}
+
+	host_start = url + 7;
+
+	path = strchr(host_start, '/');
+	if (path == NULL) {
+		path = host_start + strlen(host_start);
+	}
+
+	if (*host_start == '[') {
+		host_start++;
+
+		host_end = memchr(host_start, ']', path - host_start);
+		if (host_end == NULL) {
+			return(-1);
+		}
+
+		port_start = host_end + 1;
+	} else {
+		host_end = memchr(host_start, ':', path - host_start);
+		if (host_end == NULL) {
+			host_end = path;
 		}
 
-		if (pathinfo->type == APPFS_PATHTYPE_INVALID) {
-			APPFS_DEBUG("Returning from cache: invalid object \"%s\"", path);
+		port_start = host_end;
+	}
+
+	if (memchr(host_start, '@', path - host_start) != NULL) {
+		return(-1);
+	}
+
+	len = host_end - host_start;
+	if (len == 0 || len >= host_size) {
+		return(-1);
+	}
+
+	memcpy(host, host_start, len);
+	host[len] = '\0';
+
+	if (*port_start == ':') {
+		port_start++;
+
+		len = path - port_start;
+		if (len == 0 || len >= port_size) {
+			return(-1);
+		}
+
+		memcpy(port, port_start, len);
+		port[len] = '\0';
+	} else if (port_start == path) {
+		snprintf(port, port_size, "80");
+	} else {
+		return(-1);
+	}
+
+	if (*path == '\0') {
+		path = "/";
+	}
+
+	*path_p = path;
+
+	return(0);
+}
+
+static int appfs_http_connect(const char *host, const char *port) {
+	struct addrinfo hints, *addrs, *addr;
+	struct timeval timeout;
+	int fd, one = 1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if (getaddrinfo(host, port, &hints, &addrs) != 0) {
+		return(-1);
+	}
+
+	fd = -1;
+	for (addr = addrs; addr != NULL; addr = addr->ai_next) {
+		fd = socket(addr->ai_family, addr->ai_socktype | SOCK_CLOEXEC, addr->ai_protocol);
+		if (fd < 0) {
+			continue;
+		}
+
+		timeout.tv_sec = APPFS_HTTP_IO_TIMEOUT;
+		timeout.tv_usec = 0;
+
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+		if (connect(fd, addr->ai_addr, addr->ai_addrlen) == 0) {
+			break;
+		}
+
+		close(fd);
+		fd = -1;
+	}
+
+	freeaddrinfo(addrs);
+
+	return(fd);
+}
+
+/*
+ * Wait for a turn to make a request to a host, and get an idle connection
+ * to it if there is one (or -1 if not)
+ */
+static struct appfs_http_host *appfs_http_host_acquire(const char *host, const char *port, int *fd_p) {
+	struct appfs_http_host *http_host;
+	struct appfs_http_conn *conn;
+	time_t now;
+
+	pthread_mutex_lock(&appfs_http_mutex);
+
+	for (http_host = appfs_http_hosts; http_host != NULL; http_host = http_host->_next) {
+		if (strcmp(http_host->host, host) == 0 && strcmp(http_host->port, port) == 0) {
+			break;
+		}
+	}
+
+	if (http_host == NULL) {
+		http_host = calloc(1, sizeof(*http_host));
+		if (http_host != NULL) {
+			http_host->host = strdup(host);
+			http_host->port = strdup(port);
+		}
+
+		if (http_host == NULL || http_host->host == NULL || http_host->port == NULL) {
+			if (http_host != NULL) {
+				free(http_host->host);
+				free(http_host->port);
+				free(http_host);
+			}
+
+			pthread_mutex_unlock(&appfs_http_mutex);
+
+			return(NULL);
+		}
+
+		http_host->_next = appfs_http_hosts;
+		appfs_http_hosts = http_host;
+	}
+
+	while (appfs_http_connections > 0 && http_host->active >= appfs_http_connections) {
+		pthread_cond_wait(&appfs_http_cond, &appfs_http_mutex);
+	}
+
+	http_host->active++;
+
+	/* Connections left idle for too long have probably been closed */
+	now = time(NULL);
+
+	*fd_p = -1;
+	while (http_host->idle != NULL) {
+		conn = http_host->idle;
+		http_host->idle = conn->_next;
+
+		if ((now - conn->last_used) < APPFS_HTTP_IDLE_TIMEOUT) {
+			*fd_p = conn->fd;
+
+			free(conn);
+
+			break;
+		}
+
+		close(conn->fd);
+		free(conn);
+	}
+
+	pthread_mutex_unlock(&appfs_http_mutex);
+
+	return(http_host);
+}
+
+/*
+ * Finish a request to a host, keeping its connection for the next one if
+ * it can be reused
+ */
+static void appfs_http_host_release(struct appfs_http_host *http_host, int fd, int reusable) {
+	struct appfs_http_conn *conn;
+
+	pthread_mutex_lock(&appfs_http_mutex);
+
+	http_host->active--;
+
+	conn = NULL;
+	if (fd >= 0 && reusable) {
+		conn = malloc(sizeof(*conn));
+	}
+
+	if (conn != NULL) {
+		conn->fd = fd;
+		conn->last_used = time(NULL);
+		conn->_next = http_host->idle;
+		http_host->idle = conn;
+	} else if (fd >= 0) {
+		close(fd);
+	}
+
+	pthread_cond_broadcast(&appfs_http_cond);
+
+	pthread_mutex_unlock(&appfs_http_mutex);
+
+	return;
+}
+
+static int appfs_http_write_all(int fd, const char *buf, size_t len) {
+	ssize_t write_ret;
+
+	while (len > 0) {
+		write_ret = send(fd, buf, len, MSG_NOSIGNAL);
+		if (write_ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			return(-1);
+		}
+
+		buf += write_ret;
+		len -= write_ret;
+	}
+
+	return(0);
+}
+
+static int appfs_http_fill(struct appfs_http_reader *reader) {
+	ssize_t read_ret;
+
+	if (reader->pos < reader->len) {
+		return(0);
+	}
+
+	while (1) {
+		read_ret = recv(reader->fd, reader->buf, sizeof(reader->buf), 0);
+		if (read_ret < 0 && errno == EINTR) {
+			continue;
+		}
+
+		break;
+	}
+
+	if (read_ret <= 0) {
+		return(-1);
+	}
+
+	reader->pos = 0;
+	reader->len = read_ret;
+	reader->got_data = 1;
+
+	return(0);
+}
+
+/*
+ * Read a line, without its line ending, failing if it does not fit
+ */
+static int appfs_http_read_line(struct appfs_http_reader *reader, char *line, size_t line_size) {
+	size_t line_len;
+	char ch;
+
+	line_len = 0;
+	while (1) {
+		if (appfs_http_fill(reader) != 0) {
+			return(-1);
+		}
+
+		ch = reader->buf[reader->pos++];
+		if (ch == '\n') {
+			break;
+		}
+
+		if (line_len + 1 >= line_size) {
+			return(-1);
+		}
+
+		line[line_len++] = ch;
+	}
+
+	if (line_len > 0 && line[line_len - 1] == '\r') {
+		line_len--;
+	}
+
+	line[line_len] = '\0';
+
+	return(0);
+}
+
+/*
+ * Pass "length" bytes of the body to the sink, or everything until the
+ * connection is closed if "length" is negative
+ */
+static int appfs_http_read_body(struct appfs_http_reader *reader, long long length, struct appfs_http_request *request) {
+	size_t chunk;
+
+	while (length != 0) {
+		if (appfs_http_fill(reader) != 0) {
+			if (length < 0) {
+				return(0);
+			}
+
+			request->error = "Connection closed before the whole response was received";
+
+			return(-1);
+		}
+
+		chunk = reader->len - reader->pos;
+		if (length > 0 && (long long) chunk > length) {
+			chunk = length;
+		}
+
+		if (request->sink(request->sink_data, reader->buf + reader->pos, chunk) != 0) {
+			request->error = "Unable to store the response";
+
+			return(-1);
+		}
+
+		reader->pos += chunk;
+
+		if (length > 0) {
+			length -= chunk;
+		}
+	}
+
+	return(0);
+}
+
+static int appfs_http_header_is(const char *line, const char *name, const char **value_p) {
+	size_t name_len;
+	const char *value;
+
+	name_len = strlen(name);
+
+	if (strncasecmp(line, name, name_len) != 0 || line[name_len] != ':') {
+		return(0);
+	}
+
+	for (value = line + name_len + 1; *value == ' ' || *value == '\t'; value++) {
+		/* Nothing */
+	}
+
+	*value_p = value;
+
+	return(1);
+}
+
+static int appfs_http_value_has(const char *value, const char *token) {
+	const char *end;
+	size_t token_len;
+
+	token_len = strlen(token);
+
+	while (*value != '\0') {
+		while (*value == ',' || *value == ' ' || *value == '\t') {
+			value++;
+		}
+
+		/* Each element ends at the next comma, ignoring any parameters */
+		for (end = value; *end != '\0' && *end != ',' && *end != ';' && *end != ' ' && *end != '\t'; end++) {
+			/* Nothing */
+		}
+
+		if ((size_t) (end - value) == token_len && strncasecmp(value, token, token_len) == 0) {
+			return(1);
+		}
+
+		value = strchr(end, ',');
+		if (value == NULL) {
+			break;
+		}
+	}
+
+	return(0);
+}
+
+/*
+ * Make one request over a connection.  Returns 0 on success, -1 on
+ * failure, or -2 if nothing at all was received, in which case a reused
+ * connection may just have been closed by the server and the request can
+ * be tried again.
+ */
+static int appfs_http_request_conn(int fd, const char *host, const char *port, const char *path, struct appfs_http_request *request, int *reusable_p) {
+	struct appfs_http_reader *reader;
+	char line[8192], *request_headers, *new_response_headers;
+	const char *value;
+	long long content_length, chunk_length;
+	int http_minor, keepalive, chunked, has_body;
+	int request_len;
+	size_t request_size, line_len;
+	int retval = -1;
+
+	*reusable_p = 0;
+
+	request_size = strlen(path) + strlen(host) + strlen(port) + 128;
+	if (request->headers) {
+		request_size += strlen(request->headers);
+	}
+
+	request_headers = malloc(request_size);
+	if (request_headers == NULL) {
+		request->error = "Unable to allocate memory";
+
+		return(-1);
+	}
+
+	request_len = snprintf(request_headers, request_size,
+		"GET %s HTTP/1.1\r\n"
+		"Host: %s%s%s\r\n"
+		"User-Agent: appfsd\r\n"
+		"Connection: keep-alive\r\n"
+		"%s"
+		"\r\n",
+		path, host, strcmp(port, "80") == 0 ? "" : ":", strcmp(port, "80") == 0 ? "" : port,
+		request->headers ? request->headers : ""
+	);
+	if (request_len < 0 || (size_t) request_len >= request_size) {
+		free(request_headers);
+
+		request->error = "Unable to allocate memory";
+
+		return(-1);
+	}
+
+	if (appfs_http_write_all(fd, request_headers, request_len) != 0) {
+		free(request_headers);
+
+		return(-2);
+	}
+
+	free(request_headers);
+
+	reader = malloc(sizeof(*reader));
+	if (reader == NULL) {
+		request->error = "Unable to allocate memory";
+
+		return(-1);
+	}
+
+	reader->fd = fd;
+	reader->pos = 0;
+	reader->len = 0;
+	reader->got_data = 0;
+
+	/* Informational responses are followed by the real one */
+	do {
+		if (appfs_http_read_line(reader, line, sizeof(line)) != 0) {
+			if (!reader->got_data) {
+				retval = -2;
+			}
+
+			request->error = "Unable to read response";
+
+			goto request_out;
+		}
+
+		if (sscanf(line, "HTTP/1.%d %d", &http_minor, &request->code) != 2) {
+			request->error = "Invalid response";
+
+			goto request_out;
+		}
+
+		content_length = -1;
+		chunked = 0;
+		keepalive = (http_minor >= 1);
+		request->response_headers_len = 0;
+
+		while (1) {
+			if (appfs_http_read_line(reader, line, sizeof(line)) != 0) {
+				request->error = "Unable to read response headers";
+
+				goto request_out;
+			}
+
+			if (line[0] == '\0') {
+				break;
+			}
+
+			if (appfs_http_header_is(line, "Content-Length", &value)) {
+				content_length = strtoll(value, NULL, 10);
+			} else if (appfs_http_header_is(line, "Transfer-Encoding", &value)) {
+				if (appfs_http_value_has(value, "chunked")) {
+					chunked = 1;
+				}
+			} else if (appfs_http_header_is(line, "Connection", &value)) {
+				if (appfs_http_value_has(value, "close")) {
+					keepalive = 0;
+				} else if (appfs_http_value_has(value, "keep-alive")) {
+					keepalive = 1;
+				}
+			}
+
+			line_len = strlen(line);
+
+			new_response_headers = realloc(request->response_headers, request->response_headers_len + line_len + 2);
+			if (new_response_headers == NULL) {
+				request->error = "Unable to allocate memory";
+
+				goto request_out;
+			}
+
+			request->response_headers = new_response_headers;
+
+			memcpy(request->response_headers + request->response_headers_len, line, line_len);
+			request->response_headers_len += line_len;
+			request->response_headers[request->response_headers_len++] = '\n';
+			request->response_headers[request->response_headers_len] = '\0';
+		}
+	} while (request->code >= 100 && request->code < 200);
+
+	has_body = !(request->code == 204 || request->code == 304);
+
+	/*
+	 * A response other than the one expected is not wanted, so rather
+	 * than read what may be a very large body, give up on the connection
+	 */
+	if (request->expect != 0 && request->code != request->expect) {
+		if (!has_body || content_length == 0) {
+			*reusable_p = keepalive;
+		}
+
+		retval = 0;
+
+		goto request_out;
+	}
+
+	if (!has_body) {
+		/* Nothing more to read */
+	} else if (chunked) {
+		while (1) {
+			if (appfs_http_read_line(reader, line, sizeof(line)) != 0) {
+				request->error = "Unable to read response";
+
+				goto request_out;
+			}
+
+			chunk_length = strtoll(line, NULL, 16);
+			if (chunk_length < 0) {
+				request->error = "Invalid response";
+
+				goto request_out;
+			}
+
+			if (chunk_length == 0) {
+				break;
+			}
+
+			if (appfs_http_read_body(reader, chunk_length, request) != 0) {
+				goto request_out;
+			}
+
+			if (appfs_http_read_line(reader, line, sizeof(line)) != 0) {
+				request->error = "Unable to read response";
+
+				goto request_out;
+			}
+		}
+
+		/* Trailers */
+		do {
+			if (appfs_http_read_line(reader, line, sizeof(line)) != 0) {
+				request->error = "Unable to read response";
+
+				goto request_out;
+			}
+		} while (line[0] != '\0');
+	} else if (content_length >= 0) {
+		if (appfs_http_read_body(reader, content_length, request) != 0) {
+			goto request_out;
+		}
+	} else {
+		keepalive = 0;
+
+		if (appfs_http_read_body(reader, -1, request) != 0) {
+			goto request_out;
+		}
+	}
+
+	/* Anything left over means the connection is out of step */
+	if (reader->pos != reader->len) {
+		keepalive = 0;
+	}
+
+	*reusable_p = keepalive;
+
+	retval = 0;
+
+request_out:
+	free(reader);
+
+	return(retval);
+}
+
+/*
+ * Fetch an URL, passing the body of the response to the request's sink.
+ * Returns 0 if a response was received (whatever its status), or -1 with
+ * the request's "error" set.
+ */
+static int appfs_http_get(struct appfs_http_request *request) {
+	struct appfs_http_host *http_host;
+	char host[256], port[16];
+	const char *path;
+	int fd, reused, reusable, tries;
+	int retval;
+
+	request->code = 0;
+	request->response_headers = NULL;
+	request->response_headers_len = 0;
+	request->error = NULL;
+
+	if (appfs_http_parse_url(request->url, host, sizeof(host), port, sizeof(port), &path) != 0) {
+		request->error = "Unsupported URL";
+
+		return(-1);
+	}
+
+	http_host = appfs_http_host_acquire(host, port, &fd);
+	if (http_host == NULL) {
+		request->error = "Unable to allocate memory";
+
+		return(-1);
+	}
+
+	retval = -1;
+	reusable = 0;
+	for (tries = 0; tries < 2; tries++) {
+		reused = (fd >= 0);
+		if (!reused) {
+			fd = appfs_http_connect(host, port);
+			if (fd < 0) {
+				request->error = "Unable to connect";
+
+				break;
+			}
+		}
+
+		APPFS_DEBUG("Fetching %s (%s connection %i)", request->url, reused ? "reused" : "new", fd);
+
+		retval = appfs_http_request_conn(fd, host, port, path, request, &reusable);
+		if (retval != -2 || !reused) {
+			break;
+		}
+
+		/* The server closed the idle connection, try a new one */
+		close(fd);
+		fd = -1;
+
+		request->error = NULL;
+	}
+
+	if (retval == -2) {
+		retval = -1;
+
+		if (request->error == NULL) {
+			request->error = "Unable to send request";
+		}
+	}
+
+	appfs_http_host_release(http_host, fd, reusable && retval == 0);
+
+	if (retval != 0) {
+		free(request->response_headers);
+		request->response_headers = NULL;
+	}
+
+	return(retval);
+}
+
+/*
+ * Download locks:
+ *         Only one download of a file into the cache should be happening at
+ *         a time, however many threads (or appfsd processes sharing the
+ *         cache directory) want it.  Whoever wants to download a file first
+ *         takes its lock, and once it has the lock checks again whether the
+ *         file is already in the cache, since whoever held the lock before
+ *         may have just put it there.  Within this process the locks are
+ *         kept in a list, and between processes with a lock file next to
+ *         the file being downloaded.  Locks taken within this process may
+ *         note the temporary file being downloaded into, so that others
+ *         can read it as it arrives rather than wait for it.
+ */
+struct appfs_download_lock {
+	char *path;
+	char *tmp_path;
+	int fd;
+
+	struct appfs_download_lock *_next;
+};
+
+static pthread_mutex_t appfs_download_locks_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t appfs_download_locks_cond = PTHREAD_COND_INITIALIZER;
+static struct appfs_download_lock *appfs_download_locks = NULL;
+
+/*
+ * Lock the lock file for a path against other processes, returning its
+ * file descriptor.  If the lock file could not be used at all, the lock
+ * only applies within this process.
+ */
+static int appfs_download_lock_file(const char *path, int wait) {
+	struct stat fd_stbuf, path_stbuf;
+	char lock_path[PATH_MAX];
+	int fd;
+
+	snprintf(lock_path, sizeof(lock_path), "%s.lock", path);
+
+	while (1) {
+		fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+		if (fd < 0) {
+			APPFS_DEBUG("Unable to open lock file %s, locking %s only within this process", lock_path, path);
+
+			return(-1);
+		}
+
+		if (flock(fd, wait ? LOCK_EX : (LOCK_EX | LOCK_NB)) != 0) {
+			close(fd);
+
+			if (errno == EWOULDBLOCK) {
+				return(-2);
+			}
+
+			if (errno == EINTR) {
+				continue;
+			}
+
+			return(-1);
+		}
+
+		/*
+		 * Lock files are removed when they are unlocked, so make sure
+		 * the one locked was not removed while waiting for it
+		 */
+		if (fstat(fd, &fd_stbuf) == 0 && stat(lock_path, &path_stbuf) == 0) {
+			if (fd_stbuf.st_dev == path_stbuf.st_dev && fd_stbuf.st_ino == path_stbuf.st_ino) {
+				return(fd);
+			}
+		}
+
+		close(fd);
+	}
+}
+
+static void appfs_download_unlock(const char *path) {
+	struct appfs_download_lock **lock_p, *lock;
+	char lock_path[PATH_MAX];
+
+	pthread_mutex_lock(&appfs_download_locks_mutex);
+
+	for (lock_p = &appfs_download_locks; *lock_p != NULL; lock_p = &(*lock_p)->_next) {
+		lock = *lock_p;
+
+		if (strcmp(lock->path, path) == 0) {
+			*lock_p = lock->_next;
+
+			if (lock->fd >= 0) {
+				snprintf(lock_path, sizeof(lock_path), "%s.lock", path);
+
+				unlink(lock_path);
+				close(lock->fd);
+			}
+
+			free(lock->path);
+			free(lock->tmp_path);
+			free(lock);
+
+			APPFS_DEBUG("Unlocked %s for downloading", path);
+
+			break;
+		}
+	}
+
+	pthread_cond_broadcast(&appfs_download_locks_cond);
+
+	pthread_mutex_unlock(&appfs_download_locks_mutex);
+
+	return;
+}
+
+/*
+ * Take the lock for downloading the file at a path in the cache, waiting
+ * for it if "wait" is set.  Returns 1 if the lock was taken, or 0 if it
+ * was not because it is held and "wait" is not set.
+ */
+static int appfs_download_lock(const char *path, int wait) {
+	struct appfs_download_lock *lock;
+	int fd;
+
+	pthread_mutex_lock(&appfs_download_locks_mutex);
+
+	while (1) {
+		for (lock = appfs_download_locks; lock != NULL; lock = lock->_next) {
+			if (strcmp(lock->path, path) == 0) {
+				break;
+			}
+		}
+
+		if (lock == NULL) {
+			break;
+		}
+
+		if (!wait) {
+			pthread_mutex_unlock(&appfs_download_locks_mutex);
+
+			return(0);
+		}
+
+		pthread_cond_wait(&appfs_download_locks_cond, &appfs_download_locks_mutex);
+	}
+
+	/*
+	 * Claim the path within this process before waiting for other
+	 * processes, so that only one thread waits on the lock file
+	 */
+	lock = malloc(sizeof(*lock));
+	if (lock == NULL) {
+		pthread_mutex_unlock(&appfs_download_locks_mutex);
+
+		return(1);
+	}
+
+	lock->path = strdup(path);
+	if (lock->path == NULL) {
+		free(lock);
+
+		pthread_mutex_unlock(&appfs_download_locks_mutex);
+
+		return(1);
+	}
+
+	lock->tmp_path = NULL;
+	lock->fd = -1;
+	lock->_next = appfs_download_locks;
+	appfs_download_locks = lock;
+
+	pthread_mutex_unlock(&appfs_download_locks_mutex);
+
+	fd = appfs_download_lock_file(path, wait);
+
+	pthread_mutex_lock(&appfs_download_locks_mutex);
+
+	if (fd == -2) {
+		/* Held by another process */
+		pthread_mutex_unlock(&appfs_download_locks_mutex);
+
+		appfs_download_unlock(path);
+
+		return(0);
+	}
+
+	lock->fd = fd;
+
+	pthread_mutex_unlock(&appfs_download_locks_mutex);
+
+	APPFS_DEBUG("Locked %s for downloading", path);
+
+	return(1);
+}
+
+/*
+ * Note the temporary file a locked path is being downloaded into
+ */
+static void appfs_download_lock_set_tmp_path(const char *path, const char *tmp_path) {
+	struct appfs_download_lock *lock;
+
+	pthread_mutex_lock(&appfs_download_locks_mutex);
+
+	for (lock = appfs_download_locks; lock != NULL; lock = lock->_next) {
+		if (strcmp(lock->path, path) == 0) {
+			free(lock->tmp_path);
+			lock->tmp_path = strdup(tmp_path);
+
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&appfs_download_locks_mutex);
+
+	return;
+}
+
+/*
+ * Get the temporary file a path locked within this process is being
+ * downloaded into, if known
+ *         Returns a newly allocated C string, or NULL
+ */
+static char *appfs_download_lock_get_tmp_path(const char *path) {
+	struct appfs_download_lock *lock;
+	char *retval;
+
+	retval = NULL;
+
+	pthread_mutex_lock(&appfs_download_locks_mutex);
+
+	for (lock = appfs_download_locks; lock != NULL; lock = lock->_next) {
+		if (strcmp(lock->path, path) == 0) {
+			if (lock->tmp_path != NULL) {
+				retval = strdup(lock->tmp_path);
+			}
+
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&appfs_download_locks_mutex);
+
+	return(retval);
+}
+
+/*
+ * Streaming downloads:
+ *         Rather than making open() wait for an entire file to be downloaded
+ *         into the cache, the download is started in the background and the
+ *         file it is being written to is opened.  Reads then only wait
+ *         until the range they ask for has arrived.  The file is only moved
+ *         into the cache once it has been verified, and if it fails
+ *         verification any further reads fail.  Opens of a file which is
+ *         already being downloaded share the download.
+ *
+ *         Large files whose manifest listed the hashes of their blocks are
+ *         instead downloaded sparsely: only the blocks which are read (and
+ *         a little beyond, to coalesce sequential reads into fewer
+ *         requests) are fetched, using requests for part of the file, and
+ *         the file is verified and moved into the cache once every block
+ *         has been fetched.  If part of the file cannot be fetched, the
+ *         whole file is downloaded instead.  Sparse downloads which are
+ *         not finished by the time nothing has them open are abandoned.
+ *
+ *         If the manifest listed the hashes of a file's blocks, each block
+ *         is verified before it is read, whether it was fetched sparsely
+ *         or is part of a whole file being downloaded.
+ */
+#define APPFS_STREAM_STARTING    0
+#define APPFS_STREAM_DOWNLOADING 1
+#define APPFS_STREAM_COMPLETE    2
+#define APPFS_STREAM_FAILED      3
+
+#define APPFS_STREAM_FDS_BUCKETS 64
+
+#define APPFS_SPARSE_BLOCK_MISSING  0
+#define APPFS_SPARSE_BLOCK_FETCHING 1
+#define APPFS_SPARSE_BLOCK_PRESENT  2
+
+#define APPFS_SPARSE_READAHEAD (2 * 1024 * 1024)
+
+struct appfs_stream {
+	char *hostname;
+	char *sha1;
+	char *tmp_path;
+	char *cache_path;
+	char *path;
+	char *lock_path;
+	off_t size;
+	int state;
+	int refs;
+
+	/* Only for sparse downloads, or files with hashes for each block */
+	int sparse;
+	int sparse_abandoned;
+	int blocks_hashed;
+	off_t block_size;
+	unsigned char *blocks;
+	size_t blocks_count;
+	size_t blocks_present;
+	size_t blocks_fetching;
+
+	struct appfs_stream *_next;
+};
+
+struct appfs_stream_fd {
+	int fd;
+	struct appfs_stream *stream;
+
+	struct appfs_stream_fd *_next;
+};
+
+static int appfs_streaming = 1;
+static int appfs_streaming_started = 0;
+static long long appfs_sparse_min = 64 * 1024 * 1024;
+static int appfs_stream_fds_count = 0;
+static pthread_mutex_t appfs_streams_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t appfs_streams_cond = PTHREAD_COND_INITIALIZER;
+static struct appfs_stream *appfs_streams = NULL;
+static struct appfs_stream_fd *appfs_stream_fds[APPFS_STREAM_FDS_BUCKETS];
+
+/*
+ * Must be called with the streams mutex held
+ */
+static void appfs_stream_release(struct appfs_stream *stream) {
+	stream->refs--;
+
+	if (stream->refs > 0) {
+		return;
+	}
+
+	APPFS_DEBUG("Releasing stream for %s", stream->sha1);
+
+	free(stream->hostname);
+	free(stream->sha1);
+	free(stream->tmp_path);
+	free(stream->cache_path);
+	free(stream->path);
+	free(stream->lock_path);
+	free(stream->blocks);
+	free(stream);
+
+	return;
+}
+
+/*
+ * Must be called with the streams mutex held
+ */
+static void appfs_stream_finish(struct appfs_stream *stream, int state, const char *path) {
+	struct appfs_stream **stream_p;
+
+	for (stream_p = &appfs_streams; *stream_p != NULL; stream_p = &(*stream_p)->_next) {
+		if (*stream_p == stream) {
+			*stream_p = stream->_next;
+
+			break;
+		}
+	}
+
+	if (path != NULL) {
+		stream->path = strdup(path);
+		if (stream->path == NULL) {
+			state = APPFS_STREAM_FAILED;
+		}
+	}
+
+	stream->state = state;
+
+	if (stream->lock_path != NULL) {
+		appfs_download_unlock(stream->lock_path);
+
+		free(stream->lock_path);
+		stream->lock_path = NULL;
+	}
+
+	pthread_cond_broadcast(&appfs_streams_cond);
+
+	/* The download's reference */
+	appfs_stream_release(stream);
+
+	return;
+}
+
+static void appfs_stream_download_job(Tcl_Interp *interp, void *data) {
+	struct appfs_stream *stream;
+	const char *path = NULL, *proc;
+	int tcl_ret;
+
+	stream = data;
+
+	/* Sparse downloads have already been fetched, and only need verifying */
+	if (stream->sparse) {
+		proc = "::appfs::download_verify";
+	} else {
+		proc = "::appfs::download_finish";
+	}
+
+	APPFS_DEBUG("Downloading %s to %s", stream->sha1, stream->tmp_path);
+
+	if (interp == NULL) {
+		APPFS_DEBUG("error: Unable to get an interpreter");
+
+		tcl_ret = TCL_ERROR;
+	} else {
+		appfs_call_libtcl(Tcl_Preserve(interp);)
+
+		tcl_ret = appfs_Tcl_Eval(interp, 4, proc, stream->hostname, stream->sha1, stream->tmp_path);
+		if (tcl_ret != TCL_OK) {
+			APPFS_DEBUG("%s(%s, %s, %s) failed.", proc, stream->hostname, stream->sha1, stream->tmp_path);
+			appfs_call_libtcl(
+				APPFS_DEBUG("Tcl Error is: %s", Tcl_GetStringResult(interp));
+			)
+		} else {
+			appfs_call_libtcl(
+				path = Tcl_GetStringResult(interp);
+			)
+		}
+	}
+
+	pthread_mutex_lock(&appfs_streams_mutex);
+
+	appfs_stream_finish(stream, tcl_ret == TCL_OK ? APPFS_STREAM_COMPLETE : APPFS_STREAM_FAILED, path);
+
+	pthread_mutex_unlock(&appfs_streams_mutex);
+
+	if (interp != NULL) {
+		appfs_call_libtcl(Tcl_Release(interp);)
+	}
+
+	return;
+}
+
+/*
+ * Queue the download (or, for sparse downloads, the verification) of a
+ * file for the download workers.  Must be called with the streams mutex
+ * held.
+ */
+static void appfs_stream_download_start(struct appfs_stream *stream) {
+	if (appfs_download_queue(appfs_stream_download_job, stream, 0) != 0) {
+		APPFS_DEBUG("Unable to queue download of %s", stream->sha1);
+
+		appfs_stream_finish(stream, APPFS_STREAM_FAILED, NULL);
+
+		return;
+	}
+
+	return;
+}
+
+/*
+ * Set up a stream to verify each block of its file as it is read, given
+ * the block size and number of blocks that hashes were listed for.  Must
+ * be called with the streams mutex held.
+ */
+static void appfs_stream_blocks_start(struct appfs_stream *stream, const char *blocks_desc) {
+	const char **blocks_argv;
+	Tcl_WideInt block_size, blocks_count;
+	int blocks_argc;
+
+	if (blocks_desc == NULL || blocks_desc[0] == '\0') {
+		return;
+	}
+
+	if (Tcl_SplitList(NULL, blocks_desc, &blocks_argc, &blocks_argv) != TCL_OK) {
+		return;
+	}
+
+	block_size = 0;
+	blocks_count = -1;
+	if (blocks_argc == 2) {
+		block_size = strtoll(blocks_argv[0], NULL, 10);
+		blocks_count = strtoll(blocks_argv[1], NULL, 10);
+	}
+
+	Tcl_Free((char *) blocks_argv);
+
+	if (block_size <= 0 || blocks_count != (stream->size + block_size - 1) / block_size) {
+		APPFS_DEBUG("Block hashes for %s do not cover it, ignoring them", stream->sha1);
+
+		return;
+	}
+
+	stream->blocks = calloc(blocks_count, sizeof(*stream->blocks));
+	if (stream->blocks == NULL) {
+		return;
+	}
+
+	stream->block_size = block_size;
+	stream->blocks_count = blocks_count;
+	stream->blocks_hashed = 1;
+
+	return;
+}
+
+/*
+ * Make a stream's temporary file a sparse file of its full size, to be
+ * filled in as it is read.  Only files with hashes for each block are
+ * downloaded sparsely, since otherwise nothing read could be verified
+ * until all of the file had been.  Must be called with the streams mutex
+ * held.
+ */
+static int appfs_stream_sparse_start(struct appfs_stream *stream) {
+	if (!stream->blocks_hashed) {
+		return(-1);
+	}
+
+	if (truncate(stream->tmp_path, stream->size) != 0) {
+		APPFS_DEBUG("Unable to extend %s for a sparse download, downloading all of it instead", stream->tmp_path);
+
+		return(-1);
+	}
+
+	APPFS_DEBUG("Downloading %s sparsely in %llu blocks", stream->sha1, (unsigned long long) stream->blocks_count);
+
+	stream->sparse = 1;
+
+	/*
+	 * Sparse downloads may never be finished, so do not keep anyone
+	 * else who wants the whole file waiting for one
+	 */
+	if (stream->lock_path != NULL) {
+		appfs_download_unlock(stream->lock_path);
+
+		free(stream->lock_path);
+		stream->lock_path = NULL;
+	}
+
+	return(0);
+}
+
+/*
+ * Once no blocks of a sparse download are being fetched, either verify it
+ * if they have all been fetched or fall back to downloading the whole file
+ * if fetching part of it failed.  Must be called with the streams mutex
+ * held.
+ */
+static void appfs_stream_sparse_check(struct appfs_stream *stream) {
+	if (stream->blocks_fetching != 0) {
+		return;
+	}
+
+	if (stream->sparse_abandoned) {
+		APPFS_DEBUG("Unable to fetch part of %s, downloading all of it instead", stream->sha1);
+
+		/*
+		 * Readers of the full download wait for the file to grow
+		 * to cover what they need, so it must start empty
+		 */
+		if (truncate(stream->tmp_path, 0) != 0) {
+			appfs_stream_finish(stream, APPFS_STREAM_FAILED, NULL);
+
+			return;
+		}
+
+		stream->sparse = 0;
+
+		/* Nothing fetched so far remains */
+		memset(stream->blocks, APPFS_SPARSE_BLOCK_MISSING, stream->blocks_count);
+		stream->blocks_present = 0;
+
+		appfs_stream_download_start(stream);
+
+		return;
+	}
+
+	if (stream->blocks_present == stream->blocks_count) {
+		APPFS_DEBUG("All of %s has been fetched, verifying it", stream->sha1);
+
+		appfs_stream_download_start(stream);
+	}
+
+	return;
+}
+
+/*
+ * Call a Tcl procedure which fetches or verifies part of the file being
+ * downloaded by a stream
+ */
+struct appfs_stream_range_data {
+	const char *proc;
+	struct appfs_stream *stream;
+	off_t offset;
+	off_t length;
+};
+
+static int appfs_stream_range_func(Tcl_Interp *interp, void *_data) {
+	struct appfs_stream_range_data *data;
+	char offset_str[32], length_str[32];
+	int tcl_ret;
+
+	data = _data;
+
+	if (interp == NULL) {
+		APPFS_DEBUG("error: Unable to get an interpreter");
+
+		return(-1);
+	}
+
+	snprintf(offset_str, sizeof(offset_str), "%llu", (unsigned long long) data->offset);
+	snprintf(length_str, sizeof(length_str), "%llu", (unsigned long long) data->length);
+
+	appfs_call_libtcl(Tcl_Preserve(interp);)
+
+	tcl_ret = appfs_Tcl_Eval(interp, 6, data->proc, data->stream->hostname, data->stream->sha1, data->stream->tmp_path, offset_str, length_str);
+	if (tcl_ret != TCL_OK) {
+		APPFS_DEBUG("%s(%s, %s, %s, %s, %s) failed.", data->proc, data->stream->hostname, data->stream->sha1, data->stream->tmp_path, offset_str, length_str);
+		appfs_call_libtcl(
+			APPFS_DEBUG("Tcl Error is: %s", Tcl_GetStringResult(interp));
+		)
+	}
+
+	appfs_call_libtcl(Tcl_Release(interp);)
+
+	if (tcl_ret != TCL_OK) {
+		return(-1);
+	}
+
+	return(0);
+}
+
+/*
+ * Fetch whichever blocks of a sparse download are needed for a read that
+ * are not already present.  Returns 0 once they are, or 1 if the stream is
+ * no longer being downloaded sparsely and the caller should wait for it
+ * some other way.  Must be called with the streams mutex held, which is
+ * released while fetching.
+ */
+static int appfs_stream_sparse_wait(struct appfs_stream *stream, off_t offset, size_t size) {
+	struct appfs_stream_range_data data;
+	size_t block, first_block, last_block, end_block;
+	off_t end;
+	int fetch_ret;
+
+	if (size == 0 || offset >= stream->size) {
+		return(0);
+	}
+
+	end = offset + size;
+	if (end > stream->size) {
+		end = stream->size;
+	}
+
+	first_block = offset / stream->block_size;
+	last_block = (end - 1) / stream->block_size;
+
+	while (stream->sparse && stream->state == APPFS_STREAM_DOWNLOADING) {
+		for (block = first_block; block <= last_block; block++) {
+			if (stream->blocks[block] != APPFS_SPARSE_BLOCK_PRESENT) {
+				break;
+			}
+		}
+
+		if (block > last_block) {
+			return(0);
+		}
+
+		if (stream->blocks[block] == APPFS_SPARSE_BLOCK_FETCHING || stream->sparse_abandoned) {
+			pthread_cond_wait(&appfs_streams_cond, &appfs_streams_mutex);
+
+			continue;
+		}
+
+		/*
+		 * Fetch this block along with the missing blocks which follow
+		 * it, through the end of the read and a little beyond
+		 */
+		end_block = block;
+		while (end_block + 1 < stream->blocks_count && end_block + 1 <= last_block + (APPFS_SPARSE_READAHEAD / stream->block_size)) {
+			if (stream->blocks[end_block + 1] != APPFS_SPARSE_BLOCK_MISSING) {
+				break;
+			}
+
+			end_block++;
+		}
+
+		memset(stream->blocks + block, APPFS_SPARSE_BLOCK_FETCHING, end_block - block + 1);
+		stream->blocks_fetching += end_block - block + 1;
+
+		data.proc = "::appfs::download_range";
+		data.stream = stream;
+		data.offset = (off_t) block * stream->block_size;
+		data.length = (off_t) (end_block + 1) * stream->block_size;
+		if (data.length > stream->size) {
+			data.length = stream->size;
+		}
+		data.length -= data.offset;
+
+		pthread_mutex_unlock(&appfs_streams_mutex);
+
+		APPFS_DEBUG("Fetching %llu bytes of %s at %llu", (unsigned long long) data.length, stream->sha1, (unsigned long long) data.offset);
+
+		fetch_ret = appfs_download_call(appfs_stream_range_func, &data);
+
+		pthread_mutex_lock(&appfs_streams_mutex);
+
+		stream->blocks_fetching -= end_block - block + 1;
+
+		if (fetch_ret == 0) {
+			memset(stream->blocks + block, APPFS_SPARSE_BLOCK_PRESENT, end_block - block + 1);
+			stream->blocks_present += end_block - block + 1;
+		} else {
+			memset(stream->blocks + block, APPFS_SPARSE_BLOCK_MISSING, end_block - block + 1);
+			stream->sparse_abandoned = 1;
+		}
+
+		appfs_stream_sparse_check(stream);
+
+		pthread_cond_broadcast(&appfs_streams_cond);
+	}
+
+	return(1);
+}
+
+/*
+ * Verify blocks of the file being downloaded by a stream, which have been
+ * read into memory, against their hashes
+ */
+struct appfs_stream_verify_data {
+	struct appfs_stream *stream;
+	size_t block;
+	unsigned char *buf;
+	size_t length;
+};
+
+static int appfs_stream_verify_func(Tcl_Interp *interp, void *_data) {
+	struct appfs_stream_verify_data *data;
+	Tcl_Obj *objv[5];
+	char block_str[32];
+	int tcl_ret, idx;
+
+	data = _data;
+
+	if (interp == NULL) {
+		APPFS_DEBUG("error: Unable to get an interpreter");
+
+		return(-1);
+	}
+
+	snprintf(block_str, sizeof(block_str), "%llu", (unsigned long long) data->block);
+
+	appfs_call_libtcl(Tcl_Preserve(interp);)
+
+	appfs_call_libtcl(
+		objv[0] = Tcl_NewStringObj("::appfs::download_verify_blocks", -1);
+		objv[1] = Tcl_NewStringObj(data->stream->hostname, -1);
+		objv[2] = Tcl_NewStringObj(data->stream->sha1, -1);
+		objv[3] = Tcl_NewStringObj(block_str, -1);
+		objv[4] = Tcl_NewByteArrayObj(data->buf, data->length);
+
+		for (idx = 0; idx < 5; idx++) {
+			Tcl_IncrRefCount(objv[idx]);
+		}
+
+		tcl_ret = Tcl_EvalObjv(interp, 5, objv, 0);
+
+		for (idx = 0; idx < 5; idx++) {
+			Tcl_DecrRefCount(objv[idx]);
+		}
+	)
+
+	if (tcl_ret != TCL_OK) {
+		APPFS_DEBUG("::appfs::download_verify_blocks(%s, %s, %s, ...) failed.", data->stream->hostname, data->stream->sha1, block_str);
+		appfs_call_libtcl(
+			APPFS_DEBUG("Tcl Error is: %s", Tcl_GetStringResult(interp));
+		)
+	}
+
+	appfs_call_libtcl(Tcl_Release(interp);)
+
+	if (tcl_ret != TCL_OK) {
+		return(-1);
+	}
+
+	return(0);
+}
+
+/*
+ * Verify the blocks needed for a read from a file being downloaded in its
+ * entirety, which have all arrived, against their hashes.  They are read
+ * through the reader's own file descriptor, which remains valid even once
+ * the download finishes and the file is moved into the cache.  Must be
+ * called with the streams mutex held, which is released while verifying.
+ */
+static int appfs_stream_blocks_verify(struct appfs_stream *stream, int fd, off_t offset, size_t size) {
+	struct appfs_stream_verify_data data;
+	size_t block, first_block, last_block;
+	off_t block_offset;
+	ssize_t read_ret;
+	size_t read_len;
+	int verify_ret;
+
+	first_block = offset / stream->block_size;
+	last_block = (offset + size - 1) / stream->block_size;
+	if (last_block >= stream->blocks_count) {
+		last_block = stream->blocks_count - 1;
+	}
+
+	for (block = first_block; block <= last_block; block++) {
+		if (stream->blocks[block] != APPFS_SPARSE_BLOCK_PRESENT) {
+			break;
+		}
+	}
+
+	if (block > last_block) {
+		return(0);
+	}
+
+	block_offset = (off_t) block * stream->block_size;
+
+	data.stream = stream;
+	data.block = block;
+	data.length = ((off_t) (last_block + 1) * stream->block_size) - block_offset;
+	if (block_offset + (off_t) data.length > stream->size) {
+		data.length = stream->size - block_offset;
+	}
+
+	data.buf = malloc(data.length);
+	if (data.buf == NULL) {
+		return(-ENOMEM);
+	}
+
+	pthread_mutex_unlock(&appfs_streams_mutex);
+
+	verify_ret = 0;
+
+	for (read_len = 0; read_len < data.length; read_len += read_ret) {
+#ifdef APPFS_NO_PREAD
+		read_ret = -1;
+		if (lseek(fd, block_offset + read_len, SEEK_SET) == block_offset + (off_t) read_len) {
+			read_ret = read(fd, data.buf + read_len, data.length - read_len);
+		}
+#else
+		read_ret = pread(fd, data.buf + read_len, data.length - read_len, block_offset + read_len);
+#endif
+		if (read_ret <= 0) {
+			APPFS_DEBUG("error: Unable to read back part of %s to verify it", stream->sha1);
+
+			verify_ret = -1;
+
+			break;
+		}
+	}
+
+	if (verify_ret == 0) {
+		verify_ret = appfs_tcl_call(appfs_stream_verify_func, &data);
+	}
+
+	free(data.buf);
+
+	pthread_mutex_lock(&appfs_streams_mutex);
+
+	if (verify_ret != 0) {
+		APPFS_DEBUG("Part of %s failed verification", stream->sha1);
+
+		return(-EIO);
+	}
+
+	memset(stream->blocks + block, APPFS_SPARSE_BLOCK_PRESENT, last_block - block + 1);
+
+	return(0);
+}
+
+/*
+ * Start the download of the file of a new stream, or if someone else is
+ * already downloading it, wait for them to finish in the background.  Must
+ * be called without the streams mutex held.
+ */
+static void appfs_stream_join_job(Tcl_Interp *interp, void *data);
+
+static void appfs_stream_start(struct appfs_stream *stream) {
+	char *start_result, **start_argv, *blocks_result, *holder_tmp_path;
+	int start_argc;
+
+	start_result = appfs_tcl_call_string("::appfs::download_start", stream->hostname, stream->sha1);
+
+	start_argv = NULL;
+	if (start_result != NULL) {
+		if (Tcl_SplitList(NULL, start_result, &start_argc, (const char ***) &start_argv) != TCL_OK || start_argc != 2) {
+			if (start_argv != NULL) {
+				Tcl_Free((char *) start_argv);
+			}
+
+			start_argv = NULL;
+		}
+
+		free(start_result);
+	}
+
+	blocks_result = NULL;
+	holder_tmp_path = NULL;
+	if (start_argv != NULL && strcmp(start_argv[0], start_argv[1]) != 0) {
+		if (start_argv[0][0] == '\0') {
+			holder_tmp_path = appfs_download_lock_get_tmp_path(start_argv[1]);
+		}
+
+		if (start_argv[0][0] != '\0' || holder_tmp_path != NULL) {
+			blocks_result = appfs_tcl_call_string("::appfs::download_blocks", stream->hostname, stream->sha1);
+		}
+	}
+
+	pthread_mutex_lock(&appfs_streams_mutex);
+
+	if (start_argv == NULL) {
+		appfs_stream_finish(stream, APPFS_STREAM_FAILED, NULL);
+	} else if (strcmp(start_argv[0], start_argv[1]) == 0) {
+		/* Already in the cache */
+		appfs_stream_finish(stream, APPFS_STREAM_COMPLETE, start_argv[1]);
+	} else if (start_argv[0][0] == '\0') {
+		/*
+		 * Someone else holds the lock for downloading the file.  If
+		 * it is being downloaded by this process, read it as it
+		 * arrives, and either way wait for it to be done with using
+		 * a download worker rather than this thread.
+		 */
+		if (stream->cache_path == NULL) {
+			stream->cache_path = strdup(start_argv[1]);
+		}
+
+		if (holder_tmp_path != NULL && stream->tmp_path == NULL) {
+			APPFS_DEBUG("Following download of %s into %s", stream->sha1, holder_tmp_path);
+
+			stream->tmp_path = holder_tmp_path;
+			holder_tmp_path = NULL;
+
+			stream->state = APPFS_STREAM_DOWNLOADING;
+
+			appfs_stream_blocks_start(stream, blocks_result);
+
+			pthread_cond_broadcast(&appfs_streams_cond);
+		}
+
+		if (stream->cache_path == NULL || appfs_download_queue(appfs_stream_join_job, stream, 0) != 0) {
+			appfs_stream_finish(stream, APPFS_STREAM_FAILED, NULL);
+		}
+	} else {
+		/*
+		 * download_start has taken the lock for downloading the file,
+		 * which is held until the download finishes
+		 */
+		stream->lock_path = strdup(start_argv[1]);
+		if (stream->lock_path == NULL) {
+			appfs_download_unlock(start_argv[1]);
+		}
+
+		/* Only used to look for the file in the cache */
+		if (stream->cache_path == NULL) {
+			stream->cache_path = strdup(start_argv[1]);
+		}
+
+		stream->tmp_path = strdup(start_argv[0]);
+		if (stream->tmp_path == NULL) {
+			appfs_stream_finish(stream, APPFS_STREAM_FAILED, NULL);
+		} else {
+			stream->state = APPFS_STREAM_DOWNLOADING;
+
+			appfs_stream_blocks_start(stream, blocks_result);
+
+			pthread_cond_broadcast(&appfs_streams_cond);
+
+			if (appfs_sparse_min <= 0 || stream->size < appfs_sparse_min || appfs_stream_sparse_start(stream) != 0) {
+				appfs_stream_download_start(stream);
+			}
+		}
+	}
+
+	pthread_mutex_unlock(&appfs_streams_mutex);
+
+	if (start_argv != NULL) {
+		Tcl_Free((char *) start_argv);
+	}
+
+	free(blocks_result);
+	free(holder_tmp_path);
+
+	return;
+}
+
+/*
+ * Wait for whoever else holds the lock for downloading the file of a
+ * stream to be done with it.  If they did not put the file into the cache
+ * and nothing has been read from their download, try downloading it again.
+ */
+static void appfs_stream_join_job(Tcl_Interp *interp, void *data) {
+	struct appfs_stream *stream;
+
+	stream = data;
+
+	appfs_download_lock(stream->cache_path, 1);
+	appfs_download_unlock(stream->cache_path);
+
+	if (access(stream->cache_path, F_OK) == 0) {
+		pthread_mutex_lock(&appfs_streams_mutex);
+
+		appfs_stream_finish(stream, APPFS_STREAM_COMPLETE, stream->cache_path);
+
+		pthread_mutex_unlock(&appfs_streams_mutex);
+
+		return;
+	}
+
+	if (stream->tmp_path != NULL) {
+		APPFS_DEBUG("Download of %s being followed failed", stream->sha1);
+
+		pthread_mutex_lock(&appfs_streams_mutex);
+
+		appfs_stream_finish(stream, APPFS_STREAM_FAILED, NULL);
+
+		pthread_mutex_unlock(&appfs_streams_mutex);
+
+		return;
+	}
+
+	appfs_stream_start(stream);
+
+	return;
+}
+
+/*
+ * Start (or join) the download of a file, and open whatever part of it has
+ * arrived so far.  Returns a file descriptor or a negative errno value.
+ */
+static int appfs_stream_open(const char *hostname, const char *sha1, off_t size, int flags) {
+	struct appfs_stream *stream;
+	struct appfs_stream_fd *stream_fd;
+	int fd;
+
+	pthread_mutex_lock(&appfs_streams_mutex);
+
+	for (stream = appfs_streams; stream != NULL; stream = stream->_next) {
+		if (strcmp(stream->sha1, sha1) == 0) {
+			break;
+		}
+	}
+
+	if (stream == NULL) {
+		stream = calloc(1, sizeof(*stream));
+		if (stream == NULL) {
+			pthread_mutex_unlock(&appfs_streams_mutex);
+
+			return(-ENOMEM);
+		}
+
+		stream->hostname = strdup(hostname);
+		stream->sha1 = strdup(sha1);
+		stream->size = size;
+		stream->state = APPFS_STREAM_STARTING;
+		stream->refs = 1;
+
+		if (stream->hostname == NULL || stream->sha1 == NULL) {
+			appfs_stream_release(stream);
+
+			pthread_mutex_unlock(&appfs_streams_mutex);
+
+			return(-ENOMEM);
+		}
+
+		/* One reference for the download, and one for us */
+		stream->refs = 2;
+
+		stream->_next = appfs_streams;
+		appfs_streams = stream;
+
+		pthread_mutex_unlock(&appfs_streams_mutex);
+
+		appfs_stream_start(stream);
+
+		pthread_mutex_lock(&appfs_streams_mutex);
+	} else {
+		/*
+		 * Sparse downloads may never be finished, so if the whole
+		 * file has since been put into the cache some other way, use
+		 * that instead
+		 */
+		if (stream->sparse && stream->state == APPFS_STREAM_DOWNLOADING && stream->cache_path != NULL && access(stream->cache_path, F_OK) == 0) {
+			fd = open(stream->cache_path, flags, 0600);
+			if (fd >= 0) {
+				APPFS_DEBUG("Opened %s from the cache rather than its sparse download", stream->sha1);
+
+				pthread_mutex_unlock(&appfs_streams_mutex);
+
+				return(fd);
+			}
+		}
+
+		stream->refs++;
+	}
+
+	/* Our reference is kept for as long as the file is open */
+
+	while (stream->state == APPFS_STREAM_STARTING) {
+		pthread_cond_wait(&appfs_streams_cond, &appfs_streams_mutex);
+	}
+
+	fd = -1;
+	if (stream->state == APPFS_STREAM_DOWNLOADING) {
+		fd = open(stream->tmp_path, flags, 0600);
+
+		/*
+		 * The download may have just finished and been moved into
+		 * the cache, in which case wait for it to be marked so
+		 */
+		if (fd < 0) {
+			while (stream->state == APPFS_STREAM_DOWNLOADING) {
+				pthread_cond_wait(&appfs_streams_cond, &appfs_streams_mutex);
+			}
+		} else {
+			stream_fd = malloc(sizeof(*stream_fd));
+			if (stream_fd == NULL) {
+				close(fd);
+
+				appfs_stream_release(stream);
+
+				pthread_mutex_unlock(&appfs_streams_mutex);
+
+				return(-ENOMEM);
+			}
+
+			stream_fd->fd = fd;
+			stream_fd->stream = stream;
+			stream_fd->_next = appfs_stream_fds[fd % APPFS_STREAM_FDS_BUCKETS];
+
+			appfs_stream_fds[fd % APPFS_STREAM_FDS_BUCKETS] = stream_fd;
+
+			__sync_add_and_fetch(&appfs_stream_fds_count, 1);
+
+			APPFS_DEBUG("Opened %s while it is being downloaded, fd = %i", stream->sha1, fd);
+
+			pthread_mutex_unlock(&appfs_streams_mutex);
+
+			return(fd);
+		}
+	}
+
+	if (stream->state == APPFS_STREAM_COMPLETE) {
+		fd = open(stream->path, flags, 0600);
+		if (fd < 0) {
+			fd = -errno;
+		}
+	} else {
+		fd = -EIO;
+	}
+
+	appfs_stream_release(stream);
+
+	pthread_mutex_unlock(&appfs_streams_mutex);
+
+	return(fd);
+}
+
+/*
+ * Wait for the range about to be read from a file descriptor to have
+ * arrived, if it refers to a file which is still being downloaded
+ */
+static int appfs_stream_wait(int fd, off_t offset, size_t size) {
+	struct appfs_stream_fd *stream_fd;
+	struct appfs_stream *stream;
+	struct timespec wait_until;
+	struct stat stbuf;
+	off_t needed;
+	int retval;
+
+	if (!__sync_fetch_and_add(&appfs_stream_fds_count, 0)) {
+		return(0);
+	}
+
+	pthread_mutex_lock(&appfs_streams_mutex);
+
+	for (stream_fd = appfs_stream_fds[fd % APPFS_STREAM_FDS_BUCKETS]; stream_fd != NULL; stream_fd = stream_fd->_next) {
+		if (stream_fd->fd == fd) {
+			break;
+		}
+	}
+
+	if (stream_fd == NULL) {
+		pthread_mutex_unlock(&appfs_streams_mutex);
+
+		return(0);
+	}
+
+	stream = stream_fd->stream;
+
+	if (stream->sparse) {
+		retval = appfs_stream_sparse_wait(stream, offset, size);
+		if (retval == 0) {
+			pthread_mutex_unlock(&appfs_streams_mutex);
+
+			return(0);
+		}
+	}
+
+	/*
+	 * Reads which reach the end of the file wait for the file to be
+	 * verified, so that anything reading a corrupt file in its
+	 * entirety is told so
+	 */
+	needed = offset + size;
+	if (stream->blocks_hashed) {
+		/* Blocks can only be verified once the whole block has arrived */
+		needed = ((needed + stream->block_size - 1) / stream->block_size) * stream->block_size;
+	}
+
+	if (needed >= stream->size) {
+		needed = -1;
+	}
+
+	while (1) {
+		if (stream->state == APPFS_STREAM_FAILED) {
+			retval = -EIO;
+
+			break;
+		}
+
+		if (stream->state == APPFS_STREAM_COMPLETE) {
+			retval = 0;
+
+			break;
+		}
+
+		if (needed >= 0 && fstat(fd, &stbuf) == 0 && stbuf.st_size >= needed) {
+			retval = 0;
+
+			break;
+		}
+
+		/*
+		 * Progress is not signalled as data arrives, only completion,
+		 * so check back on it periodically
+		 */
+		clock_gettime(CLOCK_REALTIME, &wait_until);
+		wait_until.tv_nsec += 50000000;
+		if (wait_until.tv_nsec >= 1000000000) {
+			wait_until.tv_sec++;
+			wait_until.tv_nsec -= 1000000000;
+		}
+
+		pthread_cond_timedwait(&appfs_streams_cond, &appfs_streams_mutex, &wait_until);
+	}
+
+	if (retval == 0 && stream->state == APPFS_STREAM_DOWNLOADING && stream->blocks_hashed && size != 0) {
+		retval = appfs_stream_blocks_verify(stream, fd, offset, size);
+	}
+
+	pthread_mutex_unlock(&appfs_streams_mutex);
+
+	return(retval);
+}
+
+/*
+ * Abandon a sparse download once nothing has it open, since only the parts
+ * of it which have been read have been fetched and it may never be
+ * finished.  Its temporary file is removed rather than left in the cache
+ * directory.  Must be called with the streams mutex held, while the caller
+ * still holds its own reference.
+ */
+static void appfs_stream_sparse_drop(struct appfs_stream *stream) {
+	/* Only the caller's reference and the download's remain */
+	if (stream->refs != 2) {
+		return;
+	}
+
+	if (!stream->sparse || stream->state != APPFS_STREAM_DOWNLOADING) {
+		return;
+	}
+
+	/* Once every block has been fetched it is being verified */
+	if (stream->blocks_fetching != 0 || stream->blocks_present == stream->blocks_count) {
+		return;
+	}
+
+	APPFS_DEBUG("Abandoning sparse download of %s, %llu of %llu blocks were fetched", stream->sha1, (unsigned long long) stream->blocks_present, (unsigned long long) stream->blocks_count);
+
+	unlink(stream->tmp_path);
+
+	appfs_stream_finish(stream, APPFS_STREAM_FAILED, NULL);
+
+	return;
+}
+
+/*
+ * Forget about a file descriptor which may refer to a file being
+ * downloaded, before it is closed
+ */
+static void appfs_stream_close(int fd) {
+	struct appfs_stream_fd **stream_fd_p, *stream_fd;
+
+	if (!__sync_fetch_and_add(&appfs_stream_fds_count, 0)) {
+		return;
+	}
+
+	pthread_mutex_lock(&appfs_streams_mutex);
+
+	for (stream_fd_p = &appfs_stream_fds[fd % APPFS_STREAM_FDS_BUCKETS]; *stream_fd_p != NULL; stream_fd_p = &(*stream_fd_p)->_next) {
+		stream_fd = *stream_fd_p;
+
+		if (stream_fd->fd == fd) {
+			*stream_fd_p = stream_fd->_next;
+
+			appfs_stream_sparse_drop(stream_fd->stream);
+
+			appfs_stream_release(stream_fd->stream);
+
+			free(stream_fd);
+
+			__sync_sub_and_fetch(&appfs_stream_fds_count, 1);
+
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&appfs_streams_mutex);
+
+	return;
+}
+
+static void appfs_streaming_start(void) {
+	/* Downloads are done by the download workers */
+	if (!__sync_fetch_and_add(&appfs_download_workers_started, 0) || !appfs_streaming) {
+		return;
+	}
+
+	__sync_lock_test_and_set(&appfs_streaming_started, 1);
+
+	return;
+}
+
+/*
+ * Hoarding:
+ *         All of the files of a package may be fetched into the cache ahead
+ *         of time, so that nothing using the package has to wait for them
+ *         to be downloaded.  They are fetched by the download workers, and
+ *         progress is reported as each file is done.
+ */
+struct appfs_hoard {
+	const char *hostname;
+	const char **sha1s;
+	int sha1s_count;
+	int next;
+	int done;
+	int failed;
+	int output_fd;
+	int detached;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+};
+
+static void appfs_hoard_output(int fd, const char *format, ...) {
+	char buf[1024];
+	va_list ap;
+	ssize_t write_ret;
+	int len, offset;
+
+	/* Prefetches have nowhere to report to */
+	if (fd < 0) {
+		return;
+	}
+
+	va_start(ap, format);
+	len = vsnprintf(buf, sizeof(buf), format, ap);
+	va_end(ap);
+
+	if (len < 0) {
+		return;
+	}
+
+	if (len >= (int) sizeof(buf)) {
+		len = sizeof(buf) - 1;
+	}
+
+	for (offset = 0; offset < len; offset += write_ret) {
+		write_ret = write(fd, buf + offset, len - offset);
+		if (write_ret <= 0) {
+			if (write_ret < 0 && errno == EINTR) {
+				write_ret = 0;
+
+				continue;
+			}
+
+			break;
+		}
+	}
+
+	return;
+}
+
+/*
+ * Free a detached hoard, once all of its files have been tried
+ */
+static void appfs_hoard_free(struct appfs_hoard *hoard) {
+	APPFS_DEBUG("Prefetched %i files from %s (%i failed)", hoard->done, hoard->hostname, hoard->failed);
+
+	pthread_mutex_destroy(&hoard->mutex);
+	pthread_cond_destroy(&hoard->cond);
+
+	free((char *) hoard->hostname);
+
+	Tcl_Free((char *) hoard->sha1s);
+
+	free(hoard);
+
+	return;
+}
+
+/*
+ * Fetch the next file of a hoard.  Without an interpreter the file is
+ * counted as failed.
+ */
+static void appfs_hoard_file(Tcl_Interp *interp, void *data) {
+	struct appfs_hoard *hoard;
+	const char *sha1;
+	int tcl_ret, finished;
+
+	hoard = data;
+
+	pthread_mutex_lock(&hoard->mutex);
+
+	sha1 = hoard->sha1s[hoard->next++];
+
+	pthread_mutex_unlock(&hoard->mutex);
+
+	if (interp == NULL) {
+		tcl_ret = TCL_ERROR;
+	} else {
+		appfs_call_libtcl(Tcl_Preserve(interp);)
+
+		tcl_ret = appfs_Tcl_Eval(interp, 3, "::appfs::download", hoard->hostname, sha1);
+		if (tcl_ret != TCL_OK) {
+			APPFS_DEBUG("::appfs::download(%s, %s) failed.", hoard->hostname, sha1);
+			appfs_call_libtcl(
+				APPFS_DEBUG("Tcl Error is: %s", Tcl_GetStringResult(interp));
+			)
+		}
+
+		appfs_call_libtcl(Tcl_Release(interp);)
+	}
+
+	pthread_mutex_lock(&hoard->mutex);
+
+	hoard->done++;
+	if (tcl_ret != TCL_OK) {
+		hoard->failed++;
+	}
+
+	appfs_hoard_output(hoard->output_fd, "%i/%i files fetched (%i failed)\n", hoard->done, hoard->sha1s_count, hoard->failed);
+
+	finished = (hoard->done == hoard->sha1s_count);
+	if (finished && !hoard->detached) {
+		pthread_cond_broadcast(&hoard->cond);
+	}
+
+	pthread_mutex_unlock(&hoard->mutex);
+
+	if (finished && hoard->detached) {
+		appfs_hoard_free(hoard);
+	}
+
+	return;
+}
+
+/*
+ * Fetch the files of a hoard using the download workers.  A detached hoard
+ * is freed once its files have all been tried, otherwise this returns once
+ * they have.
+ */
+static void appfs_hoard_run(struct appfs_hoard *hoard) {
+	int sha1s_count, detached, queued, idx;
+
+	pthread_mutex_init(&hoard->mutex, NULL);
+	pthread_cond_init(&hoard->cond, NULL);
+
+	/* The hoard may be freed as soon as its last file is queued */
+	sha1s_count = hoard->sha1s_count;
+	detached = hoard->detached;
+
+	if (sha1s_count == 0) {
+		if (detached) {
+			appfs_hoard_free(hoard);
+		} else {
+			pthread_mutex_destroy(&hoard->mutex);
+			pthread_cond_destroy(&hoard->cond);
+		}
+
+		return;
+	}
+
+	/* A download worker cannot wait on work queued for the others */
+	queued = 0;
+	if (detached || !appfs_download_worker_thread) {
+		for (; queued < sha1s_count; queued++) {
+			if (appfs_download_queue(appfs_hoard_file, hoard, 1) != 0) {
+				break;
+			}
+		}
+	}
+
+	/*
+	 * Anything which could not be queued is fetched in this thread, unless
+	 * nothing is waiting for it
+	 */
+	for (idx = queued; idx < sha1s_count; idx++) {
+		if (detached) {
+			appfs_hoard_file(NULL, hoard);
+		} else {
+			appfs_hoard_file(appfs_TclInterp(), hoard);
+		}
+	}
+
+	if (detached) {
+		return;
+	}
+
+	pthread_mutex_lock(&hoard->mutex);
+
+	while (hoard->done < hoard->sha1s_count) {
+		pthread_cond_wait(&hoard->cond, &hoard->mutex);
+	}
+
+	pthread_mutex_unlock(&hoard->mutex);
+
+	pthread_mutex_destroy(&hoard->mutex);
+	pthread_cond_destroy(&hoard->cond);
+
+	return;
+}
+
+/*
+ * Fetch all of the files of a package into the cache, writing progress to
+ * "output_fd".  "version" may be "latest" and "os_cpu" may be empty for
+ * this platform.  Must be called from a thread which may use its own
+ * interpreter.  Returns 0 if every file was fetched.
+ */
+static int appfs_hoard(const char *hostname, const char *package, const char *version, const char *os_cpu, int output_fd) {
+	struct appfs_hoard hoard;
+	Tcl_Interp *interp;
+	char *files;
+	int tcl_ret;
+
+	interp = appfs_TclInterp();
+	if (interp == NULL) {
+		appfs_hoard_output(output_fd, "error: Unable to get an interpreter\n");
+
+		return(1);
+	}
+
+	appfs_call_libtcl(Tcl_Preserve(interp);)
+
+	tcl_ret = appfs_Tcl_Eval(interp, 5, "::appfs::hoard_files", hostname, package, version, os_cpu);
+
+	appfs_call_libtcl(
+		files = strdup(Tcl_GetStringResult(interp));
+	)
+
+	appfs_call_libtcl(Tcl_Release(interp);)
+
+	if (files == NULL) {
+		appfs_hoard_output(output_fd, "error: Unable to allocate memory\n");
+
+		return(1);
+	}
+
+	if (tcl_ret != TCL_OK) {
+		appfs_hoard_output(output_fd, "error: %s\n", files);
+
+		free(files);
+
+		return(1);
+	}
+
+	hoard.hostname = hostname;
+	hoard.next = 0;
+	hoard.done = 0;
+	hoard.failed = 0;
+	hoard.output_fd = output_fd;
+	hoard.detached = 0;
+
+	if (Tcl_SplitList(NULL, files, &hoard.sha1s_count, &hoard.sha1s) != TCL_OK) {
+		appfs_hoard_output(output_fd, "error: Invalid list of files\n");
+
+		free(files);
+
+		return(1);
+	}
+
+	free(files);
+
+	appfs_hoard_output(output_fd, "Fetching %i files of %s from %s\n", hoard.sha1s_count, package, hostname);
+
+	appfs_hoard_run(&hoard);
+
+	Tcl_Free((char *) hoard.sha1s);
+
+	if (hoard.failed != 0) {
+		appfs_hoard_output(output_fd, "error: Unable to fetch %i of %i files of %s\n", hoard.failed, hoard.sha1s_count, package);
+
+		return(1);
+	}
+
+	appfs_hoard_output(output_fd, "ok: Fetched %i files of %s\n", hoard.sha1s_count, package);
+
+	return(0);
+}
+
+/*
+ * Access profiles:
+ *         Applications open the files of their package in much the same
+ *         order each time they start, and each open waits for its file to
+ *         be downloaded before the next is asked for.  The files of a
+ *         package opened within "appfs_profile_window" seconds of its first
+ *         open are recorded in the cache database, and the next time the
+ *         package is first opened all of those not yet in the cache are
+ *         fetched at once, before they are asked for.
+ */
+#define APPFS_PROFILE_MAX_FILES 4096
+
+struct appfs_profile {
+	char *package_sha1;
+	char **sha1s;
+	int sha1s_count;
+	int sha1s_alloc;
+	int recording;
+
+	struct appfs_profile *_next;
+};
+
+static int appfs_profile_window = 30;
+static struct appfs_profile *appfs_profiles = NULL;
+static pthread_mutex_t appfs_profiles_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void *appfs_profile_store_thread(void *data) {
+	struct appfs_profile *profile;
+	char **sha1s, *sha1s_list, *result;
+	int sha1s_count, idx;
+
+	profile = data;
+
+	sleep(appfs_profile_window);
+
+	pthread_mutex_lock(&appfs_profiles_mutex);
+
+	profile->recording = 0;
+
+	sha1s = profile->sha1s;
+	sha1s_count = profile->sha1s_count;
+
+	profile->sha1s = NULL;
+	profile->sha1s_count = 0;
+	profile->sha1s_alloc = 0;
+
+	pthread_mutex_unlock(&appfs_profiles_mutex);
+
+	appfs_call_libtcl(
+		sha1s_list = Tcl_Merge(sha1s_count, (const char * const *) sha1s);
+	)
+
+	APPFS_DEBUG("Storing the access profile of %s (%i files)", profile->package_sha1, sha1s_count);
+
+	result = appfs_tcl_call_string("::appfs::profile_store", profile->package_sha1, sha1s_list);
+	if (result == NULL) {
+		APPFS_DEBUG("::appfs::profile_store(%s, ...) failed.", profile->package_sha1);
+	} else {
+		free(result);
+	}
+
+	appfs_call_libtcl(
+		Tcl_Free(sha1s_list);
+	)
+
+	for (idx = 0; idx < sha1s_count; idx++) {
+		free(sha1s[idx]);
+	}
+
+	free(sha1s);
+
+	return(NULL);
+}
+
+/*
+ * Record that a packaged file was opened for reading.  Returns 1 if it is
+ * the first file of its package opened, in which case the package's access
+ * profile should be replayed.
+ */
+static int appfs_profile_access(const char *package_sha1, const char *file_sha1) {
+	struct appfs_profile *profile;
+	pthread_attr_t attr;
+	pthread_t thread;
+	char **sha1s, *sha1;
+	int new_profile, idx, thread_ret;
+
+	/* Profiles are stored and replayed by threads with their own interpreters */
+	if (!appfs_threaded_tcl || appfs_profile_window <= 0) {
+		return(0);
+	}
+
+	pthread_mutex_lock(&appfs_profiles_mutex);
+
+	for (profile = appfs_profiles; profile != NULL; profile = profile->_next) {
+		if (strcmp(profile->package_sha1, package_sha1) == 0) {
+			break;
+		}
+	}
+
+	new_profile = 0;
+	if (profile != NULL) {
+		if (!profile->recording || profile->sha1s_count >= APPFS_PROFILE_MAX_FILES) {
+			pthread_mutex_unlock(&appfs_profiles_mutex);
+
+			return(0);
+		}
+
+		for (idx = 0; idx < profile->sha1s_count; idx++) {
+			if (strcmp(profile->sha1s[idx], file_sha1) == 0) {
+				pthread_mutex_unlock(&appfs_profiles_mutex);
+
+				return(0);
+			}
+		}
+	} else {
+		profile = calloc(1, sizeof(*profile));
+		if (profile == NULL) {
+			pthread_mutex_unlock(&appfs_profiles_mutex);
+
+			return(0);
+		}
+
+		profile->package_sha1 = strdup(package_sha1);
+		if (profile->package_sha1 == NULL) {
+			free(profile);
+
+			pthread_mutex_unlock(&appfs_profiles_mutex);
+
+			return(0);
+		}
+
+		profile->recording = 1;
+
+		new_profile = 1;
+	}
+
+	if (profile->sha1s_count == profile->sha1s_alloc) {
+		sha1s = realloc(profile->sha1s, sizeof(*sha1s) * (profile->sha1s_alloc + 32));
+		if (sha1s != NULL) {
+			profile->sha1s = sha1s;
+			profile->sha1s_alloc += 32;
+		}
+	}
+
+	sha1 = NULL;
+	if (profile->sha1s_count < profile->sha1s_alloc) {
+		sha1 = strdup(file_sha1);
+	}
+
+	if (sha1 != NULL) {
+		profile->sha1s[profile->sha1s_count++] = sha1;
+	}
+
+	/* Not the first file opened from this package */
+	if (!new_profile) {
+		pthread_mutex_unlock(&appfs_profiles_mutex);
+
+		return(0);
+	}
+
+	profile->_next = appfs_profiles;
+	appfs_profiles = profile;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	thread_ret = pthread_create(&thread, &attr, appfs_profile_store_thread, profile);
+
+	pthread_attr_destroy(&attr);
+
+	/* Without anything to store it, stop recording this package */
+	if (thread_ret != 0) {
+		profile->recording = 0;
+
+		for (idx = 0; idx < profile->sha1s_count; idx++) {
+			free(profile->sha1s[idx]);
+		}
+
+		free(profile->sha1s);
+
+		profile->sha1s = NULL;
+		profile->sha1s_count = 0;
+		profile->sha1s_alloc = 0;
+	}
+
+	pthread_mutex_unlock(&appfs_profiles_mutex);
+
+	return(1);
+}
+
+/*
+ * Fetch files into the cache in the background, from a Tcl list of their
+ * hashes
+ */
+static int appfs_prefetch(const char *hostname, const char *sha1s_list) {
+	struct appfs_hoard *hoard;
+
+	hoard = calloc(1, sizeof(*hoard));
+	if (hoard == NULL) {
+		return(-ENOMEM);
+	}
+
+	hoard->output_fd = -1;
+	hoard->detached = 1;
+	hoard->hostname = strdup(hostname);
+	if (hoard->hostname == NULL) {
+		free(hoard);
+
+		return(-ENOMEM);
+	}
+
+	if (Tcl_SplitList(NULL, sha1s_list, &hoard->sha1s_count, &hoard->sha1s) != TCL_OK) {
+		free((char *) hoard->hostname);
+		free(hoard);
+
+		return(-EINVAL);
+	}
+
+	appfs_hoard_run(hoard);
+
+	return(0);
+}
+
+/*
+ * Library prefetching:
+ *         When an executable or shared library is opened before it is in
+ *         the cache, the dynamic linker is about to open each of the
+ *         libraries it needs in turn, waiting for each to be downloaded.
+ *         The DT_NEEDED entries of its dynamic section are read as soon as
+ *         they arrive and the libraries of the same name in the package
+ *         are all fetched at once.
+ */
+#define APPFS_ELF_MAX_PHDRS 256
+#define APPFS_ELF_MAX_DYNAMIC (64 * 1024)
+#define APPFS_ELF_MAX_STRTAB (1024 * 1024)
+#define APPFS_ELF_MAX_NEEDED 256
+
+static int appfs_prefetch_libs = 1;
+
+struct appfs_elf_prefetch {
+	char *path;
+	char *hostname;
+	char *sha1;
+	off_t size;
+	uid_t uid;
+	gid_t gid;
+};
+
+/*
+ * Read part of a file which may still be being downloaded
+ */
+static int appfs_elf_read(int fd, off_t file_size, void *buf, size_t size, off_t offset) {
+	ssize_t read_ret;
+	int wait_ret;
+
+	if (offset < 0 || offset > file_size || (off_t) size > file_size - offset) {
+		return(-EINVAL);
+	}
+
+	wait_ret = appfs_stream_wait(fd, offset, size);
+	if (wait_ret != 0) {
+		return(wait_ret);
+	}
+
+	if (lseek(fd, offset, SEEK_SET) != offset) {
+		return(-errno);
+	}
+
+	while (size != 0) {
+		read_ret = read(fd, buf, size);
+		if (read_ret <= 0) {
+			if (read_ret < 0 && errno == EINTR) {
+				continue;
+			}
+
+			return(-EIO);
+		}
+
+		buf = (char *) buf + read_ret;
+		size -= read_ret;
+	}
+
+	return(0);
+}
+
+/*
+ * Get the names of the libraries an ELF file for this system needs, as a
+ * Tcl list to be released with Tcl_Free(), or NULL if it is not one or
+ * needs none
+ */
+static char *appfs_elf_needed(int fd, off_t file_size) {
+	unsigned char ident[EI_NIDENT];
+	unsigned char *phdrs, *dynamic;
+	char *strtab, *needed_names[APPFS_ELF_MAX_NEEDED], *retval;
+	uint64_t phoff, phnum, phentsize, dynamic_offset, dynamic_size;
+	uint64_t strtab_vaddr, strtab_offset, strtab_size, needed[APPFS_ELF_MAX_NEEDED];
+	uint64_t tag, val;
+	uint16_t byte_order = 1;
+	int is64, dynentsize, have_strtab, needed_count, names_count;
+	int idx;
+
+	if (appfs_elf_read(fd, file_size, ident, sizeof(ident), 0) != 0) {
+		return(NULL);
+	}
+
+	if (memcmp(ident, ELFMAG, SELFMAG) != 0) {
+		return(NULL);
+	}
+
+	/* Only files for this system are going to be loaded here */
+	if (ident[EI_DATA] != (*((unsigned char *) &byte_order) == 1 ? ELFDATA2LSB : ELFDATA2MSB)) {
+		return(NULL);
+	}
+
+	if (ident[EI_CLASS] == ELFCLASS64) {
+		Elf64_Ehdr ehdr;
+
+		if (appfs_elf_read(fd, file_size, &ehdr, sizeof(ehdr), 0) != 0) {
+			return(NULL);
+		}
+
+		is64 = 1;
+		phoff = ehdr.e_phoff;
+		phnum = ehdr.e_phnum;
+		phentsize = ehdr.e_phentsize;
+		dynentsize = sizeof(Elf64_Dyn);
+
+		if (phentsize < sizeof(Elf64_Phdr)) {
+			return(NULL);
+		}
+	} else if (ident[EI_CLASS] == ELFCLASS32) {
+		Elf32_Ehdr ehdr;
+
+		if (appfs_elf_read(fd, file_size, &ehdr, sizeof(ehdr), 0) != 0) {
+			return(NULL);
+		}
+
+		is64 = 0;
+		phoff = ehdr.e_phoff;
+		phnum = ehdr.e_phnum;
+		phentsize = ehdr.e_phentsize;
+		dynentsize = sizeof(Elf32_Dyn);
+
+		if (phentsize < sizeof(Elf32_Phdr)) {
+			return(NULL);
+		}
+	} else {
+		return(NULL);
+	}
+
+	if (phnum == 0 || phnum > APPFS_ELF_MAX_PHDRS) {
+		return(NULL);
+	}
+
+	phdrs = malloc(phnum * phentsize);
+	if (phdrs == NULL) {
+		return(NULL);
+	}
+
+	if (appfs_elf_read(fd, file_size, phdrs, phnum * phentsize, phoff) != 0) {
+		free(phdrs);
+
+		return(NULL);
+	}
+
+	/* Find the dynamic section */
+	dynamic_size = 0;
+	dynamic_offset = 0;
+	for (idx = 0; idx < phnum; idx++) {
+		if (is64) {
+			Elf64_Phdr phdr;
+
+			memcpy(&phdr, phdrs + idx * phentsize, sizeof(phdr));
+
+			if (phdr.p_type == PT_DYNAMIC) {
+				dynamic_offset = phdr.p_offset;
+				dynamic_size = phdr.p_filesz;
+			}
+		} else {
+			Elf32_Phdr phdr;
+
+			memcpy(&phdr, phdrs + idx * phentsize, sizeof(phdr));
+
+			if (phdr.p_type == PT_DYNAMIC) {
+				dynamic_offset = phdr.p_offset;
+				dynamic_size = phdr.p_filesz;
+			}
+		}
+	}
+
+	if (dynamic_size > APPFS_ELF_MAX_DYNAMIC) {
+		dynamic_size = APPFS_ELF_MAX_DYNAMIC;
+	}
+
+	dynamic_size -= dynamic_size % dynentsize;
+
+	if (dynamic_size == 0) {
+		free(phdrs);
+
+		return(NULL);
+	}
+
+	dynamic = malloc(dynamic_size);
+	if (dynamic == NULL) {
+		free(phdrs);
+
+		return(NULL);
+	}
+
+	if (appfs_elf_read(fd, file_size, dynamic, dynamic_size, dynamic_offset) != 0) {
+		free(dynamic);
+		free(phdrs);
+
+		return(NULL);
+	}
+
+	have_strtab = 0;
+	strtab_vaddr = 0;
+	strtab_size = 0;
+	needed_count = 0;
+	for (idx = 0; idx < dynamic_size / dynentsize; idx++) {
+		if (is64) {
+			Elf64_Dyn dyn;
+
+			memcpy(&dyn, dynamic + idx * dynentsize, sizeof(dyn));
+
+			tag = dyn.d_tag;
+			val = dyn.d_un.d_val;
+		} else {
+			Elf32_Dyn dyn;
+
+			memcpy(&dyn, dynamic + idx * dynentsize, sizeof(dyn));
+
+			tag = dyn.d_tag;
+			val = dyn.d_un.d_val;
+		}
+
+		if (tag == DT_NULL) {
+			break;
+		}
+
+		switch (tag) {
+			case DT_NEEDED:
+				if (needed_count < APPFS_ELF_MAX_NEEDED) {
+					needed[needed_count++] = val;
+				}
+
+				break;
+			case DT_STRTAB:
+				have_strtab = 1;
+				strtab_vaddr = val;
+
+				break;
+			case DT_STRSZ:
+				strtab_size = val;
+
+				break;
+		}
+	}
+
+	free(dynamic);
+
+	if (needed_count == 0 || !have_strtab || strtab_size == 0) {
+		free(phdrs);
+
+		return(NULL);
+	}
+
+	if (strtab_size > APPFS_ELF_MAX_STRTAB) {
+		strtab_size = APPFS_ELF_MAX_STRTAB;
+	}
+
+	/* The string table is given by its address once loaded */
+	strtab_offset = 0;
+	for (idx = 0; idx < phnum; idx++) {
+		uint64_t type, offset, vaddr, filesz;
+
+		if (is64) {
+			Elf64_Phdr phdr;
+
+			memcpy(&phdr, phdrs + idx * phentsize, sizeof(phdr));
+
+			type = phdr.p_type;
+			offset = phdr.p_offset;
+			vaddr = phdr.p_vaddr;
+			filesz = phdr.p_filesz;
+		} else {
+			Elf32_Phdr phdr;
+
+			memcpy(&phdr, phdrs + idx * phentsize, sizeof(phdr));
+
+			type = phdr.p_type;
+			offset = phdr.p_offset;
+			vaddr = phdr.p_vaddr;
+			filesz = phdr.p_filesz;
+		}
+
+		if (type == PT_LOAD && strtab_vaddr >= vaddr && strtab_vaddr < vaddr + filesz) {
+			strtab_offset = strtab_vaddr - vaddr + offset;
+
+			if (strtab_size > vaddr + filesz - strtab_vaddr) {
+				strtab_size = vaddr + filesz - strtab_vaddr;
+			}
+
+			break;
+		}
+	}
+
+	free(phdrs);
+
+	if (idx == phnum) {
+		return(NULL);
+	}
+
+	strtab = malloc(strtab_size + 1);
+	if (strtab == NULL) {
+		return(NULL);
+	}
+
+	if (appfs_elf_read(fd, file_size, strtab, strtab_size, strtab_offset) != 0) {
+		free(strtab);
+
+		return(NULL);
+	}
+
+	strtab[strtab_size] = '\0';
+
+	/* Libraries named by path are not looked for in the package */
+	names_count = 0;
+	for (idx = 0; idx < needed_count; idx++) {
+		if (needed[idx] >= strtab_size) {
+			continue;
+		}
+
+		if (strtab[needed[idx]] == '\0' || strchr(strtab + needed[idx], '/') != NULL) {
+			continue;
+		}
+
+		needed_names[names_count++] = strtab + needed[idx];
+	}
+
+	retval = NULL;
+	if (names_count != 0) {
+		appfs_call_libtcl(
+			retval = Tcl_Merge(names_count, (const char * const *) needed_names);
+		)
+	}
+
+	free(strtab);
+
+	return(retval);
+}
+
+static void appfs_elf_prefetch_job(Tcl_Interp *interp, void *data) {
+	struct appfs_elf_prefetch *prefetch;
+	char *needed, *result;
+	int fd;
+
+	prefetch = data;
+
+	/* Libraries are looked up as the user who opened the file */
+	appfs_fuse_uid = prefetch->uid;
+	appfs_fuse_gid = prefetch->gid;
+
+	/* Our own handle on the file, which may still be downloading */
+	fd = appfs_stream_open(prefetch->hostname, prefetch->sha1, prefetch->size, O_RDONLY);
+	if (fd >= 0) {
+		needed = appfs_elf_needed(fd, prefetch->size);
+
+		appfs_stream_close(fd);
+
+		close(fd);
+
+		if (needed != NULL) {
+			APPFS_DEBUG("%s needs: %s", prefetch->path, needed);
+
+			result = appfs_tcl_call_string("::appfs::elf_prefetch", prefetch->path, needed);
+			if (result == NULL) {
+				APPFS_DEBUG("::appfs::elf_prefetch(%s, ...) failed.", prefetch->path);
+			} else {
+				free(result);
+			}
+
+			appfs_call_libtcl(
+				Tcl_Free(needed);
+			)
+		}
+	}
+
+	free(prefetch->path);
+	free(prefetch->hostname);
+	free(prefetch->sha1);
+	free(prefetch);
+
+	return;
+}
+
+/*
+ * Start fetching the libraries needed by a packaged file which has just
+ * been opened while it is being downloaded, if it is an executable or
+ * library
+ */
+static void appfs_elf_prefetch_start(const char *path, const char *hostname, const char *sha1, off_t size) {
+	struct appfs_elf_prefetch *prefetch;
+	int queue_ret;
+
+	if (!appfs_prefetch_libs || size < (off_t) sizeof(Elf32_Ehdr)) {
+		return;
+	}
+
+	prefetch = calloc(1, sizeof(*prefetch));
+	if (prefetch == NULL) {
+		return;
+	}
+
+	prefetch->path = strdup(path);
+	prefetch->hostname = strdup(hostname);
+	prefetch->sha1 = strdup(sha1);
+	prefetch->size = size;
+	prefetch->uid = appfs_get_fsuid();
+	prefetch->gid = appfs_get_fsgid();
+
+	queue_ret = -1;
+	if (prefetch->path != NULL && prefetch->hostname != NULL && prefetch->sha1 != NULL) {
+		queue_ret = appfs_download_queue(appfs_elf_prefetch_job, prefetch, 1);
+	}
+
+	if (queue_ret != 0) {
+		free(prefetch->path);
+		free(prefetch->hostname);
+		free(prefetch->sha1);
+		free(prefetch);
+	}
+
+	return;
+}
+
+/*
+ * Control socket:
+ *         A mounted appfsd listens on a UNIX domain socket in the cache
+ *         directory for work to do, such as hoarding, so that it can be
+ *         asked for without remounting.  Each connection sends a single
+ *         command, as a Tcl list on one line, and the output of the
+ *         command is written back as it happens, ending with a line
+ *         beginning with "ok:" or "error:".  The socket may only be used by
+ *         the user appfsd runs as.
+ */
+static int appfs_control_fd = -1;
+
+static int appfs_control_path(struct sockaddr_un *addr) {
+	memset(addr, 0, sizeof(*addr));
+
+	addr->sun_family = AF_UNIX;
+
+	if (snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/control", appfs_cachedir) >= (int) sizeof(addr->sun_path)) {
+		return(-1);
+	}
+
+	return(0);
+}
+
+/*
+ * Run one command from the control socket, in the thread handling it
+ */
+static void appfs_control_command(int fd, int argc, const char **argv) {
+	if (argc >= 3 && argc <= 5 && strcmp(argv[0], "hoard") == 0) {
+		appfs_hoard(argv[1], argv[2], argc > 3 ? argv[3] : "latest", argc > 4 ? argv[4] : "", fd);
+
+		return;
+	}
+
+	appfs_hoard_output(fd, "error: Invalid command, must be: hoard <site> <package> ?<version>|latest? ?<os-cpu>?\n");
+
+	return;
+}
+
+static void *appfs_control_conn_thread(void *data) {
+	const char **command_argv;
+	char command[4096];
+	ssize_t read_ret;
+	size_t command_len;
+	int command_argc;
+	int fd;
+
+	fd = (int) (intptr_t) data;
+
+	/* Commands are run as us, with an interpreter of our own */
+	appfs_tcl_worker_thread = 1;
+	appfs_fuse_uid = getuid();
+	appfs_fuse_gid = getgid();
+
+	command_len = 0;
+	while (command_len < sizeof(command) - 1) {
+		read_ret = read(fd, command + command_len, sizeof(command) - 1 - command_len);
+		if (read_ret < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (read_ret <= 0) {
+			break;
+		}
+
+		command_len += read_ret;
+
+		if (memchr(command, '\n', command_len) != NULL) {
+			break;
+		}
+	}
+
+	command[command_len] = '\0';
+	if (strchr(command, '\n') != NULL) {
+		*strchr(command, '\n') = '\0';
+	}
+
+	if (Tcl_SplitList(NULL, command, &command_argc, &command_argv) != TCL_OK) {
+		appfs_hoard_output(fd, "error: Invalid command\n");
+	} else {
+		APPFS_DEBUG("Control command: %s", command);
+
+		appfs_control_command(fd, command_argc, command_argv);
+
+		Tcl_Free((char *) command_argv);
+	}
+
+	close(fd);
+
+	return(NULL);
+}
+
+static void *appfs_control_thread(void *data) {
+	pthread_t thread;
+	int fd;
+
+	while (1) {
+		fd = accept(appfs_control_fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+
+			APPFS_DEBUG("Unable to accept control connections, giving up on them");
+
+			break;
+		}
+
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+		if (pthread_create(&thread, NULL, appfs_control_conn_thread, (void *) (intptr_t) fd) != 0) {
+			close(fd);
+
+			continue;
+		}
+
+		pthread_detach(thread);
+	}
+
+	return(NULL);
+}
+
+static void appfs_control_stop(void) {
+	struct sockaddr_un addr;
+
+	if (appfs_control_fd < 0) {
+		return;
+	}
+
+	if (appfs_control_path(&addr) == 0) {
+		unlink(addr.sun_path);
+	}
+
+	shutdown(appfs_control_fd, SHUT_RDWR);
+	close(appfs_control_fd);
+
+	appfs_control_fd = -1;
+
+	return;
+}
+
+static void appfs_control_start(void) {
+	struct sockaddr_un addr;
+	pthread_t thread;
+	int fd, check_fd;
+
+	/* Commands are run by threads with their own interpreters */
+	if (!appfs_threaded_tcl) {
+		return;
+	}
+
+	if (appfs_control_path(&addr) != 0) {
+		APPFS_DEBUG("Cache directory path is too long for a control socket");
+
+		return;
+	}
+
+	/* Do not take over the socket of another appfsd using this cache */
+	check_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (check_fd >= 0) {
+		if (connect(check_fd, (struct sockaddr *) &addr, sizeof(addr)) == 0) {
+			APPFS_DEBUG("Another appfsd is listening on %s, not starting control socket", addr.sun_path);
+
+			close(check_fd);
+
+			return;
+		}
+
+		close(check_fd);
+	}
+
+	unlink(addr.sun_path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		return;
+	}
+
+	/*
+	 * Restrict the socket to our own user before listening on it, nobody
+	 * can connect to it before then
+	 */
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || chmod(addr.sun_path, 0600) != 0 || listen(fd, 16) != 0) {
+		APPFS_DEBUG("Unable to listen on %s", addr.sun_path);
+
+		close(fd);
+
+		return;
+	}
+
+	appfs_control_fd = fd;
+
+	if (pthread_create(&thread, NULL, appfs_control_thread, NULL) != 0) {
+		appfs_control_stop();
+
+		return;
+	}
+
+	pthread_detach(thread);
+
+	return;
+}
+
+/*
+ * Record the credentials of the FUSE request about to be serviced by this
+ * thread, so that they are available to appfs_get_fsuid()/appfs_get_fsgid()
+ * even after the request has been replied to
+ */
+static void appfs_fuse_enter(fuse_req_t req) {
+	const struct fuse_ctx *ctx;
+
+	ctx = fuse_req_ctx(req);
+	if (ctx == NULL) {
+		/* Unable to lookup user for some reason */
+		/* Use an unprivileged user ID */
+		APPFS_DEBUG("Unable to lookup user for some reason, using user ID of 1");
+
+		appfs_fuse_uid = 1;
+		appfs_fuse_gid = 1;
+
+		return;
+	}
+
+	appfs_fuse_uid = ctx->uid;
+	appfs_fuse_gid = ctx->gid;
+
+	return;
+}
+
+static void appfs_simulate_user_fs_enter(void) {
+	setfsuid(appfs_get_fsuid());
+	setfsgid(appfs_get_fsgid());
+}
+
+static void appfs_simulate_user_fs_leave(void) {
+	setfsuid(0);
+	setfsgid(0);
+}
+
+#ifdef APPFS_NO_GETPWUID
+static char *appfs_get_homedir(uid_t fsuid) {
+	return(NULL);
+}
+#else
+/*
+ * Look up the home directory for a given UID
+ *        Returns a C string containing the user's home directory or NULL if
+ *        the user's home directory does not exist or is not correctly
+ *        configured
+ */
+static char *appfs_get_homedir(uid_t fsuid) {
+	struct passwd entry, *result;
+	struct stat stbuf;
+	char buf[1024], *retval;
+	int gpu_ret, stat_ret;
+
+	gpu_ret = getpwuid_r(fsuid, &entry, buf, sizeof(buf), &result);
+	if (gpu_ret != 0) {
+		APPFS_DEBUG("getpwuid_r(%llu, ...) returned in failure", (unsigned long long) fsuid);
+
+		return(NULL);
+	}
+
+	if (result == NULL) {
+		APPFS_DEBUG("getpwuid_r(%llu, ...) returned NULL result", (unsigned long long) fsuid);
+
+		return(NULL);
+	}
+
+	if (result->pw_dir == NULL) {
+		APPFS_DEBUG("getpwuid_r(%llu, ...) returned NULL home directory", (unsigned long long) fsuid);
+
+		return(NULL);
+	}
+
+	stat_ret = stat(result->pw_dir, &stbuf);
+	if (stat_ret != 0) {
+		APPFS_DEBUG("stat(%s) returned in failure", result->pw_dir);
+
+		return(NULL);
+	}
+
+	if (stbuf.st_uid != fsuid) {
+		APPFS_DEBUG("UID mis-match on user %llu's home directory (%s).  It's owned by %llu.",
+		    (unsigned long long) fsuid,
+		    result->pw_dir,
+		    (unsigned long long) stbuf.st_uid
+		);
+
+		return(NULL);
+	}
+
+	retval = strdup(result->pw_dir);
+
+	return(retval);
+}
+#endif
+
+/*
+ * Generate an inode for a given path.  The inode should be computed in such
+ * a way that it is unlikely to be duplicated and remains the same for a given
+ * file
+ *
+ * Current implementation is an FNV-1a 32-bit
+ */
+#if UINT_MAX < 4294967295
+#error Integer size is too small 
+#endif
+static unsigned long long appfs_get_path_inode(const char *path, int uid) {
+	unsigned int retval;
+	const unsigned char *p;
+
+	retval = 2166136261U; /* FNV-1a 32-bit offset_basis */
+
+	for (p = (unsigned char *) path; *p; p++) {
+		retval ^= (int) *p;
+#if 0
+		retval *= 16777619; /* FNV-1a 32-bit prime */
+#else
+		/* GCC Optimized replacement */
+		retval += (retval << 1) + (retval << 4) + (retval << 7) + (retval << 8) + (retval << 24);
+#endif
+	}
+
+	if (uid >= 0) {
+		retval += uid;
+		retval++;
+	}
+
+	APPFS_DEBUG("Looked up inode number for path=%s,uid=%i: %u", path, uid, retval);
+
+	return(retval);
+}
+
+/*
+ * Package contexts are shared between inodes, and freed once none refer
+ * to them
+ */
+static struct appfs_package_context *appfs_package_context_new(const char *hostname, const char *package, const char *package_sha1) {
+	struct appfs_package_context *package_context;
+
+	package_context = calloc(1, sizeof(*package_context));
+	if (package_context == NULL) {
+		return(NULL);
+	}
+
+	package_context->hostname = strdup(hostname);
+	package_context->package = strdup(package);
+	package_context->package_sha1 = strdup(package_sha1);
+	package_context->refs = 1;
+
+	if (package_context->hostname == NULL || package_context->package == NULL || package_context->package_sha1 == NULL) {
+		free(package_context->hostname);
+		free(package_context->package);
+		free(package_context->package_sha1);
+		free(package_context);
+
+		return(NULL);
+	}
+
+	return(package_context);
+}
+
+static struct appfs_package_context *appfs_package_context_retain(struct appfs_package_context *package_context) {
+	if (package_context != NULL) {
+		__sync_add_and_fetch(&package_context->refs, 1);
+	}
+
+	return(package_context);
+}
+
+static void appfs_package_context_release(struct appfs_package_context *package_context) {
+	if (package_context == NULL) {
+		return;
+	}
+
+	if (__sync_sub_and_fetch(&package_context->refs, 1) != 0) {
+		return;
+	}
+
+	free(package_context->hostname);
+	free(package_context->package);
+	free(package_context->package_sha1);
+	free(package_context);
+
+	return;
+}
+
+/*
+ * Inode table:
+ *         The kernel refers to every object by an inode number, so keep
+ *         track of which path each inode number refers to for as long as
+ *         the kernel holds references (lookups) to it.  Nodes are indexed by
+ *         inode number and by parent inode number and name, so a lookup only
+ *         ever has to deal with the single path component being looked up.
+ *
+ *         Each node also keeps the package context of its path, if it is
+ *         within a package, which its children are looked up within.
+ */
+static unsigned int appfs_inode_name_hash(fuse_ino_t parent, const char *name) {
+	unsigned int retval;
+	const unsigned char *p;
+
+	retval = 2166136261U ^ ((unsigned int) parent);
+
+	for (p = (unsigned char *) name; *p; p++) {
+		retval ^= (int) *p;
+		retval += (retval << 1) + (retval << 4) + (retval << 7) + (retval << 8) + (retval << 24);
+	}
+
+	return(retval % APPFS_INODE_TABLE_SIZE);
+}
+
+/*
+ * Must be called with the inode table locked
+ */
+static struct appfs_inode *appfs_inode_find(fuse_ino_t ino) {
+	struct appfs_inode *node;
+
+	for (node = appfs_inode_table_by_ino[ino % APPFS_INODE_TABLE_SIZE]; node != NULL; node = node->_next_by_ino) {
+		if (node->ino == ino) {
+			return(node);
+		}
+	}
+
+	return(NULL);
+}
+
+/*
+ * Must be called with the inode table locked
+ */
+static struct appfs_inode *appfs_inode_find_child(fuse_ino_t parent, const char *name) {
+	struct appfs_inode *node;
+
+	for (node = appfs_inode_table_by_name[appfs_inode_name_hash(parent, name)]; node != NULL; node = node->_next_by_name) {
+		if (node->parent == parent && strcmp(node->name, name) == 0) {
+			return(node);
+		}
+	}
+
+	return(NULL);
+}
+
+/*
+ * Look up the path for an inode number, and optionally its parent and its
+ * package context (which the caller must release)
+ *         Returns a newly allocated C string, or NULL if the kernel asked
+ *         about an inode number we do not know about
+ */
+static char *appfs_inode_path(fuse_ino_t ino, fuse_ino_t *parent, struct appfs_path_context *context) {
+	struct appfs_inode *node;
+	char *retval;
+
+	if (context) {
+		context->package = NULL;
+		context->file_offset = 0;
+	}
+
+	if (ino == FUSE_ROOT_ID) {
+		if (parent) {
+			*parent = FUSE_ROOT_ID;
+		}
+
+		return(strdup("/"));
+	}
+
+	retval = NULL;
+
+	pthread_rwlock_rdlock(&appfs_inode_table_lock);
+
+	node = appfs_inode_find(ino);
+	if (node != NULL) {
+		retval = strdup(node->path);
+
+		if (parent) {
+			*parent = node->parent;
+		}
+
+		if (context && retval != NULL) {
+			context->package = appfs_package_context_retain(node->context.package);
+			context->file_offset = node->context.file_offset;
+		}
+	}
+
+	pthread_rwlock_unlock(&appfs_inode_table_lock);
+
+	if (retval == NULL) {
+		APPFS_DEBUG("Unknown inode %llu", (unsigned long long) ino);
+	}
+
+	return(retval);
+}
+
+/*
+ * Record whether the data of an inode has most recently been read from the
+ * content-addressed cache or not
+ *         Returns whether the page cache could have been populated from
+ *         something other than the content-addressed cache
+ */
+static int appfs_inode_page_cache_taint(fuse_ino_t ino, int tainted) {
+	struct appfs_inode *node;
+	int retval;
+
+	retval = 1;
+
+	pthread_rwlock_rdlock(&appfs_inode_table_lock);
+
+	node = appfs_inode_find(ino);
+	if (node != NULL) {
+		retval = __sync_lock_test_and_set(&node->page_cache_tainted, tainted);
+	}
+
+	pthread_rwlock_unlock(&appfs_inode_table_lock);
+
+	return(retval);
+}
+
+/*
+ * Construct the path of a named child of an inode, and optionally the
+ * package context of the child (which the caller must release).  Children
+ * of paths within a package are within the same package.
+ */
+static char *appfs_inode_child_path(fuse_ino_t parent, const char *name, struct appfs_path_context *context) {
+	struct appfs_path_context parent_context;
+	char *parent_path, *retval;
+	size_t parent_path_len, name_len;
+
+	if (context) {
+		context->package = NULL;
+		context->file_offset = 0;
+	}
+
+	parent_path = appfs_inode_path(parent, NULL, &parent_context);
+	if (parent_path == NULL) {
+		return(NULL);
+	}
+
+	parent_path_len = strlen(parent_path);
+	if (parent_path_len == 1) {
+		/* Root directory */
+		parent_path_len = 0;
+	}
+
+	name_len = strlen(name);
+
+	retval = malloc(parent_path_len + 1 + name_len + 1);
+	if (retval != NULL) {
+		memcpy(retval, parent_path, parent_path_len);
+		retval[parent_path_len] = '/';
+		memcpy(retval + parent_path_len + 1, name, name_len + 1);
+	}
+
+	free(parent_path);
+
+	if (context && retval != NULL && parent_context.package != NULL) {
+		context->package = appfs_package_context_retain(parent_context.package);
+
+		/* The package itself has no file within it, its children do */
+		if (parent_context.file_offset >= parent_path_len) {
+			context->file_offset = parent_path_len + 1;
+		} else {
+			context->file_offset = parent_context.file_offset;
+		}
+	}
+
+	appfs_package_context_release(parent_context.package);
+
+	return(retval);
+}
+
+/*
+ * Take a reference (as the kernel does on a successful lookup) to the
+ * named child of an inode, allocating an inode number for it if needed.
+ * The package context, if any, is kept with the inode if it has none.
+ */
+static fuse_ino_t appfs_inode_ref(fuse_ino_t parent, const char *name, const char *path, struct appfs_path_context *context) {
+	struct appfs_inode *node;
+	unsigned int name_hash;
+	fuse_ino_t retval;
+
+	/* Inodes the kernel already knows about only need their count bumped */
+	pthread_rwlock_rdlock(&appfs_inode_table_lock);
+
+	node = appfs_inode_find_child(parent, name);
+	if (node != NULL && (context == NULL || context->package == NULL || node->context.package != NULL)) {
+		__sync_add_and_fetch(&node->nlookup, 1);
+
+		retval = node->ino;
+
+		pthread_rwlock_unlock(&appfs_inode_table_lock);
+
+		return(retval);
+	}
+
+	pthread_rwlock_unlock(&appfs_inode_table_lock);
+
+	pthread_rwlock_wrlock(&appfs_inode_table_lock);
+
+	node = appfs_inode_find_child(parent, name);
+	if (node == NULL) {
+		node = calloc(1, sizeof(*node));
+		if (node != NULL) {
+			node->path = strdup(path);
+		}
+
+		if (node == NULL || node->path == NULL) {
+			pthread_rwlock_unlock(&appfs_inode_table_lock);
+
+			if (node != NULL) {
+				free(node->path);
+				free(node);
+			}
+
+			APPFS_DEBUG("error: Unable to allocate inode for %s", path);
+
+			return(0);
+		}
+
+		node->name = node->path + strlen(node->path) - strlen(name);
+
+		if (context) {
+			node->context.package = appfs_package_context_retain(context->package);
+			node->context.file_offset = context->file_offset;
+		}
+
+		/*
+		 * Prefer the inode number derived from the path so that it
+		 * remains stable, but never hand out one that is in use
+		 */
+		node->ino = appfs_get_path_inode(path, -1);
+		while (node->ino <= FUSE_ROOT_ID || appfs_inode_find(node->ino) != NULL) {
+			node->ino++;
+		}
+
+		node->parent = parent;
+
+		node->_next_by_ino = appfs_inode_table_by_ino[node->ino % APPFS_INODE_TABLE_SIZE];
+		appfs_inode_table_by_ino[node->ino % APPFS_INODE_TABLE_SIZE] = node;
+
+		name_hash = appfs_inode_name_hash(parent, name);
+		node->_next_by_name = appfs_inode_table_by_name[name_hash];
+		appfs_inode_table_by_name[name_hash] = node;
+	} else if (context && node->context.package == NULL) {
+		node->context.package = appfs_package_context_retain(context->package);
+		node->context.file_offset = context->file_offset;
+	}
+
+	__sync_add_and_fetch(&node->nlookup, 1);
+
+	retval = node->ino;
+
+	pthread_rwlock_unlock(&appfs_inode_table_lock);
+
+	return(retval);
+}
+
+/*
+ * Drop references to an inode, forgetting about it once the kernel no
+ * longer holds any
+ */
+static void appfs_inode_forget(fuse_ino_t ino, unsigned long long nlookup) {
+	struct appfs_inode *node, **node_p;
+	unsigned long long node_nlookup, new_nlookup;
+
+	if (ino == FUSE_ROOT_ID) {
+		return;
+	}
+
+	pthread_rwlock_rdlock(&appfs_inode_table_lock);
+
+	node = appfs_inode_find(ino);
+	if (node == NULL) {
+		pthread_rwlock_unlock(&appfs_inode_table_lock);
+
+		APPFS_DEBUG("Asked to forget unknown inode %llu", (unsigned long long) ino);
+
+		return;
+	}
+
+	do {
+		node_nlookup = node->nlookup;
+
+		new_nlookup = 0;
+		if (node_nlookup > nlookup) {
+			new_nlookup = node_nlookup - nlookup;
+		}
+	} while (!__sync_bool_compare_and_swap(&node->nlookup, node_nlookup, new_nlookup));
+
+	pthread_rwlock_unlock(&appfs_inode_table_lock);
+
+	if (new_nlookup != 0) {
+		return;
+	}
+
+	/*
+	 * The inode may have been looked up again before the table could be
+	 * locked for writing, in which case it must be kept
+	 */
+	pthread_rwlock_wrlock(&appfs_inode_table_lock);
+
+	node = appfs_inode_find(ino);
+	if (node == NULL || node->nlookup != 0) {
+		pthread_rwlock_unlock(&appfs_inode_table_lock);
+
+		return;
+	}
+
+	for (node_p = &appfs_inode_table_by_ino[ino % APPFS_INODE_TABLE_SIZE]; *node_p != NULL; node_p = &(*node_p)->_next_by_ino) {
+		if (*node_p == node) {
+			*node_p = node->_next_by_ino;
+
+			break;
+		}
+	}
+
+	for (node_p = &appfs_inode_table_by_name[appfs_inode_name_hash(node->parent, node->name)]; *node_p != NULL; node_p = &(*node_p)->_next_by_name) {
+		if (*node_p == node) {
+			*node_p = node->_next_by_name;
+
+			break;
+		}
+	}
+
+	pthread_rwlock_unlock(&appfs_inode_table_lock);
+
+	APPFS_DEBUG("Forgot inode %llu (%s)", (unsigned long long) ino, node->path);
+
+	appfs_package_context_release(node->context.package);
+
+	free(node->path);
+	free(node);
+
+	return;
+}
+
+/*
+ * Kernel cache invalidation:
+ *         Invalidations cannot be sent to the kernel from within a request
+ *         handler, since the kernel may be holding locks that it needs in
+ *         order to process them.  Instead they are queued here and sent by
+ *         a dedicated thread.
+ */
+static void appfs_kernel_inval_queue(fuse_ino_t parent, fuse_ino_t ino, const char *name) {
+	struct appfs_kernel_inval *inval;
+
+	if (!__sync_fetch_and_add(&appfs_kernel_inval_started, 0)) {
+		return;
+	}
+
+	inval = malloc(sizeof(*inval));
+	if (inval == NULL) {
+		return;
+	}
+
+	inval->parent = parent;
+	inval->ino = ino;
+	inval->name = NULL;
+	inval->_next = NULL;
+
+	if (name != NULL) {
+		inval->name = strdup(name);
+		if (inval->name == NULL) {
+			free(inval);
+
+			return;
+		}
+	}
+
+	pthread_mutex_lock(&appfs_kernel_inval_mutex);
+
+	if (appfs_kernel_inval_tail == NULL) {
+		appfs_kernel_inval_head = inval;
+	} else {
+		appfs_kernel_inval_tail->_next = inval;
+	}
+	appfs_kernel_inval_tail = inval;
+
+	pthread_cond_signal(&appfs_kernel_inval_cond);
+
+	pthread_mutex_unlock(&appfs_kernel_inval_mutex);
+
+	return;
+}
+
+/*
+ * Invalidate every entry the kernel may have cached at or below a given
+ * path ("/" for everything).  The package contexts kept for those paths
+ * are also dropped, since the packages they refer to may have changed.
+ */
+static void appfs_kernel_inval_path(const char *path) {
+	struct appfs_inode *node;
+	size_t path_len;
+	unsigned int idx;
+	int count;
+
+	APPFS_DEBUG("Invalidating kernel cache for %s", path);
+
+	path_len = strlen(path);
+	if (path_len == 1) {
+		path_len = 0;
+	}
+
+	count = 0;
+
+	pthread_rwlock_wrlock(&appfs_inode_table_lock);
+
+	for (idx = 0; idx < APPFS_INODE_TABLE_SIZE; idx++) {
+		for (node = appfs_inode_table_by_ino[idx]; node != NULL; node = node->_next_by_ino) {
+			if (strncmp(node->path, path, path_len) != 0) {
+				continue;
+			}
+
+			if (node->path[path_len] != '/' && node->path[path_len] != '\0') {
+				continue;
+			}
+
+			appfs_package_context_release(node->context.package);
+			node->context.package = NULL;
+
+			appfs_kernel_inval_queue(node->parent, node->ino, node->name);
+			appfs_kernel_inval_queue(0, node->ino, NULL);
+
+			count++;
+		}
+	}
+
+	pthread_rwlock_unlock(&appfs_inode_table_lock);
+
+	APPFS_DEBUG("Queued invalidation of %i kernel entries under %s", count, path);
+
+	return;
+}
+
+static void *appfs_kernel_inval_thread(void *data) {
+	struct appfs_kernel_inval *inval;
+	struct timespec wait_until;
+	int thread_interp_reset_key, global_interp_reset_key;
+	int notify_ret;
+
+	thread_interp_reset_key = __sync_fetch_and_add(&interp_reset_key, 0);
+
+	while (1) {
+		/*
+		 * Hot restarts are requested from a signal handler, so rather
+		 * than being told about them notice them here and drop
+		 * everything the kernel has cached
+		 */
+		global_interp_reset_key = __sync_fetch_and_add(&interp_reset_key, 0);
+		if (global_interp_reset_key != thread_interp_reset_key) {
+			thread_interp_reset_key = global_interp_reset_key;
+
+			appfs_kernel_inval_path("/");
+		}
+
+		pthread_mutex_lock(&appfs_kernel_inval_mutex);
+
+		if (appfs_kernel_inval_head == NULL) {
+			clock_gettime(CLOCK_REALTIME, &wait_until);
+			wait_until.tv_sec++;
+
+			pthread_cond_timedwait(&appfs_kernel_inval_cond, &appfs_kernel_inval_mutex, &wait_until);
+		}
+
+		inval = appfs_kernel_inval_head;
+		if (inval == NULL) {
+			pthread_mutex_unlock(&appfs_kernel_inval_mutex);
+
+			continue;
+		}
+
+		appfs_kernel_inval_head = inval->_next;
+		if (appfs_kernel_inval_head == NULL) {
+			appfs_kernel_inval_tail = NULL;
+		}
+
+		pthread_mutex_unlock(&appfs_kernel_inval_mutex);
+
+		if (inval->name != NULL) {
+			notify_ret = fuse_lowlevel_notify_inval_entry(appfs_fuse_chan, inval->parent, inval->name, strlen(inval->name));
+		} else {
+			notify_ret = fuse_lowlevel_notify_inval_inode(appfs_fuse_chan, inval->ino, 0, 0);
+		}
+
+		if (notify_ret != 0 && notify_ret != -ENOENT) {
+			APPFS_DEBUG("Kernel invalidation of inode %llu failed: %i", (unsigned long long) inval->ino, notify_ret);
+		}
+
+		free(inval->name);
+		free(inval);
+	}
+
+	return(NULL);
+}
+
+static void appfs_kernel_inval_start(void) {
+	pthread_t thread;
+	int pthread_ret;
+
+	pthread_ret = pthread_create(&thread, NULL, appfs_kernel_inval_thread, NULL);
+	if (pthread_ret != 0) {
+		APPFS_ERROR("Unable to start kernel cache invalidation thread, disabling kernel caching of packaged paths");
+
+		appfs_packaged_timeout = 0.0;
+
+		return;
+	}
+
+	pthread_detach(thread);
+
+	__sync_lock_test_and_set(&appfs_kernel_inval_started, 1);
+
+	return;
+}
+
+/*
+ * Cache Get Path Info lookups for speed
+ */
+static int appfs_get_path_info_cache_init(void) {
+	unsigned int idx;
+	int pthread_ret;
+
+	appfs_path_info_cache_shards = calloc(APPFS_PATH_INFO_CACHE_SHARDS, sizeof(*appfs_path_info_cache_shards));
+	if (appfs_path_info_cache_shards == NULL) {
+		return(-1);
+	}
+
+	for (idx = 0; idx < APPFS_PATH_INFO_CACHE_SHARDS; idx++) {
+		pthread_ret = pthread_mutex_init(&appfs_path_info_cache_shards[idx].mutex, NULL);
+		if (pthread_ret != 0) {
+			return(-1);
+		}
+	}
+
+	return(0);
+}
+
+/*
+ * Find the shard responsible for a given hash, and lock it
+ */
+static struct appfs_path_info_cache_shard *appfs_get_path_info_cache_lock(unsigned int hash) {
+	struct appfs_path_info_cache_shard *shard;
+	int pthread_ret;
+
+	shard = &appfs_path_info_cache_shards[hash % APPFS_PATH_INFO_CACHE_SHARDS];
+
+	pthread_ret = pthread_mutex_lock(&shard->mutex);
+	if (pthread_ret != 0) {
+		APPFS_DEBUG("Unable to lock path_info cache mutex !");
+
+		return(NULL);
+	}
+
+	return(shard);
+}
+
+static void appfs_get_path_info_cache_unlock(struct appfs_path_info_cache_shard *shard) {
+	int pthread_ret;
+
+	pthread_ret = pthread_mutex_unlock(&shard->mutex);
+	if (pthread_ret != 0) {
+		APPFS_DEBUG("Unable to unlock path_info cache mutex !");
+	}
+
+	return;
+}
+
+static struct appfs_path_info_cache_entry **appfs_get_path_info_cache_find(struct appfs_path_info_cache_shard *shard, const char *path, uid_t uid, unsigned int hash) {
+	struct appfs_path_info_cache_entry **entry_p;
+
+	/* Must be called with the shard mutex held */
+
+	if (shard->buckets == NULL) {
+		return(NULL);
+	}
+
+	for (entry_p = &shard->buckets[(hash / APPFS_PATH_INFO_CACHE_SHARDS) & (shard->buckets_count - 1)]; *entry_p != NULL; entry_p = &(*entry_p)->_next_in_bucket) {
+		if ((*entry_p)->hash != hash || (*entry_p)->pathinfo._cache_uid != uid) {
+			continue;
+		}
+
+		if (strcmp((*entry_p)->pathinfo._cache_path, path) != 0) {
+			continue;
+		}
+
+		return(entry_p);
+	}
+
+	return(NULL);
+}
+
+static void appfs_get_path_info_cache_lru_unlink(struct appfs_path_info_cache_shard *shard, struct appfs_path_info_cache_entry *entry) {
+	/* Must be called with the shard mutex held */
+
+	if (entry->_lru_prev == NULL) {
+		shard->lru_head = entry->_lru_next;
+	} else {
+		entry->_lru_prev->_lru_next = entry->_lru_next;
+	}
+
+	if (entry->_lru_next == NULL) {
+		shard->lru_tail = entry->_lru_prev;
+	} else {
+		entry->_lru_next->_lru_prev = entry->_lru_prev;
+	}
+
+	entry->_lru_prev = NULL;
+	entry->_lru_next = NULL;
+
+	return;
+}
+
+static void appfs_get_path_info_cache_lru_push(struct appfs_path_info_cache_shard *shard, struct appfs_path_info_cache_entry *entry) {
+	/* Must be called with the shard mutex held */
+
+	entry->_lru_prev = NULL;
+	entry->_lru_next = shard->lru_head;
+
+	if (shard->lru_head != NULL) {
+		shard->lru_head->_lru_prev = entry;
+	}
+
+	shard->lru_head = entry;
+
+	if (shard->lru_tail == NULL) {
+		shard->lru_tail = entry;
+	}
+
+	return;
+}
+
+/*
+ * Remove an entry from the cache and free it
+ */
+static void appfs_get_path_info_cache_remove(struct appfs_path_info_cache_shard *shard, struct appfs_path_info_cache_entry *entry) {
+	struct appfs_path_info_cache_entry **entry_p;
+
+	/* Must be called with the shard mutex held */
+
+	for (entry_p = &shard->buckets[(entry->hash / APPFS_PATH_INFO_CACHE_SHARDS) & (shard->buckets_count - 1)]; *entry_p != NULL; entry_p = &(*entry_p)->_next_in_bucket) {
+		if (*entry_p == entry) {
+			*entry_p = entry->_next_in_bucket;
+
+			break;
+		}
+	}
+
+	appfs_get_path_info_cache_lru_unlink(shard, entry);
+
+	shard->mem_used -= entry->mem;
+	shard->entries--;
+
+	free(entry->pathinfo._cache_path);
+	free(entry->overlay);
+	free(entry);
+
+	return;
+}
+
+/*
+ * Look up an entry in the cache, optionally returning the name of the
+ * overlay it depends on
+ */
+static int appfs_get_path_info_cache_get_entry(const char *path, uid_t uid, struct appfs_pathinfo *pathinfo, char *overlay, size_t overlay_size) {
+	struct appfs_path_info_cache_shard *shard;
+	struct appfs_path_info_cache_entry **entry_p, *entry;
+	unsigned int hash;
+	int retval;
+
+	retval = 1;
+
+	APPFS_DEBUG("Looking up cache entry for path=%s,uid=%lli...", path, (long long) uid);
+
+	hash = appfs_get_path_inode(path, uid);
+
+	shard = appfs_get_path_info_cache_lock(hash);
+	if (shard == NULL) {
+		return(-1);
+	}
+
+	entry_p = appfs_get_path_info_cache_find(shard, path, uid, hash);
+	if (entry_p != NULL) {
+		entry = *entry_p;
+
+		retval = 0;
+
+		if (pathinfo != NULL) {
+			memcpy(pathinfo, &entry->pathinfo, sizeof(*pathinfo));
+			pathinfo->_cache_path = NULL;
+		}
+
+		if (overlay != NULL) {
+			overlay[0] = '\0';
+
+			if (entry->overlay != NULL && strlen(entry->overlay) < overlay_size) {
+				strcpy(overlay, entry->overlay);
+			}
+		}
+
+		/* Mark as most recently used */
+		if (shard->lru_head != entry) {
+			appfs_get_path_info_cache_lru_unlink(shard, entry);
+			appfs_get_path_info_cache_lru_push(shard, entry);
+		}
+	}
+
+	appfs_get_path_info_cache_unlock(shard);
+
+	return(retval);
+}
+
+/*
+ * Add an entry to the cache, replacing any existing entry for the same
+ * path and uid
+ */
+static void appfs_get_path_info_cache_add_entry(const char *path, uid_t uid, const char *overlay, struct appfs_pathinfo *pathinfo) {
+	struct appfs_path_info_cache_shard *shard;
+	struct appfs_path_info_cache_entry **entry_p, *entry;
+	unsigned int hash, bucket;
+
+	entry = malloc(sizeof(*entry));
+	if (entry == NULL) {
+		return;
+	}
+
+	memcpy(&entry->pathinfo, pathinfo, sizeof(*pathinfo));
+
+	entry->pathinfo._cache_path = strdup(path);
+	entry->pathinfo._cache_uid  = uid;
+
+	entry->overlay = NULL;
+	if (overlay != NULL) {
+		entry->overlay = strdup(overlay);
+	}
+
+	if (entry->pathinfo._cache_path == NULL || (overlay != NULL && entry->overlay == NULL)) {
+		free(entry->pathinfo._cache_path);
+		free(entry->overlay);
+		free(entry);
+
+		return;
+	}
+
+	hash = appfs_get_path_inode(path, uid);
+
+	entry->hash = hash;
+	entry->mem = sizeof(*entry) + strlen(path) + 1;
+	if (overlay != NULL) {
+		entry->mem += strlen(overlay) + 1;
+	}
+	entry->_next_in_bucket = NULL;
+
+	shard = appfs_get_path_info_cache_lock(hash);
+	if (shard == NULL) {
+		free(entry->pathinfo._cache_path);
+		free(entry->overlay);
+		free(entry);
+
+		return;
+	}
+
+	if (shard->buckets == NULL) {
+		/*
+		 * Size the hash table to have about one bucket per entry that
+		 * will fit in this shard's share of the memory budget
+		 */
+		shard->mem = appfs_path_info_cache_mem / APPFS_PATH_INFO_CACHE_SHARDS;
+
+		for (shard->buckets_count = 16; shard->buckets_count < (shard->mem / sizeof(*entry)); shard->buckets_count <<= 1) {
+			/* Nothing to do */
+		}
+
+		shard->buckets = calloc(shard->buckets_count, sizeof(*shard->buckets));
+		if (shard->buckets == NULL) {
+			appfs_get_path_info_cache_unlock(shard);
+
+			free(entry->pathinfo._cache_path);
+			free(entry->overlay);
+			free(entry);
+
+			return;
+		}
+	}
+
+	entry_p = appfs_get_path_info_cache_find(shard, path, uid, hash);
+	if (entry_p != NULL) {
+		appfs_get_path_info_cache_remove(shard, *entry_p);
+	}
+
+	bucket = (hash / APPFS_PATH_INFO_CACHE_SHARDS) & (shard->buckets_count - 1);
+
+	entry->_next_in_bucket = shard->buckets[bucket];
+	shard->buckets[bucket] = entry;
+
+	appfs_get_path_info_cache_lru_push(shard, entry);
+
+	shard->mem_used += entry->mem;
+	shard->entries++;
+
+	/*
+	 * Evict the least recently used entries until we fit within our
+	 * memory budget again
+	 */
+	while (shard->mem_used > shard->mem && shard->lru_tail != entry) {
+		APPFS_DEBUG("Evicting path=%s,uid=%lli from cache", shard->lru_tail->pathinfo._cache_path, (long long) shard->lru_tail->pathinfo._cache_uid);
+
+		appfs_get_path_info_cache_remove(shard, shard->lru_tail);
+
+		shard->evictions++;
+	}
+
+	appfs_get_path_info_cache_unlock(shard);
+
+	return;
+}
+
+/*
+ * Determine whether a user has an overlay ("package@hostname") in their
+ * home directory, which would take precedence over the packaged files
+ *         Returns 1 if it exists (or could not be checked), 0 otherwise
+ */
+static int appfs_user_overlay_exists(uid_t fsuid, const char *overlay) {
+	struct stat stbuf;
+	char overlay_path[PATH_MAX];
+	char *homedir;
+	int stat_ret, stat_errno;
+
+	homedir = appfs_get_homedir(fsuid);
+	if (homedir == NULL) {
+		return(0);
+	}
+
+	snprintf(overlay_path, sizeof(overlay_path), "%s/.appfs/%s", homedir, overlay);
+
+	free(homedir);
+
+	appfs_simulate_user_fs_enter();
+
+	stat_ret = lstat(overlay_path, &stbuf);
+	stat_errno = errno;
+
+	appfs_simulate_user_fs_leave();
+
+	if (stat_ret == 0 || stat_errno != ENOENT) {
+		APPFS_DEBUG("Found overlay %s", overlay_path);
+
+		return(1);
+	}
+
+	return(0);
+}
+
+/*
+ * Determine whether a user has an overlay, remembering the answer
+ */
+static int appfs_get_path_info_cache_overlay_exists(const char *overlay, uid_t uid) {
+	struct appfs_pathinfo marker;
+	char marker_key[PATH_MAX + 1];
+	int cache_ret, retval, snprintf_ret;
+
+	/* Paths always start with "/", so this cannot collide with one */
+	snprintf_ret = snprintf(marker_key, sizeof(marker_key), "@%s", overlay);
+	if (snprintf_ret < 0 || ((size_t) snprintf_ret) >= sizeof(marker_key)) {
+		return(1);
+	}
+
+	cache_ret = appfs_get_path_info_cache_get_entry(marker_key, uid, &marker, NULL, 0);
+	if (cache_ret == 0) {
+		return(marker.type != APPFS_PATHTYPE_DOES_NOT_EXIST);
+	}
+
+	retval = appfs_user_overlay_exists(uid, overlay);
+
+	memset(&marker, 0, sizeof(marker));
+	if (retval) {
+		marker.type = APPFS_PATHTYPE_DIRECTORY;
+	} else {
+		marker.type = APPFS_PATHTYPE_DOES_NOT_EXIST;
+	}
+
+	appfs_get_path_info_cache_add_entry(marker_key, uid, NULL, &marker);
+
+	return(retval);
+}
+
+static int appfs_get_path_info_cache_get(const char *path, uid_t uid, struct appfs_pathinfo *pathinfo) {
+	struct appfs_path_info_cache_shard *shard;
+	char overlay[PATH_MAX];
+	int retval;
+
+	retval = appfs_get_path_info_cache_get_entry(path, uid, pathinfo, NULL, 0);
+	if (retval != 0) {
+		/*
+		 * Fall back to the entry shared by all users, which is only
+		 * valid for this user if they have not modified the package
+		 */
+		retval = appfs_get_path_info_cache_get_entry(path, APPFS_PATH_INFO_CACHE_UID_SHARED, pathinfo, overlay, sizeof(overlay));
+		if (retval == 0) {
+			if (appfs_get_path_info_cache_overlay_exists(overlay, uid)) {
+				retval = 1;
+			}
+		}
+	}
+
+	shard = &appfs_path_info_cache_shards[appfs_get_path_inode(path, uid) % APPFS_PATH_INFO_CACHE_SHARDS];
+
+	if (retval == 0) {
+		__sync_fetch_and_add(&shard->hits, 1);
+
+		APPFS_DEBUG("Cache hit on path=%s,uid=%lli", path, (long long) uid);
+	} else {
+		__sync_fetch_and_add(&shard->misses, 1);
+
+		APPFS_DEBUG("Cache miss on path=%s,uid=%lli", path, (long long) uid);
+	}
+
+	return(retval);
+}
+
+static void appfs_get_path_info_cache_add(const char *path, uid_t uid, struct appfs_pathinfo *pathinfo) {
+	appfs_get_path_info_cache_add_entry(path, uid, NULL, pathinfo);
+
+	return;
+}
+
+/*
+ * Cache information about a packaged path for every user who does not
+ * have the named overlay
+ */
+static void appfs_get_path_info_cache_add_shared(const char *path, const char *overlay, struct appfs_pathinfo *pathinfo) {
+	appfs_get_path_info_cache_add_entry(path, APPFS_PATH_INFO_CACHE_UID_SHARED, overlay, pathinfo);
+
+	return;
+}
+
+static void appfs_get_path_info_cache_rm(const char *path, uid_t uid) {
+	struct appfs_path_info_cache_shard *shard;
+	struct appfs_path_info_cache_entry **entry_p;
+	unsigned int hash;
+
+	hash = appfs_get_path_inode(path, uid);
+
+	shard = appfs_get_path_info_cache_lock(hash);
+	if (shard == NULL) {
+		return;
+	}
+
+	entry_p = appfs_get_path_info_cache_find(shard, path, uid, hash);
+	if (entry_p != NULL) {
+		appfs_get_path_info_cache_remove(shard, *entry_p);
+	}
+
+	appfs_get_path_info_cache_unlock(shard);
+
+	return;
+}
+
+/*
+ * Forget about a path which the user may have just copied into their
+ * overlay, along with whether they had the overlay a shared entry for
+ * this path depends on
+ */
+static void appfs_get_path_info_cache_rm_overlay(const char *path, uid_t uid) {
+	char overlay[PATH_MAX], marker_key[PATH_MAX + 1];
+	int cache_ret, snprintf_ret;
+
+	cache_ret = appfs_get_path_info_cache_get_entry(path, APPFS_PATH_INFO_CACHE_UID_SHARED, NULL, overlay, sizeof(overlay));
+	if (cache_ret == 0 && overlay[0] != '\0' && uid != APPFS_PATH_INFO_CACHE_UID_SHARED) {
+		snprintf_ret = snprintf(marker_key, sizeof(marker_key), "@%s", overlay);
+		if (snprintf_ret >= 0 && ((size_t) snprintf_ret) < sizeof(marker_key)) {
+			appfs_get_path_info_cache_rm(marker_key, uid);
+		}
+	}
+
+	appfs_get_path_info_cache_rm(path, uid);
+
+	return;
+}
+
+static void appfs_get_path_info_cache_flush(uid_t uid, long long new_mem) {
+	struct appfs_path_info_cache_shard *shard;
+	struct appfs_path_info_cache_entry *entry, *next;
+	unsigned int idx;
+
+	APPFS_DEBUG("Flushing AppFS cache (uid = %lli, new_mem = %lli)", (long long) uid, new_mem);
+
+	if (uid == ((uid_t) -1) && new_mem != -1) {
+		appfs_path_info_cache_mem = new_mem;
+	}
+
+	for (idx = 0; idx < APPFS_PATH_INFO_CACHE_SHARDS; idx++) {
+		shard = appfs_get_path_info_cache_lock(idx);
+		if (shard == NULL) {
+			continue;
+		}
+
+		for (entry = shard->lru_head; entry != NULL; entry = next) {
+			next = entry->_lru_next;
+
+			if (uid != ((uid_t) -1)) {
+				if (entry->pathinfo._cache_uid != uid) {
+					continue;
+				}
+			}
+
+			appfs_get_path_info_cache_remove(shard, entry);
+		}
+
+		if (uid == ((uid_t) -1)) {
+			free(shard->buckets);
+
+			shard->buckets = NULL;
+		}
+
+		appfs_get_path_info_cache_unlock(shard);
+	}
+
+	return;
+}
+
+/*
+ * Total up the statistics from every shard of the cache
+ */
+static void appfs_get_path_info_cache_stats(struct appfs_path_info_cache_shard *stats) {
+	struct appfs_path_info_cache_shard *shard;
+	unsigned int idx;
+
+	memset(stats, 0, sizeof(*stats));
+
+	stats->mem = appfs_path_info_cache_mem;
+
+	for (idx = 0; idx < APPFS_PATH_INFO_CACHE_SHARDS; idx++) {
+		shard = appfs_get_path_info_cache_lock(idx);
+		if (shard == NULL) {
+			continue;
+		}
+
+		stats->mem_used += shard->mem_used;
+		stats->entries += shard->entries;
+		stats->hits += shard->hits;
+		stats->misses += shard->misses;
+		stats->evictions += shard->evictions;
+
+		appfs_get_path_info_cache_unlock(shard);
+	}
+
+	return;
+}
+
+/*
+ * Directory listing buffer, built when a directory is opened and handed
+ * out in pieces as the kernel reads it
+ */
+struct appfs_dirbuf {
+	char *buf;
+	size_t size;
+	size_t allocated;
+};
+
+static void appfs_dirbuf_add(fuse_req_t req, struct appfs_dirbuf *dirbuf, const char *name, fuse_ino_t ino) {
+	struct stat stbuf;
+	size_t entry_size;
+	char *newbuf;
+
+	entry_size = fuse_add_direntry(req, NULL, 0, name, NULL, 0);
+
+	if ((dirbuf->size + entry_size) > dirbuf->allocated) {
+		dirbuf->allocated = (dirbuf->allocated * 2) + entry_size;
+
+		newbuf = realloc(dirbuf->buf, dirbuf->allocated);
+		if (newbuf == NULL) {
+			APPFS_DEBUG("error: Unable to grow directory buffer");
+
+			return;
+		}
+
+		dirbuf->buf = newbuf;
+	}
+
+	memset(&stbuf, 0, sizeof(stbuf));
+	stbuf.st_ino = ino;
+
+	fuse_add_direntry(req, dirbuf->buf + dirbuf->size, entry_size, name, &stbuf, dirbuf->size + entry_size);
+
+	dirbuf->size += entry_size;
+
+	return;
+}
+
+/*
+ * Freshness table:
+ *         Remembers which sites have an index which is still fresh and
+ *         which packages have had their manifest ingested, so that these
+ *         questions can be answered without going to the cache database.
+ *         Only positive answers are recorded, anything missing (or
+ *         expired) is checked against the database the slow way.  The
+ *         table is emptied on a hot restart, since the cache may have been
+ *         cleaned underneath us.
+ */
+#define APPFS_FRESHNESS_TABLE_SIZE 1024
+struct appfs_freshness_entry {
+	char *key;
+	time_t expires;
+
+	struct appfs_freshness_entry *_next;
+};
+
+static struct appfs_freshness_entry *appfs_freshness_table[APPFS_FRESHNESS_TABLE_SIZE];
+static pthread_mutex_t appfs_freshness_table_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int appfs_freshness_table_reset_key = 0;
+
+static unsigned int appfs_freshness_hash(const char *key) {
+	unsigned int retval;
+	const unsigned char *p;
+
+	retval = 2166136261U;
+
+	for (p = (unsigned char *) key; *p; p++) {
+		retval ^= (int) *p;
+		retval += (retval << 1) + (retval << 4) + (retval << 7) + (retval << 8) + (retval << 24);
+	}
+
+	return(retval % APPFS_FRESHNESS_TABLE_SIZE);
+}
+
+/*
+ * Must be called with the freshness table mutex held
+ */
+static void appfs_freshness_table_check_reset(void) {
+	struct appfs_freshness_entry *entry, *next;
+	int global_interp_reset_key;
+	unsigned int idx;
+
+	global_interp_reset_key = __sync_fetch_and_add(&interp_reset_key, 0);
+	if (global_interp_reset_key == appfs_freshness_table_reset_key) {
+		return;
+	}
+
+	APPFS_DEBUG("Hot restart detected, flushing freshness table");
+
+	for (idx = 0; idx < APPFS_FRESHNESS_TABLE_SIZE; idx++) {
+		for (entry = appfs_freshness_table[idx]; entry != NULL; entry = next) {
+			next = entry->_next;
+
+			free(entry->key);
+			free(entry);
+		}
+
+		appfs_freshness_table[idx] = NULL;
+	}
+
+	appfs_freshness_table_reset_key = global_interp_reset_key;
+
+	return;
+}
+
+/*
+ * Must be called with the freshness table mutex held
+ */
+static struct appfs_freshness_entry **appfs_freshness_find(const char *key) {
+	struct appfs_freshness_entry **entry_p;
+
+	for (entry_p = &appfs_freshness_table[appfs_freshness_hash(key)]; *entry_p != NULL; entry_p = &(*entry_p)->_next) {
+		if (strcmp((*entry_p)->key, key) == 0) {
+			return(entry_p);
+		}
+	}
+
+	return(entry_p);
+}
+
+/*
+ * Determine if a key is in the table and has not expired, an expiration
+ * time of 0 never expires
+ */
+static int appfs_freshness_get(const char *key) {
+	struct appfs_freshness_entry **entry_p, *entry;
+	int retval = 0;
+
+	pthread_mutex_lock(&appfs_freshness_table_mutex);
+
+	appfs_freshness_table_check_reset();
+
+	entry_p = appfs_freshness_find(key);
+	entry = *entry_p;
+	if (entry != NULL) {
+		if (entry->expires == 0 || time(NULL) < entry->expires) {
+			retval = 1;
+		} else {
+			*entry_p = entry->_next;
+
+			free(entry->key);
+			free(entry);
+		}
+	}
+
+	pthread_mutex_unlock(&appfs_freshness_table_mutex);
+
+	return(retval);
+}
+
+static void appfs_freshness_set(const char *key, time_t expires) {
+	struct appfs_freshness_entry **entry_p, *entry;
+
+	pthread_mutex_lock(&appfs_freshness_table_mutex);
+
+	appfs_freshness_table_check_reset();
+
+	entry_p = appfs_freshness_find(key);
+	entry = *entry_p;
+	if (entry == NULL) {
+		entry = malloc(sizeof(*entry));
+		if (entry != NULL) {
+			entry->key = strdup(key);
+			if (entry->key == NULL) {
+				free(entry);
+
+				entry = NULL;
+			} else {
+				entry->_next = NULL;
+
+				*entry_p = entry;
+			}
+		}
+	}
+
+	if (entry != NULL) {
+		entry->expires = expires;
+	}
+
+	pthread_mutex_unlock(&appfs_freshness_table_mutex);
+
+	return;
+}
+
+static void appfs_freshness_rm(const char *key) {
+	struct appfs_freshness_entry **entry_p, *entry;
+
+	pthread_mutex_lock(&appfs_freshness_table_mutex);
+
+	appfs_freshness_table_check_reset();
+
+	entry_p = appfs_freshness_find(key);
+	entry = *entry_p;
+	if (entry != NULL) {
+		*entry_p = entry->_next;
+
+		free(entry->key);
+		free(entry);
+	}
+
+	pthread_mutex_unlock(&appfs_freshness_table_mutex);
+
+	return;
+}
+
+static int appfs_site_is_fresh(const char *hostname) {
+	char key[PATH_MAX];
+
+	snprintf(key, sizeof(key), "site:%s", hostname);
+
+	return(appfs_freshness_get(key));
+}
+
+static void appfs_site_set_fresh(const char *hostname, time_t expires) {
+	char key[PATH_MAX];
+
+	snprintf(key, sizeof(key), "site:%s", hostname);
+
+	if (expires == 0) {
+		appfs_freshness_rm(key);
+
+		return;
+	}
+
+	appfs_freshness_set(key, expires);
+
+	return;
+}
+
+static int appfs_manifest_is_present(const char *package_sha1) {
+	char key[PATH_MAX];
+
+	snprintf(key, sizeof(key), "manifest:%s", package_sha1);
+
+	return(appfs_freshness_get(key));
+}
+
+static void appfs_manifest_set_present(const char *package_sha1, int present) {
+	char key[PATH_MAX];
+
+	snprintf(key, sizeof(key), "manifest:%s", package_sha1);
+
+	if (!present) {
+		appfs_freshness_rm(key);
+
+		return;
+	}
+
+	appfs_freshness_set(key, 0);
+
+	return;
+}
+
+/*
+ * Package filters:
+ *         A Bloom filter of the paths within each package whose manifest
+ *         is in the cache database, so that the native resolver can tell
+ *         that a path does not exist without querying the database.
+ *         Dynamic linkers and interpreters probe many paths which do not
+ *         exist for each library or module they find.  Filters are built
+ *         as a manifest is ingested, or from the database the first time
+ *         a package is looked in, and are emptied on a hot restart like
+ *         the freshness table.
+ */
+#define APPFS_PACKAGE_FILTER_BITS_PER_ENTRY 10
+#define APPFS_PACKAGE_FILTER_HASHES 7
+
+struct appfs_package_filter {
+	char *package_sha1;
+	uint64_t *bits;
+	uint64_t mask;
+
+	struct appfs_package_filter *_next;
+};
+
+static struct appfs_package_filter *appfs_package_filters[APPFS_FRESHNESS_TABLE_SIZE];
+static pthread_mutex_t appfs_package_filters_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int appfs_package_filters_reset_key = 0;
+
+static uint64_t appfs_package_filter_hash(const char *directory, const char *name) {
+	const unsigned char *p;
+	uint64_t retval;
+
+	retval = 14695981039346656037ULL;
+
+	for (p = (const unsigned char *) directory; *p; p++) {
+		retval ^= *p;
+		retval *= 1099511628211ULL;
+	}
+
+	if (directory[0] != '\0') {
+		retval ^= '/';
+		retval *= 1099511628211ULL;
+	}
+
+	for (p = (const unsigned char *) name; *p; p++) {
+		retval ^= *p;
+		retval *= 1099511628211ULL;
+	}
+
+	/* Mix the bits, since each bit index is derived from both halves */
+	retval ^= retval >> 33;
+	retval *= 0xff51afd7ed558ccdULL;
+	retval ^= retval >> 33;
+	retval *= 0xc4ceb9fe1a85ec53ULL;
+	retval ^= retval >> 33;
+
+	return(retval);
+}
+
+/*
+ * Must be called with the package filters mutex held
+ */
+static void appfs_package_filters_check_reset(void) {
+	struct appfs_package_filter *filter, *next;
+	int global_interp_reset_key;
+	unsigned int idx;
+
+	global_interp_reset_key = __sync_fetch_and_add(&interp_reset_key, 0);
+	if (global_interp_reset_key == appfs_package_filters_reset_key) {
+		return;
+	}
+
+	APPFS_DEBUG("Hot restart detected, flushing package filters");
+
+	for (idx = 0; idx < APPFS_FRESHNESS_TABLE_SIZE; idx++) {
+		for (filter = appfs_package_filters[idx]; filter != NULL; filter = next) {
+			next = filter->_next;
+
+			free(filter->package_sha1);
+			free(filter->bits);
+			free(filter);
+		}
+
+		appfs_package_filters[idx] = NULL;
+	}
+
+	appfs_package_filters_reset_key = global_interp_reset_key;
+
+	return;
+}
+
+/*
+ * Build the filter for a package from the hashes of all of its paths,
+ * replacing any it already has
+ */
+static void appfs_package_filter_add(const char *package_sha1, const uint64_t *hashes, long hashes_count) {
+	struct appfs_package_filter *filter, **filter_p;
+	uint64_t bits_count, hash, step;
+	long idx;
+	int hash_idx;
+
+	filter = calloc(1, sizeof(*filter));
+	if (filter == NULL) {
+		return;
+	}
+
+	for (bits_count = 64; bits_count < (uint64_t) hashes_count * APPFS_PACKAGE_FILTER_BITS_PER_ENTRY; bits_count <<= 1) {
+		/* Nothing */
+	}
+
+	filter->package_sha1 = strdup(package_sha1);
+	filter->bits = calloc(bits_count / 64, sizeof(*filter->bits));
+	filter->mask = bits_count - 1;
+
+	if (filter->package_sha1 == NULL || filter->bits == NULL) {
+		free(filter->package_sha1);
+		free(filter->bits);
+		free(filter);
+
+		return;
+	}
+
+	for (idx = 0; idx < hashes_count; idx++) {
+		hash = hashes[idx] & 0xffffffffULL;
+		step = (hashes[idx] >> 32) | 1;
+
+		for (hash_idx = 0; hash_idx < APPFS_PACKAGE_FILTER_HASHES; hash_idx++) {
+			filter->bits[(hash & filter->mask) / 64] |= 1ULL << (hash % 64);
+
+			hash += step;
+		}
+	}
+
+	pthread_mutex_lock(&appfs_package_filters_mutex);
+
+	appfs_package_filters_check_reset();
+
+	for (filter_p = &appfs_package_filters[appfs_freshness_hash(package_sha1)]; *filter_p != NULL; filter_p = &(*filter_p)->_next) {
+		if (strcmp((*filter_p)->package_sha1, package_sha1) == 0) {
+			break;
+		}
+	}
+
+	if (*filter_p != NULL) {
+		filter->_next = (*filter_p)->_next;
+
+		free((*filter_p)->package_sha1);
+		free((*filter_p)->bits);
+		free(*filter_p);
+	}
+
+	*filter_p = filter;
+
+	pthread_mutex_unlock(&appfs_package_filters_mutex);
+
+	APPFS_DEBUG("Built the filter for %s from %li paths (%llu bits)", package_sha1, hashes_count, (unsigned long long) bits_count);
+
+	return;
+}
+
+/*
+ * Check whether a path may be in a package
+ *         Returns 0 if it is not, 1 if it may be, and -1 if the package has
+ *         no filter
+ */
+static int appfs_package_filter_check(const char *package_sha1, const char *directory, const char *name) {
+	struct appfs_package_filter *filter;
+	uint64_t hash, step, hash_value;
+	int hash_idx, retval;
+
+	hash_value = appfs_package_filter_hash(directory, name);
+
+	pthread_mutex_lock(&appfs_package_filters_mutex);
+
+	appfs_package_filters_check_reset();
+
+	for (filter = appfs_package_filters[appfs_freshness_hash(package_sha1)]; filter != NULL; filter = filter->_next) {
+		if (strcmp(filter->package_sha1, package_sha1) == 0) {
+			break;
+		}
+	}
+
+	if (filter == NULL) {
+		pthread_mutex_unlock(&appfs_package_filters_mutex);
+
+		return(-1);
+	}
+
+	hash = hash_value & 0xffffffffULL;
+	step = (hash_value >> 32) | 1;
+
+	retval = 1;
+	for (hash_idx = 0; hash_idx < APPFS_PACKAGE_FILTER_HASHES; hash_idx++) {
+		if ((filter->bits[(hash & filter->mask) / 64] & (1ULL << (hash % 64))) == 0) {
+			retval = 0;
+
+			break;
+		}
+
+		hash += step;
+	}
+
+	pthread_mutex_unlock(&appfs_package_filters_mutex);
+
+	return(retval);
+}
+
+/*
+ * Collects path hashes for building a filter
+ */
+struct appfs_package_filter_hashes {
+	uint64_t *hashes;
+	long count;
+	long size;
+};
+
+static void appfs_package_filter_hashes_add(struct appfs_package_filter_hashes *hashes, const char *directory, const char *name) {
+	uint64_t *new_hashes;
+	long new_size;
+
+	/* Once out of memory, no filter is built at all */
+	if (hashes->size < 0) {
+		return;
+	}
+
+	if (hashes->count == hashes->size) {
+		new_size = hashes->size == 0 ? 1024 : hashes->size * 2;
+
+		new_hashes = realloc(hashes->hashes, new_size * sizeof(*new_hashes));
+		if (new_hashes == NULL) {
+			free(hashes->hashes);
+
+			hashes->hashes = NULL;
+			hashes->size = -1;
+
+			return;
+		}
+
+		hashes->hashes = new_hashes;
+		hashes->size = new_size;
+	}
+
+	hashes->hashes[hashes->count++] = appfs_package_filter_hash(directory, name);
+
+	return;
+}
+
+/*
+ * Native path resolver:
+ *         Answers lookups of packaged files directly from the cache database
+ *         using prepared statements, without involving a Tcl interpreter.
+ *         Anything it is not certain about (sites needing to be refreshed,
+ *         manifests not yet downloaded, user overlays, symlinks like
+ *         "latest" and "platform") is left for "::appfs::getattr".
+ */
+struct appfs_sqlite3 {
+	sqlite3 *db;
+	sqlite3_stmt *site_info;
+	sqlite3_stmt *package_sha1;
+	sqlite3_stmt *package_info;
+	sqlite3_stmt *file_info;
+	sqlite3_stmt *dir_childcount;
+	sqlite3_stmt *dir_children;
+	sqlite3_stmt *package_files;
+};
+
+static void appfs_sqlite3_free(void *_ctx) {
+	struct appfs_sqlite3 *ctx;
+
+	ctx = _ctx;
+	if (ctx == NULL) {
+		return;
+	}
+
+	APPFS_DEBUG("Closing SQLite3 handle for native path resolver");
+
+	sqlite3_finalize(ctx->site_info);
+	sqlite3_finalize(ctx->package_sha1);
+	sqlite3_finalize(ctx->package_info);
+	sqlite3_finalize(ctx->file_info);
+	sqlite3_finalize(ctx->dir_childcount);
+	sqlite3_finalize(ctx->dir_children);
+	sqlite3_finalize(ctx->package_files);
+	sqlite3_close(ctx->db);
+
+	free(ctx);
+
+	return;
+}
+
+/*
+ * Return the thread-specific SQLite3 handle, creating it if needed
+ */
+static struct appfs_sqlite3 *appfs_sqlite3_handle(void) {
+	struct appfs_sqlite3 *ctx;
+	char db_path[PATH_MAX];
+	int sqlite_ret, pthread_ret;
+
+	ctx = pthread_getspecific(sqliteKey);
+	if (ctx != NULL) {
+		return(ctx);
+	}
+
+	snprintf(db_path, sizeof(db_path), "%s/cache.db", appfs_cachedir);
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (ctx == NULL) {
+		return(NULL);
+	}
+
+	sqlite_ret = sqlite3_open_v2(db_path, &ctx->db, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, NULL);
+	if (sqlite_ret != SQLITE_OK) {
+		APPFS_DEBUG("Unable to open %s: %s", db_path, sqlite3_errstr(sqlite_ret));
+
+		appfs_sqlite3_free(ctx);
+
+		return(NULL);
+	}
+
+	sqlite3_busy_timeout(ctx->db, 30000);
+
+	sqlite_ret = SQLITE_OK;
+	if (sqlite_ret == SQLITE_OK) {
+		sqlite_ret = sqlite3_prepare_v2(ctx->db, "SELECT lastUpdate, ttl FROM sites WHERE hostname = ?1 LIMIT 1;", -1, &ctx->site_info, NULL);
+	}
+	if (sqlite_ret == SQLITE_OK) {
+		sqlite_ret = sqlite3_prepare_v2(ctx->db, "SELECT sha1 FROM packages WHERE hostname = ?1 AND package = ?2 AND os = ?3 AND cpuArch = ?4 AND version = ?5 LIMIT 1;", -1, &ctx->package_sha1, NULL);
+	}
+	if (sqlite_ret == SQLITE_OK) {
+		sqlite_ret = sqlite3_prepare_v2(ctx->db, "SELECT package, haveManifest FROM packages WHERE sha1 = ?1 LIMIT 1;", -1, &ctx->package_info, NULL);
+	}
+	if (sqlite_ret == SQLITE_OK) {
+		sqlite_ret = sqlite3_prepare_v2(ctx->db, "SELECT type, time, source, size, perms FROM files WHERE package_sha1 = ?1 AND file_directory = ?2 AND file_name = ?3 LIMIT 1;", -1, &ctx->file_info, NULL);
+	}
+	if (sqlite_ret == SQLITE_OK) {
+		sqlite_ret = sqlite3_prepare_v2(ctx->db, "SELECT childcount FROM directories WHERE package_sha1 = ?1 AND file_directory = ?2 LIMIT 1;", -1, &ctx->dir_childcount, NULL);
+	}
+	if (sqlite_ret == SQLITE_OK) {
+		sqlite_ret = sqlite3_prepare_v2(ctx->db,
+			"SELECT f.file_name, f.type, f.time, f.source, f.size, f.perms, "
+			"CASE WHEN f.type = 'directory' THEN COALESCE(("
+				"SELECT d.childcount FROM directories AS d WHERE d.package_sha1 = ?1 AND "
+				"d.file_directory = (CASE WHEN ?2 = '' THEN f.file_name ELSE ?2 || '/' || f.file_name END)"
+			"), 0) ELSE 0 END "
+			"FROM files AS f WHERE f.package_sha1 = ?1 AND f.file_directory = ?2 GROUP BY f.file_name;",
+			-1, &ctx->dir_children, NULL
+		);
+	}
+	if (sqlite_ret == SQLITE_OK) {
+		sqlite_ret = sqlite3_prepare_v2(ctx->db, "SELECT file_directory, file_name FROM files WHERE package_sha1 = ?1;", -1, &ctx->package_files, NULL);
+	}
+
+	if (sqlite_ret != SQLITE_OK) {
+		APPFS_DEBUG("Unable to prepare statements for native path resolver: %s", sqlite3_errmsg(ctx->db));
+
+		appfs_sqlite3_free(ctx);
+
+		return(NULL);
+	}
+
+	pthread_ret = pthread_setspecific(sqliteKey, ctx);
+	if (pthread_ret != 0) {
+		APPFS_DEBUG("pthread_setspecific() failed.  Closing SQLite3 handle.");
+
+		appfs_sqlite3_free(ctx);
+
+		return(NULL);
+	}
+
+	return(ctx);
+}
+
+/*
+ * Normalize an OS or CPU name in the same way "::appfs::_normalizeOS" and
+ * "::appfs::_normalizeCPU" do in tolerant mode.  The name is lower-cased
+ * in place.
+ */
+static const char *appfs_normalize_os(char *os) {
+	char *p;
+
+	for (p = os; *p; p++) {
+		if (*p >= 'A' && *p <= 'Z') {
+			*p = *p - 'A' + 'a';
+		}
+	}
+
+	if (strcmp(os, "sunos") == 0) {
+		return("solaris");
+	}
+
+	if (strcmp(os, "noarch") == 0 || strcmp(os, "none") == 0 || strcmp(os, "any") == 0 || strcmp(os, "all") == 0) {
+		return("noarch");
+	}
+
+	return(os);
+}
+
+static const char *appfs_normalize_cpu(char *cpu) {
+	char *p;
+
+	for (p = cpu; *p; p++) {
+		if (*p >= 'A' && *p <= 'Z') {
+			*p = *p - 'A' + 'a';
+		}
+	}
+
+	if (cpu[0] == 'i' && cpu[1] != '\0' && strcmp(cpu + 2, "86") == 0) {
+		return("ix86");
+	}
+
+	if (strcmp(cpu, "noarch") == 0 || strcmp(cpu, "none") == 0 || strcmp(cpu, "any") == 0 || strcmp(cpu, "all") == 0) {
+		return("noarch");
+	}
+
+	return(cpu);
+}
+
+static int appfs_is_hash(const char *value) {
+	const char *p;
+
+	for (p = value; *p; p++) {
+		if (!((*p >= '0' && *p <= '9') || (*p >= 'a' && *p <= 'f') || (*p >= 'A' && *p <= 'F'))) {
+			return(0);
+		}
+	}
+
+	if ((p - value) != 40) {
+		return(0);
+	}
+
+	return(1);
+}
+
+/*
+ * Fill in a path info structure from the "type", "time", "source", "size",
+ * and "perms" columns (in that order, starting at "col") of a row from the
+ * "files" table
+ *         Returns 0 on success and 1 if the type was not understood
+ */
+static int appfs_get_path_info_native_row(sqlite3_stmt *stmt, int col, struct appfs_pathinfo *pathinfo) {
+	const char *type, *perms, *source;
+	int source_len;
+
+	pathinfo->packaged = 1;
+	pathinfo->time = appfs_boottime;
+
+	type = (const char *) sqlite3_column_text(stmt, col + 0);
+	if (type == NULL) {
+		return(1);
+	}
+
+	if (sqlite3_column_type(stmt, col + 1) != SQLITE_NULL) {
+		pathinfo->time = sqlite3_column_int64(stmt, col + 1);
+	}
+
+	if (strcmp(type, "directory") == 0) {
+		pathinfo->type = APPFS_PATHTYPE_DIRECTORY;
+	} else if (strcmp(type, "file") == 0) {
+		pathinfo->type = APPFS_PATHTYPE_FILE;
+		pathinfo->typeinfo.file.size = sqlite3_column_int64(stmt, col + 3);
+		pathinfo->typeinfo.file.executable = 0;
+		pathinfo->typeinfo.file.suidRoot = 0;
+		pathinfo->typeinfo.file.worldaccessible = 0;
+
+		perms = (const char *) sqlite3_column_text(stmt, col + 4);
+		for (; perms != NULL && *perms != '\0'; perms++) {
+			switch (*perms) {
+				case 'x':
+				case 'X':
+					pathinfo->typeinfo.file.executable = 1;
+
+					break;
+				case '-':
+					pathinfo->typeinfo.file.worldaccessible = 1;
+
+					break;
+			}
+		}
+	} else if (strcmp(type, "symlink") == 0) {
+		pathinfo->type = APPFS_PATHTYPE_SYMLINK;
+		pathinfo->typeinfo.symlink.size = 0;
+		pathinfo->typeinfo.symlink.source[0] = '\0';
+
+		source = (const char *) sqlite3_column_text(stmt, col + 2);
+		source_len = sqlite3_column_bytes(stmt, col + 2);
+		if (source != NULL && (source_len + 1) <= sizeof(pathinfo->typeinfo.symlink.source)) {
+			pathinfo->typeinfo.symlink.size = source_len;
+
+			memcpy(pathinfo->typeinfo.symlink.source, source, source_len + 1);
+		}
+	} else {
+		return(1);
+	}
+
+	return(0);
+}
+
+/*
+ * Build the filter for a package whose manifest was ingested before we
+ * started, from the cache database
+ */
+static void appfs_package_filter_load(struct appfs_sqlite3 *ctx, const char *package_sha1) {
+	struct appfs_package_filter_hashes hashes;
+	const char *directory, *name;
+	int sqlite_ret;
+
+	memset(&hashes, 0, sizeof(hashes));
+
+	sqlite3_bind_text(ctx->package_files, 1, package_sha1, -1, SQLITE_STATIC);
+
+	while ((sqlite_ret = sqlite3_step(ctx->package_files)) == SQLITE_ROW) {
+		directory = (const char *) sqlite3_column_text(ctx->package_files, 0);
+		name = (const char *) sqlite3_column_text(ctx->package_files, 1);
+
+		if (directory == NULL || name == NULL) {
+			continue;
+		}
+
+		appfs_package_filter_hashes_add(&hashes, directory, name);
+	}
+
+	sqlite3_reset(ctx->package_files);
+	sqlite3_clear_bindings(ctx->package_files);
+
+	/* A package always has files, so none means something went wrong */
+	if (sqlite_ret == SQLITE_DONE && hashes.count != 0) {
+		appfs_package_filter_add(package_sha1, hashes.hashes, hashes.count);
+	}
+
+	free(hashes.hashes);
+
+	return;
+}
+
+/*
+ * Split a path into the site, the package, and the file within the package
+ * which it refers to, looking up the hash of the package if the path named
+ * it by its name, platform, and version.  "work" is a copy of the path,
+ * which is modified, and the results point into it or into the results of
+ * the statements of "ctx" (which the caller must reset).  "package" is
+ * NULL if the path named the package by its hash.  Returns 0 if the path
+ * is within a package.
+ */
+static int appfs_get_path_package(struct appfs_sqlite3 *ctx, char *work, const char **hostname_p, const char **package_p, const char **package_sha1_p, char **file_p) {
+	char *components[4], *file, *p;
+	const char *hostname, *package, *package_sha1, *os, *cpu, *version;
+	int components_count;
+
+	/*
+	 * Split the path into "hostname", "package", "os-cpu", "version" and
+	 * the remainder, which is the file within the package.  Paths of the
+	 * form "/hostname/sha1/file" only have the first two split off.
+	 */
+	file = work;
+	while (*file == '/') {
+		file++;
+	}
+
+	for (components_count = 0; components_count < 4 && *file != '\0'; components_count++) {
+		if (components_count == 2 && appfs_is_hash(components[1])) {
+			break;
+		}
+
+		components[components_count] = file;
+
+		p = strchr(file, '/');
+		if (p == NULL) {
+			file = file + strlen(file);
+		} else {
+			*p = '\0';
+			file = p + 1;
+		}
+	}
+
+	if (components_count < 2) {
+		return(1);
+	}
+
+	hostname = components[0];
+	if (strchr(hostname, '~') != NULL) {
+		return(1);
+	}
+
+	package = NULL;
+	package_sha1 = NULL;
+
+	if (appfs_is_hash(components[1])) {
+		/* /hostname/sha1/file */
+		package_sha1 = components[1];
+	} else {
+		/* /hostname/package/os-cpu/version/file */
+		if (components_count < 4) {
+			return(1);
+		}
+
+		package = components[1];
+
+		p = strchr(components[2], '-');
+		if (p == NULL) {
+			return(1);
+		}
+		*p = '\0';
+		cpu = p + 1;
+
+		p = strchr(cpu, '-');
+		if (p != NULL) {
+			*p = '\0';
+		}
+
+		os = appfs_normalize_os(components[2]);
+		cpu = appfs_normalize_cpu((char *) cpu);
+		version = components[3];
+
+		sqlite3_bind_text(ctx->package_sha1, 1, hostname, -1, SQLITE_STATIC);
+		sqlite3_bind_text(ctx->package_sha1, 2, package, -1, SQLITE_STATIC);
+		sqlite3_bind_text(ctx->package_sha1, 3, os, -1, SQLITE_STATIC);
+		sqlite3_bind_text(ctx->package_sha1, 4, cpu, -1, SQLITE_STATIC);
+		sqlite3_bind_text(ctx->package_sha1, 5, version, -1, SQLITE_STATIC);
+
+		if (sqlite3_step(ctx->package_sha1) == SQLITE_ROW) {
+			package_sha1 = (const char *) sqlite3_column_text(ctx->package_sha1, 0);
+		}
+
+		if (package_sha1 == NULL) {
+			return(1);
+		}
+	}
+
+	*hostname_p = hostname;
+	*package_p = package;
+	*package_sha1_p = package_sha1;
+	*file_p = file;
+
+	return(0);
+}
+
+/*
+ * Resolve a path natively
+ *         Returns 0 if the path was resolved (including resolving to a path
+ *         that does not exist) and 1 if the request must be handled by Tcl
+ *
+ *         The name of the overlay which would take precedence over the
+ *         resolved path is returned in "overlay", which must be PATH_MAX
+ *         bytes, since the result is valid for any user who does not have
+ *         that overlay
+ *
+ *         If "dirbuf" is supplied and the path is a directory, its children
+ *         are also resolved (in a single query) into the path info cache
+ *         and added to the directory listing
+ *
+ *         If "context" is supplied with a package context, only the file
+ *         within that package is looked up.  Otherwise it is given the
+ *         package context of the path, if it was resolved within one.
+ */
+static int appfs_get_path_info_native(const char *path, struct appfs_path_context *context, uid_t fsuid, struct appfs_pathinfo *pathinfo, char *overlay, fuse_req_t req, struct appfs_dirbuf *dirbuf) {
+	struct appfs_pathinfo child_pathinfo;
+	struct appfs_sqlite3 *ctx;
+	char work[PATH_MAX], child_path[PATH_MAX];
+	char *file, *file_directory, *file_name, *p;
+	const char *hostname, *package, *package_sha1, *child;
+	size_t path_len, file_offset;
+	int children_count;
+	int filter_ret;
+	int retval;
+	time_t now, expires;
+
+	path_len = strlen(path);
+	if (path_len >= sizeof(work)) {
+		return(1);
+	}
+
+	ctx = appfs_sqlite3_handle();
+	if (ctx == NULL) {
+		return(1);
+	}
+
+	retval = 1;
+
+	if (context != NULL && context->package != NULL && context->file_offset <= path_len) {
+		/*
+		 * The package is already known, so only the file within it
+		 * needs to be looked up
+		 */
+		hostname = context->package->hostname;
+		package = context->package->package;
+		package_sha1 = context->package->package_sha1;
+		file_offset = context->file_offset;
+
+		strcpy(work, path + file_offset);
+		file = work;
+	} else {
+		strcpy(work, path);
+
+		if (appfs_get_path_package(ctx, work, &hostname, &package, &package_sha1, &file) != 0) {
+			goto native_out;
+		}
+
+		file_offset = file - work;
+	}
+
+	/*
+	 * The site index must be fresh, otherwise Tcl needs to refresh it
+	 */
+	now = time(NULL);
+
+	if (!appfs_site_is_fresh(hostname)) {
+		sqlite3_bind_text(ctx->site_info, 1, hostname, -1, SQLITE_STATIC);
+		if (sqlite3_step(ctx->site_info) != SQLITE_ROW) {
+			goto native_out;
+		}
+
+		/*
+		 * An expired index may still be used while it is being
+		 * refreshed in the background
+		 */
+		expires = sqlite3_column_int64(ctx->site_info, 0) + sqlite3_column_int64(ctx->site_info, 1);
+		if (now >= expires) {
+			if (sqlite3_column_int64(ctx->site_info, 0) == 0 || !appfs_index_refresh_schedule(hostname)) {
+				goto native_out;
+			}
+		} else {
+			appfs_site_set_fresh(hostname, expires);
+		}
+	}
+
+	/*
+	 * The package manifest must already be downloaded, the package name
+	 * is also needed if the path referred to the package by hash
+	 */
+	if (package == NULL || !appfs_manifest_is_present(package_sha1)) {
+		sqlite3_bind_text(ctx->package_info, 1, package_sha1, -1, SQLITE_STATIC);
+		if (sqlite3_step(ctx->package_info) != SQLITE_ROW) {
+			goto native_out;
+		}
+
+		if (sqlite3_column_int(ctx->package_info, 1) != 1) {
+			goto native_out;
+		}
+
+		appfs_manifest_set_present(package_sha1, 1);
+
+		if (package == NULL) {
+			package = (const char *) sqlite3_column_text(ctx->package_info, 0);
+			if (package == NULL) {
+				goto native_out;
+			}
+		}
+	}
+
+	/*
+	 * If the user has any local modifications (or whiteouts) for this
+	 * package then the overlay logic in Tcl must be used
+	 */
+	snprintf(overlay, PATH_MAX, "%s@%s", package, hostname);
+
+	if (appfs_get_path_info_cache_overlay_exists(overlay, fsuid)) {
+		APPFS_DEBUG("Found overlay %s, not resolving natively", overlay);
+
+		goto native_out;
+	}
+
+	/*
+	 * Look up the file within the package
+	 */
+	pathinfo->packaged = 1;
+	pathinfo->time = appfs_boottime;
+
+	if (*file == '\0') {
+		file_directory = "";
+		pathinfo->type = APPFS_PATHTYPE_DIRECTORY;
+	} else {
+		p = strrchr(file, '/');
+		if (p == NULL) {
+			file_directory = "";
+			file_name = file;
+		} else {
+			*p = '\0';
+			file_directory = file;
+			file_name = p + 1;
+		}
+
+		/*
+		 * Most paths looked up which do not exist can be answered
+		 * without querying the database
+		 */
+		filter_ret = appfs_package_filter_check(package_sha1, file_directory, file_name);
+		if (filter_ret < 0) {
+			appfs_package_filter_load(ctx, package_sha1);
+
+			filter_ret = appfs_package_filter_check(package_sha1, file_directory, file_name);
+		}
+
+		if (filter_ret == 0) {
+			APPFS_DEBUG("Native resolver: %s does not exist (filtered)", path);
+
+			pathinfo->type = APPFS_PATHTYPE_DOES_NOT_EXIST;
+
+			retval = 0;
+
+			goto native_out;
+		}
+
+		sqlite3_bind_text(ctx->file_info, 1, package_sha1, -1, SQLITE_STATIC);
+		sqlite3_bind_text(ctx->file_info, 2, file_directory, -1, SQLITE_STATIC);
+		sqlite3_bind_text(ctx->file_info, 3, file_name, -1, SQLITE_STATIC);
+
+		if (sqlite3_step(ctx->file_info) != SQLITE_ROW) {
+			APPFS_DEBUG("Native resolver: %s does not exist", path);
+
+			pathinfo->type = APPFS_PATHTYPE_DOES_NOT_EXIST;
+
+			retval = 0;
+
+			goto native_out;
+		}
+
+		if (appfs_get_path_info_native_row(ctx->file_info, 0, pathinfo) != 0) {
+			goto native_out;
+		}
+
+		if (pathinfo->type == APPFS_PATHTYPE_DIRECTORY) {
+			/* The directory we count children in is the full path */
+			if (p != NULL) {
+				*p = '/';
+			}
+			file_directory = file;
+		}
+	}
+
+	if (pathinfo->type == APPFS_PATHTYPE_DIRECTORY) {
+		sqlite3_bind_text(ctx->dir_childcount, 1, package_sha1, -1, SQLITE_STATIC);
+		sqlite3_bind_text(ctx->dir_childcount, 2, file_directory, -1, SQLITE_STATIC);
+
+		/*
+		 * Child counts are computed when the manifest is ingested, and
+		 * directories without any children have no entry
+		 */
+		switch (sqlite3_step(ctx->dir_childcount)) {
+			case SQLITE_ROW:
+				pathinfo->typeinfo.dir.childcount = sqlite3_column_int(ctx->dir_childcount, 0);
+				break;
+			case SQLITE_DONE:
+				pathinfo->typeinfo.dir.childcount = 0;
+				break;
+			default:
+				goto native_out;
+		}
+	}
+
+	pathinfo->inode = appfs_get_path_inode(path, -1);
+
+	/*
+	 * Resolve every child of a directory being listed at once, so that
+	 * the lookups the kernel does for each entry (e.g., for "ls -l") are
+	 * answered from the cache
+	 */
+	if (dirbuf != NULL && pathinfo->type == APPFS_PATHTYPE_DIRECTORY) {
+		sqlite3_bind_text(ctx->dir_children, 1, package_sha1, -1, SQLITE_STATIC);
+		sqlite3_bind_text(ctx->dir_children, 2, file_directory, -1, SQLITE_STATIC);
+
+		children_count = 0;
+
+		while (sqlite3_step(ctx->dir_children) == SQLITE_ROW) {
+			child = (const char *) sqlite3_column_text(ctx->dir_children, 0);
+			if (child == NULL) {
+				continue;
+			}
+
+			snprintf(child_path, sizeof(child_path), "%s/%s", path, child);
+
+			memset(&child_pathinfo, 0, sizeof(child_pathinfo));
+
+			if (appfs_get_path_info_native_row(ctx->dir_children, 1, &child_pathinfo) == 0) {
+				if (child_pathinfo.type == APPFS_PATHTYPE_DIRECTORY) {
+					child_pathinfo.typeinfo.dir.childcount = sqlite3_column_int(ctx->dir_children, 6);
+				}
+
+				child_pathinfo.inode = appfs_get_path_inode(child_path, -1);
+
+				appfs_get_path_info_cache_add_shared(child_path, overlay, &child_pathinfo);
+			}
+
+			appfs_dirbuf_add(req, dirbuf, child, appfs_get_path_inode(child_path, -1));
+
+			children_count++;
+		}
+
+		APPFS_DEBUG("Native resolver: resolved %i children of %s", children_count, path);
+	}
+
+	APPFS_DEBUG("Native resolver: resolved %s", path);
+
+	/* Children of this path can be looked up within the same package */
+	if (context != NULL && context->package == NULL) {
+		context->package = appfs_package_context_new(hostname, package, package_sha1);
+		context->file_offset = file_offset;
+	}
+
+	retval = 0;
+
+native_out:
+	sqlite3_reset(ctx->site_info);
+	sqlite3_reset(ctx->package_sha1);
+	sqlite3_reset(ctx->package_info);
+	sqlite3_reset(ctx->file_info);
+	sqlite3_reset(ctx->dir_childcount);
+	sqlite3_reset(ctx->dir_children);
+
+	sqlite3_clear_bindings(ctx->site_info);
+	sqlite3_clear_bindings(ctx->package_sha1);
+	sqlite3_clear_bindings(ctx->package_info);
+	sqlite3_clear_bindings(ctx->file_info);
+	sqlite3_clear_bindings(ctx->dir_childcount);
+	sqlite3_clear_bindings(ctx->dir_children);
+
+	return(retval);
+}
+
+/*
+ * Manifest ingestion:
+ *         Load a package's manifest into the "files" table.  The manifest
+ *         is read a line at a time and inserted using a single prepared
+ *         statement within one transaction, which also records the
+ *         directory child counts and marks the manifest as present.
+ *
+ *         Each line is "type,time,...,name" where "..." is "size,perms,sha1"
+ *         for files and "source" for symlinks.  Types beginning with "#"
+ *         are metadata, and are ignored.
+ */
+static char *appfs_manifest_next_field(char **work_p) {
+	char *field, *p;
+
+	field = *work_p;
+
+	p = strchr(field, ',');
+	if (p == NULL) {
+		/* Any further fields are empty */
+		*work_p = field + strlen(field);
+	} else {
+		*p = '\0';
+		*work_p = p + 1;
+	}
+
+	return(field);
+}
+
+static int appfs_manifest_ingest(const char *package_sha1, const char *manifest_path, long *entries_p, const char **error_string) {
+	struct appfs_package_filter_hashes hashes;
+	sqlite3 *db;
+	sqlite3_stmt *insert_file = NULL, *set_have_manifest = NULL, *delete_dirs = NULL, *insert_dirs = NULL, *insert_blockhashes = NULL;
+	FILE *manifest_fp;
+	char db_path[PATH_MAX];
+	char *line = NULL, *work, *end, *p;
+	char *type, *file_time, *source, *size, *perms, *file_sha1, *name, *directory, *block_size, *blocklist_sha1;
+	size_t line_size = 0;
+	long entries;
+	int sqlite_ret;
+	int retval = -1;
+
+	*error_string = "Unable to load manifest into the cache database";
+
+	memset(&hashes, 0, sizeof(hashes));
+
+	manifest_fp = fopen(manifest_path, "r");
+	if (manifest_fp == NULL) {
+		*error_string = "Unable to download or open manifest";
+
+		return(-1);
+	}
+
+	snprintf(db_path, sizeof(db_path), "%s/cache.db", appfs_cachedir);
+
+	sqlite_ret = sqlite3_open_v2(db_path, &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_NOMUTEX, NULL);
+	if (sqlite_ret != SQLITE_OK) {
+		APPFS_DEBUG("Unable to open %s: %s", db_path, sqlite3_errstr(sqlite_ret));
+
+		sqlite3_close(db);
+		fclose(manifest_fp);
+
+		return(-1);
+	}
+
+	sqlite3_busy_timeout(db, 30000);
+
+	if (sqlite_ret == SQLITE_OK) {
+		sqlite_ret = sqlite3_prepare_v2(db, "INSERT INTO files (package_sha1, type, time, source, size, perms, file_sha1, file_name, file_directory) VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8, ?9);", -1, &insert_file, NULL);
+	}
+	if (sqlite_ret == SQLITE_OK) {
+		sqlite_ret = sqlite3_prepare_v2(db, "UPDATE packages SET haveManifest = 1 WHERE sha1 = ?1;", -1, &set_have_manifest, NULL);
+	}
+	if (sqlite_ret == SQLITE_OK) {
+		sqlite_ret = sqlite3_prepare_v2(db, "DELETE FROM directories WHERE package_sha1 = ?1;", -1, &delete_dirs, NULL);
+	}
+	if (sqlite_ret == SQLITE_OK) {
+		sqlite_ret = sqlite3_prepare_v2(db,
+			"INSERT INTO directories (package_sha1, file_directory, childcount) "
+			"SELECT package_sha1, file_directory, COUNT(DISTINCT file_name) FROM files "
+			"WHERE package_sha1 = ?1 GROUP BY file_directory;",
+			-1, &insert_dirs, NULL
+		);
+	}
+	if (sqlite_ret == SQLITE_OK) {
+		sqlite_ret = sqlite3_prepare_v2(db, "INSERT OR REPLACE INTO blockhashes (package_sha1, file_sha1, blockSize, blocklist_sha1) VALUES (?1, ?2, ?3, ?4);", -1, &insert_blockhashes, NULL);
+	}
+	if (sqlite_ret == SQLITE_OK) {
+		sqlite_ret = sqlite3_exec(db, "BEGIN IMMEDIATE;", NULL, NULL, NULL);
+	}
+
+	if (sqlite_ret != SQLITE_OK) {
+		APPFS_DEBUG("Unable to prepare to load manifest: %s", sqlite3_errmsg(db));
+
+		goto ingest_out;
+	}
+
+	sqlite3_bind_text(insert_file, 1, package_sha1, -1, SQLITE_STATIC);
+
+	entries = 0;
+	while (getline(&line, &line_size, manifest_fp) != -1) {
+		/* Trim whitespace from both ends of the line */
+		for (work = line; *work != '\0' && isspace((unsigned char) *work); work++) {
+			/* Nothing */
+		}
+
+		end = work + strlen(work);
+		while (end > work && isspace((unsigned char) end[-1])) {
+			end--;
+		}
+		*end = '\0';
+
+		if (*work == '\0') {
+			continue;
+		}
+
+		type = appfs_manifest_next_field(&work);
+		if (strcmp(type, "#manifestmetadata") == 0) {
+			continue;
+		}
+
+		/*
+		 * Files may have the hashes of each of their blocks listed in
+		 * another file, so that parts of them can be verified
+		 */
+		if (strcmp(type, "#blockhashes") == 0) {
+			file_sha1 = appfs_manifest_next_field(&work);
+			block_size = appfs_manifest_next_field(&work);
+			blocklist_sha1 = appfs_manifest_next_field(&work);
+
+			sqlite3_bind_text(insert_blockhashes, 1, package_sha1, -1, SQLITE_STATIC);
+			sqlite3_bind_text(insert_blockhashes, 2, file_sha1, -1, SQLITE_STATIC);
+			sqlite3_bind_int64(insert_blockhashes, 3, strtoll(block_size, NULL, 10));
+			sqlite3_bind_text(insert_blockhashes, 4, blocklist_sha1, -1, SQLITE_STATIC);
+
+			sqlite_ret = sqlite3_step(insert_blockhashes);
+			sqlite3_reset(insert_blockhashes);
+
+			if (sqlite_ret != SQLITE_DONE) {
+				APPFS_DEBUG("Unable to insert block hashes: %s", sqlite3_errmsg(db));
+
+				goto ingest_out;
+			}
+
+			continue;
+		}
+
+		file_time = appfs_manifest_next_field(&work);
+
+		source = NULL;
+		size = NULL;
+		perms = NULL;
+		file_sha1 = NULL;
+
+		if (strcmp(type, "file") == 0) {
+			size = appfs_manifest_next_field(&work);
+
+			/*
+			 * We lower-case the permissions because upper-case permissions
+			 * should not be set remotely as they may influence the security
+			 * of the system.
+			 */
+			perms = appfs_manifest_next_field(&work);
+			for (p = perms; *p != '\0'; p++) {
+				*p = tolower((unsigned char) *p);
+			}
+
+			file_sha1 = appfs_manifest_next_field(&work);
+		} else if (strcmp(type, "symlink") == 0) {
+			source = appfs_manifest_next_field(&work);
+		} else if (strcmp(type, "directory") == 0) {
+			/* No extra data required */
+		} else if (type[0] == '#') {
+			/* Metadata type, ignore it if we don't understand this type */
+			continue;
+		} else {
+			*error_string = "Manifest cannot be parsed";
+
+			goto ingest_out;
+		}
+
+		/*
+		 * The remainder of the line is the name, which may itself
+		 * contain commas
+		 */
+		while (*work == '/') {
+			work++;
+		}
+
+		end = work + strlen(work);
+		while (end > work && end[-1] == '/') {
+			end--;
+		}
+		*end = '\0';
+
+		p = strrchr(work, '/');
+		if (p == NULL) {
+			directory = "";
+			name = work;
+		} else {
+			*p = '\0';
+			directory = work;
+			name = p + 1;
+		}
+
+		sqlite3_bind_text(insert_file, 2, type, -1, SQLITE_STATIC);
+		sqlite3_bind_text(insert_file, 3, file_time, -1, SQLITE_STATIC);
+		sqlite3_bind_text(insert_file, 4, source, -1, SQLITE_STATIC);
+		sqlite3_bind_text(insert_file, 5, size, -1, SQLITE_STATIC);
+		sqlite3_bind_text(insert_file, 6, perms, -1, SQLITE_STATIC);
+		sqlite3_bind_text(insert_file, 7, file_sha1, -1, SQLITE_STATIC);
+		sqlite3_bind_text(insert_file, 8, name, -1, SQLITE_STATIC);
+		sqlite3_bind_text(insert_file, 9, directory, -1, SQLITE_STATIC);
+
+		sqlite_ret = sqlite3_step(insert_file);
+		sqlite3_reset(insert_file);
+
+		if (sqlite_ret != SQLITE_DONE) {
+			APPFS_DEBUG("Unable to insert manifest entry: %s", sqlite3_errmsg(db));
+
+			goto ingest_out;
+		}
+
+		appfs_package_filter_hashes_add(&hashes, directory, name);
+
+		entries++;
+	}
+
+	if (ferror(manifest_fp)) {
+		*error_string = "Unable to read manifest";
+
+		goto ingest_out;
+	}
+
+	/*
+	 * Mark the manifest as present and record how many entries each
+	 * directory has, once, now that all of the entries are in
+	 */
+	sqlite3_bind_text(set_have_manifest, 1, package_sha1, -1, SQLITE_STATIC);
+	sqlite3_bind_text(delete_dirs, 1, package_sha1, -1, SQLITE_STATIC);
+	sqlite3_bind_text(insert_dirs, 1, package_sha1, -1, SQLITE_STATIC);
+
+	if (sqlite3_step(set_have_manifest) != SQLITE_DONE || sqlite3_step(delete_dirs) != SQLITE_DONE || sqlite3_step(insert_dirs) != SQLITE_DONE) {
+		APPFS_DEBUG("Unable to finish loading manifest: %s", sqlite3_errmsg(db));
+
+		goto ingest_out;
+	}
+
+	if (sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK) {
+		APPFS_DEBUG("Unable to commit manifest: %s", sqlite3_errmsg(db));
+
+		goto ingest_out;
+	}
+
+	APPFS_DEBUG("Loaded %li manifest entries for %s", entries, package_sha1);
+
+	if (hashes.count != 0) {
+		appfs_package_filter_add(package_sha1, hashes.hashes, hashes.count);
+	}
+
+	if (entries_p) {
+		*entries_p = entries;
+	}
+
+	*error_string = NULL;
+
+	retval = 0;
+
+ingest_out:
+	if (retval != 0 && !sqlite3_get_autocommit(db)) {
+		sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+	}
+
+	sqlite3_finalize(insert_file);
+	sqlite3_finalize(set_have_manifest);
+	sqlite3_finalize(delete_dirs);
+	sqlite3_finalize(insert_dirs);
+	sqlite3_finalize(insert_blockhashes);
+	sqlite3_close(db);
+
+	free(line);
+	free(hashes.hashes);
+
+	fclose(manifest_fp);
+
+	return(retval);
+}
+
+/*
+ * Get information about a path from Tcl
+ */
+struct appfs_get_path_info_tcl_data {
+	const char *path;
+	struct appfs_pathinfo *pathinfo;
+	uid_t fsuid;
+};
+
+static int appfs_get_path_info_tcl(Tcl_Interp *interp, void *_data) {
+	struct appfs_get_path_info_tcl_data *data;
+	struct appfs_pathinfo *pathinfo;
+	Tcl_Obj *attrs_dict, *attr_value;
+	const char *attr_value_str, *attr_value_str_i, *path;
+	Tcl_WideInt attr_value_wide;
+	int attr_value_int;
+	static __thread Tcl_Obj *attr_key_type = NULL, *attr_key_perms = NULL, *attr_key_size = NULL, *attr_key_time = NULL, *attr_key_source = NULL, *attr_key_childcount = NULL, *attr_key_packaged = NULL;
+	int tcl_ret;
+	int retval;
+	uid_t fsuid;
+
+	data = _data;
+	path = data->path;
+	pathinfo = data->pathinfo;
+	fsuid = data->fsuid;
+
+	retval = 0;
+
+	if (interp == NULL) {
+		APPFS_DEBUG("error: Unable to get an interpreter");
+
+		return(-EIO);
+	}
+
+	appfs_call_libtcl(Tcl_Preserve(interp);)
+
+	tcl_ret = appfs_Tcl_Eval(interp, 2, "::appfs::getattr", path);
+	if (tcl_ret != TCL_OK) {
+		APPFS_DEBUG("::appfs::getattr(%s) failed.", path);
+		appfs_call_libtcl(
+			APPFS_DEBUG("Tcl Error is: %s", Tcl_GetStringResult(interp));
+		)
+
+		pathinfo->type = APPFS_PATHTYPE_DOES_NOT_EXIST;
+
+		appfs_get_path_info_cache_add(path, fsuid, pathinfo);
+
+		appfs_call_libtcl(Tcl_Release(interp);)
+
+		return(-ENOENT);
+	}
+
+	if (attr_key_type == NULL) {
+		appfs_call_libtcl(
+			attr_key_type       = Tcl_NewStringObj("type", -1);
+			attr_key_perms      = Tcl_NewStringObj("perms", -1);
+			attr_key_size       = Tcl_NewStringObj("size", -1);
+			attr_key_time       = Tcl_NewStringObj("time", -1);
+			attr_key_source     = Tcl_NewStringObj("source", -1);
+			attr_key_childcount = Tcl_NewStringObj("childcount", -1);
+			attr_key_packaged   = Tcl_NewStringObj("packaged", -1);
+
+			Tcl_IncrRefCount(attr_key_type);
+			Tcl_IncrRefCount(attr_key_perms);
+			Tcl_IncrRefCount(attr_key_size);
+			Tcl_IncrRefCount(attr_key_time);
+			Tcl_IncrRefCount(attr_key_source);
+			Tcl_IncrRefCount(attr_key_childcount);
+			Tcl_IncrRefCount(attr_key_packaged);
+		)
+	}
+
+	appfs_call_libtcl(
+		attrs_dict = Tcl_GetObjResult(interp);
+		tcl_ret = Tcl_DictObjGet(interp, attrs_dict, attr_key_type, &attr_value);
+	)
+	if (tcl_ret != TCL_OK) {
+		APPFS_DEBUG("[dict get \"type\"] failed");
+		appfs_call_libtcl(
+			APPFS_DEBUG("Tcl Error is: %s", Tcl_GetStringResult(interp));
+		)
+
+		appfs_call_libtcl(Tcl_Release(interp);)
+
+		return(-EIO);
+	}
+
+	if (attr_value == NULL) {
+		APPFS_DEBUG("error: Unable to get type for \"%s\" from Tcl", path);
+
+		appfs_call_libtcl(Tcl_Release(interp);)
+
+		return(-EIO);
+	}
+
+	pathinfo->packaged = 0;
+
+	appfs_call_libtcl(
+		attr_value_str = Tcl_GetString(attr_value);
+
+		switch (attr_value_str[0]) {
+			case 'd': /* directory */
+				pathinfo->type = APPFS_PATHTYPE_DIRECTORY;
+				pathinfo->typeinfo.dir.childcount = 0;
+
+				Tcl_DictObjGet(interp, attrs_dict, attr_key_childcount, &attr_value);
+				if (attr_value != NULL) {
+					tcl_ret = Tcl_GetWideIntFromObj(NULL, attr_value, &attr_value_wide);
+					if (tcl_ret == TCL_OK) {
+						pathinfo->typeinfo.dir.childcount = attr_value_wide;
+					}
+				}
+
+				break;
+			case 'f': /* file */
+				pathinfo->type = APPFS_PATHTYPE_FILE;
+				pathinfo->typeinfo.file.size = 0;
+				pathinfo->typeinfo.file.executable = 0;
+				pathinfo->typeinfo.file.suidRoot = 0;
+				pathinfo->typeinfo.file.worldaccessible = 0;
+
+				Tcl_DictObjGet(interp, attrs_dict, attr_key_size, &attr_value);
+				if (attr_value != NULL) {
+					tcl_ret = Tcl_GetWideIntFromObj(NULL, attr_value, &attr_value_wide);
+					if (tcl_ret == TCL_OK) {
+						pathinfo->typeinfo.file.size = attr_value_wide;
+					}
+				}
+
+				Tcl_DictObjGet(interp, attrs_dict, attr_key_perms, &attr_value);
+				if (attr_value != NULL) {
+					attr_value_str = Tcl_GetString(attr_value);
+					for (attr_value_str_i = &attr_value_str[0]; *attr_value_str_i != '\0'; attr_value_str_i++) {
+						switch (*attr_value_str_i) {
+							case 'x':
+								pathinfo->typeinfo.file.executable = 1;
+
+								break;
+							case 'U':
+								pathinfo->typeinfo.file.suidRoot = 1;
+
+								break;
+							case '-':
+								pathinfo->typeinfo.file.worldaccessible = 1;
+
+								break;
+						}
+					}
+				}
+				break;
+			case 's': /* symlink */
+				pathinfo->type = APPFS_PATHTYPE_SYMLINK;
+				pathinfo->typeinfo.symlink.size = 0;
+				pathinfo->typeinfo.symlink.source[0] = '\0';
+
+				Tcl_DictObjGet(interp, attrs_dict, attr_key_source, &attr_value);
+				if (attr_value != NULL) {
+					attr_value_str = Tcl_GetStringFromObj(attr_value, &attr_value_int); 
+
+					if ((attr_value_int + 1) <= sizeof(pathinfo->typeinfo.symlink.source)) {
+						pathinfo->typeinfo.symlink.size = attr_value_int;
+						pathinfo->typeinfo.symlink.source[attr_value_int] = '\0';
+
+						memcpy(pathinfo->typeinfo.symlink.source, attr_value_str, attr_value_int);
+					}
+				}
+				break;
+			case 'F': /* pipe/fifo */
+				pathinfo->type = APPFS_PATHTYPE_FIFO;
+				break;
+			case 'S': /* UNIX domain socket */
+				pathinfo->type = APPFS_PATHTYPE_SOCKET;
+				break;
+			default:
+				retval = -EIO;
+		}
+
+		Tcl_DictObjGet(interp, attrs_dict, attr_key_packaged, &attr_value);
+		if (attr_value != NULL) {
+			pathinfo->packaged = 1;
+		}
+
+		Tcl_DictObjGet(interp, attrs_dict, attr_key_time, &attr_value);
+		if (attr_value != NULL) {
+			tcl_ret = Tcl_GetWideIntFromObj(NULL, attr_value, &attr_value_wide);
+			if (tcl_ret == TCL_OK) {
+				pathinfo->time = attr_value_wide;
+			}
+		} else {
+			pathinfo->time = appfs_boottime;
+		}
+
+		Tcl_Release(interp);
+	)
+
+	if (pathinfo->packaged) {
+		pathinfo->inode = appfs_get_path_inode(path, -1);
+	} else {
+		pathinfo->inode = appfs_get_path_inode(path, fsuid);
+	}
+
+	APPFS_DEBUG("Caching inode for path=%s,uid=%lli as %llu (packaged = %i)", path, (long long) fsuid, pathinfo->inode, pathinfo->packaged);
+
+	if (retval == 0) {
+		appfs_get_path_info_cache_add(path, fsuid, pathinfo);
+	} else {
+		APPFS_DEBUG("error: Invalid type for \"%s\" from Tcl", path);
+	}
+
+	return(retval);
+}
+
+/*
+ * Find the package context of a path which was not resolved natively, if
+ * it is within a package
+ */
+static void appfs_path_context_resolve(const char *path, struct appfs_path_context *context) {
+	struct appfs_sqlite3 *ctx;
+	char work[PATH_MAX];
+	char *file;
+	const char *hostname, *package, *package_sha1;
+
+	/* Package contexts are only used by the native resolver */
+	if (context->package != NULL || !__sync_fetch_and_add(&appfs_native_resolver, 0)) {
+		return;
+	}
+
+	if (strlen(path) >= sizeof(work)) {
+		return;
+	}
+
+	ctx = appfs_sqlite3_handle();
+	if (ctx == NULL) {
+		return;
+	}
+
+	strcpy(work, path);
+
+	if (appfs_get_path_package(ctx, work, &hostname, &package, &package_sha1, &file) == 0) {
+		if (package == NULL) {
+			sqlite3_bind_text(ctx->package_info, 1, package_sha1, -1, SQLITE_STATIC);
+			if (sqlite3_step(ctx->package_info) == SQLITE_ROW) {
+				package = (const char *) sqlite3_column_text(ctx->package_info, 0);
+			}
+		}
+
+		if (package != NULL) {
+			context->package = appfs_package_context_new(hostname, package, package_sha1);
+			context->file_offset = file - work;
+		}
+	}
+
+	sqlite3_reset(ctx->package_sha1);
+	sqlite3_reset(ctx->package_info);
+
+	sqlite3_clear_bindings(ctx->package_sha1);
+	sqlite3_clear_bindings(ctx->package_info);
+
+	return;
+}
+
+/*
+ * Get information about a path.  If "context" is supplied, the path is
+ * looked up within its package context, if it has one, and it is given the
+ * package context of the path otherwise.
+ */
+static int appfs_get_path_info_context(const char *path, struct appfs_path_context *context, struct appfs_pathinfo *pathinfo) {
+	struct appfs_get_path_info_tcl_data data;
+	char overlay[PATH_MAX];
+	int cache_ret, native_ret, retval;
+	uid_t fsuid;
+
+	fsuid = appfs_get_fsuid();
+
+	cache_ret = appfs_get_path_info_cache_get(path, fsuid, pathinfo);
+	if (cache_ret == 0) {
+		if (pathinfo->type == APPFS_PATHTYPE_DOES_NOT_EXIST) {
+			APPFS_DEBUG("Returning from cache: does not exist \"%s\"", path);
+
+			return(-ENOENT);
+		}
+
+		if (pathinfo->type == APPFS_PATHTYPE_INVALID) {
+			APPFS_DEBUG("Returning from cache: invalid object \"%s\"", path);
+
+			return(-EIO);
+		}
+
+		if (context) {
+			appfs_path_context_resolve(path, context);
+		}
+
+		return(0);
+	}
+
+	if (__sync_fetch_and_add(&appfs_native_resolver, 0)) {
+		native_ret = appfs_get_path_info_native(path, context, fsuid, pathinfo, overlay, NULL, NULL);
+		if (native_ret == 0) {
+			appfs_get_path_info_cache_add_shared(path, overlay, pathinfo);
+
+			if (pathinfo->type == APPFS_PATHTYPE_DOES_NOT_EXIST) {
+				return(-ENOENT);
+			}
+
+			return(0);
+		}
+	}
+
+	data.path = path;
+	data.pathinfo = pathinfo;
+	data.fsuid = fsuid;
+
+	retval = appfs_tcl_call(appfs_get_path_info_tcl, &data);
+
+	if (retval == 0 && context) {
+		appfs_path_context_resolve(path, context);
+	}
+
+	return(retval);
+}
+
+/* Get information about a path */
+static int appfs_get_path_info(const char *path, struct appfs_pathinfo *pathinfo) {
+	return(appfs_get_path_info_context(path, NULL, pathinfo));
+}
+
+static char *appfs_prepare_to_create(const char *path) {
+	appfs_get_path_info_cache_flush(appfs_get_fsuid(), -1);
+
+	return(appfs_tcl_call_string("::appfs::prepare_to_create", path, NULL));
+}
+
+static char *appfs_localpath(const char *path) {
+	return(appfs_tcl_call_string("::appfs::localpath", path, NULL));
+}
+
+#if (defined(DEBUG) && defined(APPFS_EXIT_PATH)) || defined(APPFS_EXIT_PATH_ENABLE_MAJOR_SECURITY_HOLE)
+static void appfs_exit(void) {
+	int global_interp_reset_key;
+
+	global_interp_reset_key = __sync_fetch_and_add(&interp_reset_key, 0);
+	__sync_fetch_and_sub(&interp_reset_key, global_interp_reset_key);
+
+	while (__sync_sub_and_fetch(&interp_reset_key, 1) >= 0) {
+		/* Busy Loop */
+	}
+
+	global_interp_reset_key = __sync_fetch_and_add(&interp_reset_key, 0);
+	if (global_interp_reset_key != -1) {
+		APPFS_DEBUG("Error sending kill signal to all threads, aborting anyway.");
+	}
+
+	appfs_get_path_info_cache_flush(-1, -1);
+
+	fuse_session_exit(appfs_fuse_session);
+
+	return;
+}
+
+#endif
+
+#if defined(APPFS_EXEC_PATH_ENABLE_MAJOR_SECURITY_HOLE)
+struct appfs_runTcl_data {
+	const char *script;
+	size_t scriptLen;
+};
+
+static int appfs_runTcl_func(Tcl_Interp *interp, void *_data) {
+	struct appfs_runTcl_data *data;
+	const char *script;
+	size_t scriptLen;
+	Tcl_Obj *scriptObj;
+	int tcl_ret;
+
+	data = _data;
+	script = data->script;
+	scriptLen = data->scriptLen;
+
+	if (interp == NULL) {
+		APPFS_DEBUG("Error creating an interpreter.");
+
+		return(-1);
+	}
+
+	appfs_call_libtcl(
+		scriptObj = Tcl_NewStringObj(script, scriptLen);
+
+		Tcl_IncrRefCount(scriptObj);
+	)
+
+	if (scriptObj == NULL) {
+		APPFS_DEBUG("Error creating a script object.");
+
+		return(-1);
+	}
+
+	appfs_call_libtcl(
+		tcl_ret = Tcl_EvalObjEx(interp, scriptObj, TCL_EVAL_DIRECT);
+		Tcl_DecrRefCount(scriptObj);
+	)
+
+	if (tcl_ret != TCL_OK) {
+		appfs_call_libtcl(
+			APPFS_DEBUG("Script returned error %i: %s", tcl_ret, Tcl_GetStringResult(interp));
+		)
+	}
+
+	return(0);
+}
+
+static void appfs_runTcl(const char *script, size_t scriptLen) {
+	struct appfs_runTcl_data data;
+
+	data.script = script;
+	data.scriptLen = scriptLen;
+
+	appfs_tcl_call(appfs_runTcl_func, &data);
+
+	return;
+}
+#endif
+
+static int appfs_fuse_readlink(const char *path, char *buf, size_t size) {
+	struct appfs_pathinfo pathinfo;
+	int retval = 0;
+
+	APPFS_DEBUG("Enter (path = %s, ...)", path);
+
+	pathinfo.type = APPFS_PATHTYPE_INVALID;
+
+	retval = appfs_get_path_info(path, &pathinfo);
+	if (retval != 0) {
+		return(retval);
+	}
+
+	if (pathinfo.type != APPFS_PATHTYPE_SYMLINK) {
+		return(-EINVAL);
+	}
+
+	if ((strlen(pathinfo.typeinfo.symlink.source) + 1) > size) {
+		return(-ENAMETOOLONG);
+	}
+
+	memcpy(buf, pathinfo.typeinfo.symlink.source, strlen(pathinfo.typeinfo.symlink.source) + 1);
+
+	return(0);
+}
+
+static int appfs_fuse_getattr(const char *path, struct appfs_path_context *context, struct stat *stbuf, int *packaged) {
+	struct appfs_pathinfo pathinfo;
+	int changeOwnerToUserIfPackaged;
+	int retval;
+
+	retval = 0;
+
+	APPFS_DEBUG("Enter (path = %s, ...)", path);
+
+#if (defined(DEBUG) && defined(APPFS_EXIT_PATH)) || defined(APPFS_EXIT_PATH_ENABLE_MAJOR_SECURITY_HOLE)
+	/*
+	 * This is a major security issue so we cannot let it be compiled into
+	 * any release
+	 */
+	if (strcmp(path, "/exit") == 0) {
+		appfs_exit();
+	}
+#endif
+#if defined(APPFS_EXEC_PATH_ENABLE_MAJOR_SECURITY_HOLE)
+	if (strcmp(path, "/exec") == 0) {
+		memset(stbuf, 0, sizeof(struct stat));
+
+		if (packaged) {
+			*packaged = 0;
+		}
+
+		stbuf->st_mtime = 0;
+		stbuf->st_ctime = 0;
+		stbuf->st_atime = 0;
+		stbuf->st_ino   = 3;
+		stbuf->st_mode  = 0;
+		stbuf->st_mode  = S_IFREG | 0600;
+		stbuf->st_nlink = 1;
+		stbuf->st_size  = 0;
+
+		return(retval);
+	}
+#endif
+
+	pathinfo.type = APPFS_PATHTYPE_INVALID;
+
+	retval = appfs_get_path_info_context(path, context, &pathinfo);
+	if (retval != 0) {
+		if (retval == -ENOENT) {
+			APPFS_DEBUG("get_path_info returned ENOENT, returning it as well.");
+		} else {
+			APPFS_DEBUG("error: get_path_info failed");
+		}
+
+		return(retval);
+	}
+
+	memset(stbuf, 0, sizeof(struct stat));
+
+	if (packaged) {
+		*packaged = pathinfo.packaged;
+	}
+
+	stbuf->st_mtime = pathinfo.time;
+	stbuf->st_ctime = pathinfo.time;
+	stbuf->st_atime = pathinfo.time;
+	stbuf->st_ino   = pathinfo.inode;
+	stbuf->st_mode  = 0;
+
+	changeOwnerToUserIfPackaged = 1;
+
+	switch (pathinfo.type) {
+		case APPFS_PATHTYPE_DIRECTORY:
+			stbuf->st_mode = S_IFDIR | 0555;
+			stbuf->st_nlink = 2 + pathinfo.typeinfo.dir.childcount;
+			break;
+		case APPFS_PATHTYPE_FILE:
+			stbuf->st_mode = S_IFREG | 0444;
+
+			if (pathinfo.typeinfo.file.executable) {
+				stbuf->st_mode |= 0111;
+			}
+
+			if (pathinfo.packaged) {
+				if (pathinfo.typeinfo.file.suidRoot) {
+					changeOwnerToUserIfPackaged = 0;
+
+					stbuf->st_mode |= 04000;
+				}
+			}
+
+			if (pathinfo.typeinfo.file.worldaccessible) {
+				stbuf->st_mode &= ~077;
+			}
+
+			stbuf->st_nlink = 1;
+			stbuf->st_size = pathinfo.typeinfo.file.size;
+
+			break;
+		case APPFS_PATHTYPE_SYMLINK:
+			stbuf->st_mode = S_IFLNK | 0555;
+			stbuf->st_nlink = 1;
+			stbuf->st_size = pathinfo.typeinfo.symlink.size;
+			break;
+		case APPFS_PATHTYPE_SOCKET:
+			stbuf->st_mode = S_IFSOCK | 0555;
+			stbuf->st_nlink = 1;
+			stbuf->st_size = 0;
+			break;
+		case APPFS_PATHTYPE_FIFO:
+			stbuf->st_mode = S_IFIFO | 0555;
+			stbuf->st_nlink = 1;
+			stbuf->st_size = 0;
+			break;
+		case APPFS_PATHTYPE_DOES_NOT_EXIST:
+			retval = -ENOENT;
+
+			break;
+		case APPFS_PATHTYPE_INVALID:
+			retval = -EIO;
+
+			break;
+	}
+
+	if ((pathinfo.packaged && changeOwnerToUserIfPackaged) || (!pathinfo.packaged)) {
+		stbuf->st_uid   = appfs_get_fsuid();
+		stbuf->st_gid   = appfs_get_fsgid();
+		stbuf->st_mode |= 0200;
+	}
+
+	return(retval);
+}
+
+struct appfs_fuse_readdir_tcl_data {
+	const char *path;
+	fuse_req_t req;
+	struct appfs_dirbuf *dirbuf;
+};
+
+static int appfs_fuse_readdir_tcl(Tcl_Interp *interp, void *_data) {
+	struct appfs_fuse_readdir_tcl_data *data;
+	struct appfs_dirbuf *dirbuf;
+	Tcl_Obj **children;
+	char child_path[PATH_MAX];
+	const char *child, *path;
+	fuse_req_t req;
+	int children_count, idx;
+	int tcl_ret;
+
+	data = _data;
+	path = data->path;
+	req = data->req;
+	dirbuf = data->dirbuf;
+
+	if (interp == NULL) {
+		APPFS_DEBUG("error: Unable to get an interpreter");
+
+		return(0);
+	}
+
+	appfs_call_libtcl(Tcl_Preserve(interp);)
+
+	tcl_ret = appfs_Tcl_Eval(interp, 2, "::appfs::getchildren", path);
+	if (tcl_ret != TCL_OK) {
+		APPFS_DEBUG("::appfs::getchildren(%s) failed.", path);
+		appfs_call_libtcl(
+			APPFS_DEBUG("Tcl Error is: %s", Tcl_GetStringResult(interp));
+		)
+
+		appfs_call_libtcl(Tcl_Release(interp);)
+
+		return(0);
+	}
+
+	appfs_call_libtcl(
+		tcl_ret = Tcl_ListObjGetElements(interp, Tcl_GetObjResult(interp), &children_count, &children);
+	)
+	if (tcl_ret != TCL_OK) {
+		APPFS_DEBUG("Parsing list of children on path %s failed.", path);
+		appfs_call_libtcl(
+			APPFS_DEBUG("Tcl Error is: %s", Tcl_GetStringResult(interp));
+		)
+
+		appfs_call_libtcl(Tcl_Release(interp);)
+
+		return(0);
+	}
+
+	for (idx = 0; idx < children_count; idx++) {
+		appfs_call_libtcl(
+			child = Tcl_GetString(children[idx]);
+		)
+
+		snprintf(child_path, sizeof(child_path), "%s/%s", strcmp(path, "/") == 0 ? "" : path, child);
+
+		appfs_dirbuf_add(req, dirbuf, child, appfs_get_path_inode(child_path, -1));
+	}
+
+	appfs_call_libtcl(Tcl_Release(interp);)
+
+	return(0);
+}
+
+static int appfs_fuse_readdir(const char *path, struct appfs_path_context *context, fuse_ino_t ino, fuse_ino_t parent, fuse_req_t req, struct appfs_dirbuf *dirbuf) {
+	struct appfs_fuse_readdir_tcl_data data;
+	struct appfs_pathinfo pathinfo;
+	char overlay[PATH_MAX];
+	int native_ret;
+
+	APPFS_DEBUG("Enter (path = %s, ...)", path);
+
+	appfs_dirbuf_add(req, dirbuf, ".", ino);
+	appfs_dirbuf_add(req, dirbuf, "..", parent);
+
+	if (__sync_fetch_and_add(&appfs_native_resolver, 0)) {
+		native_ret = appfs_get_path_info_native(path, context, appfs_get_fsuid(), &pathinfo, overlay, req, dirbuf);
+		if (native_ret == 0 && pathinfo.type == APPFS_PATHTYPE_DIRECTORY) {
+			appfs_get_path_info_cache_add_shared(path, overlay, &pathinfo);
+
+			return(0);
+		}
+	}
+
+	data.path = path;
+	data.req = req;
+	data.dirbuf = dirbuf;
+
+	return(appfs_tcl_call(appfs_fuse_readdir_tcl, &data));
+}
+
+static int appfs_fuse_open(const char *path, struct fuse_file_info *fi) {
+	struct appfs_pathinfo pathinfo;
+	const char *mode;
+	char *real_path, **stream_argv;
+	int gpi_ret, stream_argc;
+	int fh;
+
+	APPFS_DEBUG("Enter (path = %s, ...)", path);
+
+#if defined(APPFS_EXEC_PATH_ENABLE_MAJOR_SECURITY_HOLE)
+	if (strcmp(path, "/exec") == 0) {
+		fi->fh = 0;
+
+		return(0);
+	}
+#endif
+
+	gpi_ret = appfs_get_path_info(path, &pathinfo);
+
+	if ((fi->flags & (O_WRONLY|O_CREAT)) == (O_CREAT|O_WRONLY)) {
+		/* The file will be created if it does not exist */
+		if (gpi_ret != 0 && gpi_ret != -ENOENT) {
+			APPFS_DEBUG("error: get_path_info failed");
+
+			return(gpi_ret);
+		}
+
+		mode = "create";
+
+		/*
+		 * We have to clear the cache here so that the number of
+		 * links gets maintained on the parent directory
+		 */
+		appfs_get_path_info_cache_flush(appfs_get_fsuid(), -1);
+	} else {
+		/* The file must already exist */
+		if (gpi_ret != 0) {
+			APPFS_DEBUG("error: get_path_info failed");
+
+			return(gpi_ret);
+		}
+
+		mode = "";
+
+		if ((fi->flags & O_WRONLY) == O_WRONLY) {
+			mode = "write";
+		}
+	}
+
+	if (pathinfo.type == APPFS_PATHTYPE_DIRECTORY) {
+		APPFS_DEBUG("error: Asked to open a directory.");
+
+		return(-EISDIR);
+	}
+
+	/*
+	 * Packaged files being opened for reading may be read from while
+	 * they are still being downloaded
+	 */
+	if (mode[0] == '\0' && pathinfo.packaged && __sync_fetch_and_add(&appfs_streaming_started, 0)) {
+		mode = "stream";
+	}
+
+	real_path = appfs_tcl_call_string("::appfs::openpath", path, mode);
+	if (real_path == NULL) {
+		APPFS_DEBUG("::appfs::openpath(%s, %s) failed.", path, mode);
+
+		return(-EIO);
+	}
+
+	/* Packaged files opened for writing are copied into the overlay */
+	if (strcmp(mode, "write") == 0) {
+		appfs_get_path_info_cache_rm_overlay(path, appfs_get_fsuid());
+	}
+
+	/*
+	 * In streaming mode the result is either the path to open, or the
+	 * site and hash of the file to download
+	 */
+	if (strcmp(mode, "stream") == 0) {
+		stream_argv = NULL;
+		if (Tcl_SplitList(NULL, real_path, &stream_argc, (const char ***) &stream_argv) != TCL_OK || (stream_argc != 1 && stream_argc != 3)) {
+			APPFS_DEBUG("::appfs::openpath(%s, %s) returned an invalid result: %s", path, mode, real_path);
+
+			if (stream_argv != NULL) {
+				Tcl_Free((char *) stream_argv);
+			}
+
+			free(real_path);
+
+			return(-EIO);
+		}
+
+		free(real_path);
+
+		if (stream_argc == 3) {
+			fh = appfs_stream_open(stream_argv[1], stream_argv[2], pathinfo.typeinfo.file.size, fi->flags);
+
+			if (fh >= 0) {
+				appfs_elf_prefetch_start(path, stream_argv[1], stream_argv[2], pathinfo.typeinfo.file.size);
+			}
+
+			Tcl_Free((char *) stream_argv);
+
+			if (fh < 0) {
+				APPFS_DEBUG("error: open failed");
+
+				return(fh);
+			}
+
+			fi->fh = fh;
+			fi->keep_cache = 0;
+
+			APPFS_DEBUG("Opened \"%s\" for streaming with file descriptor %i", path, fh);
+
+			return(0);
+		}
+
+		real_path = strdup(stream_argv[0]);
+
+		Tcl_Free((char *) stream_argv);
+
+		if (real_path == NULL) {
+			return(-ENOMEM);
+		}
+
+		mode = "";
+	}
+
+	APPFS_DEBUG("Translated request to open %s to opening %s (mode = \"%s\")", path, real_path, mode);
+
+	fh = open(real_path, fi->flags, 0600);
+
+	if (fh < 0) {
+		APPFS_DEBUG("error: open failed");
+
+		free(real_path);
+
+		return(errno * -1);
+	}
+
+	fi->fh = fh;
+
+	/*
+	 * Files opened read-only out of the content-addressed cache are
+	 * immutable, so there is no need for the kernel to drop its page
+	 * cache for them every time they are opened
+	 */
+	fi->keep_cache = 0;
+	if (appfs_keep_cache && mode[0] == '\0' && pathinfo.packaged) {
+		if (strncmp(real_path, appfs_cachedir, strlen(appfs_cachedir)) == 0 && real_path[strlen(appfs_cachedir)] == '/') {
+			fi->keep_cache = 1;
+		}
+	}
+
+	APPFS_DEBUG("Opened \"%s\" (for \"%s\") with file descriptor %i, keep_cache = %i", real_path, path, fh, (int) fi->keep_cache);
+
+	free(real_path);
+
+	return(0);
+}
+
+static int appfs_fuse_close(const char *path, struct fuse_file_info *fi) {
+	int close_ret;
+
+	APPFS_DEBUG("Enter (path = %s, ...)", path);
+
+#if defined(APPFS_EXEC_PATH_ENABLE_MAJOR_SECURITY_HOLE)
+	if (strcmp(path, "/exec") == 0) {
+		return(0);
+	}
+#endif
+
+	/* Only files opened for writing can have changed */
+	if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+		appfs_get_path_info_cache_rm(path, appfs_get_fsuid());
+	}
+
+	appfs_stream_close(fi->fh);
+
+	close_ret = close(fi->fh);
+	if (close_ret != 0) {
+		APPFS_DEBUG("error: close failed");
+
+		return(errno * -1);
+	}
+
+	return(0);
+}
+
+#ifdef APPFS_NO_PREAD /* XXX:TODO: Write a wrapper function */
+/*
+ * Without pread() FUSE cannot read from the file descriptor itself, so
+ * it must be read here
+ */
+static int appfs_fuse_read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+	ssize_t read_ret;
+	int retval;
+
+	APPFS_DEBUG("Enter (buf, size = %lli, offset = %lli, fd = %lli)", (long long) size, (long long) offset, (long long) fi->fh);
+
+	retval = 0;
+
+	while (size != 0) {
+		off_t seek_ret;
+
+		seek_ret = lseek(fi->fh, offset, SEEK_SET);
+		if (seek_ret == offset) {
+			read_ret = read(fi->fh, buf, size);
+		} else {
+			read_ret = -1;
+		}
+
+		if (read_ret < 0) {
+			APPFS_DEBUG("error: read failed");
+
+			return(errno * -1);
+		}
+
+		if (read_ret == 0) {
+			break;
+		}
+
+		size -= read_ret;
+		buf  += read_ret;
+		offset += read_ret;
+		retval += read_ret;
+	}
+
+	if (size != 0) {
+		APPFS_DEBUG("error: incomplete read (this might be an error because FUSE will request the exact length of the file)");
+	}
+
+	APPFS_DEBUG("Returning: %i", retval);
+
+	return(retval);
+}
+#endif
+
+static int appfs_fuse_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+	ssize_t write_ret;
+	int retval;
+
+	APPFS_DEBUG("Enter (path = %s, ...)", path);
+
+#if defined(APPFS_EXEC_PATH_ENABLE_MAJOR_SECURITY_HOLE)
+	if (strcmp(path, "/exec") == 0) {
+		appfs_runTcl(buf, size);
+
+		return(size);
+	}
+#endif
+
+	appfs_get_path_info_cache_rm(path, appfs_get_fsuid());
+
+	retval = 0;
+
+	while (size != 0) {
+#ifdef APPFS_NO_PWRITE /* XXX:TODO: Write a wrapper function */
+#  if 1
+		/* XXX:TODO: Still fails on win32 */
+		write_ret = -1;
+#else
+		off_t seek_ret;
+
+		seek_ret = lseek(fi->fh, offset, SEEK_SET);
+		if (seek_ret == offset) {
+			write_ret = write(fi->fh, buf, size); 
+		} else {
+			write_ret = -1;
+		}
+#  endif
+#else
+		write_ret = pwrite(fi->fh, buf, size, offset);
+#endif
+
+		if (write_ret < 0) {
+			APPFS_DEBUG("error: write failed");
+
+			return(errno * -1);
+		}
+
+		if (write_ret == 0) {
+			break;
+		}
+
+		size -= write_ret;
+		buf  += write_ret;
+		offset += write_ret;
+		retval += write_ret;
+	}
+
+	if (size != 0) {
+		APPFS_DEBUG("error: incomplete write");
+	}
+
+	return(retval);
+}
+
+static int appfs_fuse_mknod(const char *path, mode_t mode, dev_t device) {
+	char *real_path;
+	int mknod_ret;
+
+	APPFS_DEBUG("Enter (path = %s, ...)", path);
+
+	if ((mode & S_IFCHR) == S_IFCHR) {
+		return(-EPERM);
+	}
+
+	if ((mode & S_IFBLK) == S_IFBLK) {
+		return(-EPERM);
+	}
+
+	real_path = appfs_prepare_to_create(path);
+	if (real_path == NULL) {
+		return(-EIO);
+	}
+
+	appfs_simulate_user_fs_enter();
+
+	mknod_ret = mknod(real_path, mode, device);
+
+	appfs_simulate_user_fs_leave();
+
+	free(real_path);
+
+	if (mknod_ret != 0) {
+		return(errno * -1);
+	}
+
+	return(0);
+}
+
+static int appfs_fuse_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+	char *real_path;
+	int fd;
+
+	APPFS_DEBUG("Enter (path = %s, ...)", path);
+
+	if ((mode & S_IFCHR) == S_IFCHR) {
+		return(-EPERM);
+	}
+
+	if ((mode & S_IFBLK) == S_IFBLK) {
+		return(-EPERM);
+	}
+
+	real_path = appfs_prepare_to_create(path);
+	if (real_path == NULL) {
+		return(-EIO);
+	}
+
+	appfs_simulate_user_fs_enter();
+
+	fd = creat(real_path, mode);
+
+	appfs_simulate_user_fs_leave();
+
+	free(real_path);
+
+	if (fd < 0) {
+		return(errno * -1);
+	}
+
+	fi->fh = fd;
+
+	return(0);
+}
+
+static int appfs_fuse_truncate(const char *path, off_t size) {
+	char *real_path;
+	int truncate_ret;
+
+	APPFS_DEBUG("Enter (path = %s, ...)", path);
+
+#if defined(APPFS_EXEC_PATH_ENABLE_MAJOR_SECURITY_HOLE)
+	if (strcmp(path, "/exec") == 0) {
+		return(0);
+	}
+#endif
+
+	real_path = appfs_localpath(path);
+	if (real_path == NULL) {
+		return(-EIO);
+	}
+
+	appfs_get_path_info_cache_rm_overlay(path, appfs_get_fsuid());
+
+	appfs_simulate_user_fs_enter();
+
+	truncate_ret = truncate(real_path, size);
+
+	appfs_simulate_user_fs_leave();
+
+	free(real_path);
+
+	if (truncate_ret != 0) {
+		return(errno * -1);
+	}
+
+	return(0);
+}
+
+static int appfs_fuse_unlink_rmdir(const char *path) {
+	char *result;
+
+	APPFS_DEBUG("Enter (path = %s, ...)", path);
+
+	appfs_get_path_info_cache_flush(appfs_get_fsuid(), -1);
+
+	result = appfs_tcl_call_string("::appfs::unlinkpath", path, NULL);
+	if (result == NULL) {
+		APPFS_DEBUG("::appfs::unlinkpath(%s) failed.", path);
+
+		return(-EIO);
+	}
+
+	free(result);
+
+	return(0);
+}
+
+static int appfs_fuse_mkdir(const char *path, mode_t mode) {
+	char *real_path;
+	int mkdir_ret;
+
+	APPFS_DEBUG("Enter (path = %s, ...)", path);
+
+	real_path = appfs_prepare_to_create(path);
+	if (real_path == NULL) {
+		return(-EIO);
+	}
+
+	appfs_simulate_user_fs_enter();
+
+	mkdir_ret = mkdir(real_path, mode);
+
+	appfs_simulate_user_fs_leave();
+
+	free(real_path);
+
+	if (mkdir_ret != 0) {
+		if (errno != EEXIST) {
+			return(errno * -1);
+		}
+	}
+
+	return(0);
+}
+
+static int appfs_fuse_chmod(const char *path, mode_t mode) {
+	char *real_path;
+	int chmod_ret;
+
+	APPFS_DEBUG("Enter (path = %s, ...)", path);
+
+	real_path = appfs_tcl_call_string("::appfs::openpath", path, "write");
+	if (real_path == NULL) {
+		APPFS_DEBUG("::appfs::openpath(%s, %s) failed.", path, "write");
+
+		return(-EIO);
+	}
+
+	appfs_get_path_info_cache_rm_overlay(path, appfs_get_fsuid());
+
+	appfs_simulate_user_fs_enter();
+
+	chmod_ret = chmod(real_path, mode);
+
+	appfs_simulate_user_fs_leave();
+
+	free(real_path);
+
+	if (chmod_ret != 0) {
+		return(errno * -1);
+	}
+
+	return(0);
+}
+
+static int appfs_fuse_symlink(const char *oldpath, const char *newpath) {
+	char *real_path;
+	int symlink_ret;
+
+	APPFS_DEBUG("Enter (path = %s, %s)", oldpath, newpath);
+
+	real_path = appfs_prepare_to_create(newpath);
+	if (real_path == NULL) {
+		return(-EIO);
+	}
+
+	appfs_simulate_user_fs_enter();
+
+	symlink_ret = symlink(oldpath, real_path);
+
+	appfs_simulate_user_fs_leave();
+
+	free(real_path);
+
+	if (symlink_ret != 0) {
+		return(errno * -1);
+	}
+
+	return(0);
+}
+
+/*
+ * FUSE low-level operations:
+ *         Translate the inode numbers the kernel uses into paths and hand
+ *         the request off to the path-based implementations above
+ */
+static int appfs_fuse_ll_entry(fuse_ino_t parent, const char *name, const char *path, struct appfs_path_context *context, struct fuse_entry_param *entry) {
+	int getattr_ret, packaged;
+
+	memset(entry, 0, sizeof(*entry));
+
+	getattr_ret = appfs_fuse_getattr(path, context, &entry->attr, &packaged);
+	if (getattr_ret != 0) {
+		return(getattr_ret);
+	}
+
+	entry->ino = appfs_inode_ref(parent, name, path, context);
+	if (entry->ino == 0) {
+		return(-ENOMEM);
+	}
+
+	entry->attr.st_ino = entry->ino;
+
+	if (packaged) {
+		entry->attr_timeout = appfs_packaged_timeout;
+		entry->entry_timeout = appfs_packaged_timeout;
+	} else {
+		entry->attr_timeout = appfs_attr_timeout;
+		entry->entry_timeout = appfs_entry_timeout;
+	}
+
+	return(0);
+}
+
+static void appfs_fuse_ll_reply_entry(fuse_req_t req, fuse_ino_t parent, const char *name, const char *path, struct appfs_path_context *context) {
+	struct fuse_entry_param entry;
+	int entry_ret;
+
+	entry_ret = appfs_fuse_ll_entry(parent, name, path, context, &entry);
+	if (entry_ret != 0) {
+		fuse_reply_err(req, -entry_ret);
+
+		return;
+	}
+
+	if (fuse_reply_entry(req, &entry) != 0) {
+		/* The kernel did not get the reference, so drop it */
+		appfs_inode_forget(entry.ino, 1);
+	}
+
+	return;
+}
+
+static void appfs_fuse_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+	struct appfs_path_context context;
+	char *path;
+
+	appfs_fuse_enter(req);
+
+	path = appfs_inode_child_path(parent, name, &context);
+	if (path == NULL) {
+		fuse_reply_err(req, ESTALE);
+
+		return;
+	}
+
+	APPFS_DEBUG("Enter (parent = %llu, name = %s, path = %s)", (unsigned long long) parent, name, path);
+
+	appfs_fuse_ll_reply_entry(req, parent, name, path, &context);
+
+	appfs_package_context_release(context.package);
+
+	free(path);
+
+	return;
+}
+
+static void appfs_fuse_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+	appfs_inode_forget(ino, nlookup);
+
+	fuse_reply_none(req);
+
+	return;
+}
+
+static void appfs_fuse_ll_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets) {
+	size_t idx;
+
+	for (idx = 0; idx < count; idx++) {
+		appfs_inode_forget(forgets[idx].ino, forgets[idx].nlookup);
+	}
+
+	fuse_reply_none(req);
+
+	return;
+}
+
+static void appfs_fuse_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	struct appfs_path_context context;
+	struct stat stbuf;
+	char *path;
+	int getattr_ret, packaged;
+
+	appfs_fuse_enter(req);
+
+	path = appfs_inode_path(ino, NULL, &context);
+	if (path == NULL) {
+		fuse_reply_err(req, ESTALE);
+
+		return;
+	}
+
+	getattr_ret = appfs_fuse_getattr(path, &context, &stbuf, &packaged);
+
+	appfs_package_context_release(context.package);
+
+	free(path);
+
+	if (getattr_ret != 0) {
+		fuse_reply_err(req, -getattr_ret);
+
+		return;
+	}
+
+	stbuf.st_ino = ino;
+
+	if (packaged) {
+		fuse_reply_attr(req, &stbuf, appfs_packaged_timeout);
+	} else {
+		fuse_reply_attr(req, &stbuf, appfs_attr_timeout);
+	}
+
+	return;
+}
+
+static void appfs_fuse_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi) {
+	char *path;
+	int setattr_ret;
+
+	appfs_fuse_enter(req);
 
-			return(-EIO);
-		}
+	path = appfs_inode_path(ino, NULL, NULL);
+	if (path == NULL) {
+		fuse_reply_err(req, ESTALE);
 
-		return(0);
+		return;
 	}
 
-	interp = appfs_TclInterp();
-	if (interp == NULL) {
-		APPFS_DEBUG("error: Unable to get an interpreter");
+	setattr_ret = 0;
 
-		return(-EIO);
+	if (setattr_ret == 0 && (to_set & FUSE_SET_ATTR_MODE) == FUSE_SET_ATTR_MODE) {
+		setattr_ret = appfs_fuse_chmod(path, attr->st_mode);
 	}
 
-	appfs_call_libtcl(Tcl_Preserve(interp);)
+	if (setattr_ret == 0 && (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) != 0) {
+		setattr_ret = -ENOSYS;
+	}
 
-	tcl_ret = appfs_Tcl_Eval(interp, 2, "::appfs::getattr", path);
-	if (tcl_ret != TCL_OK) {
-		APPFS_DEBUG("::appfs::getattr(%s) failed.", path);
-		appfs_call_libtcl(
-			APPFS_DEBUG("Tcl Error is: %s", Tcl_GetStringResult(interp));
-		)
+	if (setattr_ret == 0 && (to_set & FUSE_SET_ATTR_SIZE) == FUSE_SET_ATTR_SIZE) {
+		setattr_ret = appfs_fuse_truncate(path, attr->st_size);
+	}
 
-		pathinfo->type = APPFS_PATHTYPE_DOES_NOT_EXIST;
+	if (setattr_ret == 0 && (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME)) != 0) {
+		setattr_ret = -ENOSYS;
+	}
 
-		appfs_get_path_info_cache_add(path, fsuid, pathinfo);
+	free(path);
 
-		appfs_call_libtcl(Tcl_Release(interp);)
+	if (setattr_ret != 0) {
+		fuse_reply_err(req, -setattr_ret);
 
-		return(-ENOENT);
+		return;
 	}
 
-	if (attr_key_type == NULL) {
-		appfs_call_libtcl(
-			attr_key_type       = Tcl_NewStringObj("type", -1);
-			attr_key_perms      = Tcl_NewStringObj("perms", -1);
-			attr_key_size       = Tcl_NewStringObj("size", -1);
-			attr_key_time       = Tcl_NewStringObj("time", -1);
-			attr_key_source     = Tcl_NewStringObj("source", -1);
-			attr_key_childcount = Tcl_NewStringObj("childcount", -1);
-			attr_key_packaged   = Tcl_NewStringObj("packaged", -1);
+	appfs_kernel_inval_queue(0, ino, NULL);
 
-			Tcl_IncrRefCount(attr_key_type);
-			Tcl_IncrRefCount(attr_key_perms);
-			Tcl_IncrRefCount(attr_key_size);
-			Tcl_IncrRefCount(attr_key_time);
-			Tcl_IncrRefCount(attr_key_source);
-			Tcl_IncrRefCount(attr_key_childcount);
-			Tcl_IncrRefCount(attr_key_packaged);
-		)
-	}
+	appfs_fuse_ll_getattr(req, ino, fi);
 
-	appfs_call_libtcl(
-		attrs_dict = Tcl_GetObjResult(interp);
-		tcl_ret = Tcl_DictObjGet(interp, attrs_dict, attr_key_type, &attr_value);
-	)
-	if (tcl_ret != TCL_OK) {
-		APPFS_DEBUG("[dict get \"type\"] failed");
-		appfs_call_libtcl(
-			APPFS_DEBUG("Tcl Error is: %s", Tcl_GetStringResult(interp));
-		)
+	return;
+}
 
-		appfs_call_libtcl(Tcl_Release(interp);)
+static void appfs_fuse_ll_readlink(fuse_req_t req, fuse_ino_t ino) {
+	char buf[PATH_MAX], *path;
+	int readlink_ret;
 
-		return(-EIO);
+	appfs_fuse_enter(req);
+
+	path = appfs_inode_path(ino, NULL, NULL);
+	if (path == NULL) {
+		fuse_reply_err(req, ESTALE);
+
+		return;
 	}
 
-	if (attr_value == NULL) {
-		APPFS_DEBUG("error: Unable to get type for \"%s\" from Tcl", path);
+	readlink_ret = appfs_fuse_readlink(path, buf, sizeof(buf));
 
-		appfs_call_libtcl(Tcl_Release(interp);)
+	free(path);
 
-		return(-EIO);
+	if (readlink_ret != 0) {
+		fuse_reply_err(req, -readlink_ret);
+
+		return;
 	}
 
-	pathinfo->packaged = 0;
+	fuse_reply_readlink(req, buf);
 
-	appfs_call_libtcl(
-		attr_value_str = Tcl_GetString(attr_value);
+	return;
+}
 
-		switch (attr_value_str[0]) {
-			case 'd': /* directory */
-				pathinfo->type = APPFS_PATHTYPE_DIRECTORY;
-				pathinfo->typeinfo.dir.childcount = 0;
+static void appfs_fuse_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	struct appfs_path_context context;
+	struct appfs_dirbuf *dirbuf;
+	fuse_ino_t parent;
+	char *path;
 
-				Tcl_DictObjGet(interp, attrs_dict, attr_key_childcount, &attr_value);
-				if (attr_value != NULL) {
-					tcl_ret = Tcl_GetWideIntFromObj(NULL, attr_value, &attr_value_wide);
-					if (tcl_ret == TCL_OK) {
-						pathinfo->typeinfo.dir.childcount = attr_value_wide;
-					}
-				}
+	appfs_fuse_enter(req);
 
-				break;
-			case 'f': /* file */
-				pathinfo->type = APPFS_PATHTYPE_FILE;
-				pathinfo->typeinfo.file.size = 0;
-				pathinfo->typeinfo.file.executable = 0;
-				pathinfo->typeinfo.file.suidRoot = 0;
-				pathinfo->typeinfo.file.worldaccessible = 0;
+	path = appfs_inode_path(ino, &parent, &context);
+	if (path == NULL) {
+		fuse_reply_err(req, ESTALE);
 
-				Tcl_DictObjGet(interp, attrs_dict, attr_key_size, &attr_value);
-				if (attr_value != NULL) {
-					tcl_ret = Tcl_GetWideIntFromObj(NULL, attr_value, &attr_value_wide);
-					if (tcl_ret == TCL_OK) {
-						pathinfo->typeinfo.file.size = attr_value_wide;
-					}
-				}
+		return;
+	}
 
-				Tcl_DictObjGet(interp, attrs_dict, attr_key_perms, &attr_value);
-				if (attr_value != NULL) {
-					attr_value_str = Tcl_GetString(attr_value);
-					for (attr_value_str_i = &attr_value_str[0]; *attr_value_str_i != '\0'; attr_value_str_i++) {
-						switch (*attr_value_str_i) {
-							case 'x':
-								pathinfo->typeinfo.file.executable = 1;
+	dirbuf = calloc(1, sizeof(*dirbuf));
+	if (dirbuf == NULL) {
+		appfs_package_context_release(context.package);
 
-								break;
-							case 'U':
-								pathinfo->typeinfo.file.suidRoot = 1;
+		free(path);
 
-								break;
-							case '-':
-								pathinfo->typeinfo.file.worldaccessible = 1;
+		fuse_reply_err(req, ENOMEM);
 
-								break;
-						}
-					}
-				}
-				break;
-			case 's': /* symlink */
-				pathinfo->type = APPFS_PATHTYPE_SYMLINK;
-				pathinfo->typeinfo.symlink.size = 0;
-				pathinfo->typeinfo.symlink.source[0] = '\0';
+		return;
+	}
 
-				Tcl_DictObjGet(interp, attrs_dict, attr_key_source, &attr_value);
-				if (attr_value != NULL) {
-					attr_value_str = Tcl_GetStringFromObj(attr_value, &attr_value_int); 
+	appfs_fuse_readdir(path, &context, ino, parent, req, dirbuf);
 
-					if ((attr_value_int + 1) <= sizeof(pathinfo->typeinfo.symlink.source)) {
-						pathinfo->typeinfo.symlink.size = attr_value_int;
-						pathinfo->typeinfo.symlink.source[attr_value_int] = '\0';
+	appfs_package_context_release(context.package);
 
-						memcpy(pathinfo->typeinfo.symlink.source, attr_value_str, attr_value_int);
-					}
-				}
-				break;
-			case 'F': /* pipe/fifo */
-				pathinfo->type = APPFS_PATHTYPE_FIFO;
-				break;
-			case 'S': /* UNIX domain socket */
-				pathinfo->type = APPFS_PATHTYPE_SOCKET;
-				break;
-			default:
-				retval = -EIO;
-		}
+	free(path);
 
-		Tcl_DictObjGet(interp, attrs_dict, attr_key_packaged, &attr_value);
-		if (attr_value != NULL) {
-			pathinfo->packaged = 1;
-		}
+	fi->fh = (uintptr_t) dirbuf;
 
-		Tcl_DictObjGet(interp, attrs_dict, attr_key_time, &attr_value);
-		if (attr_value != NULL) {
-			tcl_ret = Tcl_GetWideIntFromObj(NULL, attr_value, &attr_value_wide);
-			if (tcl_ret == TCL_OK) {
-				pathinfo->time = attr_value_wide;
-			}
-		} else {
-			pathinfo->time = appfs_boottime;
-		}
+	if (fuse_reply_open(req, fi) != 0) {
+		free(dirbuf->buf);
+		free(dirbuf);
+	}
 
-		Tcl_Release(interp);
-	)
+	return;
+}
 
-	if (pathinfo->packaged) {
-		pathinfo->inode = appfs_get_path_inode(path, -1);
-	} else {
-		pathinfo->inode = appfs_get_path_inode(path, fsuid);
-	}
+static void appfs_fuse_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+	struct appfs_dirbuf *dirbuf;
 
-	APPFS_DEBUG("Caching inode for path=%s,uid=%lli as %llu (packaged = %i)", path, (long long) fsuid, pathinfo->inode, pathinfo->packaged);
+	dirbuf = (struct appfs_dirbuf *) (uintptr_t) fi->fh;
 
-	if (retval == 0) {
-		appfs_get_path_info_cache_add(path, fsuid, pathinfo);
-	} else {
-		APPFS_DEBUG("error: Invalid type for \"%s\" from Tcl", path);
+	if (off >= dirbuf->size) {
+		fuse_reply_buf(req, NULL, 0);
+
+		return;
 	}
 
-	return(retval);
+	if (size > (dirbuf->size - off)) {
+		size = dirbuf->size - off;
+	}
+
+	fuse_reply_buf(req, dirbuf->buf + off, size);
+
+	return;
 }
 
-static char *appfs_prepare_to_create(const char *path) {
-	Tcl_Interp *interp;
-	const char *real_path;
-	int tcl_ret;
+static void appfs_fuse_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	struct appfs_dirbuf *dirbuf;
 
-	appfs_get_path_info_cache_flush(appfs_get_fsuid(), -1);
+	dirbuf = (struct appfs_dirbuf *) (uintptr_t) fi->fh;
 
-	interp = appfs_TclInterp();
-	if (interp == NULL) {
-		return(NULL);
+	free(dirbuf->buf);
+	free(dirbuf);
+
+	fuse_reply_err(req, 0);
+
+	return;
+}
+
+static void appfs_fuse_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	char *path;
+	int open_ret;
+
+	appfs_fuse_enter(req);
+
+	path = appfs_inode_path(ino, NULL, NULL);
+	if (path == NULL) {
+		fuse_reply_err(req, ESTALE);
+
+		return;
 	}
 
-	appfs_call_libtcl(Tcl_Preserve(interp);)
+	open_ret = appfs_fuse_open(path, fi);
 
-	appfs_call_libtcl(
-		tcl_ret = appfs_Tcl_Eval(interp, 2, "::appfs::prepare_to_create", path);
-	)
-	if (tcl_ret != TCL_OK) {
-		APPFS_DEBUG("::appfs::prepare_to_create(%s) failed.", path);
-		appfs_call_libtcl(
-			APPFS_DEBUG("Tcl Error is: %s", Tcl_GetStringResult(interp));
-		)
+	free(path);
 
-		appfs_call_libtcl(Tcl_Release(interp);)
+	if (open_ret != 0) {
+		fuse_reply_err(req, -open_ret);
 
-		return(NULL);
+		return;
 	}
 
-	appfs_call_libtcl(
-		real_path = Tcl_GetStringResult(interp);
-	)
+	if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+		/*
+		 * Opening for writing may have copied the file into the
+		 * user's home directory, so it is no longer packaged
+		 */
+		appfs_kernel_inval_queue(0, ino, NULL);
+	}
 
-	appfs_call_libtcl(Tcl_Release(interp);)
+	/*
+	 * The kernel's page cache is per-inode, not per-user, so if another
+	 * user has read their own copy of this file since it was last opened
+	 * out of the content-addressed cache, do not keep the page cache
+	 * this time around
+	 */
+	if (fi->keep_cache) {
+		if (appfs_inode_page_cache_taint(ino, 0)) {
+			fi->keep_cache = 0;
+		}
+	} else {
+		appfs_inode_page_cache_taint(ino, 1);
+	}
 
-	if (real_path == NULL) {
-		return(NULL);
+	if (fuse_reply_open(req, fi) != 0) {
+		appfs_stream_close(fi->fh);
+
+		close(fi->fh);
 	}
 
-	return(strdup(real_path));
+	return;
 }
 
-static char *appfs_localpath(const char *path) {
-	Tcl_Interp *interp;
-	const char *real_path;
-	int tcl_ret;
+static void appfs_fuse_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	char *path;
+	int close_ret;
 
-	interp = appfs_TclInterp();
-	if (interp == NULL) {
-		return(NULL);
-	}
+	appfs_fuse_enter(req);
 
-	appfs_call_libtcl(Tcl_Preserve(interp);)
+	path = appfs_inode_path(ino, NULL, NULL);
+	if (path == NULL) {
+		appfs_stream_close(fi->fh);
 
-	appfs_call_libtcl(
-		tcl_ret = appfs_Tcl_Eval(interp, 2, "::appfs::localpath", path);
-	)
-	if (tcl_ret != TCL_OK) {
-		APPFS_DEBUG("::appfs::localpath(%s) failed.", path);
-		appfs_call_libtcl(
-			APPFS_DEBUG("Tcl Error is: %s", Tcl_GetStringResult(interp));
-		)
+		close(fi->fh);
 
-		return(NULL);
+		fuse_reply_err(req, 0);
+
+		return;
 	}
 
-	appfs_call_libtcl(
-		real_path = Tcl_GetStringResult(interp);
-	)
+	close_ret = appfs_fuse_close(path, fi);
 
-	appfs_call_libtcl(Tcl_Release(interp);)
+	free(path);
 
-	if (real_path == NULL) {
-		return(NULL);
-	}
+	fuse_reply_err(req, -close_ret);
 
-	return(strdup(real_path));
+	return;
 }
 
-#if (defined(DEBUG) && defined(APPFS_EXIT_PATH)) || defined(APPFS_EXIT_PATH_ENABLE_MAJOR_SECURITY_HOLE)
-static void appfs_exit(void) {
-	int global_interp_reset_key;
+/*
+ * Reads are answered with a reference to the file descriptor rather than
+ * with the data itself, so that FUSE can splice() the data straight from
+ * the cache file into the FUSE device without it being copied through
+ * our address space
+ */
+static void appfs_fuse_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+#ifdef APPFS_NO_PREAD
+	char *buf;
+	int read_ret;
+#else
+	struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(size);
+#endif
+	int wait_ret;
 
-	global_interp_reset_key = __sync_fetch_and_add(&interp_reset_key, 0);
-	__sync_fetch_and_sub(&interp_reset_key, global_interp_reset_key);
+	appfs_fuse_enter(req);
 
-	while (__sync_sub_and_fetch(&interp_reset_key, 1) >= 0) {
-		/* Busy Loop */
+	/*
+	 * If the file is still being downloaded, wait for this part of it
+	 */
+	wait_ret = appfs_stream_wait(fi->fh, off, size);
+	if (wait_ret != 0) {
+		fuse_reply_err(req, -wait_ret);
+
+		return;
 	}
 
-	global_interp_reset_key = __sync_fetch_and_add(&interp_reset_key, 0);
-	if (global_interp_reset_key != -1) {
-		APPFS_DEBUG("Error sending kill signal to all threads, aborting anyway.");
+#ifndef APPFS_NO_PREAD
+	APPFS_DEBUG("Enter (size = %lli, offset = %lli, fd = %lli)", (long long) size, (long long) off, (long long) fi->fh);
+
+	bufv.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK | FUSE_BUF_FD_RETRY;
+	bufv.buf[0].fd = fi->fh;
+	bufv.buf[0].pos = off;
+
+	fuse_reply_data(req, &bufv, FUSE_BUF_SPLICE_MOVE);
+#else
+	buf = malloc(size);
+	if (buf == NULL) {
+		fuse_reply_err(req, ENOMEM);
+
+		return;
 	}
 
-	appfs_get_path_info_cache_flush(-1, -1);
+	read_ret = appfs_fuse_read(buf, size, off, fi);
+	if (read_ret < 0) {
+		fuse_reply_err(req, -read_ret);
+	} else {
+		fuse_reply_buf(req, buf, read_ret);
+	}
 
-	fuse_exit(fuse_get_context()->fuse);
+	free(buf);
+#endif
 
 	return;
 }
 
-#endif
+static void appfs_fuse_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off, struct fuse_file_info *fi) {
+	char *path;
+	int write_ret;
 
-#if defined(APPFS_EXEC_PATH_ENABLE_MAJOR_SECURITY_HOLE)
-static void appfs_runTcl(const char *script, size_t scriptLen) {
-	Tcl_Interp *interp;
-	Tcl_Obj *scriptObj;
-	int tcl_ret;
+	appfs_fuse_enter(req);
 
-	interp = appfs_TclInterp();
-	if (interp == NULL) {
-		APPFS_DEBUG("Error creating an interpreter.");
+	path = appfs_inode_path(ino, NULL, NULL);
+	if (path == NULL) {
+		fuse_reply_err(req, ESTALE);
 
 		return;
 	}
 
-	appfs_call_libtcl(
-		scriptObj = Tcl_NewStringObj(script, scriptLen);
+	write_ret = appfs_fuse_write(path, buf, size, off, fi);
 
-		Tcl_IncrRefCount(scriptObj);
-	)
+	free(path);
 
-	if (scriptObj == NULL) {
-		APPFS_DEBUG("Error creating a script object.");
+	if (write_ret < 0) {
+		fuse_reply_err(req, -write_ret);
 
 		return;
 	}
 
-	appfs_call_libtcl(
-		tcl_ret = Tcl_EvalObjEx(interp, scriptObj, TCL_EVAL_DIRECT);
-		Tcl_DecrRefCount(scriptObj);
-	)
+	appfs_kernel_inval_queue(0, ino, NULL);
 
-	if (tcl_ret != TCL_OK) {
-		appfs_call_libtcl(
-			APPFS_DEBUG("Script returned error %i: %s", tcl_ret, Tcl_GetStringResult(interp));
-		)
-	}
+	fuse_reply_write(req, write_ret);
 
 	return;
 }
-#endif
 
-static int appfs_fuse_readlink(const char *path, char *buf, size_t size) {
-	struct appfs_pathinfo pathinfo;
-	int retval = 0;
+static void appfs_fuse_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev) {
+	char *path;
+	int mknod_ret;
 
-	APPFS_DEBUG("Enter (path = %s, ...)", path);
+	appfs_fuse_enter(req);
 
-	pathinfo.type = APPFS_PATHTYPE_INVALID;
+	path = appfs_inode_child_path(parent, name, NULL);
+	if (path == NULL) {
+		fuse_reply_err(req, ESTALE);
 
-	retval = appfs_get_path_info(path, &pathinfo);
-	if (retval != 0) {
-		return(retval);
+		return;
 	}
 
-	if (pathinfo.type != APPFS_PATHTYPE_SYMLINK) {
-		return(-EINVAL);
-	}
+	mknod_ret = appfs_fuse_mknod(path, mode, rdev);
+	if (mknod_ret != 0) {
+		fuse_reply_err(req, -mknod_ret);
+	} else {
+		appfs_kernel_inval_queue(0, parent, NULL);
 
-	if ((strlen(pathinfo.typeinfo.symlink.source) + 1) > size) {
-		return(-ENAMETOOLONG);
+		appfs_fuse_ll_reply_entry(req, parent, name, path, NULL);
 	}
 
-	memcpy(buf, pathinfo.typeinfo.symlink.source, strlen(pathinfo.typeinfo.symlink.source) + 1);
+	free(path);
 
-	return(0);
+	return;
 }
 
-static int appfs_fuse_getattr(const char *path, struct stat *stbuf) {
-	struct appfs_pathinfo pathinfo;
-	int changeOwnerToUserIfPackaged;
-	int retval;
+static void appfs_fuse_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+	char *path;
+	int mkdir_ret;
 
-	retval = 0;
+	appfs_fuse_enter(req);
 
-	APPFS_DEBUG("Enter (path = %s, ...)", path);
+	path = appfs_inode_child_path(parent, name, NULL);
+	if (path == NULL) {
+		fuse_reply_err(req, ESTALE);
 
-#if (defined(DEBUG) && defined(APPFS_EXIT_PATH)) || defined(APPFS_EXIT_PATH_ENABLE_MAJOR_SECURITY_HOLE)
-	/*
-	 * This is a major security issue so we cannot let it be compiled into
-	 * any release
-	 */
-	if (strcmp(path, "/exit") == 0) {
-		appfs_exit();
+		return;
 	}
-#endif
-#if defined(APPFS_EXEC_PATH_ENABLE_MAJOR_SECURITY_HOLE)
-	if (strcmp(path, "/exec") == 0) {
-		memset(stbuf, 0, sizeof(struct stat));
 
-		stbuf->st_mtime = 0;
-		stbuf->st_ctime = 0;
-		stbuf->st_atime = 0;
-		stbuf->st_ino   = 3;
-		stbuf->st_mode  = 0;
-		stbuf->st_mode  = S_IFREG | 0600;
-		stbuf->st_nlink = 1;
-		stbuf->st_size  = 0;
+	mkdir_ret = appfs_fuse_mkdir(path, mode);
+	if (mkdir_ret != 0) {
+		fuse_reply_err(req, -mkdir_ret);
+	} else {
+		appfs_kernel_inval_queue(0, parent, NULL);
 
-		return(retval);
+		appfs_fuse_ll_reply_entry(req, parent, name, path, NULL);
 	}
-#endif
-
-	pathinfo.type = APPFS_PATHTYPE_INVALID;
 
-	retval = appfs_get_path_info(path, &pathinfo);
-	if (retval != 0) {
-		if (retval == -ENOENT) {
-			APPFS_DEBUG("get_path_info returned ENOENT, returning it as well.");
-		} else {
-			APPFS_DEBUG("error: get_path_info failed");
-		}
+	free(path);
 
-		return(retval);
-	}
+	return;
+}
 
-	memset(stbuf, 0, sizeof(struct stat));
+static void appfs_fuse_ll_symlink(fuse_req_t req, const char *link, fuse_ino_t parent, const char *name) {
+	char *path;
+	int symlink_ret;
 
-	stbuf->st_mtime = pathinfo.time;
-	stbuf->st_ctime = pathinfo.time;
-	stbuf->st_atime = pathinfo.time;
-	stbuf->st_ino   = pathinfo.inode;
-	stbuf->st_mode  = 0;
+	appfs_fuse_enter(req);
 
-	changeOwnerToUserIfPackaged = 1;
+	path = appfs_inode_child_path(parent, name, NULL);
+	if (path == NULL) {
+		fuse_reply_err(req, ESTALE);
 
-	switch (pathinfo.type) {
-		case APPFS_PATHTYPE_DIRECTORY:
-			stbuf->st_mode = S_IFDIR | 0555;
-			stbuf->st_nlink = 2 + pathinfo.typeinfo.dir.childcount;
-			break;
-		case APPFS_PATHTYPE_FILE:
-			stbuf->st_mode = S_IFREG | 0444;
+		return;
+	}
 
-			if (pathinfo.typeinfo.file.executable) {
-				stbuf->st_mode |= 0111;
-			}
+	symlink_ret = appfs_fuse_symlink(link, path);
+	if (symlink_ret != 0) {
+		fuse_reply_err(req, -symlink_ret);
+	} else {
+		appfs_kernel_inval_queue(0, parent, NULL);
 
-			if (pathinfo.packaged) {
-				if (pathinfo.typeinfo.file.suidRoot) {
-					changeOwnerToUserIfPackaged = 0;
+		appfs_fuse_ll_reply_entry(req, parent, name, path, NULL);
+	}
 
-					stbuf->st_mode |= 04000;
-				}
-			}
+	free(path);
 
-			if (pathinfo.typeinfo.file.worldaccessible) {
-				stbuf->st_mode &= ~077;
-			}
+	return;
+}
 
-			stbuf->st_nlink = 1;
-			stbuf->st_size = pathinfo.typeinfo.file.size;
+static void appfs_fuse_ll_unlink_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+	char *path;
+	int unlink_ret;
 
-			break;
-		case APPFS_PATHTYPE_SYMLINK:
-			stbuf->st_mode = S_IFLNK | 0555;
-			stbuf->st_nlink = 1;
-			stbuf->st_size = pathinfo.typeinfo.symlink.size;
-			break;
-		case APPFS_PATHTYPE_SOCKET:
-			stbuf->st_mode = S_IFSOCK | 0555;
-			stbuf->st_nlink = 1;
-			stbuf->st_size = 0;
-			break;
-		case APPFS_PATHTYPE_FIFO:
-			stbuf->st_mode = S_IFIFO | 0555;
-			stbuf->st_nlink = 1;
-			stbuf->st_size = 0;
-			break;
-		case APPFS_PATHTYPE_DOES_NOT_EXIST:
-			retval = -ENOENT;
+	appfs_fuse_enter(req);
 
-			break;
-		case APPFS_PATHTYPE_INVALID:
-			retval = -EIO;
+	path = appfs_inode_child_path(parent, name, NULL);
+	if (path == NULL) {
+		fuse_reply_err(req, ESTALE);
 
-			break;
+		return;
 	}
 
-	if ((pathinfo.packaged && changeOwnerToUserIfPackaged) || (!pathinfo.packaged)) {
-		stbuf->st_uid   = appfs_get_fsuid();
-		stbuf->st_gid   = appfs_get_fsgid();
-		stbuf->st_mode |= 0200;
+	unlink_ret = appfs_fuse_unlink_rmdir(path);
+
+	free(path);
+
+	if (unlink_ret == 0) {
+		appfs_kernel_inval_queue(0, parent, NULL);
 	}
 
-	return(retval);
+	fuse_reply_err(req, -unlink_ret);
+
+	return;
 }
 
-static int appfs_fuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
-	Tcl_Interp *interp;
-	Tcl_Obj **children;
-	int children_count, idx;
-	int tcl_ret;
+static void appfs_fuse_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi) {
+	struct fuse_entry_param entry;
+	char *path;
+	int create_ret;
 
-	APPFS_DEBUG("Enter (path = %s, ...)", path);
+	appfs_fuse_enter(req);
 
-	interp = appfs_TclInterp();
-	if (interp == NULL) {
-		APPFS_DEBUG("error: Unable to get an interpreter");
+	path = appfs_inode_child_path(parent, name, NULL);
+	if (path == NULL) {
+		fuse_reply_err(req, ESTALE);
 
-		return(0);
+		return;
 	}
 
-	appfs_call_libtcl(Tcl_Preserve(interp);)
-
-	filler(buf, ".", NULL, 0);
-	filler(buf, "..", NULL, 0);
+	create_ret = appfs_fuse_create(path, mode, fi);
+	if (create_ret == 0) {
+		create_ret = appfs_fuse_ll_entry(parent, name, path, NULL, &entry);
+		if (create_ret != 0) {
+			close(fi->fh);
+		}
+	}
 
-	tcl_ret = appfs_Tcl_Eval(interp, 2, "::appfs::getchildren", path);
-	if (tcl_ret != TCL_OK) {
-		APPFS_DEBUG("::appfs::getchildren(%s) failed.", path);
-		appfs_call_libtcl(
-			APPFS_DEBUG("Tcl Error is: %s", Tcl_GetStringResult(interp));
-		)
+	free(path);
 
-		appfs_call_libtcl(Tcl_Release(interp);)
+	if (create_ret != 0) {
+		fuse_reply_err(req, -create_ret);
 
-		return(0);
+		return;
 	}
 
-	appfs_call_libtcl(
-		tcl_ret = Tcl_ListObjGetElements(interp, Tcl_GetObjResult(interp), &children_count, &children);
-	)
-	if (tcl_ret != TCL_OK) {
-		APPFS_DEBUG("Parsing list of children on path %s failed.", path);
-		appfs_call_libtcl(
-			APPFS_DEBUG("Tcl Error is: %s", Tcl_GetStringResult(interp));
-		)
-
-		appfs_call_libtcl(Tcl_Release(interp);)
+	appfs_kernel_inval_queue(0, parent, NULL);
 
-		return(0);
-	}
+	if (fuse_reply_create(req, &entry, fi) != 0) {
+		appfs_inode_forget(entry.ino, 1);
 
-	for (idx = 0; idx < children_count; idx++) {
-		appfs_call_libtcl(
-			filler(buf, Tcl_GetString(children[idx]), NULL, 0);
-		)
+		close(fi->fh);
 	}
 
-	appfs_call_libtcl(Tcl_Release(interp);)
-
-	return(0);
+	return;
 }
 
-static int appfs_fuse_open(const char *path, struct fuse_file_info *fi) {
+/*
+ * SQLite3 mode: Execute raw SQL and return success or failure
+ */
+static int appfs_sqlite3(const char *sql) {
 	Tcl_Interp *interp;
-	struct appfs_pathinfo pathinfo;
-	const char *real_path, *mode;
-	int gpi_ret, tcl_ret;
-	int fh;
-
-	APPFS_DEBUG("Enter (path = %s, ...)", path);
+	const char *sql_ret;
+	int tcl_ret;
 
-#if defined(APPFS_EXEC_PATH_ENABLE_MAJOR_SECURITY_HOLE)
-	if (strcmp(path, "/exec") == 0) {
-		fi->fh = 0;
+	interp = appfs_create_TclInterp(NULL);
+	if (interp == NULL) {
+		APPFS_ERROR("Unable to create a Tcl interpreter.  Aborting.");
 
-		return(0);
+		return(1);
 	}
-#endif
-
-	gpi_ret = appfs_get_path_info(path, &pathinfo);
-
-	if ((fi->flags & (O_WRONLY|O_CREAT)) == (O_CREAT|O_WRONLY)) {
-		/* The file will be created if it does not exist */
-		if (gpi_ret != 0 && gpi_ret != -ENOENT) {
-			APPFS_DEBUG("error: get_path_info failed");
-
-			return(gpi_ret);
-		}
 
-		mode = "create";
-
-		/*
-		 * We have to clear the cache here so that the number of
-		 * links gets maintained on the parent directory
-		 */
-		appfs_get_path_info_cache_flush(appfs_get_fsuid(), -1);
-	} else {
-		/* The file must already exist */
-		if (gpi_ret != 0) {
-			APPFS_DEBUG("error: get_path_info failed");
-
-			return(gpi_ret);
-		}
+	tcl_ret = appfs_Tcl_Eval(interp, 5, "::appfs::db", "eval", sql, "row", "unset -nocomplain row(*); parray row; puts \"----\"");
+	sql_ret = Tcl_GetStringResult(interp);
 
-		mode = "";
+	if (tcl_ret != TCL_OK) {
+		APPFS_ERROR("[error] %s", sql_ret);
 
-		if ((fi->flags & O_WRONLY) == O_WRONLY) {
-			mode = "write";
-		}
+		return(1);
 	}
 
-	if (pathinfo.type == APPFS_PATHTYPE_DIRECTORY) {
-		APPFS_DEBUG("error: Asked to open a directory.");
-
-		return(-EISDIR);
+	if (sql_ret && sql_ret[0] != '\0') {
+		printf("%s\n", sql_ret);
 	}
 
-	interp = appfs_TclInterp();
+	return(0);
+}
+
+/*
+ * Tcl mode: Execute raw Tcl and return success or failure
+ */
+static int appfs_tcl(const char *tcl) {
+	Tcl_Interp *interp;
+	const char *tcl_result;
+	int tcl_ret;
+
+	interp = appfs_create_TclInterp(NULL);
 	if (interp == NULL) {
-		APPFS_DEBUG("error: Unable to get an interpreter");
+		APPFS_ERROR("Unable to create a Tcl interpreter.  Aborting.");
 
-		return(-EIO);
+		return(1);
 	}
 
-	appfs_call_libtcl(Tcl_Preserve(interp);)
+	tcl_ret = Tcl_Eval(interp, tcl);
+	tcl_result = Tcl_GetStringResult(interp);
 
-	tcl_ret = appfs_Tcl_Eval(interp, 3, "::appfs::openpath", path, mode);
 	if (tcl_ret != TCL_OK) {
-		APPFS_DEBUG("::appfs::openpath(%s, %s) failed.", path, mode);
-		appfs_call_libtcl(
-			APPFS_DEBUG("Tcl Error is: %s", Tcl_GetStringResult(interp));
-		)
+		APPFS_ERROR("[error] %s", Tcl_GetVar(interp, "errorInfo", TCL_GLOBAL_ONLY));
 
-		appfs_call_libtcl(Tcl_Release(interp);)
+		return(1);
+	}
 
-		return(-EIO);
+	if (tcl_result && tcl_result[0] != '\0') {
+		printf("%s\n", tcl_result);
 	}
 
-	appfs_call_libtcl(
-		real_path = Tcl_GetStringResult(interp);
-	)
+	return(0);
+}
 
-	appfs_call_libtcl(Tcl_Release(interp);)
+/*
+ * Hoard mode: Ask the appfsd using the cache directory to fetch all of the
+ * files of a package into it, or fetch them ourselves if there is none
+ */
+static int appfs_hoard_main(int argc, char **argv) {
+	struct sockaddr_un addr;
+	const char *command_argv[5];
+	char *command, buf[4096], line_start[3];
+	ssize_t read_ret;
+	int line_pos, last_ok;
+	int fd, idx;
 
-	if (real_path == NULL) {
-		APPFS_DEBUG("error: real_path was NULL.")
+	if (argc < 2 || argc > 4) {
+		APPFS_ERROR("Usage: appfsd [--cachedir <dir>] --hoard <site> <package> [<version>|latest [<os-cpu>]]");
 
-		return(-EIO);
+		return(1);
 	}
 
-	APPFS_DEBUG("Translated request to open %s to opening %s (mode = \"%s\")", path, real_path, mode);
+	fd = -1;
+	if (appfs_control_path(&addr) == 0) {
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd >= 0 && connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+			close(fd);
 
-	fh = open(real_path, fi->flags, 0600);
+			fd = -1;
+		}
+	}
 
-	if (fh < 0) {
-		APPFS_DEBUG("error: open failed");
+	if (fd < 0) {
+		appfs_tcl_worker_thread = 1;
 
-		return(errno * -1);
+		appfs_download_workers_start();
+
+		return(appfs_hoard(argv[0], argv[1], argc > 2 ? argv[2] : "latest", argc > 3 ? argv[3] : "", STDOUT_FILENO));
 	}
 
-	fi->fh = fh;
+	command_argv[0] = "hoard";
+	for (idx = 0; idx < argc; idx++) {
+		command_argv[idx + 1] = argv[idx];
+	}
 
-	APPFS_DEBUG("Opened \"%s\" (for \"%s\") with file descriptor %i", real_path, path, fh);
+	command = Tcl_Merge(argc + 1, command_argv);
 
-	return(0);
-}
+	appfs_hoard_output(fd, "%s\n", command);
 
-static int appfs_fuse_close(const char *path, struct fuse_file_info *fi) {
-	int close_ret;
+	Tcl_Free(command);
 
-	APPFS_DEBUG("Enter (path = %s, ...)", path);
+	/* Pass on the output, noting whether it ended in success */
+	line_pos = 0;
+	last_ok = 0;
+	while (1) {
+		read_ret = read(fd, buf, sizeof(buf));
+		if (read_ret < 0 && errno == EINTR) {
+			continue;
+		}
 
-#if defined(APPFS_EXEC_PATH_ENABLE_MAJOR_SECURITY_HOLE)
-	if (strcmp(path, "/exec") == 0) {
-		return(0);
-	}
-#endif
+		if (read_ret <= 0) {
+			break;
+		}
 
-	appfs_get_path_info_cache_rm(path, appfs_get_fsuid());
+		fwrite(buf, 1, read_ret, stdout);
+		fflush(stdout);
 
-	close_ret = close(fi->fh);
-	if (close_ret != 0) {
-		APPFS_DEBUG("error: close failed");
+		for (idx = 0; idx < read_ret; idx++) {
+			if (buf[idx] == '\n') {
+				last_ok = (line_pos >= 3 && memcmp(line_start, "ok:", 3) == 0);
+				line_pos = 0;
 
-		return(errno * -1);
+				continue;
+			}
+
+			if (line_pos < 3) {
+				line_start[line_pos] = buf[idx];
+			}
+
+			line_pos++;
+		}
+	}
+
+	close(fd);
+
+	if (!last_ok) {
+		return(1);
 	}
 
 	return(0);
 }
 
-static int appfs_fuse_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-	ssize_t read_ret;
-	int retval;
+/*
+ * Startup benchmark mode: Create and destroy a number of interpreters,
+ * the way worker threads and hot restarts do, and report how long each
+ * one took to become ready
+ */
+static int appfs_benchmark_startup(const char *count_str) {
+	Tcl_Interp *interp;
+	struct timespec start, end;
+	double elapsed, elapsed_total, elapsed_first;
+	long count, idx;
 
-	APPFS_DEBUG("Enter (path = %s, buf, size = %lli, offset = %lli, fd = %lli)", path, (long long) size, (long long) offset, (long long) fi->fh);
+	count = strtol(count_str, NULL, 10);
+	if (count <= 0) {
+		APPFS_ERROR("Invalid interpreter count: %s", count_str);
 
-	retval = 0;
+		return(1);
+	}
 
-	while (size != 0) {
-#ifdef APPFS_NO_PREAD /* XXX:TODO: Write a wrapper function */
-		off_t seek_ret;
+	elapsed_total = 0;
+	elapsed_first = 0;
+	for (idx = 0; idx < count; idx++) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
 
-		seek_ret = lseek(fi->fh, offset, SEEK_SET);
-		if (seek_ret == offset) {
-			read_ret = read(fi->fh, buf, size);
-		} else {
-			read_ret = -1;
+		interp = appfs_create_TclInterp(NULL);
+		if (interp == NULL) {
+			APPFS_ERROR("Unable to create a Tcl interpreter.  Aborting.");
+
+			return(1);
 		}
-#else
-		read_ret = pread(fi->fh, buf, size, offset);
-#endif
 
-		if (read_ret < 0) {
-			APPFS_DEBUG("error: read failed");
+		clock_gettime(CLOCK_MONOTONIC, &end);
 
-			return(errno * -1);
-		}
+		Tcl_DeleteInterp(interp);
 
-		if (read_ret == 0) {
-			break;
+		elapsed = ((end.tv_sec - start.tv_sec) * 1000.0) + ((end.tv_nsec - start.tv_nsec) / 1000000.0);
+		if (idx == 0) {
+			elapsed_first = elapsed;
 		}
 
-		size -= read_ret;
-		buf  += read_ret;
-		offset += read_ret;
-		retval += read_ret;
+		elapsed_total += elapsed;
 	}
 
-	if (size != 0) {
-		APPFS_DEBUG("error: incomplete read (this might be an error because FUSE will request the exact length of the file)");
+	printf("interpreters: %li\n", count);
+	printf("first: %.3f ms\n", elapsed_first);
+	printf("average: %.3f ms\n", elapsed_total / count);
+	if (count > 1) {
+		printf("average (excluding first): %.3f ms\n", (elapsed_total - elapsed_first) / (count - 1));
 	}
 
-	APPFS_DEBUG("Returning: %i", retval);
-
-	return(retval);
+	return(0);
 }
 
-static int appfs_fuse_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-	ssize_t write_ret;
-	int retval;
+/*
+ * Manifest benchmark mode: Load synthetic manifests of a number of entries
+ * into a scratch cache database, and report how long each one took
+ */
+static int appfs_benchmark_manifest(int count_argc, char **count_argv) {
+	static char *default_count_argv[] = {"1000", "100000", "1000000"};
+	Tcl_Interp *interp;
+	FILE *manifest_fp;
+	struct timespec start, end;
+	char cachedir[] = "/tmp/appfs-benchmark-XXXXXX";
+	char manifest_path[PATH_MAX], db_path[PATH_MAX], package_sha1[41];
+	const char *error_string;
+	double elapsed;
+	long count, entries, idx;
+	int ingest_ret, argidx;
+	int retval = 0;
 
-	APPFS_DEBUG("Enter (path = %s, ...)", path);
+	if (count_argc == 0) {
+		count_argc = sizeof(default_count_argv) / sizeof(default_count_argv[0]);
+		count_argv = default_count_argv;
+	}
 
-#if defined(APPFS_EXEC_PATH_ENABLE_MAJOR_SECURITY_HOLE)
-	if (strcmp(path, "/exec") == 0) {
-		appfs_runTcl(buf, size);
+	if (mkdtemp(cachedir) == NULL) {
+		APPFS_ERROR("Unable to create scratch cache directory");
 
-		return(size);
+		return(1);
 	}
-#endif
 
-	appfs_get_path_info_cache_rm(path, appfs_get_fsuid());
+	appfs_cachedir = cachedir;
 
-	retval = 0;
+	snprintf(manifest_path, sizeof(manifest_path), "%s/manifest", cachedir);
+	snprintf(db_path, sizeof(db_path), "%s/cache.db", cachedir);
 
-	while (size != 0) {
-#ifdef APPFS_NO_PWRITE /* XXX:TODO: Write a wrapper function */
-#  if 1
-		/* XXX:TODO: Still fails on win32 */
-		write_ret = -1;
-#else
-		off_t seek_ret;
+	/*
+	 * Creating an interpreter creates the cache database
+	 */
+	interp = appfs_create_TclInterp(NULL);
+	if (interp == NULL) {
+		APPFS_ERROR("Unable to create a Tcl interpreter.  Aborting.");
 
-		seek_ret = lseek(fi->fh, offset, SEEK_SET);
-		if (seek_ret == offset) {
-			write_ret = write(fi->fh, buf, size); 
-		} else {
-			write_ret = -1;
-		}
-#  endif
-#else
-		write_ret = pwrite(fi->fh, buf, size, offset);
-#endif
+		rmdir(cachedir);
 
-		if (write_ret < 0) {
-			APPFS_DEBUG("error: write failed");
+		return(1);
+	}
 
-			return(errno * -1);
-		}
+	Tcl_DeleteInterp(interp);
+
+	for (argidx = 0; argidx < count_argc; argidx++) {
+		count = strtol(count_argv[argidx], NULL, 10);
+		if (count <= 0) {
+			APPFS_ERROR("Invalid entry count: %s", count_argv[argidx]);
+
+			retval = 1;
 
-		if (write_ret == 0) {
 			break;
 		}
 
-		size -= write_ret;
-		buf  += write_ret;
-		offset += write_ret;
-		retval += write_ret;
-	}
+		/*
+		 * Generate a manifest resembling a real package, with 100
+		 * files in each directory
+		 */
+		manifest_fp = fopen(manifest_path, "w");
+		if (manifest_fp == NULL) {
+			APPFS_ERROR("Unable to create %s", manifest_path);
 
-	if (size != 0) {
-		APPFS_DEBUG("error: incomplete write");
-	}
+			retval = 1;
 
-	return(retval);
-}
+			break;
+		}
 
-static int appfs_fuse_mknod(const char *path, mode_t mode, dev_t device) {
-	char *real_path;
-	int mknod_ret;
+		for (idx = 0; idx < count; idx++) {
+			if ((idx % 100) == 0) {
+				fprintf(manifest_fp, "directory,1418152800,dir%li\n", idx / 100);
+			} else {
+				fprintf(manifest_fp, "file,1418152800,%li,x,%040lx,dir%li/file%li\n", idx, idx, idx / 100, idx);
+			}
+		}
 
-	APPFS_DEBUG("Enter (path = %s, ...)", path);
+		fclose(manifest_fp);
 
-	if ((mode & S_IFCHR) == S_IFCHR) {
-		return(-EPERM);
-	}
+		snprintf(package_sha1, sizeof(package_sha1), "%040lx", count);
 
-	if ((mode & S_IFBLK) == S_IFBLK) {
-		return(-EPERM);
-	}
+		clock_gettime(CLOCK_MONOTONIC, &start);
 
-	real_path = appfs_prepare_to_create(path);
-	if (real_path == NULL) {
-		return(-EIO);
-	}
+		ingest_ret = appfs_manifest_ingest(package_sha1, manifest_path, &entries, &error_string);
 
-	appfs_simulate_user_fs_enter();
+		clock_gettime(CLOCK_MONOTONIC, &end);
 
-	mknod_ret = mknod(real_path, mode, device);
+		if (ingest_ret != 0) {
+			APPFS_ERROR("Unable to load manifest: %s", error_string);
 
-	appfs_simulate_user_fs_leave();
+			retval = 1;
 
-	free(real_path);
+			break;
+		}
 
-	if (mknod_ret != 0) {
-		return(errno * -1);
+		elapsed = ((end.tv_sec - start.tv_sec) * 1000.0) + ((end.tv_nsec - start.tv_nsec) / 1000000.0);
+
+		printf("entries: %li, time: %.3f ms, rate: %.0f entries/s\n", entries, elapsed, entries / (elapsed / 1000.0));
 	}
 
-	return(0);
+	unlink(manifest_path);
+	unlink(db_path);
+	rmdir(cachedir);
+
+	return(retval);
 }
 
-static int appfs_fuse_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
-	char *real_path;
-	int fd;
+/*
+ * AppFSd Package for Tcl:
+ *         Bridge for I/O operations to request information about the current
+ *         transaction
+ */
+/*
+ * Tcl interface to get the home directory for the user making the "current"
+ * FUSE I/O request
+ */
+static int tcl_appfs_get_homedir(ClientData cd, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]) {
+	char *homedir;
+	Tcl_Obj *homedir_obj;
+	uid_t fsuid;
+	static __thread Tcl_Obj *last_homedir_obj = NULL;
+	static __thread uid_t last_fsuid = -1;
+
+        if (objc != 1) {
+                Tcl_WrongNumArgs(interp, 1, objv, NULL);
+                return(TCL_ERROR);
+        }
+
+	fsuid = appfs_get_fsuid();
+
+	if (fsuid == last_fsuid && last_homedir_obj != NULL) {
+		homedir_obj = last_homedir_obj;
+
+		Tcl_IncrRefCount(homedir_obj);
+	} else {
+		homedir = appfs_get_homedir(appfs_get_fsuid());
+
+		if (homedir == NULL) {
+			return(TCL_ERROR);
+		}
+
+		homedir_obj = Tcl_NewStringObj(homedir, -1);
+
+		free(homedir);
 
-	APPFS_DEBUG("Enter (path = %s, ...)", path);
+		Tcl_IncrRefCount(homedir_obj);
 
-	if ((mode & S_IFCHR) == S_IFCHR) {
-		return(-EPERM);
-	}
+		if (last_homedir_obj != NULL) {
+			Tcl_DecrRefCount(last_homedir_obj);
+		}
 
-	if ((mode & S_IFBLK) == S_IFBLK) {
-		return(-EPERM);
-	}
+		last_homedir_obj = homedir_obj;
+		last_fsuid = fsuid;
 
-	real_path = appfs_prepare_to_create(path);
-	if (real_path == NULL) {
-		return(-EIO);
+		Tcl_IncrRefCount(homedir_obj);
 	}
 
-	appfs_simulate_user_fs_enter();
+       	Tcl_SetObjResult(interp, homedir_obj);
 
-	fd = creat(real_path, mode);
+	Tcl_DecrRefCount(homedir_obj);
 
-	appfs_simulate_user_fs_leave();
+        return(TCL_OK);
+}
 
-	free(real_path);
+static int tcl_appfs_simulate_user_fs_enter(ClientData cd, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]) {
+	appfs_simulate_user_fs_enter();
 
-	if (fd < 0) {
-		return(errno * -1);
-	}
+	return(TCL_OK);
+}
 
-	fi->fh = fd;
+static int tcl_appfs_simulate_user_fs_leave(ClientData cd, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]) {
+	appfs_simulate_user_fs_leave();
 
-	return(0);
+	return(TCL_OK);
 }
 
-static int appfs_fuse_truncate(const char *path, off_t size) {
-	char *real_path;
-	int truncate_ret;
+static int tcl_appfs_get_fsuid(ClientData cd, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]) {
+	uid_t fsuid;
 
-	APPFS_DEBUG("Enter (path = %s, ...)", path);
+	fsuid = appfs_get_fsuid();
 
-#if defined(APPFS_EXEC_PATH_ENABLE_MAJOR_SECURITY_HOLE)
-	if (strcmp(path, "/exec") == 0) {
-		return(0);
-	}
-#endif
+       	Tcl_SetObjResult(interp, Tcl_NewWideIntObj(fsuid));
 
-	real_path = appfs_localpath(path);
-	if (real_path == NULL) {
-		return(-EIO);
-	}
+	return(TCL_OK);
+}
 
-	appfs_get_path_info_cache_rm(path, appfs_get_fsuid());
+static int tcl_appfs_get_fsgid(ClientData cd, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]) {
+	gid_t fsgid;
 
-	appfs_simulate_user_fs_enter();
+	fsgid = appfs_get_fsgid();
 
-	truncate_ret = truncate(real_path, size);
+       	Tcl_SetObjResult(interp, Tcl_NewWideIntObj(fsgid));
 
-	appfs_simulate_user_fs_leave();
+	return(TCL_OK);
+}
 
-	free(real_path);
+static int tcl_appfs_get_path_info_cache_flush(ClientData cd, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]) {
+	Tcl_WideInt new_mem;
+	int tcl_ret;
 
-	if (truncate_ret != 0) {
-		return(errno * -1);
+	new_mem = -1;
+
+	if (objc == 2) {
+		tcl_ret = Tcl_GetWideIntFromObj(interp, objv[1], &new_mem);
+		if (tcl_ret != TCL_OK) {
+			return(tcl_ret);
+		}
+	} else if (objc > 2 || objc < 1) {
+                Tcl_WrongNumArgs(interp, 1, objv, "?new_cache_mem?");
+		return(TCL_ERROR);
 	}
 
-	return(0);
+	appfs_get_path_info_cache_flush(-1, new_mem);
+
+	return(TCL_OK);
 }
 
-static int appfs_fuse_unlink_rmdir(const char *path) {
-	Tcl_Interp *interp;
-	int tcl_ret;
+static int tcl_appfs_get_path_info_cache_stats(ClientData cd, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]) {
+	struct appfs_path_info_cache_shard cache_stats;
+	Tcl_Obj *stats;
 
-	APPFS_DEBUG("Enter (path = %s, ...)", path);
+	if (objc != 1) {
+		Tcl_WrongNumArgs(interp, 1, objv, NULL);
+		return(TCL_ERROR);
+	}
 
-	appfs_get_path_info_cache_flush(appfs_get_fsuid(), -1);
+	appfs_get_path_info_cache_stats(&cache_stats);
 
-	interp = appfs_TclInterp();
-	if (interp == NULL) {
-		return(-EIO);
-	}
+	stats = Tcl_NewDictObj();
 
-	appfs_call_libtcl(Tcl_Preserve(interp);)
+	Tcl_DictObjPut(interp, stats, Tcl_NewStringObj("hits", -1), Tcl_NewWideIntObj(cache_stats.hits));
+	Tcl_DictObjPut(interp, stats, Tcl_NewStringObj("misses", -1), Tcl_NewWideIntObj(cache_stats.misses));
+	Tcl_DictObjPut(interp, stats, Tcl_NewStringObj("evictions", -1), Tcl_NewWideIntObj(cache_stats.evictions));
+	Tcl_DictObjPut(interp, stats, Tcl_NewStringObj("entries", -1), Tcl_NewWideIntObj(cache_stats.entries));
+	Tcl_DictObjPut(interp, stats, Tcl_NewStringObj("mem", -1), Tcl_NewWideIntObj(cache_stats.mem_used));
+	Tcl_DictObjPut(interp, stats, Tcl_NewStringObj("mem_limit", -1), Tcl_NewWideIntObj(cache_stats.mem));
 
-	tcl_ret = appfs_Tcl_Eval(interp, 2, "::appfs::unlinkpath", path);
-	if (tcl_ret != TCL_OK) {
-		APPFS_DEBUG("::appfs::unlinkpath(%s) failed.", path);
-		appfs_call_libtcl(
-			APPFS_DEBUG("Tcl Error is: %s", Tcl_GetStringResult(interp));
-		)
+	Tcl_SetObjResult(interp, stats);
 
-		appfs_call_libtcl(Tcl_Release(interp);)
+	return(TCL_OK);
+}
 
-		return(-EIO);
+static int tcl_appfs_kernel_cache_invalidate(ClientData cd, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]) {
+	if (objc != 2) {
+		Tcl_WrongNumArgs(interp, 1, objv, "path");
+		return(TCL_ERROR);
 	}
 
-	appfs_call_libtcl(Tcl_Release(interp);)
+	appfs_kernel_inval_path(Tcl_GetString(objv[1]));
 
-	return(0);
+	return(TCL_OK);
 }
 
-static int appfs_fuse_mkdir(const char *path, mode_t mode) {
-	char *real_path;
-	int mkdir_ret;
-
-	APPFS_DEBUG("Enter (path = %s, ...)", path);
+/*
+ * Tcl interface to load the PKI stack ("pki.tcl", along with the ASN.1,
+ * bignum, and hashing packages it depends on) into the calling
+ * interpreter.  This is a large amount of script and is only needed
+ * when a signature is verified, so it is loaded on first use rather
+ * than every time an interpreter is created.
+ */
+static int tcl_appfs_load_pki(ClientData cd, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]) {
+	static const char *pki_script = ""
+#include "pki.tcl.h"
+	"";
 
-	real_path = appfs_prepare_to_create(path);
-	if (real_path == NULL) {
-		return(-EIO);
+	if (objc != 1) {
+		Tcl_WrongNumArgs(interp, 1, objv, NULL);
+		return(TCL_ERROR);
 	}
 
-	appfs_simulate_user_fs_enter();
-
-	mkdir_ret = mkdir(real_path, mode);
+	return(Tcl_EvalEx(interp, pki_script, -1, TCL_EVAL_GLOBAL));
+}
 
-	appfs_simulate_user_fs_leave();
+/*
+ * Tcl interface to track whether the cache database schema has been
+ * created by this process yet, so that new interpreters (including those
+ * created after a hot restart) do not need to re-issue the DDL
+ */
+static int appfs_schema_initialized = 0;
+static int tcl_appfs_schema_initialized(ClientData cd, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]) {
+	int tcl_ret;
+	int value;
 
-	free(real_path);
+	if (objc != 1 && objc != 2) {
+		Tcl_WrongNumArgs(interp, 1, objv, "?value?");
+		return(TCL_ERROR);
+	}
 
-	if (mkdir_ret != 0) {
-		if (errno != EEXIST) {
-			return(errno * -1);
+	if (objc == 2) {
+		tcl_ret = Tcl_GetBooleanFromObj(interp, objv[1], &value);
+		if (tcl_ret != TCL_OK) {
+			return(tcl_ret);
 		}
+
+		__sync_lock_test_and_set(&appfs_schema_initialized, value);
 	}
 
-	return(0);
+	Tcl_SetObjResult(interp, Tcl_NewBooleanObj(__sync_fetch_and_add(&appfs_schema_initialized, 0)));
+
+	return(TCL_OK);
 }
 
-static int appfs_fuse_chmod(const char *path, mode_t mode) {
-	Tcl_Interp *interp;
-	const char *real_path;
-	int tcl_ret, chmod_ret;
+/*
+ * Tcl interface to the freshness table, to record (or check) that a site's
+ * index is fresh until a given time
+ */
+static int tcl_appfs_site_fresh(ClientData cd, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]) {
+	Tcl_WideInt expires;
+	int tcl_ret;
 
-	APPFS_DEBUG("Enter (path = %s, ...)", path);
+	if (objc != 2 && objc != 3) {
+		Tcl_WrongNumArgs(interp, 1, objv, "hostname ?expires?");
+		return(TCL_ERROR);
+	}
 
-	appfs_get_path_info_cache_rm(path, appfs_get_fsuid());
+	if (objc == 3) {
+		tcl_ret = Tcl_GetWideIntFromObj(interp, objv[2], &expires);
+		if (tcl_ret != TCL_OK) {
+			return(tcl_ret);
+		}
 
-	interp = appfs_TclInterp();
-	if (interp == NULL) {
-		return(-EIO);
+		appfs_site_set_fresh(Tcl_GetString(objv[1]), expires);
 	}
 
-	appfs_call_libtcl(Tcl_Preserve(interp);)
+	Tcl_SetObjResult(interp, Tcl_NewBooleanObj(appfs_site_is_fresh(Tcl_GetString(objv[1]))));
 
-	tcl_ret = appfs_Tcl_Eval(interp, 3, "::appfs::openpath", path, "write");
-	if (tcl_ret != TCL_OK) {
-		APPFS_DEBUG("::appfs::openpath(%s, %s) failed.", path, "write");
-		appfs_call_libtcl(
-			APPFS_DEBUG("Tcl Error is: %s", Tcl_GetStringResult(interp));
-		)
+	return(TCL_OK);
+}
 
-		appfs_call_libtcl(Tcl_Release(interp);)
+/*
+ * Tcl interface to the freshness table, to record (or check) that a
+ * package's manifest has been ingested
+ */
+static int tcl_appfs_manifest_present(ClientData cd, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]) {
+	int present;
+	int tcl_ret;
 
-		return(-EIO);
+	if (objc != 2 && objc != 3) {
+		Tcl_WrongNumArgs(interp, 1, objv, "package_sha1 ?present?");
+		return(TCL_ERROR);
 	}
 
-	appfs_call_libtcl(
-		real_path = Tcl_GetStringResult(interp);
-	)
-
-	appfs_call_libtcl(Tcl_Release(interp);)
+	if (objc == 3) {
+		tcl_ret = Tcl_GetBooleanFromObj(interp, objv[2], &present);
+		if (tcl_ret != TCL_OK) {
+			return(tcl_ret);
+		}
 
-	if (real_path == NULL) {
-		return(-EIO);
+		appfs_manifest_set_present(Tcl_GetString(objv[1]), present);
 	}
 
-	appfs_simulate_user_fs_enter();
+	Tcl_SetObjResult(interp, Tcl_NewBooleanObj(appfs_manifest_is_present(Tcl_GetString(objv[1]))));
 
-	chmod_ret = chmod(real_path, mode);
+	return(TCL_OK);
+}
 
-	appfs_simulate_user_fs_leave();
+/*
+ * Tcl interface to queue a site's index to be refreshed in the background
+ */
+static int tcl_appfs_index_refresh(ClientData cd, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]) {
+	if (objc != 2) {
+		Tcl_WrongNumArgs(interp, 1, objv, "hostname");
+		return(TCL_ERROR);
+	}
+
+	Tcl_SetObjResult(interp, Tcl_NewBooleanObj(appfs_index_refresh_schedule(Tcl_GetString(objv[1]))));
 
-	return(chmod_ret);
+	return(TCL_OK);
 }
 
-static int appfs_fuse_symlink(const char *oldpath, const char *newpath) {
-	char *real_path;
-	int symlink_ret;
+/*
+ * Tcl interface to the HTTP download engine, returns a list of the status
+ * code of the response, its headers, and its body (unless the body was
+ * written to a channel)
+ */
+struct appfs_http_buffer {
+	char *data;
+	size_t len;
+	size_t size;
+};
 
-	APPFS_DEBUG("Enter (path = %s, %s)", oldpath, newpath);
+static int appfs_http_sink_buffer(void *_data, const char *buf, size_t len) {
+	struct appfs_http_buffer *buffer;
+	char *new_data;
+	size_t new_size;
 
-	real_path = appfs_prepare_to_create(newpath);
-	if (real_path == NULL) {
-		return(-EIO);
-	}
+	buffer = _data;
 
-	appfs_simulate_user_fs_enter();
+	if (buffer->len + len > buffer->size) {
+		new_size = (buffer->size * 2) + len;
 
-	symlink_ret = symlink(oldpath, real_path);
+		new_data = realloc(buffer->data, new_size);
+		if (new_data == NULL) {
+			return(-1);
+		}
 
-	appfs_simulate_user_fs_leave();
+		buffer->data = new_data;
+		buffer->size = new_size;
+	}
 
-	free(real_path);
+	memcpy(buffer->data + buffer->len, buf, len);
+	buffer->len += len;
 
-	if (symlink_ret != 0) {
-		return(errno * -1);
+	return(0);
+}
+
+static int appfs_http_sink_channel(void *data, const char *buf, size_t len) {
+	if (Tcl_Write((Tcl_Channel) data, buf, len) != (int) len) {
+		return(-1);
 	}
 
 	return(0);
 }
 
-/*
- * SQLite3 mode: Execute raw SQL and return success or failure
- */
-static int appfs_sqlite3(const char *sql) {
-	Tcl_Interp *interp;
-	const char *sql_ret;
-	int tcl_ret;
+static int tcl_appfs_http_get(ClientData cd, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]) {
+	struct appfs_http_request request;
+	struct appfs_http_buffer buffer;
+	Tcl_Obj **header_objv, *meta, *result;
+	Tcl_Channel channel = NULL;
+	Tcl_DString headers;
+	const char *option, *header, *line, *line_end, *value;
+	int header_objc, channel_mode, idx, header_idx;
+
+	if (objc < 2 || (objc % 2) != 0) {
+		Tcl_WrongNumArgs(interp, 1, objv, "url ?-headers headers? ?-channel channel? ?-expect code?");
+		return(TCL_ERROR);
+	}
 
-	interp = appfs_create_TclInterp(NULL);
-	if (interp == NULL) {
-		APPFS_ERROR("Unable to create a Tcl interpreter.  Aborting.");
+	request.url = Tcl_GetString(objv[1]);
+	request.headers = NULL;
+	request.expect = 0;
 
-		return(1);
-	}
+	Tcl_DStringInit(&headers);
 
-	tcl_ret = appfs_Tcl_Eval(interp, 5, "::appfs::db", "eval", sql, "row", "unset -nocomplain row(*); parray row; puts \"----\"");
-	sql_ret = Tcl_GetStringResult(interp);
+	for (idx = 2; idx < objc; idx += 2) {
+		option = Tcl_GetString(objv[idx]);
 
-	if (tcl_ret != TCL_OK) {
-		APPFS_ERROR("[error] %s", sql_ret);
+		if (strcmp(option, "-headers") == 0) {
+			if (Tcl_ListObjGetElements(interp, objv[idx + 1], &header_objc, &header_objv) != TCL_OK) {
+				Tcl_DStringFree(&headers);
 
-		return(1);
-	}
+				return(TCL_ERROR);
+			}
 
-	if (sql_ret && sql_ret[0] != '\0') {
-		printf("%s\n", sql_ret);
-	}
+			for (header_idx = 0; header_idx + 1 < header_objc; header_idx += 2) {
+				Tcl_DStringAppend(&headers, Tcl_GetString(header_objv[header_idx]), -1);
+				Tcl_DStringAppend(&headers, ": ", 2);
+				Tcl_DStringAppend(&headers, Tcl_GetString(header_objv[header_idx + 1]), -1);
+				Tcl_DStringAppend(&headers, "\r\n", 2);
+			}
 
-	return(0);
-}
+			/* Each header must stay on its own line */
+			header = Tcl_DStringValue(&headers);
+			for (line = strpbrk(header, "\r\n"); line != NULL; line = strpbrk(line + 2, "\r\n")) {
+				if (line[0] != '\r' || line[1] != '\n') {
+					Tcl_DStringFree(&headers);
 
-/*
- * Tcl mode: Execute raw Tcl and return success or failure
- */
-static int appfs_tcl(const char *tcl) {
-	Tcl_Interp *interp;
-	const char *tcl_result;
-	int tcl_ret;
+					Tcl_SetObjResult(interp, Tcl_NewStringObj("invalid header", -1));
+
+					return(TCL_ERROR);
+				}
+			}
+		} else if (strcmp(option, "-channel") == 0) {
+			channel = Tcl_GetChannel(interp, Tcl_GetString(objv[idx + 1]), &channel_mode);
+			if (channel == NULL) {
+				Tcl_DStringFree(&headers);
+
+				return(TCL_ERROR);
+			}
+
+			if ((channel_mode & TCL_WRITABLE) == 0) {
+				Tcl_DStringFree(&headers);
 
-	interp = appfs_create_TclInterp(NULL);
-	if (interp == NULL) {
-		APPFS_ERROR("Unable to create a Tcl interpreter.  Aborting.");
+				Tcl_SetObjResult(interp, Tcl_ObjPrintf("channel \"%s\" wasn't opened for writing", Tcl_GetString(objv[idx + 1])));
 
-		return(1);
-	}
+				return(TCL_ERROR);
+			}
+		} else if (strcmp(option, "-expect") == 0) {
+			if (Tcl_GetIntFromObj(interp, objv[idx + 1], &request.expect) != TCL_OK) {
+				Tcl_DStringFree(&headers);
 
-	tcl_ret = Tcl_Eval(interp, tcl);
-	tcl_result = Tcl_GetStringResult(interp);
+				return(TCL_ERROR);
+			}
+		} else {
+			Tcl_DStringFree(&headers);
 
-	if (tcl_ret != TCL_OK) {
-		APPFS_ERROR("[error] %s", Tcl_GetVar(interp, "errorInfo", TCL_GLOBAL_ONLY));
+			Tcl_SetObjResult(interp, Tcl_ObjPrintf("bad option \"%s\": must be -headers, -channel, or -expect", option));
 
-		return(1);
+			return(TCL_ERROR);
+		}
 	}
 
-	if (tcl_result && tcl_result[0] != '\0') {
-		printf("%s\n", tcl_result);
+	if (Tcl_DStringLength(&headers) > 0) {
+		request.headers = Tcl_DStringValue(&headers);
 	}
 
-	return(0);
-}
+	buffer.data = NULL;
+	buffer.len = 0;
+	buffer.size = 0;
 
-/*
- * AppFSd Package for Tcl:
- *         Bridge for I/O operations to request information about the current
- *         transaction
- */
-/*
- * Tcl interface to get the home directory for the user making the "current"
- * FUSE I/O request
- */
-static int tcl_appfs_get_homedir(ClientData cd, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]) {
-	char *homedir;
-	Tcl_Obj *homedir_obj;
-	uid_t fsuid;
-	static __thread Tcl_Obj *last_homedir_obj = NULL;
-	static __thread uid_t last_fsuid = -1;
+	if (channel != NULL) {
+		request.sink = appfs_http_sink_channel;
+		request.sink_data = channel;
+	} else {
+		request.sink = appfs_http_sink_buffer;
+		request.sink_data = &buffer;
+	}
 
-        if (objc != 1) {
-                Tcl_WrongNumArgs(interp, 1, objv, NULL);
-                return(TCL_ERROR);
-        }
+	if (appfs_http_get(&request) != 0) {
+		Tcl_DStringFree(&headers);
+		free(buffer.data);
 
-	fsuid = appfs_get_fsuid();
+		Tcl_SetObjResult(interp, Tcl_ObjPrintf("Unable to download \"%s\": %s", request.url, request.error));
 
-	if (fsuid == last_fsuid && last_homedir_obj != NULL) {
-		homedir_obj = last_homedir_obj;
+		return(TCL_ERROR);
+	}
 
-		Tcl_IncrRefCount(homedir_obj);
-	} else {
-		homedir = appfs_get_homedir(appfs_get_fsuid());
+	Tcl_DStringFree(&headers);
 
-		if (homedir == NULL) {
-			return(TCL_ERROR);
-		}
+	meta = Tcl_NewObj();
+	if (request.response_headers != NULL) {
+		for (line = request.response_headers; *line != '\0'; line = line_end + 1) {
+			line_end = strchr(line, '\n');
 
-		homedir_obj = Tcl_NewStringObj(homedir, -1);
+			value = memchr(line, ':', line_end - line);
+			if (value == NULL) {
+				continue;
+			}
 
-		free(homedir);
+			Tcl_ListObjAppendElement(NULL, meta, Tcl_NewStringObj(line, value - line));
 
-		Tcl_IncrRefCount(homedir_obj);
+			for (value++; *value == ' ' || *value == '\t'; value++) {
+				/* Nothing */
+			}
 
-		if (last_homedir_obj != NULL) {
-			Tcl_DecrRefCount(last_homedir_obj);
+			Tcl_ListObjAppendElement(NULL, meta, Tcl_NewStringObj(value, line_end - value));
 		}
 
-		last_homedir_obj = homedir_obj;
-		last_fsuid = fsuid;
-
-		Tcl_IncrRefCount(homedir_obj);
+		free(request.response_headers);
 	}
 
-       	Tcl_SetObjResult(interp, homedir_obj);
+	result = Tcl_NewObj();
+	Tcl_ListObjAppendElement(NULL, result, Tcl_NewIntObj(request.code));
+	Tcl_ListObjAppendElement(NULL, result, meta);
+	Tcl_ListObjAppendElement(NULL, result, Tcl_NewByteArrayObj((unsigned char *) buffer.data, buffer.len));
 
-	Tcl_DecrRefCount(homedir_obj);
+	free(buffer.data);
 
-        return(TCL_OK);
+	Tcl_SetObjResult(interp, result);
+
+	return(TCL_OK);
 }
 
-static int tcl_appfs_simulate_user_fs_enter(ClientData cd, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]) {
-	appfs_simulate_user_fs_enter();
+/*
+ * Tcl interface to take and release the lock for downloading a file into
+ * the cache
+ */
+static int tcl_appfs_download_lock(ClientData cd, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]) {
+	int wait = 1, locked;
+
+	if (objc < 2 || objc > 4) {
+		Tcl_WrongNumArgs(interp, 1, objv, "path ?wait? ?tmpfile?");
+		return(TCL_ERROR);
+	}
+
+	if (objc >= 3) {
+		if (Tcl_GetBooleanFromObj(interp, objv[2], &wait) != TCL_OK) {
+			return(TCL_ERROR);
+		}
+	}
+
+	locked = appfs_download_lock(Tcl_GetString(objv[1]), wait);
+
+	if (locked && objc == 4) {
+		appfs_download_lock_set_tmp_path(Tcl_GetString(objv[1]), Tcl_GetString(objv[3]));
+	}
+
+	Tcl_SetObjResult(interp, Tcl_NewBooleanObj(locked));
 
 	return(TCL_OK);
 }
 
-static int tcl_appfs_simulate_user_fs_leave(ClientData cd, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]) {
-	appfs_simulate_user_fs_leave();
+static int tcl_appfs_download_unlock(ClientData cd, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]) {
+	if (objc != 2) {
+		Tcl_WrongNumArgs(interp, 1, objv, "path");
+		return(TCL_ERROR);
+	}
+
+	appfs_download_unlock(Tcl_GetString(objv[1]));
 
 	return(TCL_OK);
 }
 
-static int tcl_appfs_get_fsuid(ClientData cd, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]) {
-	uid_t fsuid;
-
-	fsuid = appfs_get_fsuid();
+/*
+ * Tcl interface to record that a packaged file was opened, and to fetch the
+ * files of a replayed access profile
+ */
+static int tcl_appfs_profile_access(ClientData cd, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]) {
+	if (objc != 3) {
+		Tcl_WrongNumArgs(interp, 1, objv, "package_sha1 file_sha1");
+		return(TCL_ERROR);
+	}
 
-       	Tcl_SetObjResult(interp, Tcl_NewWideIntObj(fsuid));
+	Tcl_SetObjResult(interp, Tcl_NewBooleanObj(appfs_profile_access(Tcl_GetString(objv[1]), Tcl_GetString(objv[2]))));
 
 	return(TCL_OK);
 }
 
-static int tcl_appfs_get_fsgid(ClientData cd, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]) {
-	gid_t fsgid;
+static int tcl_appfs_prefetch(ClientData cd, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]) {
+	int prefetch_ret;
 
-	fsgid = appfs_get_fsgid();
+	if (objc != 3) {
+		Tcl_WrongNumArgs(interp, 1, objv, "hostname sha1s");
+		return(TCL_ERROR);
+	}
 
-       	Tcl_SetObjResult(interp, Tcl_NewWideIntObj(fsgid));
+	prefetch_ret = appfs_prefetch(Tcl_GetString(objv[1]), Tcl_GetString(objv[2]));
+	if (prefetch_ret != 0) {
+		Tcl_SetObjResult(interp, Tcl_NewStringObj(strerror(-prefetch_ret), -1));
+
+		return(TCL_ERROR);
+	}
 
 	return(TCL_OK);
 }
 
-static int tcl_appfs_get_path_info_cache_flush(ClientData cd, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]) {
-	int tcl_ret;
-	int new_size;
+/*
+ * Tcl interface to load a package's manifest into the cache database
+ */
+static int tcl_appfs_ingest_manifest(ClientData cd, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]) {
+	const char *error_string;
+	long entries;
+	int ingest_ret;
 
-	new_size = -1;
+	if (objc != 3) {
+		Tcl_WrongNumArgs(interp, 1, objv, "package_sha1 manifest_file");
+		return(TCL_ERROR);
+	}
+
+	ingest_ret = appfs_manifest_ingest(Tcl_GetString(objv[1]), Tcl_GetString(objv[2]), &entries, &error_string);
+	if (ingest_ret != 0) {
+		Tcl_SetObjResult(interp, Tcl_ObjPrintf("%s: %s", error_string, Tcl_GetString(objv[2])));
 
-	if (objc == 2) {
-		tcl_ret = Tcl_GetIntFromObj(interp, objv[1], &new_size);
-		if (tcl_ret != TCL_OK) {
-			return(tcl_ret);
-		}
-	} else if (objc > 2 || objc < 1) {
-                Tcl_WrongNumArgs(interp, 1, objv, "?new_cache_size?");
 		return(TCL_ERROR);
 	}
 
-	appfs_get_path_info_cache_flush(-1, new_size);
+	Tcl_SetObjResult(interp, Tcl_NewLongObj(entries));
 
 	return(TCL_OK);
 }
@@ -2058,6 +9870,19 @@ static int Appfsd_Init(Tcl_Interp *interp) {
 	Tcl_CreateObjCommand(interp, "appfsd::simulate_user_fs_enter", tcl_appfs_simulate_user_fs_enter, NULL, NULL);
 	Tcl_CreateObjCommand(interp, "appfsd::simulate_user_fs_leave", tcl_appfs_simulate_user_fs_leave, NULL, NULL);
 	Tcl_CreateObjCommand(interp, "appfsd::get_path_info_cache_flush", tcl_appfs_get_path_info_cache_flush, NULL, NULL);
+	Tcl_CreateObjCommand(interp, "appfsd::get_path_info_cache_stats", tcl_appfs_get_path_info_cache_stats, NULL, NULL);
+	Tcl_CreateObjCommand(interp, "appfsd::kernel_cache_invalidate", tcl_appfs_kernel_cache_invalidate, NULL, NULL);
+	Tcl_CreateObjCommand(interp, "appfsd::load_pki", tcl_appfs_load_pki, NULL, NULL);
+	Tcl_CreateObjCommand(interp, "appfsd::schema_initialized", tcl_appfs_schema_initialized, NULL, NULL);
+	Tcl_CreateObjCommand(interp, "appfsd::site_fresh", tcl_appfs_site_fresh, NULL, NULL);
+	Tcl_CreateObjCommand(interp, "appfsd::manifest_present", tcl_appfs_manifest_present, NULL, NULL);
+	Tcl_CreateObjCommand(interp, "appfsd::index_refresh", tcl_appfs_index_refresh, NULL, NULL);
+	Tcl_CreateObjCommand(interp, "appfsd::ingest_manifest", tcl_appfs_ingest_manifest, NULL, NULL);
+	Tcl_CreateObjCommand(interp, "appfsd::http_get", tcl_appfs_http_get, NULL, NULL);
+	Tcl_CreateObjCommand(interp, "appfsd::download_lock", tcl_appfs_download_lock, NULL, NULL);
+	Tcl_CreateObjCommand(interp, "appfsd::download_unlock", tcl_appfs_download_unlock, NULL, NULL);
+	Tcl_CreateObjCommand(interp, "appfsd::profile_access", tcl_appfs_profile_access, NULL, NULL);
+	Tcl_CreateObjCommand(interp, "appfsd::prefetch", tcl_appfs_prefetch, NULL, NULL);
 
 	Tcl_PkgProvide(interp, "appfsd", "1.0");
 
@@ -2157,14 +9982,109 @@ static void appfs_print_help(FILE *channel) {
 	fprintf(channel, "  -o nothreads    Enable single threaded mode.\n");
 	fprintf(channel, "  -o allow_other  Allow other users to access this mountpoint (default\n");
 	fprintf(channel, "                  if root).\n");
+	fprintf(channel, "  -o cache_mem=<size>\n");
+	fprintf(channel, "                  Amount of memory to use for caching path information,\n");
+	fprintf(channel, "                  optionally suffixed with k, m, or g (default 32m).\n");
+	fprintf(channel, "  -o tcl_workers=<count>\n");
+	fprintf(channel, "                  Number of threads with Tcl interpreters to handle\n");
+	fprintf(channel, "                  requests which need Tcl, or 0 to create one for each\n");
+	fprintf(channel, "                  FUSE thread as needed (default 8).\n");
+	fprintf(channel, "  -o download_workers=<count>\n");
+	fprintf(channel, "                  Number of threads with Tcl interpreters to download\n");
+	fprintf(channel, "                  files in the background, at least 2 (default 8).\n");
+	fprintf(channel, "  -o nokeep_cache Do not keep the kernel's page cache for packaged files\n");
+	fprintf(channel, "                  between opens.\n");
+	fprintf(channel, "  -o nostreaming  Do not allow packaged files to be read while they are\n");
+	fprintf(channel, "                  still being downloaded.\n");
+	fprintf(channel, "  -o noprefetch_libs\n");
+	fprintf(channel, "                  Do not fetch the libraries needed by executables and\n");
+	fprintf(channel, "                  libraries being streamed ahead of their being opened.\n");
+	fprintf(channel, "  -o download_connections=<count>\n");
+	fprintf(channel, "                  Number of requests to make to a site at the same time\n");
+	fprintf(channel, "                  with the native download method, or 0 for no limit\n");
+	fprintf(channel, "                  (default 4).\n");
+	fprintf(channel, "  -o sparse_min=<size>\n");
+	fprintf(channel, "                  Size of the smallest packaged file to fetch only the\n");
+	fprintf(channel, "                  parts of which are read while streaming, or 0 to always\n");
+	fprintf(channel, "                  download whole files (default 64m).\n");
+	fprintf(channel, "  -o profile_window=<seconds>\n");
+	fprintf(channel, "                  Number of seconds after a package is first opened to\n");
+	fprintf(channel, "                  record the files opened from it, which are fetched\n");
+	fprintf(channel, "                  together the next time, or 0 to disable (default 30).\n");
+	fprintf(channel, "  -o packaged_ttl=<seconds>\n");
+	fprintf(channel, "                  Number of seconds the kernel may cache lookups and\n");
+	fprintf(channel, "                  attributes of packaged files, only safe when a single\n");
+	fprintf(channel, "                  user uses the mount (default 3600, or 0 if other users\n");
+	fprintf(channel, "                  may access the mountpoint).\n");
 
 	return;
 }
 
+/*
+ * Parse a size in bytes, optionally suffixed with "k", "m", or "g"
+ *         Returns -1 if the size could not be parsed
+ */
+static long long appfs_opt_parse_size(const char *value) {
+	unsigned long long retval;
+	char *suffix;
+
+	errno = 0;
+	retval = strtoull(value, &suffix, 10);
+	if (errno != 0 || suffix == value) {
+		return(-1);
+	}
+
+	switch (*suffix) {
+		case 'g':
+		case 'G':
+			retval *= 1024;
+			/* Fall through */
+		case 'm':
+		case 'M':
+			retval *= 1024;
+			/* Fall through */
+		case 'k':
+		case 'K':
+			retval *= 1024;
+
+			suffix++;
+
+			break;
+	}
+
+	if (*suffix != '\0') {
+		return(-1);
+	}
+
+	return(retval);
+}
+
+/*
+ * Parse a count between "min" and "max"
+ *         Returns -1 if the count could not be parsed or is out of range
+ */
+static int appfs_opt_parse_count(const char *value, int min, int max) {
+	long retval;
+	char *end;
+
+	errno = 0;
+	retval = strtol(value, &end, 10);
+	if (errno != 0 || end == value || *end != '\0') {
+		return(-1);
+	}
+
+	if (retval < min || retval > max) {
+		return(-1);
+	}
+
+	return(retval);
+}
+
 static int appfs_opt_parse(int argc, char **argv,  struct fuse_args *args) {
-	int ch;
-	char *optstr, *optstr_next, *optstr_s;
+	int ch, allow_other;
+	char *optstr, *optstr_next, *optstr_s, *end;
 	char fake_arg[3] = {'-', 0, 0};
+	long long cache_mem;
 
 	/*
 	 * Default values
@@ -2178,9 +10098,13 @@ static int appfs_opt_parse(int argc, char **argv,  struct fuse_args *args) {
 	/**
 	 ** Add FUSE arguments which we always supply
 	 **/
-	fuse_opt_add_arg(args, "-odefault_permissions,fsname=appfs,subtype=appfsd,use_ino,entry_timeout=0,attr_timeout=0,big_writes,intr,hard_remove");
+	fuse_opt_add_arg(args, "-odefault_permissions,fsname=appfs,subtype=appfsd,big_writes");
+
+	allow_other = 0;
 
 	if (getuid() == 0) {
+		allow_other = 1;
+
 		fuse_opt_parse(args, NULL, NULL, NULL);
 		fuse_opt_add_arg(args, "-oallow_other");
 
@@ -2225,6 +10149,86 @@ static int appfs_opt_parse(int argc, char **argv,  struct fuse_args *args) {
 
 						fuse_opt_parse(args, NULL, NULL, NULL);
 						fuse_opt_add_arg(args, "-oallow_other");
+
+						allow_other = 1;
+					} else if (strncmp(optstr, "cache_mem=", 10) == 0) {
+						cache_mem = appfs_opt_parse_size(optstr + 10);
+						if (cache_mem <= 0) {
+							APPFS_ERROR("appfsd: invalid cache size: \"-o %s\"", optstr);
+
+							free(optstr_s);
+
+							return(1);
+						}
+
+						appfs_path_info_cache_mem = cache_mem;
+					} else if (strncmp(optstr, "tcl_workers=", 12) == 0) {
+						appfs_tcl_workers = appfs_opt_parse_count(optstr + 12, 0, 1024);
+						if (appfs_tcl_workers < 0) {
+							APPFS_ERROR("appfsd: invalid number of Tcl workers: \"-o %s\"", optstr);
+
+							free(optstr_s);
+
+							return(1);
+						}
+					} else if (strncmp(optstr, "download_workers=", 17) == 0) {
+						appfs_download_workers = appfs_opt_parse_count(optstr + 17, 2, 1024);
+						if (appfs_download_workers < 0) {
+							APPFS_ERROR("appfsd: invalid number of download workers: \"-o %s\"", optstr);
+
+							free(optstr_s);
+
+							return(1);
+						}
+					} else if (strcmp(optstr, "keep_cache") == 0) {
+						appfs_keep_cache = 1;
+					} else if (strcmp(optstr, "nokeep_cache") == 0) {
+						appfs_keep_cache = 0;
+					} else if (strcmp(optstr, "streaming") == 0) {
+						appfs_streaming = 1;
+					} else if (strcmp(optstr, "nostreaming") == 0) {
+						appfs_streaming = 0;
+					} else if (strcmp(optstr, "prefetch_libs") == 0) {
+						appfs_prefetch_libs = 1;
+					} else if (strcmp(optstr, "noprefetch_libs") == 0) {
+						appfs_prefetch_libs = 0;
+					} else if (strncmp(optstr, "download_connections=", 21) == 0) {
+						appfs_http_connections = appfs_opt_parse_count(optstr + 21, 0, 1024);
+						if (appfs_http_connections < 0) {
+							APPFS_ERROR("appfsd: invalid number of download connections: \"-o %s\"", optstr);
+
+							free(optstr_s);
+
+							return(1);
+						}
+					} else if (strncmp(optstr, "sparse_min=", 11) == 0) {
+						appfs_sparse_min = appfs_opt_parse_size(optstr + 11);
+						if (appfs_sparse_min < 0) {
+							APPFS_ERROR("appfsd: invalid size: \"-o %s\"", optstr);
+
+							free(optstr_s);
+
+							return(1);
+						}
+					} else if (strncmp(optstr, "profile_window=", 15) == 0) {
+						appfs_profile_window = appfs_opt_parse_count(optstr + 15, 0, INT_MAX);
+						if (appfs_profile_window < 0) {
+							APPFS_ERROR("appfsd: invalid profile window: \"-o %s\"", optstr);
+
+							free(optstr_s);
+
+							return(1);
+						}
+					} else if (strncmp(optstr, "packaged_ttl=", 13) == 0) {
+						errno = 0;
+						appfs_packaged_timeout = strtod(optstr + 13, &end);
+						if (errno != 0 || end == optstr + 13 || *end != '\0' || !(appfs_packaged_timeout >= 0.0)) {
+							APPFS_ERROR("appfsd: invalid time: \"-o %s\"", optstr);
+
+							free(optstr_s);
+
+							return(1);
+						}
 					} else if (strcmp(optstr, "rw") == 0) {
 						/* Ignored */
 					} else {
@@ -2266,6 +10270,18 @@ static int appfs_opt_parse(int argc, char **argv,  struct fuse_args *args) {
 		}
 	}
 
+	/*
+	 * Only let the kernel cache packaged paths by default if nobody but
+	 * the user mounting AppFS can use it
+	 */
+	if (appfs_packaged_timeout < 0.0) {
+		if (allow_other) {
+			appfs_packaged_timeout = 0.0;
+		} else {
+			appfs_packaged_timeout = 3600.0;
+		}
+	}
+
 	if ((optind + 2) != argc) {
 		if ((optind + 2) < argc) {
 			APPFS_ERROR("Too many arguments");
@@ -2294,26 +10310,140 @@ static int appfs_opt_parse(int argc, char **argv,  struct fuse_args *args) {
 
 
 /*
- * FUSE operations structure
+ * FUSE low-level operations structure
  */
-static struct fuse_operations appfs_operations = {
-	.getattr   = appfs_fuse_getattr,
-	.readdir   = appfs_fuse_readdir,
-	.readlink  = appfs_fuse_readlink,
-	.open      = appfs_fuse_open,
-	.release   = appfs_fuse_close,
-	.read      = appfs_fuse_read,
-	.write     = appfs_fuse_write,
-	.mknod     = appfs_fuse_mknod,
-	.create    = appfs_fuse_create,
-	.truncate  = appfs_fuse_truncate,
-	.unlink    = appfs_fuse_unlink_rmdir,
-	.rmdir     = appfs_fuse_unlink_rmdir,
-	.mkdir     = appfs_fuse_mkdir,
-	.chmod     = appfs_fuse_chmod,
-	.symlink   = appfs_fuse_symlink,
+static void appfs_fuse_ll_init(void *userdata, struct fuse_conn_info *conn) {
+	/*
+	 * Allow FUSE to splice() data we reply with from a file descriptor
+	 * directly to the kernel
+	 */
+	if ((conn->capable & FUSE_CAP_SPLICE_WRITE) == FUSE_CAP_SPLICE_WRITE) {
+		conn->want |= FUSE_CAP_SPLICE_WRITE;
+	}
+
+	if ((conn->capable & FUSE_CAP_SPLICE_MOVE) == FUSE_CAP_SPLICE_MOVE) {
+		conn->want |= FUSE_CAP_SPLICE_MOVE;
+	}
+
+	APPFS_DEBUG("FUSE capabilities: %#x, wanted: %#x", conn->capable, conn->want);
+
+	return;
+}
+
+static struct fuse_lowlevel_ops appfs_operations = {
+	.init         = appfs_fuse_ll_init,
+	.lookup       = appfs_fuse_ll_lookup,
+	.forget       = appfs_fuse_ll_forget,
+	.forget_multi = appfs_fuse_ll_forget_multi,
+	.getattr      = appfs_fuse_ll_getattr,
+	.setattr      = appfs_fuse_ll_setattr,
+	.readlink     = appfs_fuse_ll_readlink,
+	.opendir      = appfs_fuse_ll_opendir,
+	.readdir      = appfs_fuse_ll_readdir,
+	.releasedir   = appfs_fuse_ll_releasedir,
+	.open         = appfs_fuse_ll_open,
+	.release      = appfs_fuse_ll_release,
+	.read         = appfs_fuse_ll_read,
+	.write        = appfs_fuse_ll_write,
+	.mknod        = appfs_fuse_ll_mknod,
+	.create       = appfs_fuse_ll_create,
+	.unlink       = appfs_fuse_ll_unlink_rmdir,
+	.rmdir        = appfs_fuse_ll_unlink_rmdir,
+	.mkdir        = appfs_fuse_ll_mkdir,
+	.symlink      = appfs_fuse_ll_symlink,
 };
 
+/*
+ * Mount the filesystem and service requests until unmounted, this is the
+ * low-level equivalent of fuse_main()
+ */
+static int appfs_fuse_main(struct fuse_args *args) {
+	char *mountpoint;
+	int multithreaded, foreground;
+	int fuse_ret;
+
+	fuse_ret = fuse_parse_cmdline(args, &mountpoint, &multithreaded, &foreground);
+	if (fuse_ret != 0) {
+		return(1);
+	}
+
+	if (mountpoint == NULL) {
+		APPFS_ERROR("Missing mountpoint");
+
+		return(1);
+	}
+
+	appfs_fuse_chan = fuse_mount(mountpoint, args);
+	if (appfs_fuse_chan == NULL) {
+		free(mountpoint);
+
+		return(1);
+	}
+
+	appfs_fuse_session = fuse_lowlevel_new(args, &appfs_operations, sizeof(appfs_operations), NULL);
+	if (appfs_fuse_session == NULL) {
+		fuse_unmount(mountpoint, appfs_fuse_chan);
+
+		free(mountpoint);
+
+		return(1);
+	}
+
+	fuse_session_add_chan(appfs_fuse_session, appfs_fuse_chan);
+
+	fuse_ret = fuse_set_signal_handlers(appfs_fuse_session);
+	if (fuse_ret == 0) {
+		fuse_ret = fuse_daemonize(foreground);
+	}
+
+	if (fuse_ret == 0) {
+		/*
+		 * Started after daemonizing since threads do not survive fork()
+		 */
+		appfs_kernel_inval_start();
+
+		if (multithreaded) {
+			appfs_tcl_workers_start();
+			appfs_download_workers_start();
+			appfs_index_refresh_start();
+			appfs_streaming_start();
+			appfs_control_start();
+		}
+
+		if (multithreaded) {
+			fuse_ret = fuse_session_loop_mt(appfs_fuse_session);
+		} else {
+			fuse_ret = fuse_session_loop(appfs_fuse_session);
+		}
+
+		appfs_control_stop();
+
+		fuse_remove_signal_handlers(appfs_fuse_session);
+	}
+
+#ifdef DEBUG
+	{
+		struct appfs_path_info_cache_shard cache_stats;
+
+		appfs_get_path_info_cache_stats(&cache_stats);
+
+		APPFS_DEBUG("Path info cache: %llu hits, %llu misses, %llu evictions, %llu entries", cache_stats.hits, cache_stats.misses, cache_stats.evictions, cache_stats.entries);
+	}
+#endif
+
+	fuse_session_remove_chan(appfs_fuse_chan);
+	fuse_session_destroy(appfs_fuse_session);
+	fuse_unmount(mountpoint, appfs_fuse_chan);
+
+	free(mountpoint);
+
+	if (fuse_ret != 0) {
+		return(1);
+	}
+
+	return(0);
+}
+
 
 #ifdef APPFS_NO_RLIMIT
 static void appfs_set_resource_limits(void) {
@@ -2425,6 +10555,26 @@ for (i = 0; i < argc; i++) {
 		return(1);
 	}
 
+	/*
+	 * Create a TSD key for each thread's SQLite3 handle, used by the
+	 * native path resolver
+	 */
+	pthread_ret = pthread_key_create(&sqliteKey, appfs_sqlite3_free);
+	if (pthread_ret != 0) {
+		APPFS_ERROR("Unable to create TSD key for SQLite3.  Aborting.");
+
+		return(1);
+	}
+
+	/*
+	 * Create the locks for each shard of the path info cache
+	 */
+	if (appfs_get_path_info_cache_init() != 0) {
+		APPFS_ERROR("Unable to initialize path info cache.  Aborting.");
+
+		return(1);
+	}
+
 	/*
 	 * Manually specify cache directory, without FUSE callback
 	 * This option only works when not using FUSE, since we
@@ -2454,6 +10604,30 @@ for (i = 0; i < argc; i++) {
 		return(appfs_tcl(argv[1]));
 	}
 
+	/*
+	 * Hoard mode, for fetching all of a package's files into the cache
+	 * ahead of time
+	 */
+	if (argc >= 1 && strcmp(argv[0], "--hoard") == 0) {
+		return(appfs_hoard_main(argc - 1, argv + 1));
+	}
+
+	/*
+	 * Startup benchmark mode, for measuring how long it takes to bring
+	 * up an interpreter
+	 */
+	if (argc == 2 && strcmp(argv[0], "--benchmark-startup") == 0) {
+		return(appfs_benchmark_startup(argv[1]));
+	}
+
+	/*
+	 * Manifest benchmark mode, for measuring how quickly manifests are
+	 * loaded into the cache database
+	 */
+	if (argc >= 1 && strcmp(argv[0], "--benchmark-manifest") == 0) {
+		return(appfs_benchmark_manifest(argc - 1, argv + 1));
+	}
+
 	/*
 	 * Parse command line arguments
 	 */
@@ -2507,5 +10681,5 @@ for (i = 0; i < argc; i++) {
 	 * and start servicing requests.
 	 */
 	appfs_fuse_started = 1;
-	return(fuse_main(args.argc, args.argv, &appfs_operations, NULL));
+	return(appfs_fuse_main(&args));
 }
@@ -27,11 +27,48 @@ package require sqlite3
 package require sha1
 package require appfsd
 package require platform
-package require pki
 
 # Functions specifically meant for users to replace as a part of configuration
 namespace eval ::appfs::user {
-	variable download_method "tcl"
+	# One of "native" (appfsd's own HTTP client, which reuses
+	# connections), "tcl", or "curl"
+	variable download_method "native"
+
+	# The download method to use for an URL, since the native method
+	# only handles "http" URLs and does not know about any proxy
+	# configured for the "tcl" method
+	proc _download_method {url} {
+		if {$::appfs::user::download_method eq "native"} {
+			if {![string match -nocase "http://*" $url]} {
+				return "tcl"
+			}
+
+			if {[::http::config -proxyhost] ne "" || [string trimleft [::http::config -proxyfilter] ":"] ne "http::ProxyRequired"} {
+				return "tcl"
+			}
+		}
+
+		return $::appfs::user::download_method
+	}
+
+	# Check that the headers of a response to a request for part of a
+	# file say that it is the part which was asked for
+	proc _check_content_range {url meta offset end} {
+		set content_range ""
+		foreach {key value} $meta {
+			if {[string tolower $key] eq "content-range"} {
+				set content_range [string trim $value]
+			}
+		}
+
+		if {![regexp {^bytes +([0-9]+)-([0-9]+)/([0-9]+|\*)$} $content_range -> range_start range_end]} {
+			return -code error "Unable to download part of \"$url\": Site did not return a valid Content-Range (returned \"$content_range\")"
+		}
+
+		if {$range_start != $offset || $range_end != $end} {
+			return -code error "Unable to download part of \"$url\": Site returned bytes ${range_start}-${range_end}, not ${offset}-${end}"
+		}
+	}
 
 	# User-replacable function to convert a hostname/hash/method to an URL
 	proc construct_url {hostname hash method} {
@@ -58,7 +95,20 @@ namespace eval ::appfs::user {
 
 	# User-replacable function to fetch a remote file
 	proc download_file {url {outputChannel ""}} {
-		switch -- $::appfs::user::download_method {
+		switch -- [_download_method $url] {
+			"native" {
+				if {$outputChannel eq ""} {
+					lassign [::appfsd::http_get $url -expect 200] tokenCode meta retval
+				} else {
+					lassign [::appfsd::http_get $url -expect 200 -channel $outputChannel] tokenCode meta retval
+				}
+
+				if {$tokenCode != "200"} {
+					return -code error "Unable to download \"$url\": Site did not return a 200 (returned $tokenCode)"
+				}
+
+				return $retval
+			}
 			"curl" {
 				if {$outputChannel eq ""} {
 					return [exec curl -sS -L -- $url]
@@ -102,6 +152,135 @@ namespace eval ::appfs::user {
 
 		return -code error "Unable to download"
 	}
+
+	# User-replacable function to fetch a remote file only if it has
+	# changed since it was last fetched.  "validators" is a dictionary
+	# with the "etag" and "last_modified" values from the last fetch, if
+	# any.  Returns a dictionary with "changed", and when it has changed
+	# the "data" and new "validators"
+	proc download_file_if_changed {url validators} {
+		set method [_download_method $url]
+
+		if {$method ni {native tcl}} {
+			return [dict create changed 1 data [download_file $url] validators [dict create]]
+		}
+
+		set headers [list]
+		if {[dict exists $validators etag]} {
+			lappend headers If-None-Match [dict get $validators etag]
+		}
+		if {[dict exists $validators last_modified]} {
+			lappend headers If-Modified-Since [dict get $validators last_modified]
+		}
+
+		if {$method eq "native"} {
+			lassign [::appfsd::http_get $url -headers $headers] tokenCode meta data
+		} else {
+			catch {
+				set token [http::geturl $url -headers $headers]
+			} err
+
+			if {![info exists token]} {
+				return -code error "Unable to download \"$url\": $err"
+			}
+
+			set tokenCode [http::ncode $token]
+			set data [http::data $token]
+			set meta [http::meta $token]
+
+			http::cleanup $token
+		}
+
+		if {$tokenCode == "304"} {
+			return [dict create changed 0]
+		}
+
+		if {$tokenCode != "200"} {
+			return -code error "Unable to download \"$url\": Site did not return a 200 (returned $tokenCode)"
+		}
+
+		set validators [dict create]
+		foreach {key value} $meta {
+			switch -- [string tolower $key] {
+				"etag" {
+					dict set validators etag $value
+				}
+				"last-modified" {
+					dict set validators last_modified $value
+				}
+			}
+		}
+
+		return [dict create changed 1 data $data validators $validators]
+	}
+
+	# User-replacable function to fetch "length" bytes of a remote file
+	# starting at "offset", writing them to outputChannel.  Returns an
+	# error if the site will not send just that part of the file.
+	proc download_file_range {url offset length outputChannel} {
+		set method [_download_method $url]
+		set end [expr {$offset + $length - 1}]
+
+		if {$method eq "native"} {
+			set start [tell $outputChannel]
+
+			lassign [::appfsd::http_get $url -headers [list Range "bytes=${offset}-${end}"] -expect 206 -channel $outputChannel] tokenCode meta
+
+			if {$tokenCode != "206"} {
+				return -code error "Unable to download part of \"$url\": Site did not return a 206 (returned $tokenCode)"
+			}
+
+			_check_content_range $url $meta $offset $end
+
+			flush $outputChannel
+
+			if {[tell $outputChannel] - $start != $length} {
+				return -code error "Unable to download part of \"$url\": Site returned [expr {[tell $outputChannel] - $start}] bytes, not $length"
+			}
+
+			return ""
+		}
+
+		if {$method ne "tcl"} {
+			return -code error "Unable to download part of \"$url\": Not supported by download method $method"
+		}
+
+		# Give up as soon as it is clear the site is sending more than
+		# was asked for, rather than transferring the whole file
+		set progress [list apply {{length token total current} {
+			if {$current > $length || ([http::ncode $token] ne "" && [http::ncode $token] != "206")} {
+				http::reset $token
+			}
+		}} $length]
+
+		catch {
+			set token [http::geturl $url -binary true -headers [list Range "bytes=${offset}-${end}"] -progress $progress]
+		} err
+
+		if {![info exists token]} {
+			return -code error "Unable to download part of \"$url\": $err"
+		}
+
+		set tokenCode [http::ncode $token]
+		set data [http::data $token]
+		set meta [http::meta $token]
+
+		http::cleanup $token
+
+		if {$tokenCode != "206"} {
+			return -code error "Unable to download part of \"$url\": Site did not return a 206 (returned $tokenCode)"
+		}
+
+		_check_content_range $url $meta $offset $end
+
+		if {[string length $data] != $length} {
+			return -code error "Unable to download part of \"$url\": Site returned [string length $data] bytes, not $length"
+		}
+
+		puts -nonewline $outputChannel $data
+
+		return ""
+	}
 }
 
 namespace eval ::appfs {
@@ -109,6 +288,9 @@ namespace eval ::appfs {
 	variable ttl 3600
 	variable nttl 3600
 	variable trusted_cas [list]
+	variable native_resolver 1
+	variable conditional_index_fetch 1
+	variable blockhashes_last [list]
 	variable platform [::platform::generic]
 
 	proc _hash_sep {hash {seps 4}} {
@@ -121,6 +303,36 @@ namespace eval ::appfs {
 	}
 
 	proc _cachefile {url key method {keyIsHash 1}} {
+		set file [_cachefile_path $key $method $keyIsHash]
+
+		if {[file exists $file]} {
+			return $file
+		}
+
+		# Only one thread or process downloads a file at a time, the
+		# rest wait for it and then find it in the cache.  Files being
+		# streamed by appfsd may instead be read from the temporary
+		# file as it arrives.
+		set tmpfile [_cachefile_tmpfile $file]
+
+		::appfsd::download_lock $file 1 $tmpfile
+
+		set retcode [catch {
+			if {![file exists $file]} {
+				_cachefile_fetch $url $key $keyIsHash $file $tmpfile
+			}
+		} err]
+
+		::appfsd::download_unlock $file
+
+		if {$retcode != 0} {
+			return -code error $err
+		}
+
+		return $file
+	}
+
+	proc _cachefile_path {key method {keyIsHash 1}} {
 		if {$keyIsHash && $method != "sha1"} {
 			return -code error "Only SHA1 hashing method is supported"
 		}
@@ -134,12 +346,16 @@ namespace eval ::appfs {
 
 		file mkdir [file dirname $file]
 
-		if {[file exists $file]} {
-			return $file
-		}
+		return $file
+	}
 
-		set tmpfile "${file}.[expr {rand()}][clock clicks]"
+	proc _cachefile_tmpfile {file} {
+		return "${file}.[expr {rand()}][clock clicks]"
+	}
 
+	# Fetch a file into a temporary file, then move it into the cache if
+	# it is what was asked for
+	proc _cachefile_fetch {url key keyIsHash file tmpfile} {
 		set fd [open $tmpfile "w"]
 		fconfigure $fd -translation binary
 
@@ -149,6 +365,12 @@ namespace eval ::appfs {
 
 		close $fd
 
+		_cachefile_promote $key $keyIsHash $file $tmpfile
+	}
+
+	# Move a temporary file into the cache if it is what was asked for,
+	# otherwise discard it
+	proc _cachefile_promote {key keyIsHash file tmpfile} {
 		if {$keyIsHash} {
 			set hash [string tolower [sha1::sha1 -hex -file $tmpfile]]
 		} else {
@@ -160,11 +382,8 @@ namespace eval ::appfs {
 		} else {
 			file delete -force -- $tmpfile
 		}
-
-		return $file
 	}
 
-
 	proc _isHash {value} {
 		set value [string tolower $value]
 
@@ -179,7 +398,66 @@ namespace eval ::appfs {
 		return true
 	}
 
+	# Load the PKI stack on first use, since signatures only need to be
+	# verified when an index is fetched
+	proc _loadPKI {} {
+		if {[info exists ::appfs::pki_loaded]} {
+			return
+		}
+
+		::appfsd::load_pki
+
+		set ::appfs::pki_loaded 1
+	}
+
+	# Handle unknown commands for every namespace, so that commands in
+	# "::pki" (such as those called by a configuration file) load the PKI
+	# stack when first called
+	proc _unknown {command args} {
+		set pki_command "::[string trimleft $command :]"
+		if {[string match "::pki::*" $pki_command]} {
+			_loadPKI
+
+			if {[info commands $pki_command] ne ""} {
+				return [uplevel 1 [list $pki_command {*}$args]]
+			}
+		}
+
+		if {[info commands ::unknown] ne ""} {
+			return [uplevel 1 [list ::unknown $command {*}$args]]
+		}
+
+		return -code error "invalid command name \"$command\""
+	}
+
+	# The trusted CAs may be given as PEM, which are parsed when first
+	# needed, or as already parsed certificates
+	proc _trustedCAs {} {
+		if {[info exists ::appfs::trusted_cas_parsed]} {
+			if {[lindex $::appfs::trusted_cas_parsed 0] eq $::appfs::trusted_cas} {
+				return [lindex $::appfs::trusted_cas_parsed 1]
+			}
+		}
+
+		_loadPKI
+
+		set retval [list]
+		foreach trusted_ca $::appfs::trusted_cas {
+			if {[string match "*-----BEGIN CERTIFICATE-----*" $trusted_ca]} {
+				set trusted_ca [::pki::x509::parse_cert $trusted_ca]
+			}
+
+			lappend retval $trusted_ca
+		}
+
+		set ::appfs::trusted_cas_parsed [list $::appfs::trusted_cas $retval]
+
+		return $retval
+	}
+
 	proc _verifySignatureAndCertificate {hostname certificate signature hash} {
+		_loadPKI
+
 		set certificate [binary format "H*" $certificate]
 		set signature   [binary format "H*" $signature]
 
@@ -196,7 +474,7 @@ namespace eval ::appfs {
 			return false
 		}
 
-		if {![::pki::x509::verify_cert $certificate $::appfs::trusted_cas]} {
+		if {![::pki::x509::verify_cert $certificate [_trustedCAs]]} {
 			return false
 		}
 
@@ -275,8 +553,9 @@ namespace eval ::appfs {
 
 		set ::appfs::init_called 1
 
-		# Add a default CA to list of trusted CAs
-		lappend ::appfs::trusted_cas [::pki::x509::parse_cert {
+		# Add a default CA to list of trusted CAs, this is only parsed
+		# once a signature needs to be verified (see _trustedCAs)
+		lappend ::appfs::trusted_cas {
 -----BEGIN CERTIFICATE-----
 MIIC7DCCAdSgAwIBAgIBATANBgkqhkiG9w0BAQUFADAvMRIwEAYDVQQKEwlSb3kg
 S2VlbmUxGTAXBgNVBAMTEEFwcEZTIEtleSBNYXN0ZXIwHhcNMTkxMjEyMjM1OTIz
@@ -295,14 +574,43 @@ BQM75CMQckwmnlII1yhStRDCcgIaMpv7L6vutmvdvN0QMJKnX/5papLrdiHu1Nt7
 bSf8agpRgIQKKSyuwFjp3zT8oeAzEzL4HdOBCveQ5EamCqvV6EDIuIR7b+4ZnYoL
 3qh0YRO/9jrtb786iqWGexZ1JBjiSMhYA1CcvJtR/vQ=
 -----END CERTIFICATE-----
-}]
+}
 
 		# Load configuration file
+		foreach hook {get_homedir change_perms download_file download_file_if_changed} {
+			set default_hooks($hook) [info body ::appfs::user::$hook]
+		}
+
+		# Configuration files (and the hooks they define) may call
+		# into the PKI stack, which is only loaded once one of its
+		# commands is called
+		namespace eval :: {
+			namespace unknown ::appfs::_unknown
+		}
+
 		set config_file [file join $::appfs::cachedir config]
 		if {[file exists $config_file]} {
 			source $config_file
 		}
 
+		# The native path resolver in appfsd does not call into the
+		# user hooks, so it can only be used if they are not replaced
+		foreach hook {get_homedir change_perms} {
+			if {[info body ::appfs::user::$hook] ne $default_hooks($hook)} {
+				set ::appfs::native_resolver 0
+			}
+		}
+
+		if {[array exists ::appfs::user::add_perms]} {
+			set ::appfs::native_resolver 0
+		}
+
+		# If the way files are fetched has been replaced, conditional
+		# fetching of the index must be too for it to be used
+		if {[info body ::appfs::user::download_file] ne $default_hooks(download_file) && [info body ::appfs::user::download_file_if_changed] eq $default_hooks(download_file_if_changed)} {
+			set ::appfs::conditional_index_fetch 0
+		}
+
 		if {![info exists ::appfs::db]} {
 			file mkdir $::appfs::cachedir
 
@@ -311,15 +619,52 @@ bSf8agpRgIQKKSyuwFjp3zT8oeAzEzL4HdOBCveQ5EamCqvV6EDIuIR7b+4ZnYoL
 			::appfs::db timeout 30000
 		}
 
-		# Create tables
+		# Create tables and indexes, once per process
+		if {[::appfsd::schema_initialized]} {
+			return
+		}
+
+		set have_directories [db onecolumn {SELECT 1 FROM sqlite_master WHERE type = 'table' AND name = 'directories';}]
+
 		db eval {CREATE TABLE IF NOT EXISTS sites(hostname PRIMARY KEY, lastUpdate, ttl);}
 		db eval {CREATE TABLE IF NOT EXISTS packages(hostname, sha1, package, version, os, cpuArch, isLatest, haveManifest);}
 		db eval {CREATE TABLE IF NOT EXISTS files(package_sha1, type, time, source, size, perms, file_sha1, file_name, file_directory);}
+		db eval {CREATE TABLE IF NOT EXISTS directories(package_sha1, file_directory, childcount);}
+		db eval {CREATE TABLE IF NOT EXISTS site_index(hostname PRIMARY KEY, indexHash, etag, lastModified);}
+
+		# Block hashes used to be shared by every site listing a file,
+		# they are now only used for the site whose manifest listed them
+		set blockhashes_columns [list]
+		db eval {PRAGMA table_info(blockhashes);} column {
+			lappend blockhashes_columns $column(name)
+		}
+
+		if {[llength $blockhashes_columns] != 0 && [lsearch -exact $blockhashes_columns package_sha1] == -1} {
+			db eval {DROP TABLE blockhashes;}
+		}
+
+		db eval {CREATE TABLE IF NOT EXISTS blockhashes(package_sha1, file_sha1, blockSize, blocklist_sha1, PRIMARY KEY (package_sha1, file_sha1));}
+		db eval {CREATE TABLE IF NOT EXISTS access_profiles(package_sha1, seq, file_sha1);}
 
-		# Create indexes
 		db eval {CREATE INDEX IF NOT EXISTS sites_index ON sites (hostname);}
 		db eval {CREATE INDEX IF NOT EXISTS packages_index ON packages (hostname, sha1, package, version, os, cpuArch);}
 		db eval {CREATE INDEX IF NOT EXISTS files_index ON files (package_sha1, file_name, file_directory);}
+		db eval {CREATE INDEX IF NOT EXISTS files_directory_index ON files (package_sha1, file_directory);}
+		db eval {CREATE INDEX IF NOT EXISTS directories_index ON directories (package_sha1, file_directory);}
+		db eval {CREATE INDEX IF NOT EXISTS blockhashes_index ON blockhashes (file_sha1);}
+		db eval {CREATE INDEX IF NOT EXISTS access_profiles_index ON access_profiles (package_sha1, seq);}
+
+		# Caches created before directory child counts were recorded
+		# need them computed for all the manifests they already have
+		if {$have_directories != "1"} {
+			db eval {
+				INSERT INTO directories (package_sha1, file_directory, childcount)
+					SELECT package_sha1, file_directory, COUNT(DISTINCT file_name) FROM files
+						GROUP BY package_sha1, file_directory;
+			}
+		}
+
+		::appfsd::schema_initialized 1
 	}
 
 	proc download {hostname hash {method sha1}} {
@@ -333,11 +678,240 @@ bSf8agpRgIQKKSyuwFjp3zT8oeAzEzL4HdOBCveQ5EamCqvV6EDIuIR7b+4ZnYoL
 		return $file
 	}
 
-	proc getindex {hostname} {
+	# Record that a site's index was just brought up to date
+	proc _indexFresh {hostname now} {
+		db eval {INSERT OR REPLACE INTO sites (hostname, lastUpdate, ttl) VALUES ($hostname, $now, $::appfs::ttl);}
+		::appfsd::site_fresh $hostname [expr {$now + $::appfs::ttl}]
+	}
+
+	# Record which index a site gave us, and what to give back to the
+	# site to find out if it has changed
+	proc _indexValidators {hostname indexhash validators} {
+		set etag ""
+		set lastModified ""
+
+		if {[dict exists $validators etag]} {
+			set etag [dict get $validators etag]
+		}
+
+		if {[dict exists $validators last_modified]} {
+			set lastModified [dict get $validators last_modified]
+		}
+
+		db eval {INSERT OR REPLACE INTO site_index (hostname, indexHash, etag, lastModified) VALUES ($hostname, $indexhash, $etag, $lastModified);}
+	}
+
+	# Begin a download into the cache which can be read from while it is
+	# still arriving.  Returns the temporary file the data will be
+	# written to, and the file it will become once it has been verified
+	# by download_finish.  If the file is already in the cache, these
+	# are the same.  Otherwise the download lock for the file is held,
+	# and must be released by the caller once the download is over.
+	# If someone else holds the lock, the temporary file is empty and
+	# the caller waits for them, rather than this thread.
+	proc download_start {hostname hash {method sha1}} {
+		set file [_cachefile_path $hash $method]
+
+		if {[file exists $file]} {
+			return [list $file $file]
+		}
+
+		if {![::appfsd::download_lock $file 0]} {
+			return [list "" $file]
+		}
+
+		if {[file exists $file]} {
+			::appfsd::download_unlock $file
+
+			return [list $file $file]
+		}
+
+		set tmpfile [_cachefile_tmpfile $file]
+
+		if {[catch {
+			close [open $tmpfile "w"]
+		} err]} {
+			::appfsd::download_unlock $file
+
+			return -code error $err
+		}
+
+		return [list $tmpfile $file]
+	}
+
+	proc download_finish {hostname hash tmpfile {method sha1}} {
+		set url [::appfs::user::construct_url $hostname $hash $method]
+		set file [_cachefile_path $hash $method]
+
+		_cachefile_fetch $url $hash 1 $file $tmpfile
+
+		if {![file exists $file]} {
+			return -code error "Unable to fetch (file does not exist: $file)"
+		}
+
+		return $file
+	}
+
+	# Fill in part of a temporary file created by download_start, for
+	# files which are fetched piece by piece as they are read.  Once
+	# every piece is present, download_verify moves it into the cache.
+	proc download_range {hostname hash tmpfile offset length {method sha1}} {
+		set url [::appfs::user::construct_url $hostname $hash $method]
+
+		set fd [open $tmpfile {WRONLY BINARY}]
+
+		set retcode [catch {
+			seek $fd $offset
+			::appfs::user::download_file_range $url $offset $length $fd
+		} err]
+
+		close $fd
+
+		if {$retcode != 0} {
+			return -code error $err
+		}
+
+		download_verify_range $hostname $hash $tmpfile $offset $length
+
+		return ""
+	}
+
+	# Get the size of the blocks of a file and their hashes, if its
+	# manifest listed them, as a list of the block size and the list of
+	# hashes.  The list of hashes is itself fetched by its hash.
+	proc _blockhashes {hostname hash} {
+		variable blockhashes_last
+
+		if {[lindex $blockhashes_last 0] eq "$hostname/$hash"} {
+			return [lrange $blockhashes_last 1 end]
+		}
+
+		# Only block hashes from this site's own manifests are used, so
+		# that no other site can make its files unreadable
+		set blockinfo [db eval {
+			SELECT b.blockSize, b.blocklist_sha1 FROM blockhashes AS b, packages AS p
+				WHERE b.file_sha1 = $hash AND p.sha1 = b.package_sha1 AND p.hostname = $hostname LIMIT 1;
+		}]
+		if {[llength $blockinfo] != 2} {
+			return [list]
+		}
+
+		lassign $blockinfo blocksize blocklist_sha1
+
+		if {![string is integer -strict $blocksize] || $blocksize < 4096 || ![_isHash $blocklist_sha1]} {
+			return -code error "Invalid block hashes for $hash"
+		}
+
+		set url [::appfs::user::construct_url $hostname $blocklist_sha1 sha1]
+		set file [_cachefile $url $blocklist_sha1 sha1]
+		if {![file exists $file]} {
+			return -code error "Unable to fetch block hashes for $hash (file does not exist: $file)"
+		}
+
+		set fd [open $file]
+		set hashes [split [string trim [read $fd]] "\n"]
+		close $fd
+
+		foreach blockhash $hashes {
+			if {![_isHash $blockhash]} {
+				return -code error "Invalid block hashes for $hash"
+			}
+		}
+
+		set blockhashes_last [list "$hostname/$hash" $blocksize $hashes]
+
+		return [list $blocksize $hashes]
+	}
+
+	# Get the size of the blocks a file can be verified in, and how many
+	# there are, or nothing if it can only be verified as a whole
+	proc download_blocks {hostname hash} {
+		set blockhashes [_blockhashes $hostname $hash]
+		if {[llength $blockhashes] == 0} {
+			return ""
+		}
+
+		lassign $blockhashes blocksize hashes
+
+		return [list $blocksize [llength $hashes]]
+	}
+
+	# Verify consecutive blocks of a file, starting with the given block,
+	# against the hashes listed for them, if any
+	proc download_verify_blocks {hostname hash block data} {
+		set blockhashes [_blockhashes $hostname $hash]
+		if {[llength $blockhashes] == 0} {
+			return ""
+		}
+
+		lassign $blockhashes blocksize hashes
+
+		for {set offset 0} {$offset < [string length $data]} {incr offset $blocksize; incr block} {
+			set blockdata [string range $data $offset [expr {$offset + $blocksize - 1}]]
+
+			if {[string tolower [sha1::sha1 -hex $blockdata]] ne [lindex $hashes $block]} {
+				return -code error "Block $block of $hash does not match its hash"
+			}
+		}
+
+		return ""
+	}
+
+	# Verify the blocks in part of a temporary file created by
+	# download_start against the hashes listed for them, if any
+	proc download_verify_range {hostname hash tmpfile offset length} {
+		set blockhashes [_blockhashes $hostname $hash]
+		if {[llength $blockhashes] == 0} {
+			return ""
+		}
+
+		set blocksize [lindex $blockhashes 0]
+
+		# Whole blocks are verified, even if only part of one is wanted
+		set block [expr {$offset / $blocksize}]
+		set start [expr {$block * $blocksize}]
+		set end [expr {(($offset + $length + $blocksize - 1) / $blocksize) * $blocksize}]
+
+		set fd [open $tmpfile {RDONLY BINARY}]
+
+		set retcode [catch {
+			seek $fd $start
+
+			set data [read $fd [expr {$end - $start}]]
+		} err]
+
+		close $fd
+
+		if {$retcode != 0} {
+			return -code error $err
+		}
+
+		download_verify_blocks $hostname $hash $block $data
+
+		return ""
+	}
+
+	proc download_verify {hostname hash tmpfile {method sha1}} {
+		set file [_cachefile_path $hash $method]
+
+		_cachefile_promote $hash 1 $file $tmpfile
+
+		if {![file exists $file]} {
+			return -code error "Unable to fetch (file does not exist: $file)"
+		}
+
+		return $file
+	}
+
+	proc getindex {hostname {synchronous 0}} {
 		if {[string match "*\[/~\]*" $hostname]} {
 			return -code error "Invalid hostname"
 		}
 
+		if {[::appfsd::site_fresh $hostname]} {
+			return COMPLETE
+		}
+
 		set now [clock seconds]
 
 		set lastUpdates [db eval {SELECT lastUpdate, ttl FROM sites WHERE hostname = $hostname LIMIT 1;}]
@@ -350,23 +924,64 @@ bSf8agpRgIQKKSyuwFjp3zT8oeAzEzL4HdOBCveQ5EamCqvV6EDIuIR7b+4ZnYoL
 		}
 
 		if {$now < ($lastUpdate + $ttl)} {
+			::appfsd::site_fresh $hostname [expr {$lastUpdate + $ttl}]
+
 			return COMPLETE
 		}
 
+		# If we already have an index for this site, keep using it
+		# while a new one is fetched in the background
+		if {!$synchronous && $lastUpdate != 0} {
+			if {[::appfsd::index_refresh $hostname]} {
+				return COMPLETE
+			}
+		}
+
 		set url "http://$hostname/appfs/index"
 
+		# Only ask whether the index has changed if we still have it
+		set validators [dict create]
+		set previous_indexhash ""
+		if {$lastUpdate != 0} {
+			db eval {SELECT indexHash, etag, lastModified FROM site_index WHERE hostname = $hostname LIMIT 1;} site_index {
+				set previous_indexhash $site_index(indexHash)
+
+				if {$site_index(etag) != ""} {
+					dict set validators etag $site_index(etag)
+				}
+
+				if {$site_index(lastModified) != ""} {
+					dict set validators last_modified $site_index(lastModified)
+				}
+			}
+		}
+
 		catch {
-			set indexhash_data [::appfs::user::download_file $url]
+			if {$::appfs::conditional_index_fetch} {
+				set indexhash_fetch [::appfs::user::download_file_if_changed $url $validators]
+			} else {
+				set indexhash_fetch [dict create changed 1 data [::appfs::user::download_file $url] validators [dict create]]
+			}
 		}
 
 		# Note that we attempted to fetch this index and do not try
 		# again for a while
 		db eval {INSERT OR REPLACE INTO sites (hostname, lastUpdate, ttl) VALUES ($hostname, $now, $::appfs::nttl);}
+		::appfsd::site_fresh $hostname [expr {$now + $::appfs::nttl}]
 
-		if {![info exists indexhash_data]} {
+		if {![info exists indexhash_fetch]} {
 			return -code error "Unable to fetch $url"
 		}
 
+		if {![dict get $indexhash_fetch changed]} {
+			_indexFresh $hostname $now
+
+			return COMPLETE
+		}
+
+		set indexhash_data [dict get $indexhash_fetch data]
+		set validators [dict get $indexhash_fetch validators]
+
 		set indexhash_data [string trim $indexhash_data "\r\n"]
 		set indexhash_data [split $indexhash_data ","]
 		set indexhash       [lindex $indexhash_data 0]
@@ -378,6 +993,17 @@ bSf8agpRgIQKKSyuwFjp3zT8oeAzEzL4HdOBCveQ5EamCqvV6EDIuIR7b+4ZnYoL
 			return -code error "Invalid hash: $indexhash"
 		}
 
+		# The same index we already have, whose signature was
+		# checked when it was first fetched
+		if {$indexhash == $previous_indexhash} {
+			db transaction {
+				_indexFresh $hostname $now
+				_indexValidators $hostname $indexhash $validators
+			}
+
+			return COMPLETE
+		}
+
 		if {![_verifySignatureAndCertificate $hostname $indexhashcert $indexhashsig $indexhash]} {
 			return -code error "Invalid signature or certificate from $hostname"
 		}
@@ -398,77 +1024,114 @@ bSf8agpRgIQKKSyuwFjp3zT8oeAzEzL4HdOBCveQ5EamCqvV6EDIuIR7b+4ZnYoL
 
 		close $fd
 
-		set curr_packages [list]
-		foreach line [split $data "\n"] {
-			set line [string trim $line]
+		# Load the new index into a temporary table and reconcile the
+		# packages table with it all at once, so that nothing sees it
+		# partially applied
+		db transaction {
+			db eval {CREATE TEMP TABLE IF NOT EXISTS new_index(sha1, package, version, os, cpuArch, isLatest, isNew);}
+			db eval {CREATE INDEX IF NOT EXISTS temp.new_index_index ON new_index (sha1, package);}
+			db eval {DELETE FROM temp.new_index;}
 
-			if {[string match "*/*" $line]} {
-				continue
-			}
+			foreach line [split $data "\n"] {
+				set line [string trim $line]
 
-			if {$line == ""} {
-				continue
-			}
+				if {[string match "*/*" $line]} {
+					continue
+				}
 
-			set work [split $line ","]
+				if {$line == ""} {
+					continue
+				}
 
-			unset -nocomplain pkgInfo
-			if {[catch {
-				set pkgInfo(package)  [lindex $work 0]
-				set pkgInfo(version)  [lindex $work 1]
-				set pkgInfo(os)       [_normalizeOS [lindex $work 2]]
-				set pkgInfo(cpuArch)  [_normalizeCPU [lindex $work 3]]
-				set pkgInfo(hash)     [string tolower [lindex $work 4]]
-				set pkgInfo(hash_type) "sha1"
-				set pkgInfo(isLatest) [expr {!![lindex $work 5]}]
-			}]} {
-				continue
+				set work [split $line ","]
+
+				unset -nocomplain pkgInfo
+				if {[catch {
+					set pkgInfo(package)  [lindex $work 0]
+					set pkgInfo(version)  [lindex $work 1]
+					set pkgInfo(os)       [_normalizeOS [lindex $work 2]]
+					set pkgInfo(cpuArch)  [_normalizeCPU [lindex $work 3]]
+					set pkgInfo(hash)     [string tolower [lindex $work 4]]
+					set pkgInfo(hash_type) "sha1"
+					set pkgInfo(isLatest) [expr {!![lindex $work 5]}]
+				}]} {
+					continue
+				}
+
+				if {![_isHash $pkgInfo(hash)]} {
+					continue
+				}
+
+				db eval {INSERT INTO temp.new_index (sha1, package, version, os, cpuArch, isLatest, isNew) VALUES ($pkgInfo(hash), $pkgInfo(package), $pkgInfo(version), $pkgInfo(os), $pkgInfo(cpuArch), $pkgInfo(isLatest), 0);}
 			}
 
-			if {![_isHash $pkgInfo(hash)]} {
-				continue
+			# Packages we do not already have, only the first time a
+			# package appears in the index counts
+			db eval {
+				UPDATE temp.new_index SET isNew = 1 WHERE
+					rowid IN (SELECT MIN(rowid) FROM temp.new_index GROUP BY sha1, package) AND
+					NOT EXISTS (SELECT 1 FROM packages WHERE packages.hostname = $hostname AND packages.sha1 = new_index.sha1 AND packages.package = new_index.package);
 			}
 
-			lappend curr_packages $pkgInfo(hash)
+			# Only the last new package claiming to be the latest for
+			# a given package/OS/CPU is, and it replaces the existing
+			# latest package
+			db eval {
+				UPDATE temp.new_index SET isLatest = 0 WHERE isNew = 1 AND isLatest = 1 AND
+					rowid < (SELECT MAX(rowid) FROM temp.new_index AS other WHERE other.isNew = 1 AND other.isLatest = 1 AND other.package = new_index.package AND other.os = new_index.os AND other.cpuArch = new_index.cpuArch);
+			}
 
-			# Do not do any additional work if we already have this package
-			set existing_packages [db eval {SELECT package FROM packages WHERE hostname = $hostname AND sha1 = $pkgInfo(hash);}]
-			if {[lsearch -exact $existing_packages $pkgInfo(package)] != -1} {
-				continue
+			db eval {
+				UPDATE packages SET isLatest = 0 WHERE hostname = $hostname AND
+					EXISTS (SELECT 1 FROM temp.new_index WHERE isNew = 1 AND isLatest = 1 AND new_index.package = packages.package AND new_index.os = packages.os AND new_index.cpuArch = packages.cpuArch);
 			}
 
-			if {$pkgInfo(isLatest)} {
-				db eval {UPDATE packages SET isLatest = 0 WHERE hostname = $hostname AND package = $pkgInfo(package) AND os = $pkgInfo(os) AND cpuArch = $pkgInfo(cpuArch);}
+			db eval {
+				INSERT INTO packages (hostname, sha1, package, version, os, cpuArch, isLatest, haveManifest)
+					SELECT $hostname, sha1, package, version, os, cpuArch, isLatest, 0 FROM temp.new_index WHERE isNew = 1;
 			}
 
-			db eval {INSERT INTO packages (hostname, sha1, package, version, os, cpuArch, isLatest, haveManifest) VALUES ($hostname, $pkgInfo(hash), $pkgInfo(package), $pkgInfo(version), $pkgInfo(os), $pkgInfo(cpuArch), $pkgInfo(isLatest), 0);}
-		}
+			set changed [expr {[db changes] != 0}]
 
-		# Look for packages that have been deleted
-		set found_packages [db eval {SELECT sha1 FROM packages WHERE hostname = $hostname;}]
-		foreach package $found_packages {
-			set found_packages_arr($package) 1
-		}
+			# Packages which have been removed from the index
+			set removed_packages [db eval {SELECT DISTINCT sha1 FROM packages WHERE hostname = $hostname AND sha1 NOT IN (SELECT sha1 FROM temp.new_index);}]
+			if {[llength $removed_packages] != 0} {
+				db eval {DELETE FROM packages WHERE hostname = $hostname AND sha1 NOT IN (SELECT sha1 FROM temp.new_index);}
 
-		foreach package $curr_packages {
-			unset -nocomplain found_packages_arr($package)
-		}
+				foreach package $removed_packages {
+					::appfsd::manifest_present $package 0
+				}
 
-		foreach package [array names found_packages_arr] {
-			db eval {DELETE FROM packages WHERE hostname = $hostname AND sha1 = $package;}
-		}
+				set changed 1
+			}
 
-		db eval {INSERT OR REPLACE INTO sites (hostname, lastUpdate, ttl) VALUES ($hostname, $now, $::appfs::ttl);}
+			db eval {DELETE FROM temp.new_index;}
+
+			_indexFresh $hostname $now
+			_indexValidators $hostname $indexhash $validators
+		}
 
 		appfsd::get_path_info_cache_flush
 
+		# The kernel may be holding on to entries for packages which
+		# have been replaced or removed, tell it to drop them
+		if {$changed} {
+			appfsd::kernel_cache_invalidate "/$hostname"
+		}
+
 		return COMPLETE
 	}
 
 	proc getpkgmanifest {hostname package_sha1} {
+		if {[::appfsd::manifest_present $package_sha1]} {
+			return COMPLETE
+		}
+
 		set haveManifest [db onecolumn {SELECT haveManifest FROM packages WHERE sha1 = $package_sha1 LIMIT 1;}]
 
 		if {$haveManifest == "1"} {
+			::appfsd::manifest_present $package_sha1 1
+
 			return COMPLETE
 		}
 
@@ -478,87 +1141,167 @@ bSf8agpRgIQKKSyuwFjp3zT8oeAzEzL4HdOBCveQ5EamCqvV6EDIuIR7b+4ZnYoL
 
 		set file [download $hostname $package_sha1]
 
-		catch {
-			set fd [open $file]
+		# Parsed and loaded into the database, along with each
+		# directory's child count, in one transaction by appfsd
+		::appfsd::ingest_manifest $package_sha1 $file
+
+		::appfsd::manifest_present $package_sha1 1
+
+		appfsd::get_path_info_cache_flush
+
+		return COMPLETE
+	}
+
+	# Find the files of a package which are not yet in the cache, so that
+	# appfsd can fetch them all ahead of time.  "version" may be "latest"
+	# and "os_cpu" defaults to this platform.
+	proc hoard_files {hostname package {version latest} {os_cpu ""}} {
+		if {[getindex $hostname] != "COMPLETE"} {
+			return -code error "Unable to fetch the index for $hostname"
 		}
 
-		if {![info exists fd]} {
-			return -code error "Unable to download or open $file"
+		if {$os_cpu eq ""} {
+			set os_cpu $::appfs::platform
 		}
 
-		catch {
-			set pkgdata [read $fd]
+		set os_cpu [split $os_cpu "-"]
+		set os [_normalizeOS [lindex $os_cpu 0] 1]
+		set cpu [_normalizeCPU [lindex $os_cpu 1] 1]
+
+		if {$version eq "latest"} {
+			set package_sha1 [db onecolumn {SELECT sha1 FROM packages WHERE hostname = $hostname AND package = $package AND os = $os AND cpuArch = $cpu AND isLatest = 1 LIMIT 1;}]
+		} else {
+			set package_sha1 [db onecolumn {SELECT sha1 FROM packages WHERE hostname = $hostname AND package = $package AND os = $os AND cpuArch = $cpu AND version = $version LIMIT 1;}]
 		}
 
-		close $fd
+		if {$package_sha1 eq ""} {
+			return -code error "No such package: $package $version for $os-$cpu on $hostname"
+		}
+
+		if {[getpkgmanifest $hostname $package_sha1] != "COMPLETE"} {
+			return -code error "Unable to fetch the manifest of $package $version"
+		}
+
+		set retval [list]
+		db eval {SELECT DISTINCT file_sha1 FROM files WHERE package_sha1 = $package_sha1 AND type = 'file';} {
+			if {![_isHash $file_sha1]} {
+				continue
+			}
 
+			if {[file exists [_cachefile_path $file_sha1 sha1]]} {
+				continue
+			}
+
+			lappend retval $file_sha1
+		}
+
+		return $retval
+	}
+
+	# Replace the access profile of a package with the files, by hash,
+	# opened from it shortly after it was first opened (see
+	# appfs_profile_access)
+	proc profile_store {package_sha1 file_sha1s} {
 		db transaction {
-			foreach line [split $pkgdata "\n"] {
-				set line [string trim $line]
+			db eval {DELETE FROM access_profiles WHERE package_sha1 = $package_sha1;}
 
-				if {$line == ""} {
-					continue
-				}
+			set seq 0
+			foreach file_sha1 $file_sha1s {
+				db eval {INSERT INTO access_profiles (package_sha1, seq, file_sha1) VALUES ($package_sha1, $seq, $file_sha1);}
 
-				set work [split $line ","]
+				incr seq
+			}
+		}
+	}
 
-				unset -nocomplain fileInfo
-				set fileInfo(type) [lindex $work 0]
-				set fileInfo(time) [lindex $work 1]
+	# Fetch the files which were opened the last time this package was
+	# used, other than the one being opened now, and which are not
+	# already cached, all at once in the background
+	proc _profile_replay {hostname package_sha1 file_sha1} {
+		set files [list]
+		db eval {SELECT file_sha1 AS profile_sha1 FROM access_profiles WHERE package_sha1 = $package_sha1 ORDER BY seq;} {
+			if {$profile_sha1 eq $file_sha1 || ![_isHash $profile_sha1]} {
+				continue
+			}
 
-				set work [lrange $work 2 end]
-				switch -- $fileInfo(type) {
-					"#manifestmetadata" {
-						unset -nocomplain fileInfo
-						continue
-					}
-					"file" {
-						set fileInfo(size) [lindex $work 0]
+			if {[file exists [_cachefile_path $profile_sha1 sha1]]} {
+				continue
+			}
+
+			lappend files $profile_sha1
+		}
+
+		if {[llength $files] == 0} {
+			return
+		}
 
-						# We lower-case the permissions because upper-case permissions
-						# should not be set remotely as they may influence the security
-						# of the system.
-						set fileInfo(perms) [string tolower [lindex $work 1]]
+		::appfsd::prefetch $hostname $files
+	}
+
+	# Fetch the libraries needed by a packaged executable or library
+	# which is being opened (see appfs_elf_prefetch_start) from the "lib"
+	# directories of the same package, all at once in the background,
+	# following symlinks within the package
+	proc elf_prefetch {path needed} {
+		array set pathinfo [_parsepath $path]
+
+		if {$pathinfo(_type) != "files"} {
+			return
+		}
 
-						set fileInfo(sha1) [lindex $work 2]
+		set files [list]
+		foreach name $needed {
+			set candidates [db eval {SELECT file_directory FROM files WHERE package_sha1 = $pathinfo(package_sha1) AND file_name = $name AND file_directory GLOB 'lib*';}]
 
-						set work [lrange $work 3 end]
+			foreach directory $candidates {
+				set file $name
+
+				for {set depth 0} {$depth < 8} {incr depth} {
+					unset -nocomplain row
+					db eval {SELECT type, source, file_sha1 FROM files WHERE package_sha1 = $pathinfo(package_sha1) AND file_name = $file AND file_directory = $directory LIMIT 1;} row {}
+
+					if {![info exists row(type)]} {
+						break
 					}
-					"symlink" {
-						set fileInfo(source) [lindex $work 0]
-						set work [lrange $work 1 end]
+
+					if {$row(type) == "file"} {
+						if {[_isHash $row(file_sha1)] && [lsearch -exact $files $row(file_sha1)] == -1} {
+							if {![file exists [_cachefile_path $row(file_sha1) sha1]]} {
+								lappend files $row(file_sha1)
+							}
+						}
+
+						break
 					}
-					"directory" {
-						# No extra data required
+
+					if {$row(type) != "symlink" || [string index $row(source) 0] == "/"} {
+						break
 					}
-					default {
-						# Handle unknown types
-						if {[string index $fileInfo(type) 0] == "#"} {
-							# Metadata type, ignore
-							# it if we don't
-							# understand this type
-							continue
-						} else {
-							# Unknown type,
-							# generate an error
-							error "Manifest cannot be parsed"
+
+					set parts [list]
+					foreach part [split "$directory/$row(source)" "/"] {
+						switch -- $part {
+							"" - "." {}
+							".." {
+								set parts [lrange $parts 0 end-1]
+							}
+							default {
+								lappend parts $part
+							}
 						}
 					}
-				}
 
-				set fileInfo(name) [join $work ","]
-				set fileInfo(name) [split [string trim $fileInfo(name) "/"] "/"]
-				set fileInfo(directory) [join [lrange $fileInfo(name) 0 end-1] "/"]
-				set fileInfo(name) [lindex $fileInfo(name) end]
-
-				db eval {INSERT INTO files (package_sha1, type, time, source, size, perms, file_sha1, file_name, file_directory) VALUES ($package_sha1, $fileInfo(type), $fileInfo(time), $fileInfo(source), $fileInfo(size), $fileInfo(perms), $fileInfo(sha1), $fileInfo(name), $fileInfo(directory) );}
-				db eval {UPDATE packages SET haveManifest = 1 WHERE sha1 = $package_sha1;}
+					set directory [join [lrange $parts 0 end-1] "/"]
+					set file [lindex $parts end]
+				}
 			}
 		}
 
-		appfsd::get_path_info_cache_flush
+		if {[llength $files] == 0} {
+			return
+		}
 
-		return COMPLETE
+		::appfsd::prefetch $pathinfo(hostname) $files
 	}
 
 	proc _localpath {package hostname file} {
@@ -734,6 +1477,41 @@ bSf8agpRgIQKKSyuwFjp3zT8oeAzEzL4HdOBCveQ5EamCqvV6EDIuIR7b+4ZnYoL
 		return -code error "Invalid or unacceptable path: $dir"
 	}
 
+	# Number of entries in a packaged directory, without listing it.  The
+	# count recorded from the manifest is used unless the user has
+	# modified or removed entries in this directory, in which case the
+	# overlay has to be merged in by listing it.
+	proc _childcount {path} {
+		array set pathinfo [_parsepath $path]
+
+		if {$pathinfo(_children) != "files"} {
+			return [llength [getchildren $path]]
+		}
+
+		set dir [_localpath $pathinfo(package) $pathinfo(hostname) $pathinfo(file)]
+		set whiteoutdir [string range [_whiteoutpath $pathinfo(package) $pathinfo(hostname) $pathinfo(file)] 0 end-15]
+
+		set have_overlay 0
+		_as_user {
+			foreach check [list $dir $whiteoutdir] {
+				if {$check != "" && [file isdirectory $check]} {
+					set have_overlay 1
+				}
+			}
+		}
+
+		if {$have_overlay} {
+			return [llength [getchildren $path]]
+		}
+
+		set childcount [::appfs::db onecolumn {SELECT childcount FROM directories WHERE package_sha1 = $pathinfo(package_sha1) AND file_directory = $pathinfo(file);}]
+		if {$childcount == ""} {
+			set childcount 0
+		}
+
+		return $childcount
+	}
+
 	proc getattr {path} {
 		array set pathinfo [_parsepath $path]
 		array set retval [list]
@@ -751,7 +1529,7 @@ bSf8agpRgIQKKSyuwFjp3zT8oeAzEzL4HdOBCveQ5EamCqvV6EDIuIR7b+4ZnYoL
 		switch -- $pathinfo(_type) {
 			"toplevel" {
 				set retval(type) directory
-				set retval(childcount) [llength [getchildren $path]]
+				set retval(childcount) [::appfs::db onecolumn {SELECT COUNT(DISTINCT hostname) FROM packages;}]
 			}
 			"sites" {
 				set check [::appfs::db onecolumn {SELECT 1 FROM packages WHERE hostname = $pathinfo(hostname);}]
@@ -764,7 +1542,9 @@ bSf8agpRgIQKKSyuwFjp3zT8oeAzEzL4HdOBCveQ5EamCqvV6EDIuIR7b+4ZnYoL
 				set check [::appfs::db onecolumn {SELECT 1 FROM packages WHERE hostname = $pathinfo(hostname) AND package = $pathinfo(package);}]
 				if {$check == "1"} {
 					set retval(type) directory
-					set retval(childcount) [llength [getchildren $path]]
+
+					# All of the OS-CPU pairs, plus "platform"
+					set retval(childcount) [::appfs::db onecolumn {SELECT COUNT(DISTINCT os || "-" || cpuArch) + 1 FROM packages WHERE hostname = $pathinfo(hostname) AND package = $pathinfo(package);}]
 				}
 			}
 			"os-cpu" {
@@ -786,7 +1566,12 @@ bSf8agpRgIQKKSyuwFjp3zT8oeAzEzL4HdOBCveQ5EamCqvV6EDIuIR7b+4ZnYoL
 					}]
 					if {$check == "1"} {
 						set retval(type) directory
-						set retval(childcount) [llength [getchildren $path]]
+
+						# All of the versions, plus "latest" if there is one
+						set retval(childcount) [::appfs::db onecolumn {
+							SELECT COUNT(DISTINCT version) + (SELECT COUNT(*) FROM (SELECT 1 FROM packages WHERE isLatest = 1 AND hostname = $pathinfo(hostname) AND package = $pathinfo(package) AND os = $pathinfo(os) AND cpuArch = $pathinfo(cpu) LIMIT 1))
+								FROM packages WHERE hostname = $pathinfo(hostname) AND package = $pathinfo(package) AND os = $pathinfo(os) AND cpuArch = $pathinfo(cpu);
+						}]
 					}
 				}
 			}
@@ -801,7 +1586,7 @@ bSf8agpRgIQKKSyuwFjp3zT8oeAzEzL4HdOBCveQ5EamCqvV6EDIuIR7b+4ZnYoL
 				} else {
 					if {[info exists pathinfo(package_sha1)] && $pathinfo(package_sha1) != ""} {
 						set retval(type) directory
-						set retval(childcount) [llength [getchildren $path]]
+						set retval(childcount) [_childcount $path]
 					}
 				}
 			}
@@ -890,7 +1675,7 @@ bSf8agpRgIQKKSyuwFjp3zT8oeAzEzL4HdOBCveQ5EamCqvV6EDIuIR7b+4ZnYoL
 						}
 
 						if {[info exists retval(type)] && $retval(type) == "directory"} {
-							set retval(childcount) [llength [getchildren $path]]
+							set retval(childcount) [_childcount $path]
 						}
 
 						unset -nocomplain retval(*)
@@ -925,6 +1710,10 @@ bSf8agpRgIQKKSyuwFjp3zT8oeAzEzL4HdOBCveQ5EamCqvV6EDIuIR7b+4ZnYoL
 		}
 
 		if {$localpath != "" && [file exists $localpath]} {
+			if {$mode == "stream"} {
+				return [list $localpath]
+			}
+
 			return $localpath
 		}
 
@@ -937,6 +1726,27 @@ bSf8agpRgIQKKSyuwFjp3zT8oeAzEzL4HdOBCveQ5EamCqvV6EDIuIR7b+4ZnYoL
 			return -code error "No such file or directory"
 		}
 
+		# Files opened for reading are recorded in the package's access
+		# profile, and the first one opened fetches the rest of it
+		if {$mode == "" || $mode == "stream"} {
+			if {[::appfsd::profile_access $pathinfo(package_sha1) $pkgpathinfo(file_sha1)]} {
+				catch {
+					_profile_replay $pathinfo(hostname) $pathinfo(package_sha1) $pkgpathinfo(file_sha1)
+				}
+			}
+		}
+
+		# When streaming, appfsd starts the download itself (see
+		# download_start) if the file is not already in the cache
+		if {$mode == "stream"} {
+			set localcachefile [_cachefile_path $pkgpathinfo(file_sha1) sha1]
+			if {[file exists $localcachefile]} {
+				return [list $localcachefile]
+			}
+
+			return [list "" $pathinfo(hostname) $pkgpathinfo(file_sha1)]
+		}
+
 		set localcachefile [download $pathinfo(hostname) $pkgpathinfo(file_sha1)]
 
 		if {$mode == "write"} {